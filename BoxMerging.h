@@ -0,0 +1,279 @@
+#ifndef BOXMERGING_H
+#define BOXMERGING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <opencv2/core.hpp>
+
+// Объединение bounding boxes из нескольких источников (фрагменты, области, камеры)
+namespace BoxMerging{
+
+/*
+    Набор bounding boxes с уверенностями: координаты углов и уверенности
+    хранятся в отдельных непрерывных массивах (structure of arrays)
+*/
+class BoxSet
+{
+public:
+    std::vector<float> x1, y1, x2, y2, score;
+
+    void clear()
+    {
+        x1.clear(); y1.clear(); x2.clear(); y2.clear(); score.clear();
+    }
+
+    void reserve(int n)
+    {
+        x1.reserve(n); y1.reserve(n); x2.reserve(n); y2.reserve(n); score.reserve(n);
+    }
+
+    void add(float x, float y, float w, float h, float s)
+    {
+        x1.push_back(x);
+        y1.push_back(y);
+        x2.push_back(x + w);
+        y2.push_back(y + h);
+        score.push_back(s);
+    }
+
+    void add(const cv::Rect2i& box, float s) { add(float(box.x), float(box.y), float(box.width), float(box.height), s); }
+
+    int size() const { return int(score.size()); }
+    cv::Rect2f box(int i) const { return cv::Rect2f(x1[i], y1[i], x2[i] - x1[i], y2[i] - y1[i]); }
+};
+
+/*
+    Non-maximum suppression и weighted box fusion над BoxSet.
+    Boxes сортируются по уверенности один раз и копируются в выровненные массивы,
+    IoU текущего box со всеми последующими считается по 4 за инструкцию (SSE2,
+    при его отсутствии - скалярно). Сравнение IoU > t выполняется без деления:
+    inter * (1 + t) > t * (area1 + area2).
+    Буферы переиспользуются между вызовами.
+*/
+class BoxMerger
+{
+private:
+    // Отсортированные по убыванию уверенности boxes, длина кратна 4
+    std::vector<float> m_x1, m_y1, m_x2, m_y2, m_area;
+    std::vector<int> m_order;
+    std::vector<uint8_t> m_suppressed;
+    // Номер кластера (индекс в m_keep) для каждого входного box, -1 - отброшен порогом
+    std::vector<int> m_cluster;
+    std::vector<int> m_keep;
+    // Суммы весов кластеров для fuse и fuseRows
+    std::vector<float> m_weight;
+    int m_count = 0;
+
+    /*
+        Сортировка по уверенности и отсечение boxes ниже порога
+    */
+    void prepare(const BoxSet& boxes, float scoreThreshold)
+    {
+        int n = boxes.size();
+        m_order.resize(n);
+        for (int i = 0; i < n; i++){
+            m_order[i] = i;
+        }
+        const float* score = boxes.score.data();
+        // stable_sort: при равных уверенностях сохраняется порядок добавления
+        std::stable_sort(m_order.begin(), m_order.end(), [score](int a, int b){ return score[a] > score[b]; });
+        m_count = 0;
+        while (m_count < n && score[m_order[m_count]] >= scoreThreshold){
+            m_count++;
+        }
+
+        int padded = (m_count + 3) / 4 * 4;
+        m_x1.assign(padded, 0.f);
+        m_y1.assign(padded, 0.f);
+        m_x2.assign(padded, 0.f);
+        m_y2.assign(padded, 0.f);
+        m_area.assign(padded, 0.f);
+        m_suppressed.assign(padded, 1);
+        for (int k = 0; k < m_count; k++){
+            int i = m_order[k];
+            m_x1[k] = boxes.x1[i];
+            m_y1[k] = boxes.y1[i];
+            m_x2[k] = boxes.x2[i];
+            m_y2[k] = boxes.y2[i];
+            m_area[k] = (m_x2[k] - m_x1[k]) * (m_y2[k] - m_y1[k]);
+            m_suppressed[k] = 0;
+        }
+        m_cluster.assign(n, -1);
+    }
+
+    /*
+        Подавление boxes [first, m_count), перекрывающихся с box k больше чем на iouThreshold.
+        Подавленные boxes относятся к кластеру cluster.
+    */
+    void suppress(int k, int first, float iouThreshold, int cluster)
+    {
+        float t1 = 1.f + iouThreshold;
+#if defined(__SSE2__)
+        // Начало выравнивается на 4; boxes до first уже обработаны и не изменяются
+        int j = first & ~3;
+        __m128 x1 = _mm_set1_ps(m_x1[k]), y1 = _mm_set1_ps(m_y1[k]);
+        __m128 x2 = _mm_set1_ps(m_x2[k]), y2 = _mm_set1_ps(m_y2[k]);
+        __m128 area = _mm_set1_ps(m_area[k]);
+        __m128 t = _mm_set1_ps(iouThreshold), tt = _mm_set1_ps(t1), zero = _mm_setzero_ps();
+        for (; j < m_count; j += 4){
+            __m128 w = _mm_sub_ps(_mm_min_ps(x2, _mm_loadu_ps(&m_x2[j])), _mm_max_ps(x1, _mm_loadu_ps(&m_x1[j])));
+            __m128 h = _mm_sub_ps(_mm_min_ps(y2, _mm_loadu_ps(&m_y2[j])), _mm_max_ps(y1, _mm_loadu_ps(&m_y1[j])));
+            __m128 inter = _mm_mul_ps(_mm_max_ps(w, zero), _mm_max_ps(h, zero));
+            __m128 over = _mm_cmpgt_ps(_mm_mul_ps(inter, tt), _mm_mul_ps(t, _mm_add_ps(area, _mm_loadu_ps(&m_area[j]))));
+            int mask = _mm_movemask_ps(over);
+            if (mask == 0){
+                continue;
+            }
+            for (int b = 0; b < 4; b++){
+                int jj = j + b;
+                if ((mask & (1 << b)) && jj >= first && !m_suppressed[jj]){
+                    m_suppressed[jj] = 1;
+                    m_cluster[m_order[jj]] = cluster;
+                }
+            }
+        }
+#else
+        for (int j = first; j < m_count; j++){
+            if (m_suppressed[j]){
+                continue;
+            }
+            float w = std::min(m_x2[k], m_x2[j]) - std::max(m_x1[k], m_x1[j]);
+            float h = std::min(m_y2[k], m_y2[j]) - std::max(m_y1[k], m_y1[j]);
+            float inter = std::max(w, 0.f) * std::max(h, 0.f);
+            if (inter * t1 > iouThreshold * (m_area[k] + m_area[j])){
+                m_suppressed[j] = 1;
+                m_cluster[m_order[j]] = cluster;
+            }
+        }
+#endif
+    }
+
+public:
+    BoxMerger(){};
+    ~BoxMerger(){};
+
+    /*
+        Non-maximum suppression.
+        Возвращает индексы оставленных boxes (в порядке убывания уверенности).
+        Аргументы:
+            - boxes - набор boxes
+            - iouThreshold - IoU, выше которого box подавляется более уверенным
+            - scoreThreshold - boxes с меньшей уверенностью отбрасываются
+            - topK - максимальное число оставленных boxes, 0 - без ограничения
+    */
+    const std::vector<int>& nms(const BoxSet& boxes, float iouThreshold, float scoreThreshold = 0.f, int topK = 0)
+    {
+        prepare(boxes, scoreThreshold);
+        m_keep.clear();
+        for (int k = 0; k < m_count; k++){
+            if (m_suppressed[k]){
+                continue;
+            }
+            int cluster = int(m_keep.size());
+            m_keep.push_back(m_order[k]);
+            m_cluster[m_order[k]] = cluster;
+            if (topK > 0 && int(m_keep.size()) >= topK){
+                break;
+            }
+            suppress(k, k + 1, iouThreshold, cluster);
+        }
+        return m_keep;
+    }
+
+    /*
+        Weighted box fusion: каждый кластер NMS заменяется средним его boxes,
+        взвешенным по уверенности; уверенность кластера - максимальная.
+        Аргументы:
+            - boxes - набор boxes
+            - fused - результат (по box на кластер)
+            - остальные - как в nms
+    */
+    void fuse(const BoxSet& boxes, BoxSet& fused, float iouThreshold, float scoreThreshold = 0.f, int topK = 0)
+    {
+        nms(boxes, iouThreshold, scoreThreshold, topK);
+        int n = int(m_keep.size());
+        fused.clear();
+        fused.x1.assign(n, 0.f);
+        fused.y1.assign(n, 0.f);
+        fused.x2.assign(n, 0.f);
+        fused.y2.assign(n, 0.f);
+        fused.score.assign(n, 0.f);
+        m_weight.assign(n, 0.f);
+        for (int i = 0; i < boxes.size(); i++){
+            int c = m_cluster[i];
+            if (c < 0){
+                continue;
+            }
+            float s = boxes.score[i];
+            fused.x1[c] += s * boxes.x1[i];
+            fused.y1[c] += s * boxes.y1[i];
+            fused.x2[c] += s * boxes.x2[i];
+            fused.y2[c] += s * boxes.y2[i];
+            fused.score[c] = std::max(fused.score[c], s);
+            m_weight[c] += s;
+        }
+        for (int c = 0; c < n; c++){
+            float inv = m_weight[c] > 0.f ? 1.f / m_weight[c] : 0.f;
+            fused.x1[c] *= inv;
+            fused.y1[c] *= inv;
+            fused.x2[c] *= inv;
+            fused.y2[c] *= inv;
+        }
+    }
+
+    /*
+        Слияние строк-описаний лиц (формат YuNet: x, y, w, h, ключевые точки, score)
+        по кластерам последнего вызова nms: все столбцы, кроме scoreCol, усредняются
+        с весами-уверенностями, уверенность - максимальная.
+        Аргументы:
+            - rows - строки в порядке boxes, переданных в nms (CV_32F)
+            - scoreCol - столбец уверенности
+            - fused - результат (по строке на кластер)
+    */
+    void fuseRows(const cv::Mat& rows, int scoreCol, cv::Mat& fused)
+    {
+        int n = int(m_keep.size());
+        fused.create(n, rows.cols, CV_32F);
+        fused.setTo(cv::Scalar::all(0));
+        m_weight.assign(n, 0.f);
+        for (int i = 0; i < rows.rows && i < int(m_cluster.size()); i++){
+            int c = m_cluster[i];
+            if (c < 0){
+                continue;
+            }
+            const float* src = rows.ptr<float>(i);
+            float* dst = fused.ptr<float>(c);
+            float s = src[scoreCol];
+            for (int k = 0; k < rows.cols; k++){
+                if (k != scoreCol){
+                    dst[k] += s * src[k];
+                }
+            }
+            dst[scoreCol] = std::max(dst[scoreCol], s);
+            m_weight[c] += s;
+        }
+        for (int c = 0; c < n; c++){
+            float* dst = fused.ptr<float>(c);
+            float inv = m_weight[c] > 0.f ? 1.f / m_weight[c] : 0.f;
+            for (int k = 0; k < rows.cols; k++){
+                if (k != scoreCol){
+                    dst[k] *= inv;
+                }
+            }
+        }
+    }
+
+    // Индексы оставленных boxes и номера кластеров входных boxes последнего вызова nms
+    const std::vector<int>& keep() const { return m_keep; }
+    const std::vector<int>& clusters() const { return m_cluster; }
+};
+
+}
+
+#endif // BOXMERGING_H
@@ -0,0 +1,313 @@
+#ifndef CASCADEDETECTOR_H
+#define CASCADEDETECTOR_H
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "BoxMerging.h"
+#include "FaceBatch.h"
+#include "FaceDetectors.h"
+#include "FrameCache.h"
+
+// Face Bounding Box Detector
+namespace FaceBBDetector{
+
+/*
+    Предварительный фильтр каскадного детектора
+*/
+enum CascadeGate
+{
+    // Каскад Хаара на уменьшенном кадре
+    GATE_HAAR,
+    // Разность с предыдущим уменьшенным кадром
+    GATE_MOTION,
+    // Области обоих фильтров
+    GATE_HAAR_OR_MOTION
+};
+
+/*
+    Статистика каскадного детектора
+*/
+struct CascadeStats
+{
+    int frames = 0;
+    // Кадры, на которых YuNet не запускался
+    int gatedFrames = 0;
+    // Кадры с запуском YuNet только в областях-кандидатах
+    int regionFrames = 0;
+    // Кадры с запуском YuNet на всем кадре (периодическая проверка)
+    int fullFrames = 0;
+    // Кадры с запуском каскада Хаара
+    int haarFrames = 0;
+    // Теневой режим: лица постоянно работающего YuNet и найденные из них каскадом
+    int referenceFaces = 0;
+    int recalledFaces = 0;
+
+    double gatedFraction() const { return frames > 0 ? double(gatedFrames) / frames : 0.0; }
+    double recall() const { return referenceFaces > 0 ? double(recalledFaces) / referenceFaces : 1.0; }
+};
+
+/*
+    Каскадный детектор: дешевый фильтр (каскад Хаара на уменьшенном кадре и/или
+    разность кадров) выделяет области-кандидаты, YuNet запускается только в них.
+    Области лиц предыдущего кадра всегда остаются кандидатами. Раз в m_fullEvery
+    кадров YuNet запускается на всем кадре, чтобы ограничить число пропусков фильтра.
+    Каскад Хаара на пустой сцене запускается раз в m_haarIdleEvery кадров, поэтому
+    на неподвижной пустой сцене почти все кадры обрабатывает только разность кадров.
+*/
+class CascadeDetector
+{
+private:
+    HaarCascaadDetector m_haar;
+    YuNetDetector m_yunet;
+    CascadeGate m_gate;
+
+    // Разрешение, на котором работает фильтр
+    cv::Size m_gateSize = cv::Size(320, 240);
+    // Нестрогие параметры каскада: пропуск лица дороже ложного кандидата
+    double m_haarScaleFactor = 1.2;
+    int m_haarMinNeighbors = 2;
+    // Период запуска каскада (в кадрах), когда на предыдущем кадре нет лиц
+    int m_haarIdleEvery = 5;
+    // Порог разности яркости и минимальная доля изменившихся пикселей
+    int m_motionThreshold = 25;
+    float m_minMotionFraction = 0.002;
+    // Расширение области кандидата (доля размера) и период полной детекции
+    float m_expand = 0.5;
+    int m_fullEvery = 30;
+    // Теневой режим: YuNet дополнительно запускается на каждом кадре для оценки полноты
+    bool m_shadow = false;
+    float m_recallIoU = 0.5;
+    // Период вывода статистики (в кадрах), 0 - не выводить
+    int m_reportEvery = 300;
+
+    int m_framesSinceFull = 0;
+    int m_framesSinceHaar = 0;
+    CascadeStats m_stats;
+
+    // Буферы переиспользуются между кадрами
+    cv::Mat m_prevGray, m_diff, m_mask;
+    std::vector<cv::Rect2i> m_regions, m_previous;
+    cv::Mat m_candidates, m_faces;
+    BoxMerging::BoxSet m_boxes;
+    BoxMerging::BoxMerger m_merger;
+
+    void addRegion(const cv::Rect2i& box, float scaleX, float scaleY)
+    {
+        cv::Rect2i r(int(box.x * scaleX), int(box.y * scaleY), int(box.width * scaleX), int(box.height * scaleY));
+        int dx = int(r.width * m_expand), dy = int(r.height * m_expand);
+        m_regions.push_back(cv::Rect2i(r.x - dx, r.y - dy, r.width + 2 * dx, r.height + 2 * dy));
+    }
+
+    /*
+        Запуск каскада Хаара на текущем кадре. Область движения и лица предыдущего
+        кадра уже являются кандидатами, поэтому каскад нужен только для новых лиц:
+        в режиме GATE_HAAR он запускается на каждом кадре, пока в кадре есть лица,
+        и раз в m_haarIdleEvery кадров на пустой сцене; в режиме GATE_HAAR_OR_MOTION -
+        только на кадрах без движения и раз в m_haarIdleEvery кадров.
+        Аргументы:
+            - moved - на кадре найдено движение
+    */
+    bool haarDue(bool moved)
+    {
+        if (m_gate == GATE_MOTION || moved){
+            return false;
+        }
+        if (++m_framesSinceHaar < m_haarIdleEvery && (m_gate == GATE_HAAR_OR_MOTION || m_previous.empty())){
+            return false;
+        }
+        m_framesSinceHaar = 0;
+        return true;
+    }
+
+    /*
+        Области-кандидаты текущего кадра (в координатах исходного кадра)
+    */
+    void gate(FrameCache& frame)
+    {
+        m_regions.clear();
+        const cv::Mat& gray = frame.gray(m_gateSize);
+        float scaleX = float(frame.size().width) / gray.cols;
+        float scaleY = float(frame.size().height) / gray.rows;
+
+        bool moved = false;
+        if ((m_gate == GATE_MOTION || m_gate == GATE_HAAR_OR_MOTION) && m_prevGray.size() == gray.size()){
+            cv::absdiff(gray, m_prevGray, m_diff);
+            cv::threshold(m_diff, m_mask, m_motionThreshold, 255, cv::THRESH_BINARY);
+            if (cv::countNonZero(m_mask) > m_minMotionFraction * m_mask.total()){
+                addRegion(cv::boundingRect(m_mask), scaleX, scaleY);
+                moved = true;
+            }
+        }
+        gray.copyTo(m_prevGray);
+
+        if (haarDue(moved)){
+            m_stats.haarFrames++;
+            const std::vector<cv::Rect2i>& boxes = m_haar.detectGray(gray, m_haarScaleFactor, m_haarMinNeighbors);
+            for (size_t i = 0; i < boxes.size(); i++){
+                addRegion(boxes[i], scaleX, scaleY);
+            }
+        }
+
+        // Лица предыдущего кадра остаются кандидатами
+        for (size_t i = 0; i < m_previous.size(); i++){
+            addRegion(m_previous[i], 1.f, 1.f);
+        }
+    }
+
+    /*
+        Запуск YuNet в областях-кандидатах и объединение результатов
+    */
+    const cv::Mat& detectRegions(FrameCache& frame)
+    {
+        m_candidates.create(0, 15, CV_32F);
+        for (size_t i = 0; i < m_regions.size(); i++){
+            cv::Size maxFaceSize(int(m_regions[i].width / (1.f + 2.f * m_expand)) * 2,
+                                 int(m_regions[i].height / (1.f + 2.f * m_expand)) * 2);
+            const cv::Mat& faces = m_yunet.detect(frame.bgr(), m_regions[i], maxFaceSize);
+            for (int j = 0; j < faces.rows; j++){
+                m_candidates.push_back(faces.row(j));
+            }
+        }
+        m_boxes.clear();
+        for (int i = 0; i < m_candidates.rows; i++){
+            const float* face = m_candidates.ptr<float>(i);
+            m_boxes.add(face[0], face[1], face[2], face[3], face[14]);
+        }
+        const std::vector<int>& keep = m_merger.nms(m_boxes, 0.3f);
+        m_faces.create(int(keep.size()), 15, CV_32F);
+        for (size_t i = 0; i < keep.size(); i++){
+            cv::Mat row = m_faces.row(int(i));
+            m_candidates.row(keep[i]).copyTo(row);
+        }
+        return m_faces;
+    }
+
+    static float iou(const cv::Rect2i& a, const cv::Rect2i& b)
+    {
+        float inter = float((a & b).area());
+        float uni = float(a.area() + b.area()) - inter;
+        return uni > 0 ? inter / uni : 0.f;
+    }
+
+    /*
+        Теневой режим: сравнение с YuNet на всем кадре
+    */
+    void measureRecall(FrameCache& frame)
+    {
+        std::vector<cv::Rect2i> reference = YuNetDetector::boxesFromFaces(m_yunet.detect(frame));
+        m_stats.referenceFaces += int(reference.size());
+        for (size_t i = 0; i < reference.size(); i++){
+            for (size_t j = 0; j < m_previous.size(); j++){
+                if (iou(reference[i], m_previous[j]) > m_recallIoU){
+                    m_stats.recalledFaces++;
+                    break;
+                }
+            }
+        }
+    }
+
+public:
+    /*
+        Аргументы:
+            - gate - предварительный фильтр
+            - config - параметры запуска YuNet
+    */
+    CascadeDetector(CascadeGate gate = GATE_HAAR_OR_MOTION, const YuNetConfig& config = defaultYuNetConfig())
+        : m_yunet(config), m_gate(gate) {};
+    ~CascadeDetector(){};
+
+    bool isReady() const { return m_haar.isReady() && m_yunet.isReady(); }
+    void waitReady()
+    {
+        m_haar.waitReady();
+        m_yunet.waitReady();
+    }
+
+    /*
+        Функция детекции лиц. Возвращает матрицу в формате YuNetDetector::detect.
+    */
+    const cv::Mat& detect(FrameCache& frame)
+    {
+        m_stats.frames++;
+        gate(frame);
+        // detect(frame) возвращает внутренний буфер YuNet, поэтому результат копируется
+        if (++m_framesSinceFull >= m_fullEvery){
+            m_framesSinceFull = 0;
+            m_stats.fullFrames++;
+            m_yunet.detect(frame).copyTo(m_faces);
+        }
+        else if (m_regions.empty()){
+            m_stats.gatedFrames++;
+            m_faces.create(0, 15, CV_32F);
+        }
+        else{
+            m_stats.regionFrames++;
+            detectRegions(frame);
+        }
+        m_previous = YuNetDetector::boxesFromFaces(m_faces);
+
+        if (m_shadow){
+            measureRecall(frame);
+        }
+        if (m_reportEvery > 0 && m_stats.frames % m_reportEvery == 0){
+            report();
+        }
+        return m_faces;
+    }
+
+    std::vector<cv::Rect> predict(FrameCache& frame)
+    {
+        return YuNetDetector::boxesFromFaces(detect(frame));
+    }
+
+    template<int N>
+    void predict(FrameCache& frame, FaceBatch<N>& faces)
+    {
+        const cv::Mat& result = detect(frame);
+        faces.resize(result.rows);
+        for (int i = 0; i < result.rows; i++){
+            const float* row = result.ptr<float>(i);
+            faces.box(i) = cv::Rect2i(int(row[0]), int(row[1]), int(row[2]), int(row[3]));
+            faces.score(i) = row[14];
+            if (N == 5){
+                for (int j = 0; j < 5; j++){
+                    faces.setLandmark(i, j, row[4 + 2 * j], row[5 + 2 * j]);
+                }
+            }
+        }
+    }
+
+    /*
+        Вывод доли кадров без запуска YuNet и, в теневом режиме, полноты
+        относительно постоянно работающего YuNet
+    */
+    void report() const
+    {
+        std::cout << "Cascade: " << m_stats.frames << " frames, gated " << 100.0 * m_stats.gatedFraction()
+                  << "%, regions " << m_stats.regionFrames << ", full " << m_stats.fullFrames
+                  << ", haar " << m_stats.haarFrames;
+        if (m_shadow){
+            std::cout << ", recall " << 100.0 * m_stats.recall() << "% (" << m_stats.recalledFaces
+                      << "/" << m_stats.referenceFaces << ")";
+        }
+        std::cout << std::endl;
+    }
+
+    const CascadeStats& stats() const { return m_stats; }
+    void resetStats() { m_stats = CascadeStats(); }
+    void setGate(CascadeGate gate) { m_gate = gate; }
+    void setFullEvery(int fullEvery) { m_fullEvery = std::max(1, fullEvery); }
+    void setHaarIdleEvery(int haarIdleEvery) { m_haarIdleEvery = std::max(1, haarIdleEvery); }
+    void setShadowMode(bool shadow) { m_shadow = shadow; }
+    void setReportEvery(int reportEvery) { m_reportEvery = reportEvery; }
+    void setMotion(int threshold, float minFraction) { m_motionThreshold = threshold; m_minMotionFraction = minFraction; }
+};
+
+}
+
+#endif // CASCADEDETECTOR_H
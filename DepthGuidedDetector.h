@@ -0,0 +1,228 @@
+#ifndef DEPTHGUIDEDDETECTOR_H
+#define DEPTHGUIDEDDETECTOR_H
+
+#include <algorithm>
+#include <vector>
+
+#include <opencv2/imgproc.hpp>
+
+#include "BoxMerging.h"
+#include "FaceDetectors.h"
+#include "OpenNI2OpenCV.h"
+
+// Face Bounding Box Detector
+namespace FaceBBDetector{
+
+/*
+    Область поиска лица, полученная по карте глубины
+*/
+struct FaceProposal
+{
+    // Область поиска в координатах кадра
+    cv::Rect2i roi;
+    // Медианная глубина области (мм)
+    float depth;
+    // Допустимый диапазон размеров лица в пикселях
+    cv::Size minSize, maxSize;
+};
+
+/*
+    Формирование областей поиска лиц по карте глубины.
+    Карта глубины должна быть совмещена с цветным изображением
+    (OpenNI2OpenCV::init(true)).
+*/
+class DepthProposals
+{
+private:
+    // Диапазон расстояний (мм), в котором ищутся лица
+    uint16_t m_minDepth = 300;
+    uint16_t m_maxDepth = 2500;
+    // Во сколько раз уменьшается карта глубины перед сегментацией
+    int m_downscale = 4;
+    // Допустимая физическая ширина лица (м)
+    float m_minFaceWidth = 0.10;
+    float m_maxFaceWidth = 0.25;
+    // Минимальная площадь объекта на уменьшенной карте глубины (в пикселях)
+    int m_minBlobArea = 40;
+
+    // Буферы переиспользуются между кадрами
+    cv::Mat m_small, m_mask, m_labels, m_stats, m_centroids;
+    std::vector<uint16_t> m_values;
+    std::vector<FaceProposal> m_proposals;
+
+    /*
+        Значение квантиля q (0..1) массива значений глубины
+    */
+    static uint16_t quantile(std::vector<uint16_t>& values, float q)
+    {
+        size_t k = std::min(values.size() - 1, size_t(q * values.size()));
+        std::nth_element(values.begin(), values.begin() + k, values.end());
+        return values[k];
+    }
+
+public:
+    DepthProposals(){};
+    ~DepthProposals(){};
+
+    /*
+        Функция формирования областей поиска лиц
+        Аргументы:
+            - depth - карта глубины (CV_16UC1, мм)
+            - K - внутренние параметры цветной камеры
+    */
+    const std::vector<FaceProposal>& propose(const cv::Mat& depth, const OpenNIOpenCV::CameraIntrinsics& K)
+    {
+        m_proposals.clear();
+        cv::Size smallSize(depth.cols / m_downscale, depth.rows / m_downscale);
+        resize(depth, m_small, smallSize, 0, 0, cv::INTER_NEAREST);
+
+        // Выделение объектов переднего плана
+        cv::inRange(m_small, cv::Scalar(m_minDepth), cv::Scalar(m_maxDepth), m_mask);
+        cv::morphologyEx(m_mask, m_mask, cv::MORPH_OPEN,
+                         cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3)));
+        int n = cv::connectedComponentsWithStats(m_mask, m_labels, m_stats, m_centroids);
+
+        cv::Rect2i frameRect(0, 0, depth.cols, depth.rows);
+        for (int i = 1; i < n; i++){
+            if (m_stats.at<int>(i, cv::CC_STAT_AREA) < m_minBlobArea){
+                continue;
+            }
+            cv::Rect2i blob(m_stats.at<int>(i, cv::CC_STAT_LEFT), m_stats.at<int>(i, cv::CC_STAT_TOP),
+                            m_stats.at<int>(i, cv::CC_STAT_WIDTH), m_stats.at<int>(i, cv::CC_STAT_HEIGHT));
+
+            // Диапазон глубин объекта
+            m_values.clear();
+            for (int y = blob.y; y < blob.y + blob.height; y++){
+                const int* label = m_labels.ptr<int>(y);
+                const uint16_t* d = m_small.ptr<uint16_t>(y);
+                for (int x = blob.x; x < blob.x + blob.width; x++){
+                    if (label[x] == i){
+                        m_values.push_back(d[x]);
+                    }
+                }
+            }
+            float zNear = quantile(m_values, 0.1f) * 0.001f;
+            float zFar = quantile(m_values, 0.9f) * 0.001f;
+
+            // Ожидаемый размер лица в пикселях для диапазона глубин объекта
+            FaceProposal proposal;
+            proposal.depth = quantile(m_values, 0.5f);
+            int minSide = std::max(8, int(K.fx * m_minFaceWidth / zFar));
+            int maxSide = std::max(minSide + 1, int(K.fx * m_maxFaceWidth / zNear));
+            proposal.minSize = cv::Size(minSide, minSide);
+            proposal.maxSize = cv::Size(maxSide, maxSide);
+
+            // Область объекта расширяется, чтобы лицо на его границе попало в область целиком
+            int pad = maxSide / 4;
+            proposal.roi = cv::Rect2i(blob.x * m_downscale - pad, blob.y * m_downscale - pad,
+                                      blob.width * m_downscale + 2 * pad,
+                                      blob.height * m_downscale + 2 * pad) & frameRect;
+            if (proposal.roi.width >= minSide && proposal.roi.height >= minSide){
+                m_proposals.push_back(proposal);
+            }
+        }
+        return m_proposals;
+    }
+
+    /*
+        Медианная глубина центральной части bounding box (мм), 0 - если глубина неизвестна
+    */
+    float faceDepth(const cv::Mat& depth, const cv::Rect2i& box)
+    {
+        cv::Rect2i center(box.x + box.width / 4, box.y + box.height / 4, box.width / 2, box.height / 2);
+        center &= cv::Rect2i(0, 0, depth.cols, depth.rows);
+        m_values.clear();
+        for (int y = center.y; y < center.y + center.height; y++){
+            const uint16_t* d = depth.ptr<uint16_t>(y);
+            for (int x = center.x; x < center.x + center.width; x++){
+                if (d[x] != 0){
+                    m_values.push_back(d[x]);
+                }
+            }
+        }
+        return m_values.empty() ? 0.f : float(quantile(m_values, 0.5f));
+    }
+
+    /*
+        Проверка физического размера найденного лица
+        Аргументы:
+            - box - bounding box лица
+            - depth - карта глубины (CV_16UC1, мм)
+            - K - внутренние параметры цветной камеры
+    */
+    bool isPlausible(const cv::Rect2i& box, const cv::Mat& depth, const OpenNIOpenCV::CameraIntrinsics& K)
+    {
+        float z = faceDepth(depth, box) * 0.001f;
+        if (z <= 0.f){
+            return false;
+        }
+        float width = box.width * z / K.fx;
+        return width >= m_minFaceWidth && width <= m_maxFaceWidth;
+    }
+
+    void setDepthRange(uint16_t minDepth, uint16_t maxDepth) { m_minDepth = minDepth; m_maxDepth = maxDepth; }
+    void setFaceWidthRange(float minWidth, float maxWidth) { m_minFaceWidth = minWidth; m_maxFaceWidth = maxWidth; }
+};
+
+/*
+    Детектор лиц, запускаемый только в областях, найденных по карте глубины.
+    Detector - HaarCascaadDetector или YuNetDetector
+    (необходим метод predict(frame, roi, minSize, maxSize)).
+*/
+template<class Detector>
+class DepthGuidedDetector
+{
+private:
+    Detector m_detector;
+    DepthProposals m_proposals;
+    // IoU, выше которого bounding boxes из перекрывающихся областей считаются дубликатами
+    float m_duplicateIoU = 0.5;
+    BoxMerging::BoxSet m_found;
+    BoxMerging::BoxMerger m_merger;
+    std::vector<cv::Rect2i> m_candidates;
+
+public:
+    DepthGuidedDetector(){};
+    ~DepthGuidedDetector(){};
+
+    /*
+        Функция предсказания координат bounding boxes лица
+        Аргументы:
+            - frame - кэш цветного кадра
+            - depth - совмещенная с ним карта глубины (CV_16UC1, мм)
+            - K - внутренние параметры цветной камеры
+    */
+    std::vector<cv::Rect2i> predict(FrameCache& frame, const cv::Mat& depth,
+                                    const OpenNIOpenCV::CameraIntrinsics& K)
+    {
+        m_found.clear();
+        m_candidates.clear();
+        const std::vector<FaceProposal>& proposals = m_proposals.propose(depth, K);
+        for (size_t i = 0; i < proposals.size(); i++){
+            std::vector<cv::Rect2i> found = m_detector.predict(frame, proposals[i].roi,
+                                                               proposals[i].minSize, proposals[i].maxSize);
+            for (size_t j = 0; j < found.size(); j++){
+                // Отсеивание лиц неправдоподобного размера (фотографии, экраны)
+                if (m_proposals.isPlausible(found[j], depth, K)){
+                    m_candidates.push_back(found[j]);
+                    m_found.add(found[j], 1.f);
+                }
+            }
+        }
+        // Дубликаты из перекрывающихся областей: при равных уверенностях
+        // остается box, найденный первым
+        const std::vector<int>& keep = m_merger.nms(m_found, m_duplicateIoU);
+        std::vector<cv::Rect2i> boxes;
+        for (size_t i = 0; i < keep.size(); i++){
+            boxes.push_back(m_candidates[keep[i]]);
+        }
+        return boxes;
+    }
+
+    Detector& detector() { return m_detector; }
+    DepthProposals& proposals() { return m_proposals; }
+};
+
+}
+
+#endif // DEPTHGUIDEDDETECTOR_H
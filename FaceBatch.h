@@ -0,0 +1,116 @@
+#ifndef FACEBATCH_H
+#define FACEBATCH_H
+
+#include <algorithm>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+/*
+    Результаты обработки кадра для всех найденных лиц.
+    Bounding boxes, уверенности и ключевые точки хранятся в отдельных
+    непрерывных массивах (structure of arrays); координаты x и y ключевых точек
+    также хранятся раздельно. Память выделяется только при росте числа лиц,
+    поэтому при повторном использовании контейнера между кадрами выделений памяти нет.
+    N - число ключевых точек модели (5 - YuNet, 68 - dlib и LBF).
+*/
+template<int N>
+class FaceBatch
+{
+public:
+    static const int numLandmarks = N;
+
+private:
+    int m_size = 0;
+    int m_capacity = 0;
+    std::vector<cv::Rect2i> m_boxes;
+    std::vector<float> m_scores;
+    // Идентификаторы сопровождаемых лиц (-1 - лицо не сопровождается)
+    std::vector<int> m_ids;
+    // Ключевые точки лица i занимают элементы [i * N, (i + 1) * N)
+    std::vector<float> m_x, m_y;
+
+public:
+    FaceBatch(int capacity = 16) { reserve(capacity); };
+    ~FaceBatch(){};
+
+    /*
+        Выделение памяти под capacity лиц
+    */
+    void reserve(int capacity)
+    {
+        if (capacity <= m_capacity){
+            return;
+        }
+        m_boxes.resize(capacity);
+        m_scores.resize(capacity);
+        m_ids.resize(capacity, -1);
+        m_x.resize(capacity * N);
+        m_y.resize(capacity * N);
+        m_capacity = capacity;
+    }
+
+    /*
+        Изменение числа лиц, память освобождается только при уничтожении контейнера
+    */
+    void resize(int size)
+    {
+        if (size > m_capacity){
+            reserve(std::max(size, 2 * m_capacity));
+        }
+        m_size = size;
+    }
+
+    void clear() { m_size = 0; }
+
+    /*
+        Добавление лица, возвращает его индекс
+    */
+    int add(const cv::Rect2i& box, float score)
+    {
+        resize(m_size + 1);
+        m_boxes[m_size - 1] = box;
+        m_scores[m_size - 1] = score;
+        m_ids[m_size - 1] = -1;
+        return m_size - 1;
+    }
+
+    int size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    cv::Rect2i& box(int i) { return m_boxes[i]; }
+    const cv::Rect2i& box(int i) const { return m_boxes[i]; }
+    float& score(int i) { return m_scores[i]; }
+    float score(int i) const { return m_scores[i]; }
+    int& id(int i) { return m_ids[i]; }
+    int id(int i) const { return m_ids[i]; }
+
+    // Координаты ключевых точек лица i
+    float* x(int i) { return m_x.data() + i * N; }
+    const float* x(int i) const { return m_x.data() + i * N; }
+    float* y(int i) { return m_y.data() + i * N; }
+    const float* y(int i) const { return m_y.data() + i * N; }
+
+    cv::Point2f landmark(int i, int j) const { return cv::Point2f(m_x[i * N + j], m_y[i * N + j]); }
+    void setLandmark(int i, int j, float x, float y)
+    {
+        m_x[i * N + j] = x;
+        m_y[i * N + j] = y;
+    }
+
+    // Непрерывные массивы для обработки всех лиц за один проход
+    const cv::Rect2i* boxes() const { return m_boxes.data(); }
+    const float* scores() const { return m_scores.data(); }
+    float* xs() { return m_x.data(); }
+    const float* xs() const { return m_x.data(); }
+    float* ys() { return m_y.data(); }
+    const float* ys() const { return m_y.data(); }
+};
+
+template<int N> const int FaceBatch<N>::numLandmarks;
+
+typedef FaceBatch<5> YuNetFaceBatch;
+typedef FaceBatch<68> DlibFaceBatch;
+typedef FaceBatch<68> LBFFaceBatch;
+
+#endif // FACEBATCH_H
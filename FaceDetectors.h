@@ -1,6 +1,9 @@
 #ifndef FACEDETECTORS_H
 #define FACEDETECTORS_H
 
+#include <algorithm>
+#include <chrono>
+#include <future>
 #include <iostream>
 #include <vector>
 
@@ -9,6 +12,10 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/objdetect.hpp>
 
+#include "FaceBatch.h"
+#include "FrameCache.h"
+#include "ModelLoader.h"
+
 // Face Bounding Box Detector
 namespace FaceBBDetector{
 /*
@@ -20,18 +27,26 @@ private:
     // Путь к каскадам Хаара
     cv::String m_face_cascade_path = "haarcascade_frontalface_default.xml";
     cv::CascadeClassifier m_faceDetector;
+    // Массив bounding boxes переиспользуется между кадрами
+    std::vector<cv::Rect2i> m_boxes;
 
 public:
     HaarCascaadDetector()
     {
+        auto start = std::chrono::steady_clock::now();
         m_faceDetector.load(m_face_cascade_path);
+        ModelLoading::reportLoadTime(m_face_cascade_path, start);
     }
     ~HaarCascaadDetector(){};
 
+    // Каскад загружается синхронно и готов сразу после создания
+    bool isReady() const { return true; }
+    void waitReady() {}
+
     /*
         Функция предсказания координат bounding boxes лица
     */
-    std::vector<cv::Rect2i> predict(cv::Mat& image){
+    std::vector<cv::Rect2i> predict(const cv::Mat& image){
         // Переменная для хранения изображения в оттенки серого
         cv::Mat gray;
 
@@ -45,8 +60,126 @@ public:
         m_faceDetector.detectMultiScale(gray, boxes);
         return boxes;
     }
+
+    /*
+        Функция предсказания координат bounding boxes лица
+        по кадру в градациях серого из кэша кадра
+    */
+    std::vector<cv::Rect2i> predict(FrameCache& frame){
+        std::vector<cv::Rect2i> boxes;
+        m_faceDetector.detectMultiScale(frame.gray(), boxes);
+        return boxes;
+    }
+
+    /*
+        Функция предсказания координат bounding boxes лица с записью в контейнер faces
+    */
+    template<int N>
+    void predict(FrameCache& frame, FaceBatch<N>& faces){
+        m_faceDetector.detectMultiScale(frame.gray(), m_boxes);
+        faces.clear();
+        for (size_t i = 0; i < m_boxes.size(); i++){
+            faces.add(m_boxes[i], 1.f);
+        }
+    }
+
+    /*
+        Быстрая детекция на изображении в градациях серого с заданной строгостью
+        (например, как предварительный фильтр перед более точной моделью)
+        Аргументы:
+            - gray - изображение в градациях серого
+            - scaleFactor - шаг масштаба пирамиды
+            - minNeighbors - минимальное число совпавших срабатываний
+    */
+    const std::vector<cv::Rect2i>& detectGray(const cv::Mat& gray, double scaleFactor, int minNeighbors){
+        m_faceDetector.detectMultiScale(gray, m_boxes, scaleFactor, minNeighbors);
+        return m_boxes;
+    }
+
+    /*
+        Функция предсказания координат bounding boxes лица внутри области изображения
+        Аргументы:
+            - image - изображение
+            - roi - область поиска
+            - minSize, maxSize - допустимый диапазон размеров лица
+    */
+    std::vector<cv::Rect2i> predict(const cv::Mat& image, const cv::Rect2i& roi,
+                                    cv::Size minSize, cv::Size maxSize)
+    {
+        cv::Mat gray;
+        std::vector<cv::Rect2i> boxes;
+        cv::Rect2i region = roi & cv::Rect2i(0, 0, image.cols, image.rows);
+        if (region.empty()){
+            return boxes;
+        }
+        cvtColor(image(region), gray, cv::COLOR_BGR2GRAY);
+
+        // Поиск только в диапазоне масштабов, соответствующем расстоянию до области
+        m_faceDetector.detectMultiScale(gray, boxes, 1.1, 3, 0, minSize, maxSize);
+        for (size_t i = 0; i < boxes.size(); i++){
+            boxes[i].x += region.x;
+            boxes[i].y += region.y;
+        }
+        return boxes;
+    }
+
+    std::vector<cv::Rect2i> predict(FrameCache& frame, const cv::Rect2i& roi,
+                                    cv::Size minSize, cv::Size maxSize)
+    {
+        std::vector<cv::Rect2i> boxes;
+        const cv::Mat& gray = frame.gray();
+        cv::Rect2i region = roi & cv::Rect2i(0, 0, gray.cols, gray.rows);
+        if (region.empty()){
+            return boxes;
+        }
+        m_faceDetector.detectMultiScale(gray(region), boxes, 1.1, 3, 0, minSize, maxSize);
+        for (size_t i = 0; i < boxes.size(); i++){
+            boxes[i].x += region.x;
+            boxes[i].y += region.y;
+        }
+        return boxes;
+    }
 };
 
+/*
+    Параметры запуска сети YuNet
+*/
+struct YuNetConfig
+{
+    // Бэкенд и устройство OpenCV DNN (cv::dnn::Backend, cv::dnn::Target)
+    int backendId = cv::dnn::DNN_BACKEND_DEFAULT;
+    int targetId = cv::dnn::DNN_TARGET_CPU;
+    // Число потоков циклов OpenCV (0 - не изменять). Детектор его не применяет:
+    // значение задается один раз при запуске программы (applyThreads)
+    int numThreads = 0;
+    // Разрешение, на котором выполняется детекция (пустой размер - исходное разрешение кадра)
+    cv::Size inputSize = cv::Size(320, 240);
+};
+
+/*
+    Параметры YuNet, с которыми создаются детекторы по умолчанию
+    (например, найденные автоматической настройкой)
+*/
+YuNetConfig& defaultYuNetConfig()
+{
+    static YuNetConfig config;
+    return config;
+}
+
+/*
+    Применение числа потоков конфигурации к циклам OpenCV. Вызывается один раз
+    при запуске: после routeOpenCV ограничивает число частей цикла OpenCV,
+    одновременно выполняемых планировщиком задач
+    Аргументы:
+        - config - параметры запуска сети
+*/
+void applyThreads(const YuNetConfig& config)
+{
+    if (config.numThreads > 0){
+        cv::setNumThreads(config.numThreads);
+    }
+}
+
 /*
     Модель на основе сети YuNet для детекции лица на изображении
     Ссылка на модель: https://github.com/opencv/opencv_zoo/tree/main/models/face_detection_yunet
@@ -61,32 +194,228 @@ private:
     // Параметр отсеивающий bounding boxes с IoU < m_nmsThreshold
     float m_nmsThreshold = 0.3;
     int m_topK = 5000;
-    // Параметр определяющий степень увеличения изображения
-    float m_scale = 1.0;
+    YuNetConfig m_config;
+    // Разрешение, на котором выполняется детекция.
+    // Пустой размер - детекция на исходном разрешении кадра
+    cv::Size m_detectSize;
+    // Масштаб разрешения детекции относительно m_config.inputSize (или кадра при пустом inputSize)
+    float m_detectScale = 1.f;
+    // Текущий размер входа сети (setInputSize вызывается только при его изменении)
+    cv::Size m_inputSize;
+    // Буфер для уменьшенного кадра, переиспользуется между кадрами
+    cv::Mat m_resized;
+    // Результат детекции в координатах исходного кадра
+    cv::Mat m_faces;
+    // Размер лица (в пикселях входа сети), к которому приводятся области поиска
+    int m_regionFaceSize = 96;
+    // Число синтетических запусков сети при прогреве
+    int m_warmUpRuns = 3;
 
     cv::Ptr<cv::FaceDetectorYN> m_detector;
+    // Загрузка модели выполняется в фоновом потоке, детекция ожидает ее завершения
+    std::shared_future<void> m_loaded;
+
+    /*
+        Разрешение детекции для кадра размера frameSize, пустой размер - исходное разрешение
+    */
+    cv::Size detectSize(cv::Size frameSize) const
+    {
+        if (!m_detectSize.empty() || m_detectScale == 1.f){
+            return m_detectSize;
+        }
+        return cv::Size(std::max(32, int(frameSize.width * m_detectScale)), std::max(32, int(frameSize.height * m_detectScale)));
+    }
+
+    /*
+        Запуск сети на подготовленном изображении и пересчет координат
+        bounding boxes и ключевых точек: p = p * scale + offset
+    */
+    const cv::Mat& run(const cv::Mat& input, cv::Point2f offset, float scaleX, float scaleY)
+    {
+        m_loaded.get();
+
+        // Установка значений размера входного изображения
+        if (input.size() != m_inputSize){
+            m_inputSize = input.size();
+            m_detector->setInputSize(m_inputSize);
+        }
+
+        m_detector->detect(input, m_faces);
+
+        if ((scaleX != 1.f || scaleY != 1.f || offset.x != 0.f || offset.y != 0.f) && m_faces.rows >= 1){
+            for (int i = 0; i < m_faces.rows; i++){
+                float* face = m_faces.ptr<float>(i);
+                face[2] *= scaleX;
+                face[3] *= scaleY;
+                face[0] = face[0] * scaleX + offset.x;
+                face[1] = face[1] * scaleY + offset.y;
+                for (int j = 4; j < 14; j += 2){
+                    face[j] = face[j] * scaleX + offset.x;
+                    face[j + 1] = face[j + 1] * scaleY + offset.y;
+                }
+            }
+        }
+        return m_faces;
+    }
 
 public:
-    YuNetDetector()
+    /*
+        Аргументы:
+            - config - параметры запуска сети
+    */
+    YuNetDetector(const YuNetConfig& config = defaultYuNetConfig()) : m_config(config), m_detectSize(config.inputSize)
     {
-        m_detector = cv::FaceDetectorYN::create(m_fd_modelPath, "", cv::Size(320, 320),
-                                                m_scoreThreshold, m_nmsThreshold, m_topK);
+        m_inputSize = m_detectSize.empty() ? cv::Size(320, 320) : m_detectSize;
+        m_loaded = std::async(std::launch::async, [this]{
+            auto start = std::chrono::steady_clock::now();
+            m_detector = cv::FaceDetectorYN::create(m_fd_modelPath, "", m_inputSize,
+                                                    m_scoreThreshold, m_nmsThreshold, m_topK,
+                                                    m_config.backendId, m_config.targetId);
+            ModelLoading::reportLoadTime(m_fd_modelPath, start);
+            warmUp();
+        }).share();
     };
     ~YuNetDetector(){};
+    // Фоновая загрузка обращается к this: копирование и перемещение запрещены
+    YuNetDetector(const YuNetDetector&) = delete;
+    YuNetDetector& operator=(const YuNetDetector&) = delete;
 
-    std::vector<cv::Rect> predict(cv::Mat& image)
+    /*
+        Прогрев сети: синтетические запуски на рабочем размере входа, чтобы
+        выделение памяти слоев и "холодные" кэши не приходились на первый кадр
+    */
+    void warmUp()
     {
+        auto start = std::chrono::steady_clock::now();
+        cv::Mat image(m_inputSize, CV_8UC3);
+        cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+        for (int i = 0; i < m_warmUpRuns; i++){
+            m_detector->detect(image, m_faces);
+        }
+        m_faces.release();
+        ModelLoading::reportWarmUpTime(m_fd_modelPath, start);
+    }
 
-        int imageWidth = int(image.cols * m_scale);
-        int imageHeight = int(image.rows * m_scale);
-        resize(image, image, cv::Size(imageWidth, imageHeight));
+    // Модель загружена и прогрета
+    bool isReady() const { return m_loaded.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+    void waitReady() { m_loaded.get(); }
 
-        // Установка значений размера входного изображения
-        m_detector->setInputSize(image.size());
-        cv::Mat faces;
+    const YuNetConfig& config() const { return m_config; }
+
+    /*
+        Изменение разрешения детекции (например, при нехватке времени на кадр)
+        Аргументы:
+            - scale - масштаб относительно размера входа из параметров запуска
+            (при пустом размере - относительно кадра)
+    */
+    void setDetectScale(float scale)
+    {
+        m_detectScale = scale;
+        m_detectSize = m_config.inputSize.empty() ? cv::Size()
+                       : cv::Size(std::max(32, int(m_config.inputSize.width * scale)),
+                                  std::max(32, int(m_config.inputSize.height * scale)));
+    }
+    float detectScale() const { return m_detectScale; }
+
+    /*
+        Функция детекции лиц. Изображение вызывающей стороны не изменяется.
+        Возвращает матрицу в формате YuNet (по строке на лицо):
+            x, y, w, h, 5 пар координат ключевых точек, score
+        Координаты пересчитаны в разрешение исходного изображения.
+        Аргументы:
+            - image - изображение
+    */
+    const cv::Mat& detect(const cv::Mat& image)
+    {
+        cv::Size size = detectSize(image.size());
+        if (size.empty() || size == image.size()){
+            return run(image, cv::Point2f(0, 0), 1.f, 1.f);
+        }
+        resize(image, m_resized, size, 0, 0, cv::INTER_LINEAR);
+        return run(m_resized, cv::Point2f(0, 0),
+                   float(image.cols) / m_resized.cols, float(image.rows) / m_resized.rows);
+    }
+
+    /*
+        Функция детекции лиц по уменьшенной копии кадра из кэша кадра
+    */
+    const cv::Mat& detect(FrameCache& frame)
+    {
+        cv::Size size = detectSize(frame.size());
+        if (size.empty() || size == frame.size()){
+            return run(frame.bgr(), cv::Point2f(0, 0), 1.f, 1.f);
+        }
+        const cv::Mat& input = frame.bgr(size);
+        return run(input, cv::Point2f(0, 0),
+                   float(frame.size().width) / input.cols, float(frame.size().height) / input.rows);
+    }
+
+    /*
+        Функция детекции лиц внутри области изображения.
+        Область масштабируется так, чтобы ожидаемый размер лица не превышал
+        m_regionFaceSize пикселей; размер входа сети округляется до 32,
+        чтобы сократить число переконфигураций сети.
+        Аргументы:
+            - image - изображение
+            - roi - область поиска
+            - maxFaceSize - максимальный ожидаемый размер лица в области
+    */
+    const cv::Mat& detect(const cv::Mat& image, const cv::Rect2i& roi, cv::Size maxFaceSize)
+    {
+        cv::Rect2i region = roi & cv::Rect2i(0, 0, image.cols, image.rows);
+        if (region.empty()){
+            m_faces.release();
+            return m_faces;
+        }
+        float scale = 1.f;
+        if (maxFaceSize.width > m_regionFaceSize){
+            scale = float(m_regionFaceSize) / maxFaceSize.width;
+        }
+        int width = std::max(32, (int(region.width * scale) + 31) / 32 * 32);
+        int height = std::max(32, (int(region.height * scale) + 31) / 32 * 32);
+        resize(image(region), m_resized, cv::Size(width, height), 0, 0, cv::INTER_LINEAR);
+        return run(m_resized, cv::Point2f(float(region.x), float(region.y)),
+                   float(region.width) / width, float(region.height) / height);
+    }
+
+    std::vector<cv::Rect> predict(const cv::Mat& image)
+    {
+        return boxesFromFaces(detect(image));
+    }
+
+    std::vector<cv::Rect> predict(FrameCache& frame)
+    {
+        return boxesFromFaces(detect(frame));
+    }
+
+    /*
+        Функция предсказания bounding boxes лиц с записью в контейнер faces.
+        Для пятиточечного контейнера записываются также ключевые точки YuNet.
+    */
+    template<int N>
+    void predict(FrameCache& frame, FaceBatch<N>& faces)
+    {
+        const cv::Mat& result = detect(frame);
+        faces.resize(result.rows);
+        for (int i = 0; i < result.rows; i++){
+            const float* row = result.ptr<float>(i);
+            faces.box(i) = cv::Rect2i(int(row[0]), int(row[1]), int(row[2]), int(row[3]));
+            faces.score(i) = row[14];
+            if (N == 5){
+                for (int j = 0; j < 5; j++){
+                    faces.setLandmark(i, j, row[4 + 2 * j], row[5 + 2 * j]);
+                }
+            }
+        }
+    }
+
+    /*
+        Формирование массива bounding boxes из результата detect
+    */
+    static std::vector<cv::Rect2i> boxesFromFaces(const cv::Mat& faces)
+    {
         std::vector<cv::Rect2i> boxes;
 
-        m_detector->detect(image, faces);
         if (faces.rows >= 1){
             for (int i = 0; i < faces.rows; i++){
                 // Формирование массива с координатами bounding boxes
@@ -97,8 +426,35 @@ public:
         return boxes;
     }
 
-};
+    /*
+        Функция предсказания координат bounding boxes лица внутри области изображения
+        Аргументы:
+            - image - изображение
+            - roi - область поиска
+            - minSize, maxSize - допустимый диапазон размеров лица
+    */
+    std::vector<cv::Rect2i> predict(const cv::Mat& image, const cv::Rect2i& roi,
+                                    cv::Size minSize, cv::Size maxSize)
+    {
+        const cv::Mat& faces = detect(image, roi, maxSize);
+        std::vector<cv::Rect2i> boxes;
+        for (int i = 0; i < faces.rows; i++){
+            cv::Rect2i box(int(faces.at<float>(i, 0)), int(faces.at<float>(i, 1)),
+                           int(faces.at<float>(i, 2)), int(faces.at<float>(i, 3)));
+            if (box.width >= minSize.width && box.width <= maxSize.width){
+                boxes.push_back(box);
+            }
+        }
+        return boxes;
+    }
 
+    std::vector<cv::Rect2i> predict(FrameCache& frame, const cv::Rect2i& roi,
+                                    cv::Size minSize, cv::Size maxSize)
+    {
+        return predict(frame.bgr(), roi, minSize, maxSize);
+    }
+
+};
 }
 
 #endif // FACEDETECTORS_H
@@ -0,0 +1,215 @@
+#ifndef FACEEMBEDDING_H
+#define FACEEMBEDDING_H
+
+#include <chrono>
+#include <future>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/dnn.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "FaceBatch.h"
+#include "FrameCache.h"
+#include "ModelLoader.h"
+
+// Распознавание лиц
+namespace FaceRecognition{
+
+/*
+    Извлечение дескриптора лица сетью SFace (OpenCV DNN).
+    Лицо выравнивается по ключевым точкам (68 точек dlib/LBF или 5 точек YuNet):
+    находится подобие, переводящее центры глаз, кончик носа и углы рта в опорные
+    точки сети, и лицо вырезается в 112x112.
+    Все лица кадра обрабатываются одним запуском сети.
+    Ссылка на модель: https://github.com/opencv/opencv_zoo/tree/main/models/face_recognition_sface
+*/
+class FaceEmbedder
+{
+public:
+    static const int embeddingSize = 128;
+
+private:
+    cv::String m_modelPath = "face_recognition_sface_2021dec.onnx";
+    cv::dnn::Net m_net;
+    cv::Size m_inputSize = cv::Size(112, 112);
+    std::shared_future<void> m_loaded;
+
+    // Буферы переиспользуются между кадрами
+    std::vector<cv::Mat> m_aligned, m_images;
+    std::vector<int> m_rows;
+    std::vector<const float*> m_x, m_y;
+    std::vector<cv::Point2f> m_points;
+    cv::Mat m_embeddings;
+
+    /*
+        Опорные точки сети в изображении 112x112: глаза, нос, углы рта
+    */
+    static const std::vector<cv::Point2f>& referencePoints()
+    {
+        static const std::vector<cv::Point2f> points = {
+            cv::Point2f(38.2946f, 51.6963f), cv::Point2f(73.5318f, 51.5014f), cv::Point2f(56.0252f, 71.7366f),
+            cv::Point2f(41.5493f, 92.3655f), cv::Point2f(70.7299f, 92.2041f)};
+        return points;
+    }
+
+    /*
+        Пять опорных точек лица в порядке referencePoints
+    */
+    void anchorPoints(const float* x, const float* y, int numLandmarks)
+    {
+        m_points.clear();
+        if (numLandmarks == 68){
+            cv::Point2f eyes[2];
+            for (int e = 0; e < 2; e++){
+                for (int j = 36 + 6 * e; j < 42 + 6 * e; j++){
+                    eyes[e] += cv::Point2f(x[j], y[j]);
+                }
+                eyes[e] *= 1.f / 6;
+            }
+            m_points.push_back(eyes[0]);
+            m_points.push_back(eyes[1]);
+            m_points.push_back(cv::Point2f(x[30], y[30]));
+            m_points.push_back(cv::Point2f(x[48], y[48]));
+            m_points.push_back(cv::Point2f(x[54], y[54]));
+        }
+        else if (numLandmarks == 5){
+            for (int j = 0; j < 5; j++){
+                m_points.push_back(cv::Point2f(x[j], y[j]));
+            }
+        }
+    }
+
+public:
+    FaceEmbedder()
+    {
+        m_loaded = std::async(std::launch::async, [this]{
+            auto start = std::chrono::steady_clock::now();
+            m_net = cv::dnn::readNet(m_modelPath);
+            ModelLoading::reportLoadTime(m_modelPath, start);
+            warmUp();
+        }).share();
+    };
+    ~FaceEmbedder(){};
+    // Фоновая загрузка обращается к this: копирование и перемещение запрещены
+    FaceEmbedder(const FaceEmbedder&) = delete;
+    FaceEmbedder& operator=(const FaceEmbedder&) = delete;
+
+    /*
+        Прогрев сети на синтетическом лице
+    */
+    void warmUp()
+    {
+        auto start = std::chrono::steady_clock::now();
+        cv::Mat image(m_inputSize, CV_8UC3);
+        cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+        m_net.setInput(cv::dnn::blobFromImage(image, 1.0, m_inputSize, cv::Scalar(0, 0, 0), true, false));
+        m_net.forward();
+        ModelLoading::reportWarmUpTime(m_modelPath, start);
+    }
+
+    bool isReady() const { return m_loaded.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+    void waitReady() { m_loaded.get(); }
+
+    /*
+        Выравнивание лица по ключевым точкам
+        Аргументы:
+            - image - кадр (BGR)
+            - x, y - координаты ключевых точек
+            - numLandmarks - число ключевых точек (68 или 5)
+            - aligned - изображение лица 112x112
+    */
+    bool align(const cv::Mat& image, const float* x, const float* y, int numLandmarks, cv::Mat& aligned)
+    {
+        anchorPoints(x, y, numLandmarks);
+        if (m_points.empty()){
+            return false;
+        }
+        // Подобие (поворот, масштаб, сдвиг), устойчивое к одной неточной точке
+        cv::Mat transform = cv::estimateAffinePartial2D(m_points, referencePoints(), cv::noArray(), cv::LMEDS);
+        if (transform.empty()){
+            return false;
+        }
+        cv::warpAffine(image, aligned, transform, m_inputSize, cv::INTER_LINEAR);
+        return true;
+    }
+
+    /*
+        Дескрипторы нескольких лиц за один запуск сети.
+        Возвращает матрицу count x 128 (CV_32F), строки нормированы (||v|| = 1),
+        сходство лиц - скалярное произведение строк. Строки лиц, которые не удалось
+        выровнять, нулевые.
+        Аргументы:
+            - image - кадр (BGR)
+            - x, y - указатели на ключевые точки каждого лица
+            - numLandmarks - число ключевых точек (68 или 5)
+            - count - число лиц
+    */
+    const cv::Mat& embed(const cv::Mat& image, const float* const* x, const float* const* y, int numLandmarks, int count)
+    {
+        m_loaded.get();
+        m_embeddings.create(count, embeddingSize, CV_32F);
+        m_embeddings.setTo(cv::Scalar::all(0));
+        if (count == 0){
+            return m_embeddings;
+        }
+        m_aligned.resize(count);
+        m_rows.clear();
+        m_images.clear();
+        for (int i = 0; i < count; i++){
+            if (align(image, x[i], y[i], numLandmarks, m_aligned[i])){
+                m_rows.push_back(i);
+                m_images.push_back(m_aligned[i]);
+            }
+        }
+        if (m_images.empty()){
+            return m_embeddings;
+        }
+        m_net.setInput(cv::dnn::blobFromImages(m_images, 1.0, m_inputSize, cv::Scalar(0, 0, 0), true, false));
+        cv::Mat out = m_net.forward().reshape(1, int(m_images.size()));
+        for (size_t k = 0; k < m_rows.size(); k++){
+            cv::Mat row = m_embeddings.row(m_rows[k]);
+            cv::normalize(out.row(int(k)), row);
+        }
+        return m_embeddings;
+    }
+
+    /*
+        Дескрипторы всех лиц контейнера (строка i - лицо i)
+        Аргументы:
+            - frame - кэш кадра
+            - faces - лица с ключевыми точками
+    */
+    template<int N>
+    const cv::Mat& embed(FrameCache& frame, const FaceBatch<N>& faces)
+    {
+        m_x.resize(faces.size());
+        m_y.resize(faces.size());
+        for (int i = 0; i < faces.size(); i++){
+            m_x[i] = faces.x(i);
+            m_y[i] = faces.y(i);
+        }
+        return embed(frame.bgr(), m_x.data(), m_y.data(), N, faces.size());
+    }
+
+    /*
+        Дескриптор одного лица (1 x 128, CV_32F, нормирован), пустая матрица - лицо не выровнено
+    */
+    cv::Mat embedFace(const cv::Mat& image, const float* x, const float* y, int numLandmarks)
+    {
+        m_loaded.get();
+        cv::Mat aligned;
+        if (!align(image, x, y, numLandmarks, aligned)){
+            return cv::Mat();
+        }
+        m_net.setInput(cv::dnn::blobFromImage(aligned, 1.0, m_inputSize, cv::Scalar(0, 0, 0), true, false));
+        cv::Mat embedding;
+        cv::normalize(m_net.forward().reshape(1, 1), embedding);
+        return embedding;
+    }
+};
+
+}
+
+#endif // FACEEMBEDDING_H
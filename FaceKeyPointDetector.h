@@ -1,6 +1,9 @@
 #ifndef FACEKEYPOINTDETECTOR_H
 #define FACEKEYPOINTDETECTOR_H
 
+#include <chrono>
+#include <future>
+
 #include <opencv2/opencv.hpp>
 #include <opencv2/face.hpp>
 
@@ -13,6 +16,10 @@
 #include <dlib/opencv.h>
 
 #include "Utils.h"
+#include "FaceDetectors.h"
+#include "FrameCache.h"
+#include "ModelLoader.h"
+#include "TaskScheduler.h"
 
 
 // Face Key Point Detector
@@ -23,21 +30,56 @@ namespace FaceKPDetector{
 */
 class FaceKeyPointDetectorLBF
 {
+public:
+    static const int numLandmarks = 68;
+
 private:
     cv::Ptr<cv::face::Facemark> m_facemark;
     // Путь к параметрам LBF модели
     cv::String m_lbf_model_path = "lbfmodel.yaml";
+    // Буферы для обмена с cv::face::Facemark, переиспользуются между кадрами
+    std::vector<cv::Rect2i> m_boxes;
+    std::vector< std::vector<cv::Point2f> > m_landmarks;
+    // Загрузка модели выполняется в фоновом потоке, predict ожидает ее завершения
+    std::shared_future<void> m_loaded;
 
 public:
 
     FaceKeyPointDetectorLBF()
     {
         m_facemark = cv::face::FacemarkLBF::create();
-        m_facemark->loadModel(m_lbf_model_path);
-
-
+        // Модель загружается из кэша с матрицами в base64 (создается при первом запуске).
+        // cv::face::FacemarkLBF читает модель только через cv::FileStorage, поэтому
+        // кэш ускоряет разбор чисел, но не исключает разбор YAML
+        m_loaded = std::async(std::launch::async, [this]{
+            auto start = std::chrono::steady_clock::now();
+            m_facemark->loadModel(ModelLoading::cachedStorage(m_lbf_model_path));
+            ModelLoading::reportLoadTime(m_lbf_model_path, start);
+            warmUp();
+        }).share();
     };
     ~FaceKeyPointDetectorLBF(){};
+    // Фоновая загрузка обращается к this: копирование и перемещение запрещены
+    FaceKeyPointDetectorLBF(const FaceKeyPointDetectorLBF&) = delete;
+    FaceKeyPointDetectorLBF& operator=(const FaceKeyPointDetectorLBF&) = delete;
+
+    /*
+        Прогрев модели синтетическим изображением с одним лицом
+    */
+    void warmUp()
+    {
+        auto start = std::chrono::steady_clock::now();
+        cv::Mat image(480, 640, CV_8UC1);
+        cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+        std::vector<cv::Rect2i> boxes(1, cv::Rect2i(245, 165, 150, 150));
+        std::vector< std::vector<cv::Point2f> > landmarks;
+        m_facemark->fit(image, boxes, landmarks);
+        ModelLoading::reportWarmUpTime(m_lbf_model_path, start);
+    }
+
+    // Модель загружена и прогрета
+    bool isReady() const { return m_loaded.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+    void waitReady() { m_loaded.get(); }
 
     /*
         Функция определения ключевых точек на лице
@@ -46,13 +88,14 @@ public:
             - boxes - массив с координатами bounding boxes полученных
             с детектора лиц
     */
-    std::vector< std::vector<cv::Point2f> > predict(cv::Mat& image, std::vector<cv::Rect2i> boxes)
+    std::vector< std::vector<cv::Point2f> > predict(cv::Mat& image, const std::vector<cv::Rect2i>& boxes)
     {
         // Variable for landmarks.
         // Landmarks for one face is a vector of points
         // There can be more than one face in the image. Hence, we
         // use a vector of vector of points.
         std::vector< std::vector<cv::Point2f> > landmarks;
+        m_loaded.get();
 
         // Run landmark detector
         bool success = m_facemark->fit(image, boxes, landmarks);
@@ -66,6 +109,54 @@ public:
 //        }
         return landmarks;
     }
+
+    /*
+        Функция определения ключевых точек на лице по кадру
+        в градациях серого из кэша кадра
+    */
+    std::vector< std::vector<cv::Point2f> > predict(FrameCache& frame, const std::vector<cv::Rect2i>& boxes)
+    {
+        std::vector< std::vector<cv::Point2f> > landmarks;
+        m_loaded.get();
+        m_facemark->fit(frame.gray(), boxes, landmarks);
+        return landmarks;
+    }
+
+    /*
+        Функция определения ключевых точек для лиц из контейнера faces.
+        Лица, для которых ключевые точки не найдены, удаляются из контейнера,
+        чтобы в нем не оставались ключевые точки предыдущего кадра.
+    */
+    void predict(FrameCache& frame, LBFFaceBatch& faces)
+    {
+        m_loaded.get();
+        m_boxes.resize(faces.size());
+        for (int i = 0; i < faces.size(); i++){
+            m_boxes[i] = faces.box(i);
+        }
+        if (faces.empty()){
+            return;
+        }
+        if (!m_facemark->fit(frame.gray(), m_boxes, m_landmarks)){
+            faces.clear();
+            return;
+        }
+        // Лица сохраняют порядок, поэтому удаляются только лица в конце контейнера
+        int numFitted = 0;
+        while (numFitted < faces.size() && numFitted < int(m_landmarks.size()) &&
+               int(m_landmarks[numFitted].size()) >= numLandmarks){
+            numFitted++;
+        }
+        faces.resize(numFitted);
+        for (int i = 0; i < faces.size(); i++){
+            float* x = faces.x(i);
+            float* y = faces.y(i);
+            for (int j = 0; j < numLandmarks; j++){
+                x[j] = m_landmarks[i][j].x;
+                y[j] = m_landmarks[i][j].y;
+            }
+        }
+    }
 };
 
 /*
@@ -75,38 +166,43 @@ public:
 class YuNetDetector
 {
 private:
-    // Путь к параметрам модели
-    cv::String m_fd_modelPath = "face_detection_yunet_2023mar.onnx";
-    // Filter out faces of score < m_scoreThreshold
-    float m_scoreThreshold = 0.9;
-    // Параметр отсеивающий bounding boxes с IoU < m_nmsThreshold
-    float m_nmsThreshold = 0.3;
-    int m_topK = 5000;
-    // Параметр определяющий степень увеличения изображения
-    float m_scale = 1.0;
-
-    cv::Ptr<cv::FaceDetectorYN> m_detector;
+    // Детектор лиц YuNet, ключевые точки берутся из его выхода
+    FaceBBDetector::YuNetDetector m_detector;
 
 public:
-    YuNetDetector()
-    {
-        m_detector = cv::FaceDetectorYN::create(m_fd_modelPath, "", cv::Size(320, 320),
-                                                m_scoreThreshold, m_nmsThreshold, m_topK);
-    };
+    /*
+        Аргументы:
+            - config - параметры запуска сети
+    */
+    YuNetDetector(const FaceBBDetector::YuNetConfig& config = FaceBBDetector::defaultYuNetConfig()) : m_detector(config) {};
     ~YuNetDetector(){};
 
-    std::vector <std::vector<cv::Point2i>> predict(cv::Mat& image)
+    bool isReady() const { return m_detector.isReady(); }
+    void waitReady() { m_detector.waitReady(); }
+
+    std::vector <std::vector<cv::Point2i>> predict(const cv::Mat& image)
     {
+        return landmarksFromFaces(m_detector.detect(image));
+    }
 
-        int imageWidth = int(image.cols * m_scale);
-        int imageHeight = int(image.rows * m_scale);
-        resize(image, image, cv::Size(imageWidth, imageHeight));
+    std::vector <std::vector<cv::Point2i>> predict(FrameCache& frame)
+    {
+        return landmarksFromFaces(m_detector.detect(frame));
+    }
 
-        // Установка значений размера входного изображения
-        m_detector->setInputSize(image.size());
-        cv::Mat faces;
+    /*
+        Функция определения bounding boxes и пяти ключевых точек лиц с записью в контейнер faces
+    */
+    void predict(FrameCache& frame, YuNetFaceBatch& faces)
+    {
+        m_detector.predict(frame, faces);
+    }
 
-        m_detector->detect(image, faces);
+    /*
+        Формирование массива ключевых точек из результата FaceBBDetector::YuNetDetector::detect
+    */
+    static std::vector <std::vector<cv::Point2i>> landmarksFromFaces(const cv::Mat& faces)
+    {
         std::vector <std::vector<cv::Point2i>> landmarks(faces.rows);
         if (faces.rows >= 1){
             for (int i = 0; i < faces.rows; i++){
@@ -127,35 +223,158 @@ public:
 
 class DlibDetector
 {
+public:
+    static const int numLandmarks = 68;
+
 private:
+    cv::String m_sp_model_path = "shape_predictor_68_face_landmarks.dat";
     dlib::shape_predictor m_sp;
+    // Массивы ключевых точек переиспользуются между кадрами
+    std::vector< std::vector <cv::Point2i>> m_landmarks;
+    std::vector<dlib::rectangle> m_dBoxes;
+    // Загрузка модели выполняется в фоновом потоке, predict ожидает ее завершения
+    std::shared_future<void> m_loaded;
 
 public:
 
     DlibDetector(){
-        dlib::deserialize("shape_predictor_68_face_landmarks.dat") >> m_sp;
+        m_loaded = std::async(std::launch::async, [this]{
+            ModelLoading::loadShapePredictor(m_sp_model_path, m_sp);
+            warmUp();
+        }).share();
     }
 
     ~DlibDetector(){}
+    // Фоновая загрузка обращается к this: копирование и перемещение запрещены
+    DlibDetector(const DlibDetector&) = delete;
+    DlibDetector& operator=(const DlibDetector&) = delete;
 
-    std::vector< std::vector <cv::Point2i>> predict(cv::Mat& image, std::vector<cv::Rect2i> boxes)
+    /*
+        Прогрев модели: несколько предсказаний на синтетическом изображении,
+        чтобы данные деревьев регрессии попали в кэш до первого кадра
+    */
+    void warmUp()
+    {
+        auto start = std::chrono::steady_clock::now();
+        cv::Mat image(480, 640, CV_8UC1);
+        cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+        dlib::cv_image<unsigned char> dImage(image);
+        for (int i = 0; i < 3; i++){
+            m_sp(dImage, openCVRectToDlib(cv::Rect2i(245 - 20 * i, 165, 150 + 20 * i, 150 + 20 * i)));
+        }
+        ModelLoading::reportWarmUpTime(m_sp_model_path, start);
+    }
+
+    // Модель загружена и прогрета
+    bool isReady() const { return m_loaded.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+    void waitReady() { m_loaded.get(); }
+
+private:
+    /*
+        Определение ключевых точек по изображению dlib.
+        Лица обрабатываются параллельно задачами общего планировщика (по одному лицу
+        на задачу), модель m_sp используется всеми потоками только для чтения. Результат записывается в предвыделенные массивы
+        и действителен до следующего вызова predict.
+    */
+    template<class Image>
+    const std::vector< std::vector <cv::Point2i>>& predictImpl(const Image& dImage, const std::vector<cv::Rect2i>& boxes)
     {
-        dlib::cv_image<dlib::rgb_pixel> dImage(image);
-        std::vector<dlib::rectangle> dBoxes(boxes.size());
+        m_loaded.get();
+        m_dBoxes.resize(boxes.size());
         for (int i = 0; i < boxes.size(); i++){
-            dBoxes[i] = openCVRectToDlib(boxes[i]);
+            m_dBoxes[i] = openCVRectToDlib(boxes[i]);
+        }
+
+        const unsigned long numParts = m_sp.num_parts();
+        m_landmarks.resize(m_dBoxes.size());
+        for (size_t i = 0; i < m_landmarks.size(); i++){
+            m_landmarks[i].resize(numParts);
         }
-        std::vector <std::vector <cv::Point2i>> landmarks(dBoxes.size());
-        for (unsigned int i = 0; i < dBoxes.size(); i++){
-            dlib::full_object_detection shape = m_sp(dImage, dBoxes[i]);
-            std::vector<cv::Point2i> currLandmarks;
-            for (int j = 0; j < shape.num_parts(); j++){
-                currLandmarks.push_back(cv::Point(int(shape.part(j).x()),
-                                                  int(shape.part(j).y())));
+
+        defaultScheduler().parallelFor(cv::Range(0, int(m_dBoxes.size())), [&](const cv::Range& range){
+            for (int i = range.start; i < range.end; i++){
+                dlib::full_object_detection shape = m_sp(dImage, m_dBoxes[i]);
+                cv::Point2i* currLandmarks = m_landmarks[i].data();
+                for (unsigned long j = 0; j < numParts; j++){
+                    currLandmarks[j] = cv::Point(int(shape.part(j).x()),
+                                                 int(shape.part(j).y()));
+                }
             }
-            landmarks[i] = currLandmarks;
+        });
+        return m_landmarks;
+    }
+
+public:
+    /*
+        Функция определения ключевых точек на лице
+        Аргументы:
+            - image - изображение (BGR)
+            - boxes - массив с координатами bounding boxes полученных
+            с детектора лиц
+    */
+    const std::vector< std::vector <cv::Point2i>>& predict(const cv::Mat& image, const std::vector<cv::Rect2i>& boxes)
+    {
+        dlib::cv_image<dlib::bgr_pixel> dImage(image);
+        return predictImpl(dImage, boxes);
+    }
+
+    /*
+        Функция определения ключевых точек на лице по кадру в градациях серого
+        из кэша кадра (модель dlib работает с яркостью пикселей)
+    */
+    const std::vector< std::vector <cv::Point2i>>& predict(FrameCache& frame, const std::vector<cv::Rect2i>& boxes)
+    {
+        dlib::cv_image<unsigned char> dImage(frame.gray());
+        return predictImpl(dImage, boxes);
+    }
+
+    /*
+        Функция определения ключевых точек для лиц из контейнера faces.
+        Ключевые точки каждого лица записываются параллельно в его область контейнера.
+        Сам dlib::shape_predictor выделяет память на каждое лицо (результат
+        возвращается в новом dlib::full_object_detection), этот этап не свободен от выделений.
+    */
+    void predict(FrameCache& frame, DlibFaceBatch& faces)
+    {
+        m_loaded.get();
+        dlib::cv_image<unsigned char> dImage(frame.gray());
+        defaultScheduler().parallelFor(cv::Range(0, faces.size()), [&](const cv::Range& range){
+            for (int i = range.start; i < range.end; i++){
+                predictFace(dImage, faces, i);
+            }
+        });
+    }
+
+    /*
+        Функция определения ключевых точек только для лиц контейнера с индексами indices
+        (ключевые точки остальных лиц не изменяются)
+    */
+    void predict(FrameCache& frame, DlibFaceBatch& faces, const std::vector<int>& indices)
+    {
+        m_loaded.get();
+        dlib::cv_image<unsigned char> dImage(frame.gray());
+        defaultScheduler().parallelFor(cv::Range(0, int(indices.size())), [&](const cv::Range& range){
+            for (int k = range.start; k < range.end; k++){
+                predictFace(dImage, faces, indices[k]);
+            }
+        });
+    }
+
+private:
+    /*
+        Ключевые точки лица i, записываются в его область контейнера
+        (общая часть обоих вариантов predict для контейнера)
+    */
+    void predictFace(const dlib::cv_image<unsigned char>& dImage, DlibFaceBatch& faces, int i) const
+    {
+        const unsigned long numParts = std::min(m_sp.num_parts(), (unsigned long)numLandmarks);
+        dlib::full_object_detection shape = m_sp(dImage, openCVRectToDlib(faces.box(i)));
+        float* x = faces.x(i);
+        float* y = faces.y(i);
+        for (unsigned long j = 0; j < numParts; j++){
+            x[j] = float(shape.part(j).x());
+            y[j] = float(shape.part(j).y());
         }
-        return landmarks;
     }
 };
 }
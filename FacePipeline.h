@@ -0,0 +1,388 @@
+#ifndef FACEPIPELINE_H
+#define FACEPIPELINE_H
+
+#include <iostream>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include "CascadeDetector.h"
+#include "FaceBatch.h"
+#include "FaceDetectors.h"
+#include "FaceKeyPointDetector.h"
+#include "FaceTracker.h"
+#include "FrameCache.h"
+#include "LandmarkCache.h"
+#include "Landmarks3D.h"
+#include "LandmarkSmoothing.h"
+#include "MultiFaceTracker.h"
+#include "QualityController.h"
+#include "TiledDetector.h"
+#include "Utils.h"
+
+/*
+    Конвейер "детектор лиц -> детектор ключевых точек", собираемый на этапе компиляции.
+
+    Требования к составляющим:
+        - детектор лиц: template<int N> void predict(FrameCache&, FaceBatch<N>&)
+        записывает bounding boxes и уверенности;
+        - детектор ключевых точек: static const int numLandmarks и
+        void predict(FrameCache&, FaceBatch<numLandmarks>&)
+        записывает ключевые точки для bounding boxes контейнера;
+        - оба детектора: isReady() и waitReady() - готовность моделей.
+    Вызовы внутри конвейера не виртуальные и могут быть встроены компилятором.
+*/
+namespace FacePipeline{
+
+/*
+    Этап ключевых точек для детекторов лиц, которые сами находят ключевые точки (YuNet)
+*/
+template<int N>
+class DetectorLandmarks
+{
+public:
+    static const int numLandmarks = N;
+    void predict(FrameCache&, FaceBatch<N>&) {}
+    bool isReady() const { return true; }
+    void waitReady() {}
+};
+
+/*
+    Действие после определения ключевых точек. По умолчанию отсутствует,
+    трекер использует ключевые точки как точки слежения на следующем кадре,
+    детектор с предсказанием сглаживает их и предсказывает box на следующий кадр.
+*/
+template<class BoxDetector, int N>
+void afterLandmarks(BoxDetector&, const FaceBatch<N>&) {}
+
+template<int N>
+void afterLandmarks(FaceTracking::DetectThenTrack& detector, const FaceBatch<N>& faces)
+{
+    detector.seedLandmarks(faces);
+}
+
+template<class BoxDetector, int N>
+void afterLandmarks(FaceTracking::PredictiveDetector<BoxDetector, N>& detector, FaceBatch<N>& faces)
+{
+    detector.smooth(faces);
+}
+
+/*
+    Детектор лиц использует результат этапа ключевых точек на следующем кадре
+    (afterLandmarks). Для таких детекторов этапы детекции и ключевых точек
+    нельзя выполнять одновременно для разных кадров.
+*/
+template<class BoxDetector>
+struct LandmarkFeedback { static const bool value = false; };
+
+template<>
+struct LandmarkFeedback<FaceTracking::DetectThenTrack> { static const bool value = true; };
+
+template<class BoxDetector, int N>
+struct LandmarkFeedback<FaceTracking::PredictiveDetector<BoxDetector, N>> { static const bool value = true; };
+
+/*
+    Применение настроек регулятора качества к детектору лиц.
+    По умолчанию детектор не настраивается.
+*/
+template<class BoxDetector>
+void applyQuality(BoxDetector&, const QualitySettings&) {}
+
+void applyQuality(FaceBBDetector::YuNetDetector& detector, const QualitySettings& settings)
+{
+    detector.setDetectScale(settings.detectScale);
+}
+
+void applyQuality(FaceTracking::DetectThenTrack& detector, const QualitySettings& settings)
+{
+    detector.detector().setDetectScale(settings.detectScale);
+    detector.setDetectEveryFactor(settings.detectEveryFactor);
+}
+
+void applyQuality(FaceTracking::MultiFaceTracker& detector, const QualitySettings& settings)
+{
+    detector.detector().setDetectScale(settings.detectScale);
+}
+
+template<class BoxDetector, int N>
+void applyQuality(FaceTracking::PredictiveDetector<BoxDetector, N>& detector, const QualitySettings& settings)
+{
+    applyQuality(detector.detector(), settings);
+    detector.setDetectEveryFactor(settings.detectEveryFactor);
+}
+
+/*
+    Параметры регулятора качества, которые детектор лиц учитывает в applyQuality.
+    По умолчанию детектор не настраивается.
+*/
+template<class BoxDetector>
+struct DetectorKnobs
+{
+    static const bool detectScale = false;
+    static const bool detectCadence = false;
+};
+
+template<>
+struct DetectorKnobs<FaceBBDetector::YuNetDetector>
+{
+    static const bool detectScale = true;
+    static const bool detectCadence = false;
+};
+
+template<>
+struct DetectorKnobs<FaceTracking::DetectThenTrack>
+{
+    static const bool detectScale = true;
+    static const bool detectCadence = true;
+};
+
+template<>
+struct DetectorKnobs<FaceTracking::MultiFaceTracker>
+{
+    static const bool detectScale = true;
+    static const bool detectCadence = false;
+};
+
+template<class BoxDetector, int N>
+struct DetectorKnobs<FaceTracking::PredictiveDetector<BoxDetector, N>>
+{
+    static const bool detectScale = DetectorKnobs<BoxDetector>::detectScale;
+    static const bool detectCadence = true;
+};
+
+/*
+    Теневой режим детектора лиц: дополнительная эталонная детекция на каждом
+    кадре для оценки полноты. По умолчанию детектор его не поддерживает.
+*/
+template<class BoxDetector>
+void setShadowMode(BoxDetector&, bool) {}
+
+void setShadowMode(FaceBBDetector::CascadeDetector& detector, bool shadow)
+{
+    detector.setShadowMode(shadow);
+}
+
+template<class BoxDetector, class LandmarkDetector>
+class Pipeline
+{
+public:
+    typedef FaceBatch<LandmarkDetector::numLandmarks> Batch;
+
+private:
+    BoxDetector m_boxDetector;
+    LandmarkDetector m_landmarkDetector;
+
+public:
+    Pipeline(){};
+    ~Pipeline(){};
+
+    /*
+        Обработка кадра: bounding boxes и ключевые точки всех лиц записываются в faces
+    */
+    void process(FrameCache& frame, Batch& faces)
+    {
+        detect(frame, faces);
+        landmarks(frame, faces);
+    }
+
+    /*
+        Этапы конвейера по отдельности. Если детектор лиц не использует ключевые
+        точки (splittable), этапы могут выполняться в разных потоках для разных кадров.
+    */
+    void detect(FrameCache& frame, Batch& faces) { m_boxDetector.predict(frame, faces); }
+    void landmarks(FrameCache& frame, Batch& faces)
+    {
+        m_landmarkDetector.predict(frame, faces);
+        afterLandmarks(m_boxDetector, faces);
+    }
+    static const bool splittable = !LandmarkFeedback<BoxDetector>::value;
+
+    /*
+        Применение настроек регулятора качества
+    */
+    void applyQuality(const QualitySettings& settings) { FacePipeline::applyQuality(m_boxDetector, settings); }
+    static QualityKnobs qualityKnobs()
+    {
+        QualityKnobs knobs;
+        knobs.detectScale = DetectorKnobs<BoxDetector>::detectScale;
+        knobs.detectCadence = DetectorKnobs<BoxDetector>::detectCadence;
+        return knobs;
+    }
+    void setShadowMode(bool shadow) { FacePipeline::setShadowMode(m_boxDetector, shadow); }
+
+    /*
+        Готовность конвейера: модели всех этапов загружены и прогреты
+    */
+    bool isReady() const { return m_boxDetector.isReady() && m_landmarkDetector.isReady(); }
+    void waitReady()
+    {
+        m_boxDetector.waitReady();
+        m_landmarkDetector.waitReady();
+    }
+
+    BoxDetector& boxDetector() { return m_boxDetector; }
+    LandmarkDetector& landmarkDetector() { return m_landmarkDetector; }
+};
+
+typedef Pipeline<FaceBBDetector::YuNetDetector, DetectorLandmarks<5>> YuNetPipeline;
+typedef Pipeline<FaceBBDetector::YuNetDetector, FaceKPDetector::DlibDetector> YuNetDlibPipeline;
+typedef Pipeline<FaceBBDetector::YuNetDetector, FaceKPDetector::FaceKeyPointDetectorLBF> YuNetLBFPipeline;
+typedef Pipeline<FaceBBDetector::HaarCascaadDetector, FaceKPDetector::DlibDetector> HaarDlibPipeline;
+typedef Pipeline<FaceBBDetector::HaarCascaadDetector, FaceKPDetector::FaceKeyPointDetectorLBF> HaarLBFPipeline;
+typedef Pipeline<FaceTracking::DetectThenTrack, FaceKPDetector::DlibDetector> TrackDlibPipeline;
+typedef Pipeline<FaceBBDetector::TiledDetector, DetectorLandmarks<5>> TiledPipeline;
+typedef Pipeline<FaceBBDetector::TiledDetector, FaceKPDetector::DlibDetector> TiledDlibPipeline;
+typedef Pipeline<FaceBBDetector::CascadeDetector, DetectorLandmarks<5>> CascadePipeline;
+typedef Pipeline<FaceBBDetector::CascadeDetector, FaceKPDetector::DlibDetector> CascadeDlibPipeline;
+typedef Pipeline<FaceTracking::MultiFaceTracker, DetectorLandmarks<5>> MultiTrackPipeline;
+typedef Pipeline<FaceTracking::MultiFaceTracker, FaceKPDetector::DlibDetector> MultiTrackDlibPipeline;
+typedef Pipeline<FaceTracking::DetectThenTrack, FaceKPDetector::CachedLandmarks<FaceKPDetector::DlibDetector>> TrackCachedDlibPipeline;
+typedef Pipeline<FaceTracking::MultiFaceTracker, FaceKPDetector::CachedLandmarks<FaceKPDetector::DlibDetector>> MultiTrackCachedDlibPipeline;
+typedef Pipeline<FaceTracking::PredictiveDetector<FaceTracking::MultiFaceTracker, 5>, DetectorLandmarks<5>> SmoothPipeline;
+typedef Pipeline<FaceTracking::PredictiveDetector<FaceTracking::MultiFaceTracker, 68>, FaceKPDetector::DlibDetector> SmoothDlibPipeline;
+
+/*
+    Конвейер, выбираемый во время выполнения (например, из конфигурации).
+    Виртуальный вызов выполняется один раз на кадр, обработка лиц внутри
+    конвейера остается статической.
+*/
+class AnyPipeline
+{
+public:
+    virtual ~AnyPipeline(){};
+
+    virtual void process(FrameCache& frame) = 0;
+    virtual void draw(cv::Mat& image) const = 0;
+
+    /*
+        Обработка кадров в многопоточном конвейере: результаты каждого кадра
+        записываются в собственный слот (0 .. numSlots - 1)
+    */
+    virtual void setSlots(int numSlots) = 0;
+    virtual void process(FrameCache& frame, int slot) = 0;
+    virtual void detect(FrameCache& frame, int slot) = 0;
+    virtual void landmarks(FrameCache& frame, int slot) = 0;
+    virtual void draw(cv::Mat& image, int slot) const = 0;
+    // Этапы детекции и ключевых точек можно выполнять в разных потоках
+    virtual bool splittable() const = 0;
+
+    // Число лиц на последнем кадре
+    virtual int size() const = 0;
+    virtual int numLandmarks() const = 0;
+    virtual const cv::Rect2i& box(int i) const = 0;
+    virtual const float* x(int i) const = 0;
+    virtual const float* y(int i) const = 0;
+    // Идентификатор лица i, сохраняющийся между кадрами (-1 - конвейер не сопровождает лица)
+    virtual int trackId(int i) const = 0;
+    /*
+        Перевод ключевых точек последнего кадра в метрические 3D координаты
+        (Landmarks3D::lift) по совмещенной с цветным кадром карте глубины
+    */
+    virtual void liftLandmarks(const cv::Mat& depth, const OpenNIOpenCV::CameraIntrinsics& K) = 0;
+    // Координаты ключевых точек лица i после liftLandmarks (мм, Z = 0 - глубины нет)
+    virtual const float* X(int i) const = 0;
+    virtual const float* Y(int i) const = 0;
+    virtual const float* Z(int i) const = 0;
+    virtual const std::string& name() const = 0;
+    virtual void applyQuality(const QualitySettings& settings) = 0;
+    // Параметры регулятора качества, которые учитывает детектор лиц
+    virtual QualityKnobs qualityKnobs() const = 0;
+    // Теневой режим детектора лиц (только каскадный детектор)
+    virtual void setShadowMode(bool shadow) = 0;
+    virtual bool isReady() const = 0;
+    virtual void waitReady() = 0;
+};
+
+template<class P>
+class AnyPipelineImpl : public AnyPipeline
+{
+private:
+    P m_pipeline;
+    typename P::Batch m_faces;
+    std::vector<typename P::Batch> m_slotFaces;
+    FacePose::Landmarks3D<P::Batch::numLandmarks> m_points;
+    std::string m_name;
+
+public:
+    AnyPipelineImpl(const std::string& name) : m_name(name) {};
+
+    void process(FrameCache& frame) { m_pipeline.process(frame, m_faces); }
+    void draw(cv::Mat& image) const { drawLandmarks(image, m_faces); }
+
+    void setSlots(int numSlots) { m_slotFaces.resize(numSlots); }
+    void process(FrameCache& frame, int slot) { m_pipeline.process(frame, m_slotFaces[slot]); }
+    void detect(FrameCache& frame, int slot) { m_pipeline.detect(frame, m_slotFaces[slot]); }
+    void landmarks(FrameCache& frame, int slot) { m_pipeline.landmarks(frame, m_slotFaces[slot]); }
+    void draw(cv::Mat& image, int slot) const { drawLandmarks(image, m_slotFaces[slot]); }
+    bool splittable() const { return P::splittable; }
+    int size() const { return m_faces.size(); }
+    int numLandmarks() const { return P::Batch::numLandmarks; }
+    const cv::Rect2i& box(int i) const { return m_faces.box(i); }
+    const float* x(int i) const { return m_faces.x(i); }
+    const float* y(int i) const { return m_faces.y(i); }
+    int trackId(int i) const { return m_faces.id(i); }
+    void liftLandmarks(const cv::Mat& depth, const OpenNIOpenCV::CameraIntrinsics& K) { m_points.lift(m_faces, depth, K); }
+    const float* X(int i) const { return m_points.X(i); }
+    const float* Y(int i) const { return m_points.Y(i); }
+    const float* Z(int i) const { return m_points.Z(i); }
+    const std::string& name() const { return m_name; }
+    void applyQuality(const QualitySettings& settings) { m_pipeline.applyQuality(settings); }
+    QualityKnobs qualityKnobs() const { return P::qualityKnobs(); }
+    void setShadowMode(bool shadow) { m_pipeline.setShadowMode(shadow); }
+    bool isReady() const { return m_pipeline.isReady(); }
+    void waitReady() { m_pipeline.waitReady(); }
+
+    P& pipeline() { return m_pipeline; }
+    typename P::Batch& faces() { return m_faces; }
+};
+
+/*
+    Создание конвейера по имени
+    Аргументы:
+        - name - "yunet", "yunet+dlib", "yunet+lbf", "haar+dlib", "haar+lbf", "track+dlib",
+        "tiled", "tiled+dlib", "cascade", "cascade+dlib", "mot", "mot+dlib",
+        "track+dlib+cache", "mot+dlib+cache" (ключевые точки неподвижных лиц берутся из кэша),
+        "smooth", "smooth+dlib" (сглаживание ключевых точек и предсказание box без детекции)
+    Возвращает пустой указатель для неизвестного имени.
+*/
+cv::Ptr<AnyPipeline> createPipeline(const std::string& name)
+{
+    if (name == "yunet") return cv::makePtr<AnyPipelineImpl<YuNetPipeline>>(name);
+    if (name == "yunet+dlib") return cv::makePtr<AnyPipelineImpl<YuNetDlibPipeline>>(name);
+    if (name == "yunet+lbf") return cv::makePtr<AnyPipelineImpl<YuNetLBFPipeline>>(name);
+    if (name == "haar+dlib") return cv::makePtr<AnyPipelineImpl<HaarDlibPipeline>>(name);
+    if (name == "haar+lbf") return cv::makePtr<AnyPipelineImpl<HaarLBFPipeline>>(name);
+    if (name == "track+dlib") return cv::makePtr<AnyPipelineImpl<TrackDlibPipeline>>(name);
+    if (name == "tiled") return cv::makePtr<AnyPipelineImpl<TiledPipeline>>(name);
+    if (name == "tiled+dlib") return cv::makePtr<AnyPipelineImpl<TiledDlibPipeline>>(name);
+    if (name == "cascade") return cv::makePtr<AnyPipelineImpl<CascadePipeline>>(name);
+    if (name == "cascade+dlib") return cv::makePtr<AnyPipelineImpl<CascadeDlibPipeline>>(name);
+    if (name == "mot") return cv::makePtr<AnyPipelineImpl<MultiTrackPipeline>>(name);
+    if (name == "mot+dlib") return cv::makePtr<AnyPipelineImpl<MultiTrackDlibPipeline>>(name);
+    if (name == "track+dlib+cache") return cv::makePtr<AnyPipelineImpl<TrackCachedDlibPipeline>>(name);
+    if (name == "mot+dlib+cache") return cv::makePtr<AnyPipelineImpl<MultiTrackCachedDlibPipeline>>(name);
+    if (name == "smooth") return cv::makePtr<AnyPipelineImpl<SmoothPipeline>>(name);
+    if (name == "smooth+dlib") return cv::makePtr<AnyPipelineImpl<SmoothDlibPipeline>>(name);
+    std::cout << "Unknown pipeline: " << name << std::endl;
+    return cv::Ptr<AnyPipeline>();
+}
+
+/*
+    Имя конвейера с 5 ключевыми точками YuNet, заменяющего конвейер name
+    при нехватке времени на кадр (тот же детектор лиц без этапа ключевых точек)
+*/
+std::string lightPipelineName(const std::string& name)
+{
+    const char* light[] = {"yunet", "tiled", "cascade", "mot", "smooth"};
+    std::string prefix = name.substr(0, name.find('+'));
+    for (size_t i = 0; i < sizeof(light) / sizeof(light[0]); i++){
+        if (prefix == light[i]){
+            return prefix;
+        }
+    }
+    return "yunet";
+}
+
+}
+
+#endif // FACEPIPELINE_H
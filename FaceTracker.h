@@ -0,0 +1,393 @@
+#ifndef FACETRACKER_H
+#define FACETRACKER_H
+
+#include <algorithm>
+#include <vector>
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+
+#include "FaceDetectors.h"
+
+// Face Tracking
+namespace FaceTracking{
+
+/*
+    Лицо, сопровождаемое между запусками детектора
+*/
+struct TrackedFace
+{
+    // Идентификатор лица, сохраняется между кадрами
+    int id;
+    // Bounding box в координатах кадра
+    cv::Rect2f box;
+    // Уверенность детектора при последней детекции
+    float score;
+    // Доля точек, успешно прослеженных на последнем кадре
+    float trackQuality;
+    // Точки, по которым выполняется слежение (ключевые точки или сетка внутри box)
+    std::vector<cv::Point2f> points;
+};
+
+/*
+    Слой "детекция + слежение" между детектором YuNet и детектором ключевых точек.
+    Полная детекция выполняется раз в m_detectEvery кадров, а также при потере
+    качества слежения. На промежуточных кадрах bounding boxes переносятся
+    оптическим потоком Лукаса-Канаде по ключевым точкам лица.
+*/
+class DetectThenTrack
+{
+private:
+    FaceBBDetector::YuNetDetector m_detector;
+    // Период запуска полной детекции (в кадрах)
+    int m_detectEvery;
+    // Множитель периода детекции (регулятор качества)
+    int m_detectEveryFactor = 1;
+    // Минимальная доля прослеженных точек, ниже которой запускается детекция
+    float m_minTrackQuality = 0.5;
+    // Максимальная ошибка прямого-обратного прослеживания точки (в пикселях)
+    float m_maxFBError = 1.5;
+    // Минимальный IoU для сопоставления детекции с существующим лицом
+    float m_matchIoU = 0.3;
+    // Размер сетки точек, которой заполняется box до появления ключевых точек
+    int m_gridSize = 5;
+
+    int m_framesSinceDetect = 0;
+    bool m_forceDetect = false;
+    int m_nextId = 0;
+    std::vector<TrackedFace> m_faces;
+    // Лица, найденные при последней детекции (обменивается с m_faces, чтобы не выделять память)
+    std::vector<TrackedFace> m_detected;
+    // Массивы точек лиц, удаленных из m_faces или m_detected (переиспользуются для новых лиц)
+    std::vector< std::vector<cv::Point2f>> m_sparePoints;
+    // Сопровождаемые лица, уже сопоставленные с детекцией
+    std::vector<bool> m_used;
+
+    // Буферы переиспользуются между кадрами
+    cv::Mat m_gray, m_prevGray;
+    std::vector<cv::Point2f> m_prevPts, m_nextPts, m_backPts;
+    std::vector<uchar> m_status, m_backStatus;
+    std::vector<float> m_err;
+    std::vector<float> m_dx, m_dy, m_ratios;
+    std::vector<size_t> m_good;
+
+    static float iou(const cv::Rect2f& a, const cv::Rect2f& b)
+    {
+        float inter = (a & b).area();
+        float uni = a.area() + b.area() - inter;
+        return uni > 0 ? inter / uni : 0.f;
+    }
+
+    /*
+        Изменение числа лиц без освобождения памяти: массивы точек удаляемых лиц
+        сохраняются и передаются добавляемым лицам, поэтому в установившемся режиме
+        (после кадра с наибольшим числом лиц) память не выделяется
+    */
+    void resizeFaces(std::vector<TrackedFace>& faces, size_t size)
+    {
+        for (size_t i = size; i < faces.size(); i++){
+            faces[i].points.clear();
+            m_sparePoints.push_back(std::move(faces[i].points));
+        }
+        size_t old = faces.size();
+        faces.resize(size);
+        // Емкость достаточна для сетки с точками YuNet и для 68 ключевых точек
+        size_t pointCapacity = std::max(size_t(m_gridSize * m_gridSize + 5), size_t(68));
+        for (size_t i = old; i < size; i++){
+            if (!m_sparePoints.empty()){
+                faces[i].points.swap(m_sparePoints.back());
+                m_sparePoints.pop_back();
+            }
+            faces[i].points.reserve(pointCapacity);
+        }
+    }
+
+    static float median(std::vector<float>& values)
+    {
+        size_t mid = values.size() / 2;
+        std::nth_element(values.begin(), values.begin() + mid, values.end());
+        return values[mid];
+    }
+
+    /*
+        Заполнение box равномерной сеткой точек для слежения
+    */
+    void seedGrid(TrackedFace& face)
+    {
+        face.points.clear();
+        for (int i = 0; i < m_gridSize; i++){
+            for (int j = 0; j < m_gridSize; j++){
+                face.points.push_back(cv::Point2f(face.box.x + face.box.width * (j + 1) / (m_gridSize + 1),
+                                                  face.box.y + face.box.height * (i + 1) / (m_gridSize + 1)));
+            }
+        }
+    }
+
+    /*
+        Запуск детектора и сопоставление новых bounding boxes с сопровождаемыми лицами
+    */
+    void detect(FrameCache& frame)
+    {
+        assignDetections(m_detector.detect(frame));
+    }
+
+    /*
+        Перенос bounding boxes на текущий кадр оптическим потоком.
+        Возвращает false, если слежение за каким-либо лицом потеряно.
+    */
+    bool track()
+    {
+        m_prevPts.clear();
+        for (size_t i = 0; i < m_faces.size(); i++){
+            m_prevPts.insert(m_prevPts.end(), m_faces[i].points.begin(), m_faces[i].points.end());
+        }
+        if (m_prevPts.empty()){
+            return true;
+        }
+
+        cv::Size winSize(15, 15);
+        cv::calcOpticalFlowPyrLK(m_prevGray, m_gray, m_prevPts, m_nextPts, m_status, m_err, winSize, 2);
+        // Обратное прослеживание для отбраковки точек, "уехавших" с лица
+        cv::calcOpticalFlowPyrLK(m_gray, m_prevGray, m_nextPts, m_backPts, m_backStatus, m_err, winSize, 2);
+
+        bool ok = true;
+        size_t offset = 0;
+        for (size_t i = 0; i < m_faces.size(); i++){
+            TrackedFace& face = m_faces[i];
+            size_t n = face.points.size();
+            m_dx.clear();
+            m_dy.clear();
+            std::vector<size_t>& good = m_good;
+            good.clear();
+            for (size_t k = offset; k < offset + n; k++){
+                cv::Point2f fb = m_backPts[k] - m_prevPts[k];
+                if (m_status[k] && m_backStatus[k] && fb.dot(fb) < m_maxFBError * m_maxFBError){
+                    good.push_back(k);
+                    m_dx.push_back(m_nextPts[k].x - m_prevPts[k].x);
+                    m_dy.push_back(m_nextPts[k].y - m_prevPts[k].y);
+                }
+            }
+            face.trackQuality = n > 0 ? float(good.size()) / n : 0.f;
+            if (face.trackQuality < m_minTrackQuality || good.size() < 2){
+                ok = false;
+                offset += n;
+                continue;
+            }
+
+            // Изменение масштаба - медиана отношений попарных расстояний между точками
+            m_ratios.clear();
+            for (size_t a = 0; a + 1 < good.size(); a++){
+                size_t b = good[a + 1], c = good[a];
+                cv::Point2f d0 = m_prevPts[b] - m_prevPts[c];
+                cv::Point2f d1 = m_nextPts[b] - m_nextPts[c];
+                float l0 = d0.dot(d0);
+                if (l0 > 1.f){
+                    m_ratios.push_back(std::sqrt(d1.dot(d1) / l0));
+                }
+            }
+            float scale = m_ratios.empty() ? 1.f : median(m_ratios);
+            float dx = median(m_dx);
+            float dy = median(m_dy);
+
+            float cx = face.box.x + face.box.width * 0.5f + dx;
+            float cy = face.box.y + face.box.height * 0.5f + dy;
+            face.box.width *= scale;
+            face.box.height *= scale;
+            face.box.x = cx - face.box.width * 0.5f;
+            face.box.y = cy - face.box.height * 0.5f;
+
+            face.points.clear();
+            for (size_t k = 0; k < good.size(); k++){
+                face.points.push_back(m_nextPts[good[k]]);
+            }
+            offset += n;
+        }
+        return ok;
+    }
+
+    /*
+        Смена кадра и слежение за лицами, если детекция на кадре не нужна.
+        Возвращает true, если на кадре нужна детекция.
+    */
+    bool trackFrame(FrameCache& frame)
+    {
+        // Кадр в градациях серого берется из кэша и сохраняется до следующего кадра
+        cv::swap(m_gray, m_prevGray);
+        frame.gray().copyTo(m_gray);
+
+        bool needDetect = m_prevGray.empty() || m_prevGray.size() != m_gray.size() ||
+                          m_faces.empty() || m_forceDetect ||
+                          m_framesSinceDetect + 1 >= m_detectEvery * m_detectEveryFactor;
+        if (!needDetect){
+            needDetect = !track();
+        }
+        if (!needDetect){
+            m_framesSinceDetect++;
+        }
+        return needDetect;
+    }
+
+public:
+    /*
+        Сопоставление результата детекции (строки в формате YuNet) с сопровождаемыми
+        лицами: лицо получает идентификатор наиболее перекрывающегося по IoU лица
+        или новый идентификатор. Вызывается после каждой детекции; также позволяет
+        воспроизводить записанные детекции без запуска сети.
+    */
+    void assignDetections(const cv::Mat& faces)
+    {
+        resizeFaces(m_detected, faces.rows);
+        std::vector<bool>& used = m_used;
+        used.assign(m_faces.size(), false);
+        for (int i = 0; i < faces.rows; i++){
+            const float* row = faces.ptr<float>(i);
+            TrackedFace& face = m_detected[i];
+            face.box = cv::Rect2f(row[0], row[1], row[2], row[3]);
+            face.score = row[14];
+            face.trackQuality = 1.f;
+
+            // Лицо получает идентификатор наиболее перекрывающегося сопровождаемого лица
+            int best = -1;
+            float bestIoU = m_matchIoU;
+            for (size_t k = 0; k < m_faces.size(); k++){
+                float overlap = iou(face.box, m_faces[k].box);
+                if (!used[k] && overlap > bestIoU){
+                    bestIoU = overlap;
+                    best = int(k);
+                }
+            }
+            if (best >= 0){
+                used[best] = true;
+                face.id = m_faces[best].id;
+            }
+            else{
+                face.id = m_nextId++;
+            }
+
+            // Пять ключевых точек YuNet дополняются сеткой внутри box
+            seedGrid(face);
+            for (int j = 4; j < 14; j += 2){
+                face.points.push_back(cv::Point2f(row[j], row[j + 1]));
+            }
+        }
+        m_faces.swap(m_detected);
+        m_framesSinceDetect = 0;
+        m_forceDetect = false;
+    }
+
+    /*
+        Аргументы:
+            - detectEvery - период запуска полной детекции (в кадрах)
+            - config - параметры запуска YuNet
+    */
+    DetectThenTrack(int detectEvery = 5, const FaceBBDetector::YuNetConfig& config = FaceBBDetector::defaultYuNetConfig())
+        : m_detector(config), m_detectEvery(std::max(detectEvery, 1)) {};
+    ~DetectThenTrack(){};
+
+    /*
+        Обработка очередного кадра: детекция или слежение.
+        Возвращает сопровождаемые лица с идентификаторами.
+    */
+    const std::vector<TrackedFace>& update(FrameCache& frame)
+    {
+        if (trackFrame(frame)){
+            detect(frame);
+        }
+        return m_faces;
+    }
+
+    /*
+        Обработка очередного кадра с записанными детекциями вместо детектора
+        (воспроизведение без запуска сети): на кадрах, где update запустил бы
+        детекцию, лица сопоставляются с detections, на остальных кадрах
+        bounding boxes переносятся оптическим потоком, а detections не используются.
+        Аргументы:
+            - detections - детекции кадра (строки в формате YuNet)
+    */
+    const std::vector<TrackedFace>& update(FrameCache& frame, const cv::Mat& detections)
+    {
+        if (trackFrame(frame)){
+            assignDetections(detections);
+        }
+        return m_faces;
+    }
+
+    /*
+        Функция предсказания координат bounding boxes лица (совместима с YuNetDetector::predict)
+    */
+    std::vector<cv::Rect2i> predict(FrameCache& frame)
+    {
+        const std::vector<TrackedFace>& faces = update(frame);
+        cv::Rect2i frameRect(0, 0, frame.size().width, frame.size().height);
+        std::vector<cv::Rect2i> boxes;
+        for (size_t i = 0; i < faces.size(); i++){
+            boxes.push_back(cv::Rect2i(faces[i].box) & frameRect);
+        }
+        return boxes;
+    }
+
+    /*
+        Функция предсказания координат bounding boxes лица с записью в контейнер faces
+    */
+    template<int N>
+    void predict(FrameCache& frame, FaceBatch<N>& faces)
+    {
+        const std::vector<TrackedFace>& tracked = update(frame);
+        cv::Rect2i frameRect(0, 0, frame.size().width, frame.size().height);
+        faces.resize(int(tracked.size()));
+        for (size_t i = 0; i < tracked.size(); i++){
+            faces.box(int(i)) = cv::Rect2i(tracked[i].box) & frameRect;
+            faces.score(int(i)) = tracked[i].score;
+            faces.id(int(i)) = tracked[i].id;
+        }
+    }
+
+    /*
+        Замена точек слежения ключевыми точками лица, найденными на текущем кадре.
+        Аргументы:
+            - landmarks - ключевые точки в порядке лиц, возвращенных predict
+    */
+    void seedLandmarks(const std::vector< std::vector<cv::Point2i>>& landmarks)
+    {
+        for (size_t i = 0; i < landmarks.size() && i < m_faces.size(); i++){
+            if (landmarks[i].empty()){
+                continue;
+            }
+            m_faces[i].points.clear();
+            for (size_t j = 0; j < landmarks[i].size(); j++){
+                m_faces[i].points.push_back(cv::Point2f(landmarks[i][j]));
+            }
+        }
+    }
+
+    /*
+        Замена точек слежения ключевыми точками лиц из контейнера faces
+    */
+    template<int N>
+    void seedLandmarks(const FaceBatch<N>& faces)
+    {
+        for (int i = 0; i < faces.size() && i < int(m_faces.size()); i++){
+            const float* x = faces.x(i);
+            const float* y = faces.y(i);
+            m_faces[i].points.resize(N);
+            for (int j = 0; j < N; j++){
+                m_faces[i].points[j] = cv::Point2f(x[j], y[j]);
+            }
+        }
+    }
+
+    bool isReady() const { return m_detector.isReady(); }
+    FaceBBDetector::YuNetDetector& detector() { return m_detector; }
+    void waitReady() { m_detector.waitReady(); }
+
+    const std::vector<TrackedFace>& faces() const { return m_faces; }
+    void setDetectEvery(int detectEvery) { m_detectEvery = std::max(detectEvery, 1); }
+    int detectEvery() const { return m_detectEvery; }
+    void setDetectEveryFactor(int factor) { m_detectEveryFactor = std::max(factor, 1); }
+    // Принудительный запуск детекции на следующем кадре
+    void forceDetect() { m_forceDetect = true; }
+};
+
+}
+
+#endif // FACETRACKER_H
@@ -0,0 +1,140 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <deque>
+
+#include <opencv2/imgproc.hpp>
+
+/*
+    Кэш производных изображений кадра (оттенки серого, уменьшенные копии).
+    Каждое изображение вычисляется не более одного раза за кадр - при первом
+    запросе, поэтому цепочка детекторов выполняет перевод в градации серого
+    и изменение размера кадра только один раз. Буферы переиспользуются между кадрами.
+*/
+class FrameCache
+{
+private:
+    /*
+        Уменьшенная копия кадра
+    */
+    struct Level
+    {
+        cv::Size size;
+        cv::Mat bgr, gray;
+        bool hasBgr, hasGray;
+    };
+
+    // Исходный кадр (BGR), данные не копируются
+    cv::Mat m_frame;
+    cv::Mat m_gray;
+    bool m_hasGray = false;
+    // deque: ссылки на уже выданные уровни не инвалидируются при добавлении новых
+    std::deque<Level> m_levels;
+    // Число уровней, используемых на текущем кадре
+    size_t m_numLevels = 0;
+
+    // Счетчики выполненных преобразований (для контроля повторных вычислений)
+    int m_conversions = 0;
+    int m_resizes = 0;
+
+    Level& level(cv::Size size)
+    {
+        for (size_t i = 0; i < m_numLevels; i++){
+            if (m_levels[i].size == size){
+                return m_levels[i];
+            }
+        }
+        if (m_numLevels == m_levels.size()){
+            m_levels.push_back(Level());
+        }
+        Level& l = m_levels[m_numLevels++];
+        l.size = size;
+        l.hasBgr = false;
+        l.hasGray = false;
+        return l;
+    }
+
+public:
+    FrameCache(){};
+    ~FrameCache(){};
+
+    /*
+        Установка нового кадра, все производные изображения становятся недействительными
+        Аргументы:
+            - frame - цветное изображение (BGR)
+    */
+    void setFrame(const cv::Mat& frame)
+    {
+        m_frame = frame;
+        m_hasGray = false;
+        m_numLevels = 0;
+        m_conversions = 0;
+        m_resizes = 0;
+    }
+
+    const cv::Mat& bgr() const { return m_frame; }
+    cv::Size size() const { return m_frame.size(); }
+
+    /*
+        Кадр в градациях серого
+    */
+    const cv::Mat& gray()
+    {
+        if (!m_hasGray){
+            cvtColor(m_frame, m_gray, cv::COLOR_BGR2GRAY);
+            m_hasGray = true;
+            m_conversions++;
+        }
+        return m_gray;
+    }
+
+    /*
+        Уменьшенная копия цветного кадра
+        Аргументы:
+            - size - требуемый размер
+    */
+    const cv::Mat& bgr(cv::Size size)
+    {
+        if (size == m_frame.size()){
+            return m_frame;
+        }
+        Level& l = level(size);
+        if (!l.hasBgr){
+            resize(m_frame, l.bgr, size, 0, 0, cv::INTER_LINEAR);
+            l.hasBgr = true;
+            m_resizes++;
+        }
+        return l.bgr;
+    }
+
+    /*
+        Уменьшенная копия кадра в градациях серого
+        Аргументы:
+            - size - требуемый размер
+    */
+    const cv::Mat& gray(cv::Size size)
+    {
+        if (size == m_frame.size()){
+            return gray();
+        }
+        Level& l = level(size);
+        if (!l.hasGray){
+            // Если уменьшенная цветная копия уже есть, переводится она (меньше пикселей)
+            if (l.hasBgr){
+                cvtColor(l.bgr, l.gray, cv::COLOR_BGR2GRAY);
+                m_conversions++;
+            }
+            else{
+                resize(gray(), l.gray, size, 0, 0, cv::INTER_LINEAR);
+                m_resizes++;
+            }
+            l.hasGray = true;
+        }
+        return l.gray;
+    }
+
+    int conversions() const { return m_conversions; }
+    int resizes() const { return m_resizes; }
+};
+
+#endif // FRAMECACHE_H
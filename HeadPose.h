@@ -0,0 +1,455 @@
+#ifndef HEADPOSE_H
+#define HEADPOSE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "FaceBatch.h"
+#include "Landmarks3D.h"
+#include "OpenNI2OpenCV.h"
+
+// Оценка положения головы
+namespace FacePose{
+
+/*
+    Положение головы в системе координат цветной камеры
+*/
+struct HeadPose
+{
+    // Поворот (вектор Родрига) и смещение (мм) модели лица
+    cv::Vec3d rvec, tvec;
+    // Углы поворота (градусы): поворот вокруг вертикальной оси, наклон вперед-назад, наклон к плечу
+    float yaw = 0, pitch = 0, roll = 0;
+    bool valid = false;
+    // Положение найдено по глубине (иначе - по проекции ключевых точек)
+    bool fromDepth = false;
+};
+
+/*
+    Оценка положения головы по ключевым точкам для всех лиц контейнера.
+    Без глубины положение находится solvePnP по опорным ключевым точкам и
+    усредненной 3D модели лица; решение для лица начинается с положения
+    ближайшего лица предыдущего кадра (итерационный метод с начальным приближением
+    сходится за несколько итераций). При совмещенной карте глубины опорные точки
+    переводятся в метрические 3D координаты (или берутся из Landmarks3D, если
+    ключевые точки уже переведены), и поворот с переносом находятся
+    замкнутым решением (алгоритм Кабша). Точки с выбросами глубины (фон на краю
+    лица, ошибки глубины) отбрасываются перебором минимальных наборов точек
+    (RANSAC); если точек остается мало или остаток велик, положение находится
+    по проекции.
+*/
+class HeadPoseEstimator
+{
+private:
+    // Опорные точки усредненной модели лица (мм; x - вправо, y - вниз, z - от камеры)
+    std::vector<cv::Point3f> m_model;
+    // Индексы опорных точек в массиве ключевых точек детектора
+    std::vector<int> m_index;
+    int m_numLandmarks = 0;
+
+    // Максимальное смещение центра лица между кадрами (доля ширины) для начального приближения
+    float m_maxShift = 0.5;
+    // Минимальное число опорных точек с глубиной для решения по глубине
+    int m_minDepthPoints = 4;
+    // Допустимое отклонение глубины опорной точки от медианы (мм) до первого решения:
+    // больше перепада глубины лица при повороте головы, меньше расстояния до фона
+    float m_maxDepthSpread = 100.f;
+    // Порог остатка точки-инлайера (мм): шум глубины и отличие лица от усредненной модели
+    float m_inlierResidual = 15.f;
+    // Максимальный средний квадратичный остаток точек-инлайеров (мм) для решения по глубине
+    float m_maxRms = 20.f;
+
+    std::vector<HeadPose> m_poses, m_prevPoses;
+    std::vector<cv::Point2f> m_centers, m_prevCenters;
+    std::vector<float> m_widths, m_prevWidths;
+
+    // Буферы переиспользуются между лицами
+    std::vector<cv::Point2f> m_image;
+    std::vector<cv::Point3f> m_observed, m_matched;
+    std::vector<uint8_t> m_candidate, m_subset, m_inlier;
+    std::vector<float> m_residuals, m_sorted;
+    DepthSampler m_sampler;
+
+    /*
+        Опорные точки для модели с numLandmarks ключевыми точками
+    */
+    void setupModel(int numLandmarks)
+    {
+        if (numLandmarks == m_numLandmarks){
+            return;
+        }
+        m_numLandmarks = numLandmarks;
+        m_model.clear();
+        m_index.clear();
+        if (numLandmarks == 68){
+            // Кончик носа, подбородок, внешние углы глаз, углы рта
+            int index[] = {30, 8, 36, 45, 48, 54};
+            cv::Point3f model[] = {cv::Point3f(0, 0, 0), cv::Point3f(0, 66, 13),
+                                   cv::Point3f(-45, -34, 27), cv::Point3f(45, -34, 27),
+                                   cv::Point3f(-30, 30, 25), cv::Point3f(30, 30, 25)};
+            m_index.assign(index, index + 6);
+            m_model.assign(model, model + 6);
+        }
+        else if (numLandmarks == 5){
+            // YuNet: центры глаз, кончик носа, углы рта
+            int index[] = {0, 1, 2, 3, 4};
+            cv::Point3f model[] = {cv::Point3f(-32, -34, 30), cv::Point3f(32, -34, 30), cv::Point3f(0, 0, 0),
+                                   cv::Point3f(-25, 30, 25), cv::Point3f(25, 30, 25)};
+            m_index.assign(index, index + 5);
+            m_model.assign(model, model + 5);
+        }
+    }
+
+    /*
+        Поворот R и перенос t, переводящие точки-инлайеры model в observed (метод наименьших квадратов)
+    */
+    static void kabsch(const std::vector<cv::Point3f>& model, const std::vector<cv::Point3f>& observed,
+                       const std::vector<uint8_t>& inlier, cv::Matx33d& R, cv::Vec3d& t)
+    {
+        cv::Vec3d mc(0, 0, 0), oc(0, 0, 0);
+        int count = 0;
+        for (size_t i = 0; i < model.size(); i++){
+            if (!inlier[i]){
+                continue;
+            }
+            mc += cv::Vec3d(model[i].x, model[i].y, model[i].z);
+            oc += cv::Vec3d(observed[i].x, observed[i].y, observed[i].z);
+            count++;
+        }
+        mc *= 1.0 / count;
+        oc *= 1.0 / count;
+        cv::Matx33d H = cv::Matx33d::zeros();
+        for (size_t i = 0; i < model.size(); i++){
+            if (!inlier[i]){
+                continue;
+            }
+            cv::Vec3d m = cv::Vec3d(model[i].x, model[i].y, model[i].z) - mc;
+            cv::Vec3d o = cv::Vec3d(observed[i].x, observed[i].y, observed[i].z) - oc;
+            H += m * o.t();
+        }
+        cv::Matx31d w;
+        cv::Matx33d U, Vt;
+        cv::SVD::compute(H, w, U, Vt);
+        cv::Matx33d V = Vt.t();
+        double d = cv::determinant(V * U.t()) < 0 ? -1.0 : 1.0;
+        cv::Matx33d D(1, 0, 0, 0, 1, 0, 0, 0, d);
+        R = V * D * U.t();
+        t = oc - R * mc;
+    }
+
+    /*
+        Остатки всех опорных точек для решения R, t (мм)
+    */
+    void computeResiduals(const cv::Matx33d& R, const cv::Vec3d& t)
+    {
+        m_residuals.resize(m_observed.size());
+        for (size_t i = 0; i < m_observed.size(); i++){
+            cv::Vec3d p = R * cv::Vec3d(m_matched[i].x, m_matched[i].y, m_matched[i].z) + t;
+            m_residuals[i] = float(cv::norm(p - cv::Vec3d(m_observed[i].x, m_observed[i].y, m_observed[i].z)));
+        }
+    }
+
+    /*
+        Решение по глубине с отбрасыванием выбросов. Точки, глубина которых далека
+        от медианы (фон на краю лица), исключаются сразу. Затем перебираются все тройки
+        остальных точек (опорных точек не больше 6, поэтому полный перебор заменяет
+        случайный выбор RANSAC): решение по тройке оценивается суммой ограниченных
+        квадратов остатков (MSAC), итоговое решение находится по точкам с остатком
+        не больше m_inlierResidual для лучшей тройки. Возвращает false, если таких
+        точек меньше m_minDepthPoints или их средний квадратичный остаток больше m_maxRms.
+    */
+    bool fitDepth(cv::Matx33d& R, cv::Vec3d& t)
+    {
+        int n = int(m_observed.size());
+        m_sorted.resize(n);
+        for (int i = 0; i < n; i++){
+            m_sorted[i] = m_observed[i].z;
+        }
+        std::nth_element(m_sorted.begin(), m_sorted.begin() + n / 2, m_sorted.end());
+        float medianZ = m_sorted[n / 2];
+        m_candidate.resize(n);
+        for (int i = 0; i < n; i++){
+            m_candidate[i] = std::abs(m_observed[i].z - medianZ) <= m_maxDepthSpread;
+        }
+
+        float limit2 = m_inlierResidual * m_inlierResidual;
+        double bestCost = -1.0;
+        m_inlier.assign(n, 0);
+        for (int i = 0; i < n; i++){
+            for (int j = i + 1; j < n && m_candidate[i]; j++){
+                for (int k = j + 1; k < n && m_candidate[j]; k++){
+                    if (!m_candidate[k]){
+                        continue;
+                    }
+                    m_subset.assign(n, 0);
+                    m_subset[i] = m_subset[j] = m_subset[k] = 1;
+                    kabsch(m_matched, m_observed, m_subset, R, t);
+                    computeResiduals(R, t);
+                    double cost = 0.0;
+                    for (int p = 0; p < n; p++){
+                        if (m_candidate[p]){
+                            cost += std::min(m_residuals[p] * m_residuals[p], limit2);
+                        }
+                    }
+                    if (bestCost < 0.0 || cost < bestCost){
+                        bestCost = cost;
+                        for (int p = 0; p < n; p++){
+                            m_inlier[p] = m_candidate[p] && m_residuals[p] <= m_inlierResidual;
+                        }
+                    }
+                }
+            }
+        }
+        int count = 0;
+        for (int i = 0; i < n; i++){
+            count += m_inlier[i];
+        }
+        if (count < m_minDepthPoints){
+            return false;
+        }
+
+        kabsch(m_matched, m_observed, m_inlier, R, t);
+        computeResiduals(R, t);
+        double ss = 0.0;
+        for (int i = 0; i < n; i++){
+            if (m_inlier[i]){
+                ss += double(m_residuals[i]) * m_residuals[i];
+            }
+        }
+        return std::sqrt(ss / count) <= m_maxRms;
+    }
+
+    static void eulerAngles(HeadPose& pose)
+    {
+        cv::Matx33d R;
+        cv::Rodrigues(pose.rvec, R);
+        const double toDeg = 180.0 / CV_PI;
+        pose.yaw = float(std::asin(std::max(-1.0, std::min(1.0, -R(2, 0)))) * toDeg);
+        pose.pitch = float(std::atan2(R(2, 1), R(2, 2)) * toDeg);
+        pose.roll = float(std::atan2(R(1, 0), R(0, 0)) * toDeg);
+    }
+
+    /*
+        Положение лица предыдущего кадра, ближайшего к текущему (nullptr - нет)
+    */
+    const HeadPose* previousPose(cv::Point2f center, float width) const
+    {
+        const HeadPose* best = nullptr;
+        float bestDist = m_maxShift * width;
+        for (size_t i = 0; i < m_prevPoses.size(); i++){
+            float dist = float(cv::norm(center - m_prevCenters[i]));
+            if (m_prevPoses[i].valid && dist < bestDist && std::abs(width - m_prevWidths[i]) < m_maxShift * width){
+                bestDist = dist;
+                best = &m_prevPoses[i];
+            }
+        }
+        return best;
+    }
+
+    /*
+        Положение лица по заполненным m_image (все опорные точки) и m_observed,
+        m_matched (опорные точки с глубиной и соответствующие точки модели)
+    */
+    HeadPose solve(const cv::Rect2i& box, const OpenNIOpenCV::CameraIntrinsics& K)
+    {
+        HeadPose pose;
+        cv::Matx33d R;
+        cv::Vec3d t;
+        if (int(m_observed.size()) >= m_minDepthPoints && fitDepth(R, t)){
+            cv::Rodrigues(R, pose.rvec);
+            pose.tvec = t;
+            pose.fromDepth = true;
+            pose.valid = true;
+        }
+        else{
+            cv::Matx33d cameraMatrix(K.fx, 0, K.cx, 0, K.fy, K.cy, 0, 0, 1);
+            cv::Point2f center(box.x + box.width * 0.5f, box.y + box.height * 0.5f);
+            const HeadPose* previous = previousPose(center, float(box.width));
+            if (previous){
+                pose.rvec = previous->rvec;
+                pose.tvec = previous->tvec;
+                pose.valid = cv::solvePnP(m_model, m_image, cameraMatrix, cv::noArray(),
+                                          pose.rvec, pose.tvec, true, cv::SOLVEPNP_ITERATIVE);
+            }
+            else{
+                pose.valid = cv::solvePnP(m_model, m_image, cameraMatrix, cv::noArray(),
+                                          pose.rvec, pose.tvec, false, cv::SOLVEPNP_EPNP);
+            }
+        }
+        if (pose.valid){
+            eulerAngles(pose);
+        }
+        return pose;
+    }
+
+    const HeadPose& storeFace(const cv::Rect2i& box, const HeadPose& pose)
+    {
+        m_poses.push_back(pose);
+        m_centers.push_back(cv::Point2f(box.x + box.width * 0.5f, box.y + box.height * 0.5f));
+        m_widths.push_back(float(box.width));
+        return m_poses.back();
+    }
+
+public:
+    HeadPoseEstimator(){};
+    ~HeadPoseEstimator(){};
+
+    /*
+        Оценка положения одного лица
+        Аргументы:
+            - box - bounding box лица
+            - x, y - координаты ключевых точек
+            - numLandmarks - число ключевых точек (68 или 5)
+            - K - внутренние параметры цветной камеры
+            - depth - совмещенная карта глубины (CV_16UC1, мм) или пустая матрица
+    */
+    HeadPose estimateFace(const cv::Rect2i& box, const float* x, const float* y, int numLandmarks,
+                          const OpenNIOpenCV::CameraIntrinsics& K, const cv::Mat& depth = cv::Mat())
+    {
+        setupModel(numLandmarks);
+        if (m_index.empty()){
+            return HeadPose();
+        }
+        m_image.clear();
+        m_observed.clear();
+        m_matched.clear();
+        for (size_t i = 0; i < m_index.size(); i++){
+            float u = x[m_index[i]], v = y[m_index[i]];
+            m_image.push_back(cv::Point2f(u, v));
+            float z = depth.empty() ? 0.f : m_sampler.sample(depth, u, v);
+            if (z > 0.f){
+                m_observed.push_back(cv::Point3f((u - K.cx) * z / K.fx, (v - K.cy) * z / K.fy, z));
+                m_matched.push_back(m_model[i]);
+            }
+        }
+        return solve(box, K);
+    }
+
+    /*
+        Оценка положения одного лица по ключевым точкам, уже переведенным в 3D
+        (Landmarks3D): глубина опорных точек повторно не выбирается
+        Аргументы:
+            - box, x, y, numLandmarks, K - как в estimateFace по карте глубины
+            - X, Y, Z - метрические координаты ключевых точек (мм), Z = 0 - глубины нет
+    */
+    HeadPose estimateFace(const cv::Rect2i& box, const float* x, const float* y, int numLandmarks,
+                          const OpenNIOpenCV::CameraIntrinsics& K, const float* X, const float* Y, const float* Z)
+    {
+        setupModel(numLandmarks);
+        if (m_index.empty()){
+            return HeadPose();
+        }
+        m_image.clear();
+        m_observed.clear();
+        m_matched.clear();
+        for (size_t i = 0; i < m_index.size(); i++){
+            int j = m_index[i];
+            m_image.push_back(cv::Point2f(x[j], y[j]));
+            if (Z[j] > 0.f){
+                m_observed.push_back(cv::Point3f(X[j], Y[j], Z[j]));
+                m_matched.push_back(m_model[i]);
+            }
+        }
+        return solve(box, K);
+    }
+
+    /*
+        Начало обработки кадра: положения текущего кадра становятся предыдущими
+    */
+    void beginFrame()
+    {
+        m_prevPoses.swap(m_poses);
+        m_prevCenters.swap(m_centers);
+        m_prevWidths.swap(m_widths);
+        m_poses.clear();
+        m_centers.clear();
+        m_widths.clear();
+    }
+
+    /*
+        Добавление положения лица текущего кадра (используется как начальное приближение на следующем)
+    */
+    const HeadPose& addFace(const cv::Rect2i& box, const float* x, const float* y, int numLandmarks,
+                            const OpenNIOpenCV::CameraIntrinsics& K, const cv::Mat& depth = cv::Mat())
+    {
+        return storeFace(box, estimateFace(box, x, y, numLandmarks, K, depth));
+    }
+    const HeadPose& addFace(const cv::Rect2i& box, const float* x, const float* y, int numLandmarks,
+                            const OpenNIOpenCV::CameraIntrinsics& K, const float* X, const float* Y, const float* Z)
+    {
+        return storeFace(box, estimateFace(box, x, y, numLandmarks, K, X, Y, Z));
+    }
+
+    /*
+        Оценка положения головы для всех лиц контейнера
+        Аргументы:
+            - faces - лица с ключевыми точками
+            - K - внутренние параметры цветной камеры
+            - depth - совмещенная карта глубины (CV_16UC1, мм) или пустая матрица
+    */
+    template<int N>
+    const std::vector<HeadPose>& estimate(const FaceBatch<N>& faces, const OpenNIOpenCV::CameraIntrinsics& K,
+                                          const cv::Mat& depth = cv::Mat())
+    {
+        beginFrame();
+        for (int i = 0; i < faces.size(); i++){
+            addFace(faces.box(i), faces.x(i), faces.y(i), N, K, depth);
+        }
+        return m_poses;
+    }
+
+    /*
+        Оценка положения головы для всех лиц контейнера по ключевым точкам в 3D
+        Аргументы:
+            - faces - лица с ключевыми точками
+            - points - ключевые точки faces, переведенные в 3D (Landmarks3D::lift)
+            - K - внутренние параметры цветной камеры
+    */
+    template<int N>
+    const std::vector<HeadPose>& estimate(const FaceBatch<N>& faces, const Landmarks3D<N>& points,
+                                          const OpenNIOpenCV::CameraIntrinsics& K)
+    {
+        beginFrame();
+        for (int i = 0; i < faces.size(); i++){
+            addFace(faces.box(i), faces.x(i), faces.y(i), N, K, points.X(i), points.Y(i), points.Z(i));
+        }
+        return m_poses;
+    }
+
+    const std::vector<HeadPose>& poses() const { return m_poses; }
+};
+
+/*
+    Функция для отображения осей модели лица (x - красная, y - зеленая, z - синяя)
+    Аргументы:
+        - image - изображение
+        - pose - положение головы
+        - K - внутренние параметры цветной камеры
+*/
+void drawHeadPose(cv::Mat& image, const HeadPose& pose, const OpenNIOpenCV::CameraIntrinsics& K)
+{
+    if (!pose.valid){
+        return;
+    }
+    std::vector<cv::Point3f> axes;
+    axes.push_back(cv::Point3f(0, 0, 0));
+    axes.push_back(cv::Point3f(50, 0, 0));
+    axes.push_back(cv::Point3f(0, 50, 0));
+    axes.push_back(cv::Point3f(0, 0, -50));
+    std::vector<cv::Point2f> projected;
+    cv::Matx33d cameraMatrix(K.fx, 0, K.cx, 0, K.fy, K.cy, 0, 0, 1);
+    cv::projectPoints(axes, pose.rvec, pose.tvec, cameraMatrix, cv::noArray(), projected);
+    cv::line(image, projected[0], projected[1], cv::Scalar(0, 0, 255), 2);
+    cv::line(image, projected[0], projected[2], cv::Scalar(0, 255, 0), 2);
+    cv::line(image, projected[0], projected[3], cv::Scalar(255, 0, 0), 2);
+}
+
+}
+
+#endif // HEADPOSE_H
@@ -0,0 +1,560 @@
+#ifndef IDENTITYINDEX_H
+#define IDENTITYINDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <opencv2/core.hpp>
+
+#include "ModelLoader.h"
+
+// Распознавание лиц
+namespace FaceRecognition{
+
+/*
+    Результат поиска: идентификатор и косинусное сходство с запросом
+*/
+struct SearchResult
+{
+    int id;
+    float similarity;
+};
+
+/*
+    Скалярное произведение векторов int8
+*/
+inline int32_t dotInt8(const int8_t* a, const int8_t* b, int dim)
+{
+    int32_t sum = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+    for (; i + 16 <= dim; i += 16){
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        // Расширение до int16 со знаком и умножение со сложением пар в int32
+        __m128i sa = _mm_cmpgt_epi8(zero, va), sb = _mm_cmpgt_epi8(zero, vb);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(va, sa), _mm_unpacklo_epi8(vb, sb)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(va, sa), _mm_unpackhi_epi8(vb, sb)));
+    }
+    int32_t parts[4];
+    _mm_storeu_si128((__m128i*)parts, acc);
+    sum = parts[0] + parts[1] + parts[2] + parts[3];
+#endif
+    for (; i < dim; i++){
+        sum += int32_t(a[i]) * int32_t(b[i]);
+    }
+    return sum;
+}
+
+/*
+    Индекс дескрипторов лиц для поиска ближайших (IVF с квантованием int8).
+    Дескрипторы разбиты на списки по ближайшему центроиду (k-means); при поиске
+    просматриваются только m_probes ближайших к запросу списков. В списке
+    идентификаторы, масштабы и коды хранятся в отдельных непрерывных массивах,
+    код дескриптора - 128 байт (в 4 раза меньше float), сходство считается в целых
+    числах. До обучения все дескрипторы находятся в одном списке (точный перебор).
+    Поиск выполняется параллельно под разделяемой блокировкой, добавление -
+    под исключительной. Файл индекса отображается в память: списки читаются
+    прямо из отображения и копируются только при добавлении в них.
+*/
+class IdentityIndex
+{
+private:
+    struct List
+    {
+        // Данные в отображенном файле (только чтение)
+        const int32_t* mappedIds = nullptr;
+        const float* mappedScales = nullptr;
+        const int8_t* mappedCodes = nullptr;
+        bool mapped = false;
+        int size = 0;
+        std::vector<int32_t> ownIds;
+        std::vector<float> ownScales;
+        std::vector<int8_t> ownCodes;
+
+        const int32_t* ids() const { return mapped ? mappedIds : ownIds.data(); }
+        const float* scales() const { return mapped ? mappedScales : ownScales.data(); }
+        const int8_t* codes() const { return mapped ? mappedCodes : ownCodes.data(); }
+
+        void add(int id, float scale, const int8_t* code, int dim)
+        {
+            if (mapped){
+                ownIds.assign(mappedIds, mappedIds + size);
+                ownScales.assign(mappedScales, mappedScales + size);
+                ownCodes.assign(mappedCodes, mappedCodes + size_t(size) * dim);
+                mapped = false;
+            }
+            ownIds.push_back(id);
+            ownScales.push_back(scale);
+            ownCodes.insert(ownCodes.end(), code, code + dim);
+            size++;
+        }
+    };
+
+    int m_dim;
+    int m_numLists;
+    int m_probes = 8;
+    // Центроиды списков (m_numLists x m_dim), пустой массив - индекс не обучен
+    std::vector<float> m_centroids;
+    std::vector<List> m_lists;
+    int m_count = 0;
+    mutable std::shared_timed_mutex m_mutex;
+    ModelLoading::MappedFile m_file;
+
+    /*
+        Квантование вектора в int8, возвращает масштаб: v ~= code * scale
+    */
+    float quantize(const float* v, int8_t* code) const
+    {
+        float maxAbs = 0.f;
+        for (int i = 0; i < m_dim; i++){
+            maxAbs = std::max(maxAbs, std::abs(v[i]));
+        }
+        float scale = maxAbs > 0.f ? maxAbs / 127.f : 1.f;
+        float inv = 1.f / scale;
+        for (int i = 0; i < m_dim; i++){
+            code[i] = int8_t(cvRound(v[i] * inv));
+        }
+        return scale;
+    }
+
+    float dotCentroid(const float* v, int list) const
+    {
+        const float* c = m_centroids.data() + size_t(list) * m_dim;
+        float sum = 0.f;
+        for (int i = 0; i < m_dim; i++){
+            sum += v[i] * c[i];
+        }
+        return sum;
+    }
+
+    int nearestList(const float* v) const
+    {
+        if (m_centroids.empty()){
+            return 0;
+        }
+        int best = 0;
+        float bestDot = dotCentroid(v, 0);
+        for (int l = 1; l < m_numLists; l++){
+            float d = dotCentroid(v, l);
+            if (d > bestDot){
+                bestDot = d;
+                best = l;
+            }
+        }
+        return best;
+    }
+
+    void addLocked(int id, const float* embedding)
+    {
+        std::vector<int8_t> code(m_dim);
+        float scale = quantize(embedding, code.data());
+        m_lists[nearestList(embedding)].add(id, scale, code.data(), m_dim);
+        m_count++;
+    }
+
+    /*
+        Разбор отображенного файла индекса. Размеры сравниваются с остатком файла
+        (end - p), указатели за пределы отображения не формируются.
+    */
+    bool loadMapped()
+    {
+        const char* p = m_file.data();
+        const char* end = m_file.data() + m_file.size();
+        int32_t header[4];
+        if (size_t(end - p) < 8 + sizeof(header) || memcmp(p, "FACEIVF1", 8) != 0){
+            return false;
+        }
+        memcpy(header, p + 8, sizeof(header));
+        p += 8 + sizeof(header);
+        int dim = header[0], numLists = header[1], numStored = header[3];
+        bool trained = header[2] != 0;
+        // Обученный индекс хранит numLists списков, необученный - один
+        if (dim <= 0 || numLists <= 0 || numStored <= 0 || (trained && numStored != numLists)){
+            return false;
+        }
+        std::vector<float> centroids;
+        if (trained){
+            size_t bytes = size_t(numLists) * dim * sizeof(float);
+            if (bytes > size_t(end - p)){
+                return false;
+            }
+            centroids.resize(size_t(numLists) * dim);
+            memcpy(centroids.data(), p, bytes);
+            p += bytes;
+        }
+        // Каждый список занимает не меньше 4 байт (размер)
+        if (size_t(numStored) > size_t(end - p) / sizeof(int32_t)){
+            return false;
+        }
+        std::vector<List> lists(numStored);
+        int count = 0;
+        for (size_t l = 0; l < lists.size(); l++){
+            int32_t size;
+            if (sizeof(size) > size_t(end - p)){
+                return false;
+            }
+            memcpy(&size, p, sizeof(size));
+            p += sizeof(size);
+            if (size < 0 || size > std::numeric_limits<int>::max() - count){
+                return false;
+            }
+            size_t bytes = size_t(size) * (sizeof(int32_t) + sizeof(float) + dim);
+            size_t tail = (size_t(size) * dim) % 4;
+            size_t padded = bytes + (tail ? 4 - tail : 0);
+            if (padded > size_t(end - p)){
+                return false;
+            }
+            List& list = lists[l];
+            list.mapped = true;
+            list.size = size;
+            list.mappedIds = (const int32_t*)p;
+            list.mappedScales = (const float*)(p + size_t(size) * sizeof(int32_t));
+            list.mappedCodes = (const int8_t*)(p + size_t(size) * (sizeof(int32_t) + sizeof(float)));
+            p += padded;
+            count += size;
+        }
+        m_dim = dim;
+        m_numLists = numLists;
+        m_centroids.swap(centroids);
+        m_lists.swap(lists);
+        m_count = count;
+        return true;
+    }
+
+public:
+    /*
+        Аргументы:
+            - dim - размер дескриптора
+            - numLists - число списков после обучения (~ sqrt(числа дескрипторов))
+    */
+    IdentityIndex(int dim = 128, int numLists = 256) : m_dim(dim), m_numLists(numLists), m_lists(1) {};
+    ~IdentityIndex(){};
+
+    /*
+        Добавление дескриптора
+        Аргументы:
+            - id - идентификатор человека
+            - embedding - нормированный дескриптор (1 x dim, CV_32F)
+    */
+    void add(int id, const cv::Mat& embedding)
+    {
+        CV_Assert(embedding.type() == CV_32F && int(embedding.total()) == m_dim && embedding.isContinuous());
+        std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+        addLocked(id, embedding.ptr<float>());
+    }
+
+    /*
+        Обучение центроидов по выборке дескрипторов и перераспределение
+        уже добавленных дескрипторов по спискам
+        Аргументы:
+            - samples - дескрипторы (n x dim, CV_32F), n >= numLists
+    */
+    void train(const cv::Mat& samples)
+    {
+        cv::Mat labels, centers;
+        cv::kmeans(samples, m_numLists, labels,
+                   cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 20, 1e-4),
+                   1, cv::KMEANS_PP_CENTERS, centers);
+        // Сходство - скалярное произведение, поэтому центроиды нормируются
+        for (int l = 0; l < centers.rows; l++){
+            cv::Mat row = centers.row(l);
+            cv::normalize(centers.row(l), row);
+        }
+
+        std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+        std::vector<List> old;
+        old.swap(m_lists);
+        m_centroids.assign(centers.ptr<float>(), centers.ptr<float>() + size_t(m_numLists) * m_dim);
+        m_lists.assign(m_numLists, List());
+        m_count = 0;
+        std::vector<float> v(m_dim);
+        for (size_t l = 0; l < old.size(); l++){
+            const int8_t* codes = old[l].codes();
+            for (int i = 0; i < old[l].size; i++){
+                for (int k = 0; k < m_dim; k++){
+                    v[k] = codes[size_t(i) * m_dim + k] * old[l].scales()[i];
+                }
+                addLocked(old[l].ids()[i], v.data());
+            }
+        }
+    }
+
+    /*
+        Поиск k ближайших дескрипторов
+        Аргументы:
+            - query - нормированный дескриптор (1 x dim, CV_32F)
+            - k - число результатов
+        Возвращает результаты в порядке убывания сходства.
+    */
+    std::vector<SearchResult> search(const cv::Mat& query, int k) const
+    {
+        CV_Assert(query.type() == CV_32F && int(query.total()) == m_dim && query.isContinuous());
+        const float* q = query.ptr<float>();
+        std::vector<int8_t> code(m_dim);
+        float qScale = quantize(q, code.data());
+
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        // Ближайшие к запросу списки
+        std::vector<std::pair<float, int>> lists;
+        if (m_centroids.empty()){
+            lists.push_back(std::make_pair(0.f, 0));
+        }
+        else{
+            for (int l = 0; l < m_numLists; l++){
+                lists.push_back(std::make_pair(dotCentroid(q, l), l));
+            }
+            int probes = std::min(m_probes, m_numLists);
+            std::partial_sort(lists.begin(), lists.begin() + probes, lists.end(),
+                              std::greater<std::pair<float, int>>());
+            lists.resize(probes);
+        }
+
+        // k лучших: минимальная куча по сходству
+        std::vector<std::pair<float, int>> heap;
+        std::greater<std::pair<float, int>> cmp;
+        for (size_t p = 0; p < lists.size(); p++){
+            const List& list = m_lists[lists[p].second];
+            const int8_t* codes = list.codes();
+            const float* scales = list.scales();
+            const int32_t* ids = list.ids();
+            for (int i = 0; i < list.size; i++){
+                float s = dotInt8(code.data(), codes + size_t(i) * m_dim, m_dim) * qScale * scales[i];
+                if (int(heap.size()) < k){
+                    heap.push_back(std::make_pair(s, ids[i]));
+                    std::push_heap(heap.begin(), heap.end(), cmp);
+                }
+                else if (s > heap.front().first){
+                    std::pop_heap(heap.begin(), heap.end(), cmp);
+                    heap.back() = std::make_pair(s, ids[i]);
+                    std::push_heap(heap.begin(), heap.end(), cmp);
+                }
+            }
+        }
+        std::sort_heap(heap.begin(), heap.end(), cmp);
+        std::vector<SearchResult> results(heap.size());
+        for (size_t i = 0; i < heap.size(); i++){
+            results[i].id = heap[i].second;
+            results[i].similarity = heap[i].first;
+        }
+        return results;
+    }
+
+    /*
+        Сохранение индекса в файл: заголовок, центроиды, затем для каждого списка
+        размер, идентификаторы, масштабы и коды
+    */
+    bool save(const std::string& path) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        std::string tmpPath = path + ".tmp";
+        FILE* f = fopen(tmpPath.c_str(), "wb");
+        if (!f){
+            return false;
+        }
+        int32_t header[4] = {m_dim, m_numLists, m_centroids.empty() ? 0 : 1, int32_t(m_lists.size())};
+        bool ok = fwrite("FACEIVF1", 1, 8, f) == 8 && fwrite(header, sizeof(header), 1, f) == 1;
+        if (ok && !m_centroids.empty()){
+            ok = fwrite(m_centroids.data(), sizeof(float), m_centroids.size(), f) == m_centroids.size();
+        }
+        for (size_t l = 0; ok && l < m_lists.size(); l++){
+            const List& list = m_lists[l];
+            int32_t size = list.size;
+            ok = fwrite(&size, sizeof(size), 1, f) == 1;
+            if (ok && size > 0){
+                ok = fwrite(list.ids(), sizeof(int32_t), size, f) == size_t(size) &&
+                     fwrite(list.scales(), sizeof(float), size, f) == size_t(size) &&
+                     fwrite(list.codes(), 1, size_t(size) * m_dim, f) == size_t(size) * m_dim;
+            }
+            // Выравнивание начала следующего списка на 4 байта
+            static const char pad[4] = {0, 0, 0, 0};
+            size_t tail = (size_t(size) * m_dim) % 4;
+            if (ok && tail){
+                ok = fwrite(pad, 1, 4 - tail, f) == 4 - tail;
+            }
+        }
+        ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0){
+            unlink(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /*
+        Загрузка индекса из файла без копирования списков (файл отображается в память).
+        Заголовок и размеры списков проверяются до обращения к данным; при ошибке
+        индекс становится пустым (прежнее отображение файла уже закрыто).
+    */
+    bool load(const std::string& path)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+        if (!m_file.open(path) || !loadMapped()){
+            m_file.close();
+            m_centroids.clear();
+            m_lists.assign(1, List());
+            m_count = 0;
+            return false;
+        }
+        return true;
+    }
+
+    int size() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        return m_count;
+    }
+    bool isTrained() const { return !m_centroids.empty(); }
+    int numLists() const { return m_numLists; }
+
+    /*
+        Все дескрипторы индекса (n x dim, CV_32F), восстановленные из кодов int8,
+        например как выборка для train
+    */
+    cv::Mat embeddings() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        cv::Mat result(m_count, m_dim, CV_32F);
+        int row = 0;
+        for (size_t l = 0; l < m_lists.size(); l++){
+            const int8_t* codes = m_lists[l].codes();
+            const float* scales = m_lists[l].scales();
+            for (int i = 0; i < m_lists[l].size; i++, row++){
+                float* v = result.ptr<float>(row);
+                for (int k = 0; k < m_dim; k++){
+                    v[k] = codes[size_t(i) * m_dim + k] * scales[i];
+                }
+            }
+        }
+        return result;
+    }
+    // Число просматриваемых списков: больше - точнее, меньше - быстрее
+    void setProbes(int probes) { m_probes = std::max(1, probes); }
+};
+
+/*
+    Результаты распознавания сопровождаемых лиц. Распознанное лицо больше не
+    распознается, пока сопровождается; нераспознанное распознается повторно раз
+    в m_retryEvery кадров. Число записей фиксировано (как число слотов
+    MultiFaceTracker), запись лица, пропавшего из кадра, занимает следующее новое
+    лицо, поэтому выделений памяти на кадре нет.
+*/
+class TrackIdentityCache
+{
+public:
+    static const int unknown = -1;
+
+private:
+    struct Entry
+    {
+        int track = -1;
+        int identity = unknown;
+        // Кадр следующей попытки распознавания нераспознанного лица
+        int retryFrame = 0;
+        int lastSeen = -1;
+    };
+    std::vector<Entry> m_entries;
+    int m_retryEvery;
+    int m_frame = 0;
+
+    Entry* find(int track)
+    {
+        for (size_t k = 0; k < m_entries.size(); k++){
+            if (m_entries[k].track == track){
+                return &m_entries[k];
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+        Свободная запись или запись лица, дольше всех отсутствующего в кадре
+    */
+    Entry* allocate(int track)
+    {
+        Entry* oldest = nullptr;
+        for (size_t k = 0; k < m_entries.size(); k++){
+            Entry& e = m_entries[k];
+            if (e.lastSeen < m_frame && (!oldest || e.lastSeen < oldest->lastSeen)){
+                oldest = &e;
+            }
+        }
+        if (oldest){
+            *oldest = Entry();
+            oldest->track = track;
+            oldest->retryFrame = m_frame;
+        }
+        return oldest;
+    }
+
+public:
+    /*
+        Аргументы:
+            - capacity - число одновременно сопровождаемых лиц
+            - retryEvery - период (кадры) повторного распознавания нераспознанных лиц
+    */
+    TrackIdentityCache(int capacity = 32, int retryEvery = 10)
+        : m_entries(std::max(capacity, 1)), m_retryEvery(std::max(retryEvery, 1)) {};
+    ~TrackIdentityCache(){};
+
+    void beginFrame() { m_frame++; }
+
+    /*
+        Идентификатор лица из кэша. Возвращает true, если лицо нужно распознать
+        на этом кадре: лицо не сопровождается (track < 0), появилось впервые,
+        или не распознано и подошло время повторной попытки.
+        Аргументы:
+            - track - идентификатор сопровождаемого лица
+            - identity - идентификатор человека или unknown
+    */
+    bool needsRecognition(int track, int& identity)
+    {
+        identity = unknown;
+        if (track < 0){
+            return true;
+        }
+        Entry* e = find(track);
+        if (!e){
+            e = allocate(track);
+            if (!e){
+                return true;
+            }
+        }
+        e->lastSeen = m_frame;
+        identity = e->identity;
+        return identity == unknown && m_frame >= e->retryFrame;
+    }
+
+    /*
+        Результат распознавания лица track на текущем кадре
+    */
+    void store(int track, int identity)
+    {
+        Entry* e = track >= 0 ? find(track) : nullptr;
+        if (e){
+            e->identity = identity;
+            e->retryFrame = m_frame + m_retryEvery;
+        }
+    }
+
+    void clear() { m_entries.assign(m_entries.size(), Entry()); }
+};
+
+}
+
+#endif // IDENTITYINDEX_H
@@ -0,0 +1,204 @@
+#ifndef LANDMARKCACHE_H
+#define LANDMARKCACHE_H
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "FaceBatch.h"
+#include "FrameCache.h"
+
+// Face Key Point Detector
+namespace FaceKPDetector{
+
+/*
+    Этап ключевых точек с кэшем по сопровождаемым лицам.
+    Для лица с идентификатором (FaceBatch::id) запоминаются ключевые точки и box,
+    по которому они найдены. Если на следующих кадрах центр box сместился меньше
+    чем на m_maxShift ширины и размер изменился меньше чем на m_maxScale,
+    ключевые точки не предсказываются заново, а переносятся из кэша вместе с box
+    (сдвиг и масштаб). Смещение считается от box последнего полного предсказания,
+    поэтому медленный дрейф накапливается и вызывает новое предсказание;
+    кроме того, ключевые точки предсказываются заново не реже раза в m_maxStale кадров.
+    Лица без идентификатора всегда обрабатываются детектором.
+    Детектор Detector должен поддерживать предсказание для подмножества лиц:
+    void predict(FrameCache&, FaceBatch<numLandmarks>&, const std::vector<int>& indices).
+*/
+template<class Detector>
+class CachedLandmarks
+{
+public:
+    static const int numLandmarks = Detector::numLandmarks;
+
+private:
+    Detector m_detector;
+    int m_capacity;
+
+    // Кэш: идентификатор, box полного предсказания, число кадров повторного использования,
+    // номер кадра последнего появления лица; ключевые точки слота k - [k * N, (k + 1) * N)
+    std::vector<int> m_ids, m_stale, m_seen;
+    std::vector<cv::Rect2f> m_boxes;
+    std::vector<float> m_x, m_y;
+    int m_frame = 0;
+
+    float m_maxShift = 0.03f;
+    float m_maxScale = 0.03f;
+    int m_maxStale = 15;
+
+    // Статистика
+    long long m_reused = 0;
+    long long m_predicted = 0;
+
+    std::vector<int> m_indices, m_slots;
+
+    int findSlot(int id) const
+    {
+        for (int k = 0; k < m_capacity; k++){
+            if (m_ids[k] == id){
+                return k;
+            }
+        }
+        return -1;
+    }
+
+    /*
+        Слот для нового лица: свободный или давно не встречавшегося лица
+    */
+    int allocateSlot(int id)
+    {
+        int oldest = 0;
+        for (int k = 0; k < m_capacity; k++){
+            if (m_ids[k] < 0){
+                oldest = k;
+                break;
+            }
+            if (m_seen[k] < m_seen[oldest]){
+                oldest = k;
+            }
+        }
+        m_ids[oldest] = id;
+        return oldest;
+    }
+
+public:
+    /*
+        Аргументы:
+            - capacity - число лиц в кэше
+    */
+    CachedLandmarks(int capacity = 32) : m_capacity(std::max(capacity, 1))
+    {
+        m_ids.assign(m_capacity, -1);
+        m_stale.assign(m_capacity, 0);
+        m_seen.assign(m_capacity, 0);
+        m_boxes.assign(m_capacity, cv::Rect2f());
+        m_x.assign(m_capacity * numLandmarks, 0.f);
+        m_y.assign(m_capacity * numLandmarks, 0.f);
+        m_indices.reserve(m_capacity);
+        m_slots.reserve(m_capacity);
+    };
+    ~CachedLandmarks(){};
+
+    /*
+        Определение ключевых точек для лиц контейнера faces с повторным использованием кэша
+    */
+    void predict(FrameCache& frame, FaceBatch<numLandmarks>& faces)
+    {
+        m_frame++;
+        m_indices.clear();
+        m_slots.clear();
+        for (int i = 0; i < faces.size(); i++){
+            int id = faces.id(i);
+            if (id < 0){
+                m_indices.push_back(i);
+                m_slots.push_back(-1);
+                continue;
+            }
+            int k = findSlot(id);
+            cv::Rect2f box(faces.box(i));
+            if (k >= 0 && m_stale[k] < m_maxStale && m_boxes[k].width > 0){
+                const cv::Rect2f& ref = m_boxes[k];
+                float refCx = ref.x + ref.width * 0.5f, refCy = ref.y + ref.height * 0.5f;
+                float cx = box.x + box.width * 0.5f, cy = box.y + box.height * 0.5f;
+                float scale = box.width / ref.width;
+                float shift = std::sqrt((cx - refCx) * (cx - refCx) + (cy - refCy) * (cy - refCy)) / ref.width;
+                if (shift <= m_maxShift && std::abs(scale - 1.f) <= m_maxScale){
+                    // Перенос ключевых точек вместе с box
+                    const float* cachedX = &m_x[k * numLandmarks];
+                    const float* cachedY = &m_y[k * numLandmarks];
+                    float* x = faces.x(i);
+                    float* y = faces.y(i);
+                    for (int j = 0; j < numLandmarks; j++){
+                        x[j] = cx + (cachedX[j] - refCx) * scale;
+                        y[j] = cy + (cachedY[j] - refCy) * scale;
+                    }
+                    m_stale[k]++;
+                    m_seen[k] = m_frame;
+                    m_reused++;
+                    continue;
+                }
+            }
+            if (k < 0){
+                k = allocateSlot(id);
+            }
+            m_indices.push_back(i);
+            m_slots.push_back(k);
+        }
+
+        if (!m_indices.empty()){
+            m_detector.predict(frame, faces, m_indices);
+            m_predicted += m_indices.size();
+        }
+        for (size_t n = 0; n < m_indices.size(); n++){
+            int k = m_slots[n];
+            if (k < 0){
+                continue;
+            }
+            int i = m_indices[n];
+            std::copy(faces.x(i), faces.x(i) + numLandmarks, &m_x[k * numLandmarks]);
+            std::copy(faces.y(i), faces.y(i) + numLandmarks, &m_y[k * numLandmarks]);
+            m_boxes[k] = cv::Rect2f(faces.box(i));
+            m_stale[k] = 0;
+            m_seen[k] = m_frame;
+        }
+    }
+
+    bool isReady() const { return m_detector.isReady(); }
+    void waitReady() { m_detector.waitReady(); }
+
+    Detector& detector() { return m_detector; }
+
+    /*
+        Аргументы:
+            - maxShift - максимальное смещение центра box (доля ширины) для повторного использования
+            - maxScale - максимальное относительное изменение размера box
+            - maxStale - максимальное число кадров подряд без предсказания
+    */
+    void setThresholds(float maxShift, float maxScale, int maxStale)
+    {
+        m_maxShift = maxShift;
+        m_maxScale = maxScale;
+        m_maxStale = std::max(maxStale, 0);
+    }
+
+    // Доля лиц, для которых ключевые точки взяты из кэша
+    double reusedFraction() const
+    {
+        long long total = m_reused + m_predicted;
+        return total > 0 ? double(m_reused) / total : 0.0;
+    }
+
+    void report() const
+    {
+        std::cout << "Landmark cache: reused " << m_reused << " of " << m_reused + m_predicted << " faces ("
+                  << 100.0 * reusedFraction() << "% landmark predictions saved)" << std::endl;
+    }
+};
+
+template<class Detector> const int CachedLandmarks<Detector>::numLandmarks;
+
+}
+
+#endif // LANDMARKCACHE_H
@@ -0,0 +1,363 @@
+#ifndef LANDMARKSMOOTHING_H
+#define LANDMARKSMOOTHING_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "FaceBatch.h"
+#include "FrameCache.h"
+#include "MultiFaceTracker.h"
+
+// Face Tracking
+namespace FaceTracking{
+
+/*
+    Сглаживание ключевых точек сопровождаемых лиц фильтром One-Euro
+    (Casiez et al., 2012): фильтр нижних частот, частота среза которого растет
+    со скоростью точки, - при неподвижном лице дрожание подавляется,
+    при быстром движении запаздывание мало. Скорость нормируется на ширину лица,
+    поэтому параметры не зависят от расстояния до камеры.
+    Состояние лиц хранится по слотам (по идентификатору FaceBatch::id), координаты,
+    скорости и предсказание - в отдельных массивах; точки лица обрабатываются
+    одним циклом без ветвлений (filterPoints).
+    По сглаженным точкам и их скорости строится box лица на следующем кадре:
+    соотношение box детектора и рамки ключевых точек запоминается на кадрах
+    с детекцией и применяется к предсказанной рамке.
+*/
+template<int N>
+class OneEuroSmoother
+{
+private:
+    int m_capacity;
+    // Параметры фильтра: минимальная частота среза (Гц), рост частоты со скоростью
+    // (Гц на ширину лица в секунду), частота среза для скорости (Гц)
+    float m_minCutoff = 1.0f;
+    float m_beta = 5.0f;
+    float m_derivativeCutoff = 1.0f;
+    // Интервал между кадрами, если время не задано (с)
+    float m_defaultDt = 1.f / 30;
+    // Число кадров, через которое освобождается слот пропавшего лица
+    int m_maxAge = 30;
+
+    // Слоты: идентификатор, номер кадра последнего появления, время последнего обновления
+    std::vector<int> m_ids, m_seen;
+    std::vector<double> m_times;
+    // Соотношение box детектора и рамки ключевых точек (x, y, w, h), 4 на слот
+    std::vector<float> m_boxRatios;
+    // Сглаженные координаты и скорости (пикселей в секунду), N на слот
+    std::vector<float> m_x, m_y, m_vx, m_vy;
+    // Предсказанные ключевые точки и box на следующем кадре
+    std::vector<float> m_px, m_py;
+    std::vector<cv::Rect2f> m_predictedBoxes;
+    int m_frame = 0;
+
+    int findSlot(int id) const
+    {
+        for (int k = 0; k < m_capacity; k++){
+            if (m_ids[k] == id){
+                return k;
+            }
+        }
+        return -1;
+    }
+
+    int allocateSlot(int id)
+    {
+        int oldest = 0;
+        for (int k = 0; k < m_capacity; k++){
+            if (m_ids[k] < 0 || m_frame - m_seen[k] > m_maxAge){
+                oldest = k;
+                break;
+            }
+            if (m_seen[k] < m_seen[oldest]){
+                oldest = k;
+            }
+        }
+        m_ids[oldest] = id;
+        m_boxRatios[4 * oldest + 2] = 0.f;
+        return oldest;
+    }
+
+    static cv::Rect2f pointsRect(const float* x, const float* y)
+    {
+        float minX = x[0], maxX = x[0], minY = y[0], maxY = y[0];
+        for (int j = 1; j < N; j++){
+            minX = std::min(minX, x[j]);
+            maxX = std::max(maxX, x[j]);
+            minY = std::min(minY, y[j]);
+            maxY = std::max(maxY, y[j]);
+        }
+        return cv::Rect2f(minX, minY, std::max(maxX - minX, 1.f), std::max(maxY - minY, 1.f));
+    }
+
+    static float alpha(float cutoff, float dt)
+    {
+        float tau = 1.f / (2.f * float(CV_PI) * cutoff);
+        return 1.f / (1.f + tau / dt);
+    }
+
+    /*
+        Шаг фильтра для N точек одного лица: обновление скоростей и координат,
+        x, y заменяются сглаженными координатами.
+        Массивы не пересекаются (__restrict): иначе компилятор не векторизует цикл
+        из-за проверок пересечения для шести массивов; std::sqrt векторизуется
+        только без errno (-fno-math-errno, задается в CMakeLists.txt).
+    */
+    static void filterPoints(float* __restrict x, float* __restrict y, float* __restrict sx, float* __restrict sy,
+                             float* __restrict vx, float* __restrict vy, float invDt, float aD, float invWidth,
+                             float minCutoff, float beta, float tauScale)
+    {
+        for (int j = 0; j < N; j++){
+            float dx = (x[j] - sx[j]) * invDt;
+            float dy = (y[j] - sy[j]) * invDt;
+            vx[j] += aD * (dx - vx[j]);
+            vy[j] += aD * (dy - vy[j]);
+            float speed = std::sqrt(vx[j] * vx[j] + vy[j] * vy[j]) * invWidth;
+            float cutoff = minCutoff + beta * speed;
+            // alpha = 1 / (1 + tau / dt), tau = 1 / (2 pi cutoff)
+            float a = cutoff / (cutoff + tauScale);
+            sx[j] += a * (x[j] - sx[j]);
+            sy[j] += a * (y[j] - sy[j]);
+            x[j] = sx[j];
+            y[j] = sy[j];
+        }
+    }
+
+public:
+    /*
+        Аргументы:
+            - capacity - число одновременно сглаживаемых лиц
+    */
+    OneEuroSmoother(int capacity = 32) : m_capacity(std::max(capacity, 1))
+    {
+        m_ids.assign(m_capacity, -1);
+        m_seen.assign(m_capacity, 0);
+        m_times.assign(m_capacity, 0.0);
+        m_boxRatios.assign(4 * m_capacity, 0.f);
+        m_x.assign(m_capacity * N, 0.f);
+        m_y.assign(m_capacity * N, 0.f);
+        m_vx.assign(m_capacity * N, 0.f);
+        m_vy.assign(m_capacity * N, 0.f);
+        m_px.assign(m_capacity * N, 0.f);
+        m_py.assign(m_capacity * N, 0.f);
+        m_predictedBoxes.assign(m_capacity, cv::Rect2f());
+    };
+    ~OneEuroSmoother(){};
+
+    /*
+        Сглаживание ключевых точек всех сопровождаемых лиц контейнера (на месте)
+        Аргументы:
+            - faces - лица с ключевыми точками и идентификаторами
+            - time - время кадра (с)
+            - detected - box лиц получены детектором (обновляется соотношение box и ключевых точек)
+    */
+    void apply(FaceBatch<N>& faces, double time, bool detected)
+    {
+        m_frame++;
+        for (int i = 0; i < faces.size(); i++){
+            int id = faces.id(i);
+            if (id < 0){
+                continue;
+            }
+            float* x = faces.x(i);
+            float* y = faces.y(i);
+            int k = findSlot(id);
+            bool fresh = k < 0;
+            if (fresh){
+                k = allocateSlot(id);
+            }
+            float* sx = &m_x[k * N];
+            float* sy = &m_y[k * N];
+            float* vx = &m_vx[k * N];
+            float* vy = &m_vy[k * N];
+            float* ratios = &m_boxRatios[4 * k];
+
+            cv::Rect2f raw = pointsRect(x, y);
+            if (detected || ratios[2] <= 0.f){
+                const cv::Rect2i& box = faces.box(i);
+                ratios[0] = (box.x - raw.x) / raw.width;
+                ratios[1] = (box.y - raw.y) / raw.height;
+                ratios[2] = box.width / raw.width;
+                ratios[3] = box.height / raw.height;
+            }
+
+            float dt = float(time - m_times[k]);
+            if (fresh || dt <= 0.f || dt > 1.f){
+                dt = m_defaultDt;
+            }
+            if (fresh){
+                std::copy(x, x + N, sx);
+                std::copy(y, y + N, sy);
+                std::fill(vx, vx + N, 0.f);
+                std::fill(vy, vy + N, 0.f);
+            }
+            else{
+                filterPoints(x, y, sx, sy, vx, vy, 1.f / dt, alpha(m_derivativeCutoff, dt), 1.f / raw.width,
+                             m_minCutoff, m_beta, 1.f / (2.f * float(CV_PI) * dt));
+            }
+
+            // Предсказание на следующий кадр
+            float* px = &m_px[k * N];
+            float* py = &m_py[k * N];
+            for (int j = 0; j < N; j++){
+                px[j] = sx[j] + vx[j] * dt;
+                py[j] = sy[j] + vy[j] * dt;
+            }
+            cv::Rect2f rect = pointsRect(px, py);
+            m_predictedBoxes[k] = cv::Rect2f(rect.x + ratios[0] * rect.width, rect.y + ratios[1] * rect.height,
+                                             ratios[2] * rect.width, ratios[3] * rect.height);
+            m_times[k] = time;
+            m_seen[k] = m_frame;
+        }
+    }
+
+    /*
+        Предсказание для лица с идентификатором id на следующем кадре.
+        Возвращает false, если лицо не встречалось на последнем кадре.
+    */
+    bool predicted(int id, cv::Rect2f& box, const float*& x, const float*& y) const
+    {
+        int k = findSlot(id);
+        if (k < 0 || m_seen[k] != m_frame){
+            return false;
+        }
+        box = m_predictedBoxes[k];
+        x = &m_px[k * N];
+        y = &m_py[k * N];
+        return true;
+    }
+
+    /*
+        Аргументы:
+            - minCutoff - минимальная частота среза (Гц)
+            - beta - рост частоты среза со скоростью (Гц на ширину лица в секунду)
+            - derivativeCutoff - частота среза фильтра скорости (Гц)
+    */
+    void setParameters(float minCutoff, float beta, float derivativeCutoff)
+    {
+        m_minCutoff = minCutoff;
+        m_beta = beta;
+        m_derivativeCutoff = derivativeCutoff;
+    }
+};
+
+/*
+    Действие на кадре без детекции для детекторов с внутренним состоянием
+*/
+template<class BoxDetector>
+void skipDetection(BoxDetector&) {}
+
+void skipDetection(MultiFaceTracker& detector) { detector.coast(); }
+
+/*
+    Детектор лиц с предсказанием box по сглаженным ключевым точкам.
+    Полная детекция выполняется раз в m_detectEvery кадров, при отсутствии лиц
+    и при появлении лиц без идентификатора; на остальных кадрах box и ключевые точки
+    лиц берутся из предсказания OneEuroSmoother и сразу передаются детектору
+    ключевых точек. Сглаживание выполняется после определения ключевых точек
+    (FacePipeline::afterLandmarks).
+    Детектор BoxDetector должен записывать идентификаторы лиц в контейнер.
+*/
+template<class BoxDetector, int N>
+class PredictiveDetector
+{
+private:
+    BoxDetector m_detector;
+    OneEuroSmoother<N> m_smoother;
+    int m_detectEvery;
+    // Множитель периода детекции (регулятор качества)
+    int m_detectEveryFactor = 1;
+    int m_framesSinceDetect = 0;
+    bool m_detected = false;
+    std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+
+    // Лица последнего кадра (идентификаторы и уверенности)
+    std::vector<int> m_ids;
+    std::vector<float> m_scores;
+
+    // Статистика
+    long long m_frames = 0;
+    long long m_detections = 0;
+
+public:
+    /*
+        Аргументы:
+            - detectEvery - период запуска полной детекции (в кадрах)
+    */
+    PredictiveDetector(int detectEvery = 5) : m_detectEvery(std::max(detectEvery, 1)) {};
+    ~PredictiveDetector(){};
+
+    /*
+        Функция предсказания координат bounding boxes лица с записью в контейнер faces
+    */
+    void predict(FrameCache& frame, FaceBatch<N>& faces)
+    {
+        m_frames++;
+        bool needDetect = m_ids.empty() || m_framesSinceDetect + 1 >= m_detectEvery * m_detectEveryFactor;
+        if (!needDetect){
+            cv::Rect2i frameRect(0, 0, frame.size().width, frame.size().height);
+            faces.resize(int(m_ids.size()));
+            for (size_t i = 0; i < m_ids.size(); i++){
+                cv::Rect2f box;
+                const float* x;
+                const float* y;
+                if (m_ids[i] < 0 || !m_smoother.predicted(m_ids[i], box, x, y)){
+                    needDetect = true;
+                    break;
+                }
+                faces.box(int(i)) = cv::Rect2i(box) & frameRect;
+                faces.score(int(i)) = m_scores[i];
+                faces.id(int(i)) = m_ids[i];
+                std::copy(x, x + N, faces.x(int(i)));
+                std::copy(y, y + N, faces.y(int(i)));
+                if (faces.box(int(i)).area() <= 0){
+                    needDetect = true;
+                    break;
+                }
+            }
+        }
+        if (needDetect){
+            m_detector.predict(frame, faces);
+            m_framesSinceDetect = 0;
+            m_detections++;
+        }
+        else{
+            skipDetection(m_detector);
+            m_framesSinceDetect++;
+        }
+        m_detected = needDetect;
+    }
+
+    /*
+        Сглаживание ключевых точек и предсказание box на следующий кадр
+    */
+    void smooth(FaceBatch<N>& faces)
+    {
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - m_start;
+        m_smoother.apply(faces, time.count(), m_detected);
+        m_ids.resize(faces.size());
+        m_scores.resize(faces.size());
+        for (int i = 0; i < faces.size(); i++){
+            m_ids[i] = faces.id(i);
+            m_scores[i] = faces.score(i);
+        }
+    }
+
+    bool isReady() const { return m_detector.isReady(); }
+    void waitReady() { m_detector.waitReady(); }
+
+    BoxDetector& detector() { return m_detector; }
+    OneEuroSmoother<N>& smoother() { return m_smoother; }
+    void setDetectEvery(int detectEvery) { m_detectEvery = std::max(detectEvery, 1); }
+    void setDetectEveryFactor(int factor) { m_detectEveryFactor = std::max(factor, 1); }
+    // Доля кадров с полной детекцией
+    double detectionFraction() const { return m_frames > 0 ? double(m_detections) / m_frames : 0.0; }
+};
+
+}
+
+#endif // LANDMARKSMOOTHING_H
@@ -0,0 +1,163 @@
+#ifndef LANDMARKS3D_H
+#define LANDMARKS3D_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "FaceBatch.h"
+#include "OpenNI2OpenCV.h"
+
+// Оценка положения головы
+namespace FacePose{
+
+/*
+    Выборка глубины в дробной точке изображения.
+    В окне (2 * m_radius + 1)^2 вокруг точки находится медиана ненулевой глубины;
+    пиксели без глубины и отличающиеся от медианы больше чем на допуск
+    (край лица, волосы, фон) отбрасываются. Глубина интерполируется билинейно
+    по оставшимся из четырех соседних пикселей, при их отсутствии берется медиана.
+*/
+class DepthSampler
+{
+private:
+    int m_radius = 2;
+    // Допуск отклонения от медианы: m_tolerance мм + m_relTolerance * медиана
+    float m_tolerance = 15.f;
+    float m_relTolerance = 0.02f;
+    std::vector<uint16_t> m_values;
+
+public:
+    DepthSampler(){};
+    ~DepthSampler(){};
+
+    /*
+        Глубина (мм) в точке (x, y), 0 - глубина неизвестна
+        Аргументы:
+            - depth - карта глубины (CV_16UC1, мм)
+            - x, y - координаты точки
+    */
+    float sample(const cv::Mat& depth, float x, float y)
+    {
+        int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+        if (x0 < 0 || y0 < 0 || x0 >= depth.cols || y0 >= depth.rows){
+            return 0.f;
+        }
+        m_values.clear();
+        for (int v = std::max(0, y0 - m_radius); v <= std::min(depth.rows - 1, y0 + 1 + m_radius); v++){
+            const uint16_t* d = depth.ptr<uint16_t>(v);
+            for (int u = std::max(0, x0 - m_radius); u <= std::min(depth.cols - 1, x0 + 1 + m_radius); u++){
+                if (d[u] != 0){
+                    m_values.push_back(d[u]);
+                }
+            }
+        }
+        if (m_values.empty()){
+            return 0.f;
+        }
+        std::nth_element(m_values.begin(), m_values.begin() + m_values.size() / 2, m_values.end());
+        float median = m_values[m_values.size() / 2];
+        float tolerance = m_tolerance + m_relTolerance * median;
+
+        float fx = x - x0, fy = y - y0;
+        float weights[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+        int dx[4] = {0, 1, 0, 1}, dy[4] = {0, 0, 1, 1};
+        float sum = 0.f, weight = 0.f;
+        for (int k = 0; k < 4; k++){
+            int u = std::min(x0 + dx[k], depth.cols - 1), v = std::min(y0 + dy[k], depth.rows - 1);
+            float d = depth.at<uint16_t>(v, u);
+            if (d != 0 && std::abs(d - median) <= tolerance){
+                sum += weights[k] * d;
+                weight += weights[k];
+            }
+        }
+        return weight > 1e-3f ? sum / weight : median;
+    }
+
+    /*
+        Аргументы:
+            - radius - радиус окна медианы
+            - tolerance, relTolerance - допуск отклонения от медианы (мм и доля медианы)
+    */
+    void setWindow(int radius, float tolerance, float relTolerance)
+    {
+        m_radius = radius;
+        m_tolerance = tolerance;
+        m_relTolerance = relTolerance;
+    }
+};
+
+/*
+    Метрические 3D координаты ключевых точек всех лиц (мм, система координат
+    цветной камеры). Как и в FaceBatch, координаты хранятся в отдельных массивах,
+    точки лица i занимают элементы [i * N, (i + 1) * N).
+    Точки без глубины имеют Z = 0 и valid = 0.
+*/
+template<int N>
+class Landmarks3D
+{
+private:
+    int m_size = 0;
+    std::vector<float> m_X, m_Y, m_Z;
+    std::vector<uint8_t> m_valid;
+    DepthSampler m_sampler;
+
+public:
+    Landmarks3D(){};
+    ~Landmarks3D(){};
+
+    /*
+        Перевод ключевых точек всех лиц в 3D
+        Аргументы:
+            - faces - лица с ключевыми точками
+            - depth - совмещенная с цветным кадром карта глубины (CV_16UC1, мм)
+            - K - внутренние параметры цветной камеры
+    */
+    void lift(const FaceBatch<N>& faces, const cv::Mat& depth, const OpenNIOpenCV::CameraIntrinsics& K)
+    {
+        m_size = faces.size();
+        int n = m_size * N;
+        if (int(m_Z.size()) < n){
+            m_X.resize(n);
+            m_Y.resize(n);
+            m_Z.resize(n);
+            m_valid.resize(n);
+        }
+        const float* xs = faces.xs();
+        const float* ys = faces.ys();
+        float* X = m_X.data();
+        float* Y = m_Y.data();
+        float* Z = m_Z.data();
+
+        // Выборка глубины: произвольный доступ к карте глубины
+        for (int i = 0; i < n; i++){
+            Z[i] = m_sampler.sample(depth, xs[i], ys[i]);
+            m_valid[i] = Z[i] > 0.f;
+        }
+        // Обратная проекция всех точек за один проход по непрерывным массивам
+        // (цикл без ветвлений векторизуется компилятором)
+        const float cx = K.cx, cy = K.cy, ifx = 1.f / K.fx, ify = 1.f / K.fy;
+        for (int i = 0; i < n; i++){
+            X[i] = (xs[i] - cx) * Z[i] * ifx;
+            Y[i] = (ys[i] - cy) * Z[i] * ify;
+        }
+    }
+
+    int size() const { return m_size; }
+
+    // Координаты ключевых точек лица i
+    const float* X(int i) const { return m_X.data() + i * N; }
+    const float* Y(int i) const { return m_Y.data() + i * N; }
+    const float* Z(int i) const { return m_Z.data() + i * N; }
+    const uint8_t* valid(int i) const { return m_valid.data() + i * N; }
+    cv::Point3f point(int i, int j) const { return cv::Point3f(m_X[i * N + j], m_Y[i * N + j], m_Z[i * N + j]); }
+
+    DepthSampler& sampler() { return m_sampler; }
+};
+
+}
+
+#endif // LANDMARKS3D_H
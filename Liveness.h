@@ -0,0 +1,473 @@
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "FaceBatch.h"
+#include "Landmarks3D.h"
+#include "OpenNI2OpenCV.h"
+
+// Проверка, что перед камерой живое лицо, а не фотография или экран
+namespace FaceLiveness{
+
+/*
+    Результат проверки лица
+*/
+struct LivenessResult
+{
+    // Итоговая оценка (0 - плоская подделка, 1 - живое лицо), -1 - недостаточно данных глубины
+    float score = -1.f;
+    // Среднеквадратичное отклонение точек лица от плоскости (мм)
+    float planeRms = 0.f;
+    // Кривизна остатков относительно плоскости (1/мм, > 0 - выпуклость к камере)
+    float curvature = 0.f;
+    // Выступ носа относительно щек (мм)
+    float relief = 0.f;
+    // Яркость ИК, приведенная к расстоянию 1 м, и ее коэффициент вариации (-1 - нет ИК кадра)
+    float irLevel = -1.f;
+    float irContrast = -1.f;
+    // Число точек глубины, по которым выполнена проверка
+    int points = 0;
+};
+
+/*
+    Проверка живого лица по глубине внутри bounding box.
+    По прореженной сетке точек центральной части лица методом наименьших квадратов
+    с отбрасыванием выбросов строится плоскость. У живого лица остатки относительно
+    плоскости велики и имеют выпуклую форму, нос выступает относительно щек;
+    фотография и экран телефона почти плоские. Дополнительно учитываются яркость
+    и неоднородность ИК изображения (экраны в ИК темные, бумага однородна).
+    На лицо обрабатывается не более m_maxPoints точек, поэтому проверка занимает
+    доли миллисекунды.
+*/
+class LivenessChecker
+{
+private:
+    int m_maxPoints = 400;
+    // Центральная часть bounding box, по которой строится плоскость (доля размера)
+    float m_roiScale = 0.6f;
+    // Минимальная доля точек с глубиной
+    float m_minValidFraction = 0.3f;
+    int m_refitIterations = 2;
+
+    // Диапазоны признаков, переводимые в оценку 0..1 (от "подделка" до "живое")
+    float m_rmsRange[2] = {2.5f, 7.f};
+    float m_curvatureRange[2] = {0.001f, 0.004f};
+    float m_reliefRange[2] = {6.f, 15.f};
+    float m_irContrastRange[2] = {0.05f, 0.15f};
+    // Допустимая яркость ИК, приведенная к 1 м
+    float m_irLevelRange[2] = {20.f, 4000.f};
+    // Веса признаков: отклонение от плоскости, кривизна, выступ носа, ИК
+    float m_weights[4] = {0.3f, 0.2f, 0.3f, 0.2f};
+
+    // Точки лица (мм) и признак инлайера, переиспользуются между лицами
+    std::vector<float> m_X, m_Y, m_Z;
+    std::vector<uint8_t> m_inlier;
+    std::vector<float> m_residuals, m_sorted;
+    FacePose::DepthSampler m_sampler;
+    std::vector<LivenessResult> m_results;
+    // Геометрия сенсора, снимающего ИК кадр (ИК кадр не совмещен с цветным)
+    bool m_mapIr = false;
+    OpenNIOpenCV::DepthSensorGeometry m_irGeometry;
+
+    static float ramp(float value, const float range[2])
+    {
+        return std::max(0.f, std::min(1.f, (value - range[0]) / (range[1] - range[0])));
+    }
+
+    /*
+        Плоскость z = a * x + b * y + c по точкам-инлайерам (нормальные уравнения 3x3)
+    */
+    bool fitPlane(double& a, double& b, double& c) const
+    {
+        double sxx = 0, sxy = 0, sx = 0, syy = 0, sy = 0, n = 0, sxz = 0, syz = 0, sz = 0;
+        for (size_t i = 0; i < m_Z.size(); i++){
+            if (!m_inlier[i]){
+                continue;
+            }
+            double x = m_X[i], y = m_Y[i], z = m_Z[i];
+            sxx += x * x; sxy += x * y; sx += x;
+            syy += y * y; sy += y; n += 1;
+            sxz += x * z; syz += y * z; sz += z;
+        }
+        // Решение по правилу Крамера
+        double det = sxx * (syy * n - sy * sy) - sxy * (sxy * n - sy * sx) + sx * (sxy * sy - syy * sx);
+        if (n < 3 || std::abs(det) < 1e-9){
+            return false;
+        }
+        a = (sxz * (syy * n - sy * sy) - sxy * (syz * n - sy * sz) + sx * (syz * sy - syy * sz)) / det;
+        b = (sxx * (syz * n - sz * sy) - sxz * (sxy * n - sy * sx) + sx * (sxy * sz - syz * sx)) / det;
+        c = (sxx * (syy * sz - sy * syz) - sxy * (sxy * sz - syz * sx) + sxz * (sxy * sy - syy * sx)) / det;
+        return true;
+    }
+
+    /*
+        Точки глубины центральной части лица в метрических координатах
+    */
+    void samplePoints(const cv::Rect2i& box, const cv::Mat& depth, const OpenNIOpenCV::CameraIntrinsics& K)
+    {
+        m_X.clear();
+        m_Y.clear();
+        m_Z.clear();
+        int w = int(box.width * m_roiScale), h = int(box.height * m_roiScale);
+        cv::Rect2i roi(box.x + (box.width - w) / 2, box.y + (box.height - h) / 2, w, h);
+        roi &= cv::Rect2i(0, 0, depth.cols, depth.rows);
+        if (roi.empty()){
+            return;
+        }
+        int step = std::max(1, int(std::ceil(std::sqrt(double(roi.area()) / m_maxPoints))));
+        int total = 0;
+        for (int v = roi.y; v < roi.y + roi.height; v += step){
+            const uint16_t* d = depth.ptr<uint16_t>(v);
+            for (int u = roi.x; u < roi.x + roi.width; u += step){
+                total++;
+                if (d[u] == 0){
+                    continue;
+                }
+                float z = d[u];
+                m_X.push_back((u - K.cx) * z / K.fx);
+                m_Y.push_back((v - K.cy) * z / K.fy);
+                m_Z.push_back(z);
+            }
+        }
+        if (m_Z.size() < m_minValidFraction * total){
+            m_X.clear();
+            m_Y.clear();
+            m_Z.clear();
+        }
+    }
+
+    /*
+        Выступ носа относительно щек (мм) по ключевым точкам, при их отсутствии -
+        по центру bounding box и точкам по бокам от него
+    */
+    float noseRelief(const cv::Rect2i& box, const float* x, const float* y, int numLandmarks, const cv::Mat& depth)
+    {
+        cv::Point2f nose, left, right;
+        if (x && numLandmarks == 68){
+            nose = cv::Point2f(x[30], y[30]);
+            // Щеки - между крылом носа и контуром лица
+            left = cv::Point2f((x[31] + x[2]) * 0.5f, (y[31] + y[2]) * 0.5f);
+            right = cv::Point2f((x[35] + x[14]) * 0.5f, (y[35] + y[14]) * 0.5f);
+        }
+        else if (x && numLandmarks == 5){
+            nose = cv::Point2f(x[2], y[2]);
+            left = cv::Point2f((x[0] + x[3]) * 0.5f, (y[0] + y[3]) * 0.5f);
+            right = cv::Point2f((x[1] + x[4]) * 0.5f, (y[1] + y[4]) * 0.5f);
+        }
+        else{
+            nose = cv::Point2f(box.x + box.width * 0.5f, box.y + box.height * 0.55f);
+            left = cv::Point2f(box.x + box.width * 0.25f, box.y + box.height * 0.6f);
+            right = cv::Point2f(box.x + box.width * 0.75f, box.y + box.height * 0.6f);
+        }
+        float zNose = m_sampler.sample(depth, nose.x, nose.y);
+        float zLeft = m_sampler.sample(depth, left.x, left.y);
+        float zRight = m_sampler.sample(depth, right.x, right.y);
+        if (zNose <= 0.f || (zLeft <= 0.f && zRight <= 0.f)){
+            return 0.f;
+        }
+        float zCheek = zLeft > 0.f && zRight > 0.f ? 0.5f * (zLeft + zRight) : std::max(zLeft, zRight);
+        return zCheek - zNose;
+    }
+
+    /*
+        Bounding box лица в координатах ИК кадра. ИК кадр снимает сенсор глубины,
+        и при совмещении глубины с цветным кадром он остается в координатах сенсора,
+        поэтому углы box переводятся через геометрию сенсора на глубине лица z (мм).
+        Без заданной геометрии (setIrGeometry) box не изменяется.
+    */
+    cv::Rect2i irBox(const cv::Rect2i& box, const OpenNIOpenCV::CameraIntrinsics& K, float z) const
+    {
+        if (!m_mapIr){
+            return box;
+        }
+        cv::Point2f corners[4] = {cv::Point2f(float(box.x), float(box.y)), cv::Point2f(float(box.x + box.width), float(box.y)),
+                                  cv::Point2f(float(box.x), float(box.y + box.height)),
+                                  cv::Point2f(float(box.x + box.width), float(box.y + box.height))};
+        float minX = std::numeric_limits<float>::max(), minY = minX, maxX = -minX, maxY = -minX;
+        for (int i = 0; i < 4; i++){
+            cv::Point3f p((corners[i].x - K.cx) * z / K.fx, (corners[i].y - K.cy) * z / K.fy, z);
+            cv::Point2f q = m_irGeometry.colorToDepthPixel(p);
+            minX = std::min(minX, q.x);
+            minY = std::min(minY, q.y);
+            maxX = std::max(maxX, q.x);
+            maxY = std::max(maxY, q.y);
+        }
+        return cv::Rect2i(cv::Point2i(int(std::floor(minX)), int(std::floor(minY))),
+                          cv::Point2i(int(std::ceil(maxX)), int(std::ceil(maxY))));
+    }
+
+    /*
+        Яркость ИК внутри лица, приведенная к 1 м (интенсивность подсветки падает
+        пропорционально квадрату расстояния), и коэффициент вариации
+    */
+    void irStatistics(const cv::Rect2i& box, const cv::Mat& ir, float z, LivenessResult& result) const
+    {
+        int w = int(box.width * m_roiScale), h = int(box.height * m_roiScale);
+        cv::Rect2i roi(box.x + (box.width - w) / 2, box.y + (box.height - h) / 2, w, h);
+        roi &= cv::Rect2i(0, 0, ir.cols, ir.rows);
+        if (roi.empty()){
+            return;
+        }
+        int step = std::max(1, int(std::ceil(std::sqrt(double(roi.area()) / m_maxPoints))));
+        double sum = 0, sum2 = 0;
+        int n = 0;
+        for (int v = roi.y; v < roi.y + roi.height; v += step){
+            const uint16_t* p = ir.ptr<uint16_t>(v);
+            for (int u = roi.x; u < roi.x + roi.width; u += step){
+                sum += p[u];
+                sum2 += double(p[u]) * p[u];
+                n++;
+            }
+        }
+        double mean = sum / n;
+        double var = std::max(0.0, sum2 / n - mean * mean);
+        float zm = z * 0.001f;
+        result.irLevel = float(mean * zm * zm);
+        result.irContrast = mean > 0 ? float(std::sqrt(var) / mean) : 0.f;
+    }
+
+public:
+    LivenessChecker(){};
+    ~LivenessChecker(){};
+
+    /*
+        Проверка одного лица
+        Аргументы:
+            - box - bounding box лица
+            - x, y - координаты ключевых точек (nullptr - без ключевых точек)
+            - numLandmarks - число ключевых точек (68 или 5)
+            - depth - совмещенная с цветным кадром карта глубины (CV_16UC1, мм)
+            - K - внутренние параметры цветной камеры
+            - ir - ИК кадр (CV_16UC1) или пустая матрица; если карта глубины совмещена
+            с цветным кадром, а ИК кадр нет, нужна геометрия сенсора (setIrGeometry)
+    */
+    LivenessResult checkFace(const cv::Rect2i& box, const float* x, const float* y, int numLandmarks,
+                             const cv::Mat& depth, const OpenNIOpenCV::CameraIntrinsics& K,
+                             const cv::Mat& ir = cv::Mat())
+    {
+        LivenessResult result;
+        samplePoints(box, depth, K);
+        int n = int(m_Z.size());
+        result.points = n;
+        if (n < 10){
+            return result;
+        }
+
+        // Плоскость с отбрасыванием выбросов (фон и волосы на краях области)
+        m_inlier.assign(n, 1);
+        m_residuals.resize(n);
+        double a = 0, b = 0, c = 0;
+        for (int it = 0; it <= m_refitIterations; it++){
+            if (!fitPlane(a, b, c)){
+                return result;
+            }
+            for (int i = 0; i < n; i++){
+                m_residuals[i] = float(m_Z[i] - (a * m_X[i] + b * m_Y[i] + c));
+            }
+            if (it == m_refitIterations){
+                break;
+            }
+            m_sorted.resize(n);
+            for (int i = 0; i < n; i++){
+                m_sorted[i] = std::abs(m_residuals[i]);
+            }
+            std::nth_element(m_sorted.begin(), m_sorted.begin() + n / 2, m_sorted.end());
+            // 3 медианных абсолютных отклонения, но не меньше шума камеры
+            float limit = std::max(3.f * 1.4826f * m_sorted[n / 2], 10.f);
+            for (int i = 0; i < n; i++){
+                m_inlier[i] = std::abs(m_residuals[i]) <= limit;
+            }
+        }
+
+        // Отклонение от плоскости и кривизна: остаток = k * (расстояние до центра)^2 + r0
+        double cx = 0, cy = 0, cz = 0, count = 0;
+        for (int i = 0; i < n; i++){
+            if (m_inlier[i]){
+                cx += m_X[i]; cy += m_Y[i]; cz += m_Z[i]; count++;
+            }
+        }
+        cx /= count; cy /= count; cz /= count;
+        double ss = 0, sr = 0, srho = 0, srho2 = 0, srhor = 0;
+        for (int i = 0; i < n; i++){
+            if (!m_inlier[i]){
+                continue;
+            }
+            double r = m_residuals[i];
+            double rho = (m_X[i] - cx) * (m_X[i] - cx) + (m_Y[i] - cy) * (m_Y[i] - cy);
+            ss += r * r;
+            sr += r; srho += rho; srho2 += rho * rho; srhor += rho * r;
+        }
+        result.planeRms = float(std::sqrt(ss / count));
+        double varRho = srho2 / count - (srho / count) * (srho / count);
+        result.curvature = varRho > 1e-9 ? float((srhor / count - (srho / count) * (sr / count)) / varRho) : 0.f;
+        result.relief = noseRelief(box, x, y, numLandmarks, depth);
+
+        float cues[4] = {ramp(result.planeRms, m_rmsRange), ramp(result.curvature, m_curvatureRange),
+                         ramp(result.relief, m_reliefRange), 0.f};
+        float weightSum = m_weights[0] + m_weights[1] + m_weights[2];
+        if (!ir.empty()){
+            irStatistics(irBox(box, K, float(cz)), ir, float(cz), result);
+            bool levelOk = result.irLevel >= m_irLevelRange[0] && result.irLevel <= m_irLevelRange[1];
+            cues[3] = levelOk ? ramp(result.irContrast, m_irContrastRange) : 0.f;
+            weightSum += m_weights[3];
+        }
+        float score = 0.f;
+        for (int k = 0; k < 4; k++){
+            score += m_weights[k] * cues[k];
+        }
+        result.score = score / weightSum;
+        return result;
+    }
+
+    /*
+        Проверка всех лиц контейнера
+        Аргументы:
+            - faces - лица с ключевыми точками
+            - depth - совмещенная с цветным кадром карта глубины (CV_16UC1, мм)
+            - K - внутренние параметры цветной камеры
+            - ir - ИК кадр (CV_16UC1) или пустая матрица
+    */
+    template<int N>
+    const std::vector<LivenessResult>& check(const FaceBatch<N>& faces, const cv::Mat& depth,
+                                             const OpenNIOpenCV::CameraIntrinsics& K, const cv::Mat& ir = cv::Mat())
+    {
+        m_results.resize(faces.size());
+        for (int i = 0; i < faces.size(); i++){
+            m_results[i] = checkFace(faces.box(i), faces.x(i), faces.y(i), N, depth, K, ir);
+        }
+        return m_results;
+    }
+
+    /*
+        Диапазоны признаков: значения ниже первой границы соответствуют подделке,
+        выше второй - живому лицу
+    */
+    void setPlaneRmsRange(float fake, float live) { m_rmsRange[0] = fake; m_rmsRange[1] = live; }
+    void setCurvatureRange(float fake, float live) { m_curvatureRange[0] = fake; m_curvatureRange[1] = live; }
+    void setReliefRange(float fake, float live) { m_reliefRange[0] = fake; m_reliefRange[1] = live; }
+    void setIrContrastRange(float fake, float live) { m_irContrastRange[0] = fake; m_irContrastRange[1] = live; }
+    void setIrLevelRange(float minLevel, float maxLevel) { m_irLevelRange[0] = minLevel; m_irLevelRange[1] = maxLevel; }
+
+    /*
+        Геометрия сенсора глубины, снимающего ИК кадр: область лица в ИК кадре
+        находится переводом bounding box цветного кадра (нужна при совмещении
+        глубины с цветным кадром, когда ИК кадр остается в координатах сенсора)
+    */
+    void setIrGeometry(const OpenNIOpenCV::DepthSensorGeometry& geometry)
+    {
+        m_irGeometry = geometry;
+        m_mapIr = true;
+    }
+
+    const std::vector<LivenessResult>& results() const { return m_results; }
+};
+
+/*
+    Записанный кадр для проверки LivenessChecker: карта глубины, ИК кадр, лицо
+    и ожидаемый результат. Записывается программой (--record-live, --record-fake)
+    и воспроизводится тестом test_liveness.
+*/
+struct LivenessSample
+{
+    cv::Mat depth, ir;
+    cv::Rect2i box;
+    // Ключевые точки (пустые - без ключевых точек)
+    std::vector<float> x, y;
+    OpenNIOpenCV::CameraIntrinsics K;
+    // Геометрия сенсора глубины, если ИК кадр не совмещен с цветным
+    bool hasIrGeometry = false;
+    OpenNIOpenCV::DepthSensorGeometry irGeometry;
+    // 1 - живое лицо, 0 - подделка, -1 - неизвестно
+    int live = -1;
+};
+
+/*
+    Запись кадра в файл cv::FileStorage (yml, yml.gz)
+*/
+bool writeSample(const std::string& path, const LivenessSample& sample)
+{
+    cv::FileStorage fs(path, cv::FileStorage::WRITE);
+    if (!fs.isOpened()){
+        return false;
+    }
+    const OpenNIOpenCV::CameraIntrinsics& K = sample.K;
+    const OpenNIOpenCV::CameraIntrinsics& D = sample.irGeometry.depthK;
+    fs << "live" << sample.live
+       << "box" << sample.box
+       << "x" << sample.x
+       << "y" << sample.y
+       << "K" << std::vector<float>{K.fx, K.fy, K.cx, K.cy}
+       << "depth" << sample.depth
+       << "ir" << sample.ir;
+    if (sample.hasIrGeometry){
+        fs << "depthK" << std::vector<float>{D.fx, D.fy, D.cx, D.cy}
+           << "R" << cv::Mat(sample.irGeometry.R)
+           << "T" << cv::Mat(sample.irGeometry.T);
+    }
+    return true;
+}
+
+/*
+    Чтение кадра, записанного writeSample
+*/
+bool readSample(const std::string& path, LivenessSample& sample)
+{
+    cv::FileStorage fs(path, cv::FileStorage::READ);
+    if (!fs.isOpened()){
+        return false;
+    }
+    std::vector<float> K;
+    fs["live"] >> sample.live;
+    fs["box"] >> sample.box;
+    fs["x"] >> sample.x;
+    fs["y"] >> sample.y;
+    fs["K"] >> K;
+    fs["depth"] >> sample.depth;
+    fs["ir"] >> sample.ir;
+    if (K.size() != 4 || sample.depth.type() != CV_16UC1){
+        return false;
+    }
+    sample.K = OpenNIOpenCV::CameraIntrinsics{K[0], K[1], K[2], K[3]};
+    sample.hasIrGeometry = !fs["depthK"].empty();
+    if (sample.hasIrGeometry){
+        std::vector<float> D;
+        cv::Mat R, T;
+        fs["depthK"] >> D;
+        fs["R"] >> R;
+        fs["T"] >> T;
+        if (D.size() != 4 || R.total() != 9 || T.total() != 3){
+            return false;
+        }
+        sample.irGeometry.depthK = OpenNIOpenCV::CameraIntrinsics{D[0], D[1], D[2], D[3]};
+        R.convertTo(R, CV_32F);
+        T.convertTo(T, CV_32F);
+        sample.irGeometry.R = cv::Matx33f(R.ptr<float>());
+        sample.irGeometry.T = cv::Vec3f(T.ptr<float>());
+    }
+    return true;
+}
+
+/*
+    Проверка лица записанного кадра
+*/
+LivenessResult checkSample(LivenessChecker& checker, const LivenessSample& sample)
+{
+    if (sample.hasIrGeometry){
+        checker.setIrGeometry(sample.irGeometry);
+    }
+    bool landmarks = !sample.x.empty() && sample.x.size() == sample.y.size();
+    return checker.checkFace(sample.box, landmarks ? sample.x.data() : nullptr, landmarks ? sample.y.data() : nullptr,
+                             int(sample.x.size()), sample.depth, sample.K, sample.ir);
+}
+
+}
+
+#endif // LIVENESS_H
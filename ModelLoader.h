@@ -0,0 +1,533 @@
+#ifndef MODELLOADER_H
+#define MODELLOADER_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/core.hpp>
+
+#include <dlib/image_processing.h>
+
+// Загрузка моделей
+namespace ModelLoading{
+
+/*
+    Вывод времени, прошедшего с момента start
+    Аргументы:
+        - message - текст перед значением времени
+        - start - момент начала операции
+*/
+void reportTime(const std::string& message, std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+    std::cout << message << " " << ms.count() << " ms" << std::endl;
+}
+
+/*
+    Вывод времени загрузки модели
+    Аргументы:
+        - name - имя модели
+        - start - момент начала загрузки
+*/
+void reportLoadTime(const std::string& name, std::chrono::steady_clock::time_point start)
+{
+    reportTime("Model " + name + " loaded in", start);
+}
+
+/*
+    Вывод времени прогрева модели
+    Аргументы:
+        - name - имя модели
+        - start - момент начала прогрева
+*/
+void reportWarmUpTime(const std::string& name, std::chrono::steady_clock::time_point start)
+{
+    reportTime("Model " + name + " warmed up in", start);
+}
+
+/*
+    Файл, отображенный в память (только чтение)
+*/
+class MappedFile
+{
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+
+public:
+    MappedFile(){};
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0){
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0){
+            ::close(fd);
+            return false;
+        }
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED){
+            return false;
+        }
+        // Файл читается последовательно от начала до конца. Значения MADV_* -
+        // перечисление, а не флаги, поэтому каждый совет задается отдельным вызовом;
+        // совет необязателен, и ошибка только выводится
+        if (madvise(data, st.st_size, MADV_SEQUENTIAL) != 0 || madvise(data, st.st_size, MADV_WILLNEED) != 0){
+            std::cout << "madvise failed for " << path << std::endl;
+        }
+        m_data = (const char*)data;
+        m_size = st.st_size;
+        return true;
+    }
+
+    void close()
+    {
+        if (m_data){
+            munmap((void*)m_data, m_size);
+            m_data = nullptr;
+            m_size = 0;
+        }
+    }
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+};
+
+/*
+    Буфер потока поверх области памяти (без копирования данных)
+*/
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+    MemoryStreamBuf(const char* data, size_t size)
+    {
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+};
+
+/*
+    Модель dlib::shape_predictor в виде массивов: начальная форма, деревья
+    регрессии и координаты точек признаков каждого каскада.
+    Координаты точек признаков задаются относительно начальной формы, как при
+    обучении: shape_predictor сам пересчитывает по ним опорные точки и смещения.
+*/
+struct ShapePredictorData
+{
+    dlib::matrix<float, 0, 1> initialShape;
+    std::vector<std::vector<dlib::impl::regression_tree>> forests;
+    std::vector<std::vector<dlib::vector<float, 2>>> pixelCoordinates;
+};
+
+/*
+    Опорные точки и смещения точек признаков shape_predictor
+*/
+typedef std::vector<std::vector<unsigned long>> ShapeAnchors;
+typedef std::vector<std::vector<dlib::vector<float, 2>>> ShapeDeltas;
+
+/*
+    Разбор модели dlib (формат serialize(shape_predictor), версия 1).
+    Возвращает false, если поток в другом формате.
+    Аргументы:
+        - in - поток модели
+        - model - массивы модели для записи
+        - anchors, deltas - опорные точки и смещения точек признаков
+*/
+bool parseShapePredictor(std::istream& in, ShapePredictorData& model, ShapeAnchors& anchors, ShapeDeltas& deltas)
+{
+    int version = 0;
+    try{
+        dlib::deserialize(version, in);
+        if (version != 1){
+            return false;
+        }
+        dlib::deserialize(model.initialShape, in);
+        dlib::deserialize(model.forests, in);
+        dlib::deserialize(anchors, in);
+        dlib::deserialize(deltas, in);
+    }
+    catch (const dlib::serialization_error&){
+        return false;
+    }
+    if (anchors.size() != model.forests.size() || deltas.size() != anchors.size()){
+        return false;
+    }
+    // Точка признака - опорная точка начальной формы плюс смещение
+    model.pixelCoordinates.resize(anchors.size());
+    for (size_t c = 0; c < anchors.size(); c++){
+        if (deltas[c].size() != anchors[c].size()){
+            return false;
+        }
+        model.pixelCoordinates[c].resize(anchors[c].size());
+        for (size_t i = 0; i < anchors[c].size(); i++){
+            long idx = long(anchors[c][i]);
+            if (2 * idx + 1 >= model.initialShape.size()){
+                return false;
+            }
+            model.pixelCoordinates[c][i] = dlib::vector<float, 2>(model.initialShape(2 * idx), model.initialShape(2 * idx + 1)) + deltas[c][i];
+        }
+    }
+    return true;
+}
+
+/*
+    Проверка, что shape_predictor, построенный по координатам точек признаков,
+    выбирает те же опорные точки, а смещения отличаются только округлением
+    (не более maxDeltaError в координатах начальной формы).
+    Проверяется модель без деревьев: опорные точки и смещения от деревьев не зависят.
+*/
+bool checkShapeEncoding(const ShapePredictorData& model, const ShapeAnchors& anchors, const ShapeDeltas& deltas,
+                        float maxDeltaError = 1e-5f)
+{
+    std::vector<std::vector<dlib::impl::regression_tree>> noTrees(model.forests.size());
+    dlib::shape_predictor probe(model.initialShape, noTrees, model.pixelCoordinates);
+    std::stringstream state;
+    dlib::serialize(probe, state);
+    ShapePredictorData rebuilt;
+    ShapeAnchors rebuiltAnchors;
+    ShapeDeltas rebuiltDeltas;
+    if (!parseShapePredictor(state, rebuilt, rebuiltAnchors, rebuiltDeltas) || rebuiltAnchors != anchors){
+        return false;
+    }
+    for (size_t c = 0; c < deltas.size(); c++){
+        for (size_t i = 0; i < deltas[c].size(); i++){
+            if ((rebuiltDeltas[c][i] - deltas[c][i]).length() > maxDeltaError){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+    Путь к кэшу модели dlib в виде массивов
+*/
+std::string shapePredictorCachePath(const std::string& path)
+{
+    return path + ".cache.bin";
+}
+
+const char shapePredictorCacheMagic[8] = {'D', 'L', 'I', 'B', 'S', 'P', '0', '1'};
+
+/*
+    Запись кэша модели dlib: заголовок, размер формы и начальная форма, число
+    каскадов; для каскада - число точек признаков и их координаты (x, y), число
+    деревьев; для дерева - число разбиений и разбиения (idx1, idx2, thresh),
+    число листьев и значения листьев (по размеру формы). Числа - uint32_t и float.
+*/
+bool writeShapePredictorCache(const std::string& path, const ShapePredictorData& model)
+{
+    std::ofstream out(path, std::ios::binary);
+    if (!out){
+        return false;
+    }
+    auto writeCount = [&out](size_t n){
+        uint32_t value = uint32_t(n);
+        out.write((const char*)&value, sizeof(value));
+    };
+    uint32_t shapeSize = uint32_t(model.initialShape.size());
+    out.write(shapePredictorCacheMagic, sizeof(shapePredictorCacheMagic));
+    writeCount(shapeSize);
+    out.write((const char*)&model.initialShape(0), shapeSize * sizeof(float));
+    writeCount(model.forests.size());
+    for (size_t c = 0; c < model.forests.size(); c++){
+        const std::vector<dlib::vector<float, 2>>& pixels = model.pixelCoordinates[c];
+        writeCount(pixels.size());
+        for (size_t i = 0; i < pixels.size(); i++){
+            float xy[2] = {pixels[i].x(), pixels[i].y()};
+            out.write((const char*)xy, sizeof(xy));
+        }
+        writeCount(model.forests[c].size());
+        for (const dlib::impl::regression_tree& tree : model.forests[c]){
+            writeCount(tree.splits.size());
+            for (const dlib::impl::split_feature& split : tree.splits){
+                writeCount(split.idx1);
+                writeCount(split.idx2);
+                out.write((const char*)&split.thresh, sizeof(float));
+            }
+            writeCount(tree.leaf_values.size());
+            for (const dlib::matrix<float, 0, 1>& leaf : tree.leaf_values){
+                if (leaf.size() != shapeSize){
+                    return false;
+                }
+                out.write((const char*)&leaf(0), shapeSize * sizeof(float));
+            }
+        }
+    }
+    return bool(out);
+}
+
+/*
+    Чтение кэша модели dlib, отображенного в память: значения копируются
+    в массивы модели без разбора чисел. Все размеры проверяются по длине файла.
+    Возвращает false, если файл испорчен.
+*/
+bool readShapePredictorCache(const MappedFile& file, ShapePredictorData& model)
+{
+    const char* p = file.data();
+    const char* end = p + file.size();
+    auto readCount = [&p, end](uint32_t& n){
+        if (end - p < ptrdiff_t(sizeof(n))){
+            return false;
+        }
+        memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        return true;
+    };
+    auto readFloats = [&p, end](float* dst, size_t count){
+        if (size_t(end - p) / sizeof(float) < count){
+            return false;
+        }
+        memcpy(dst, p, count * sizeof(float));
+        p += count * sizeof(float);
+        return true;
+    };
+    if (file.size() < sizeof(shapePredictorCacheMagic) ||
+        memcmp(p, shapePredictorCacheMagic, sizeof(shapePredictorCacheMagic)) != 0){
+        return false;
+    }
+    p += sizeof(shapePredictorCacheMagic);
+    uint32_t shapeSize, numCascades;
+    if (!readCount(shapeSize) || shapeSize == 0 || size_t(end - p) / sizeof(float) < shapeSize){
+        return false;
+    }
+    model.initialShape.set_size(shapeSize);
+    if (!readFloats(&model.initialShape(0), shapeSize) || !readCount(numCascades) || numCascades > size_t(end - p)){
+        return false;
+    }
+    model.forests.assign(numCascades, std::vector<dlib::impl::regression_tree>());
+    model.pixelCoordinates.assign(numCascades, std::vector<dlib::vector<float, 2>>());
+    for (uint32_t c = 0; c < numCascades; c++){
+        uint32_t numPixels, numTrees;
+        if (!readCount(numPixels) || size_t(end - p) / (2 * sizeof(float)) < numPixels){
+            return false;
+        }
+        model.pixelCoordinates[c].resize(numPixels);
+        for (uint32_t i = 0; i < numPixels; i++){
+            float xy[2];
+            readFloats(xy, 2);
+            model.pixelCoordinates[c][i] = dlib::vector<float, 2>(xy[0], xy[1]);
+        }
+        if (!readCount(numTrees) || numTrees > size_t(end - p)){
+            return false;
+        }
+        model.forests[c].resize(numTrees);
+        for (dlib::impl::regression_tree& tree : model.forests[c]){
+            uint32_t numSplits, numLeaves;
+            if (!readCount(numSplits) || size_t(end - p) / 12 < numSplits){
+                return false;
+            }
+            tree.splits.resize(numSplits);
+            for (dlib::impl::split_feature& split : tree.splits){
+                uint32_t idx1, idx2;
+                readCount(idx1);
+                readCount(idx2);
+                readFloats(&split.thresh, 1);
+                if (idx1 >= numPixels || idx2 >= numPixels){
+                    return false;
+                }
+                split.idx1 = idx1;
+                split.idx2 = idx2;
+            }
+            if (!readCount(numLeaves) || size_t(end - p) / sizeof(float) / shapeSize < numLeaves ||
+                numLeaves != numSplits + 1){
+                return false;
+            }
+            tree.leaf_values.resize(numLeaves);
+            for (dlib::matrix<float, 0, 1>& leaf : tree.leaf_values){
+                leaf.set_size(shapeSize);
+                readFloats(&leaf(0), shapeSize);
+            }
+        }
+    }
+    return p == end;
+}
+
+/*
+    Создание кэша модели dlib из исходного файла, отображенного в память.
+    Модель строится по разобранным массивам; кэш записывается, только если
+    построенная модель кодирует точки признаков так же, как исходная (checkShapeEncoding).
+    Возвращает false, если модель не удалось построить по массивам.
+*/
+bool convertShapePredictor(const MappedFile& file, const std::string& cachePath, dlib::shape_predictor& sp)
+{
+    MemoryStreamBuf buf(file.data(), file.size());
+    std::istream stream(&buf);
+    ShapePredictorData model;
+    ShapeAnchors anchors;
+    ShapeDeltas deltas;
+    if (!parseShapePredictor(stream, model, anchors, deltas) || !checkShapeEncoding(model, anchors, deltas)){
+        std::cout << "Can't create model cache " << cachePath << ": unsupported shape predictor" << std::endl;
+        return false;
+    }
+    sp = dlib::shape_predictor(model.initialShape, model.forests, model.pixelCoordinates);
+
+    // Кэш записывается во временный файл и переименовывается только после успешной записи
+    std::string tmpPath = cachePath + ".tmp";
+    if (!writeShapePredictorCache(tmpPath, model) || rename(tmpPath.c_str(), cachePath.c_str()) != 0){
+        std::cout << "Can't create model cache " << cachePath << std::endl;
+        unlink(tmpPath.c_str());
+    }
+    return true;
+}
+
+/*
+    Загрузка модели dlib::shape_predictor.
+    Модель загружается из кэша с массивами модели (path + ".cache.bin"): кэш
+    отображается в память, и значения копируются без разбора чисел, которым
+    занята почти вся десериализация dlib. Кэш создается при первом запуске
+    и пересоздается, если исходный файл новее. Без кэша исходный файл
+    отображается в память и десериализуется из памяти.
+    Аргументы:
+        - path - путь к модели
+        - sp - модель для записи
+*/
+void loadShapePredictor(const std::string& path, dlib::shape_predictor& sp)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::string cachePath = shapePredictorCachePath(path);
+    struct stat src, dst;
+    bool fresh = stat(path.c_str(), &src) == 0 && stat(cachePath.c_str(), &dst) == 0 && dst.st_mtime >= src.st_mtime;
+    MappedFile cache;
+    ShapePredictorData model;
+    if (fresh && cache.open(cachePath) && readShapePredictorCache(cache, model)){
+        sp = dlib::shape_predictor(model.initialShape, model.forests, model.pixelCoordinates);
+        reportLoadTime(cachePath, start);
+        return;
+    }
+    MappedFile file;
+    if (file.open(path)){
+        if (!convertShapePredictor(file, cachePath, sp)){
+            MemoryStreamBuf buf(file.data(), file.size());
+            std::istream stream(&buf);
+            dlib::deserialize(sp, stream);
+        }
+    }
+    else{
+        dlib::deserialize(path) >> sp;
+    }
+    reportLoadTime(path, start);
+}
+
+/*
+    Рекурсивное копирование узла cv::FileStorage.
+    Матрицы записываются в base64: при чтении не разбираются текстовые
+    числа, но сам файл по-прежнему разбирается cv::FileStorage.
+*/
+void copyFileNode(const cv::FileNode& node, cv::FileStorage& fs, const std::string& name)
+{
+    // Внутри последовательностей элементы записываются без имени
+    if (!name.empty()){
+        fs << name;
+    }
+    if (node.isMap() && !node["dt"].empty() && !node["data"].empty()){
+        cv::Mat mat;
+        node >> mat;
+        fs << mat;
+    }
+    else if (node.isMap()){
+        fs << "{";
+        for (cv::FileNodeIterator it = node.begin(); it != node.end(); ++it){
+            copyFileNode(*it, fs, (*it).name());
+        }
+        fs << "}";
+    }
+    else if (node.isSeq()){
+        fs << "[";
+        for (cv::FileNodeIterator it = node.begin(); it != node.end(); ++it){
+            copyFileNode(*it, fs, "");
+        }
+        fs << "]";
+    }
+    else if (node.isInt()){
+        fs << int(node);
+    }
+    else if (node.isReal()){
+        fs << double(node);
+    }
+    else{
+        fs << std::string(node);
+    }
+}
+
+/*
+    Путь к кэшу модели в формате cv::FileStorage
+*/
+std::string storageCachePath(const std::string& path)
+{
+    return path + ".cache.yml";
+}
+
+/*
+    Получение пути к кэшу модели в формате cv::FileStorage с матрицами в base64.
+    При первом запуске кэш создается из исходного файла; при ошибке
+    возвращается путь к исходному файлу.
+    Аргументы:
+        - path - путь к модели (yaml/xml)
+*/
+std::string cachedStorage(const std::string& path)
+{
+    std::string cachePath = storageCachePath(path);
+    struct stat src, dst;
+    if (stat(path.c_str(), &src) != 0){
+        return path;
+    }
+    if (stat(cachePath.c_str(), &dst) == 0 && dst.st_mtime >= src.st_mtime){
+        return cachePath;
+    }
+
+    // Кэш записывается во временный файл и переименовывается только после успешной записи
+    auto start = std::chrono::steady_clock::now();
+    std::string tmpPath = cachePath + ".tmp";
+    try{
+        cv::FileStorage in(path, cv::FileStorage::READ);
+        if (!in.isOpened()){
+            return path;
+        }
+        cv::FileStorage out(tmpPath, cv::FileStorage::WRITE | cv::FileStorage::FORMAT_YAML | cv::FileStorage::BASE64);
+        if (!out.isOpened()){
+            return path;
+        }
+        cv::FileNode root = in.root();
+        for (cv::FileNodeIterator it = root.begin(); it != root.end(); ++it){
+            copyFileNode(*it, out, (*it).name());
+        }
+        out.release();
+    }
+    catch (const cv::Exception& e){
+        std::cout << "Can't create model cache " << cachePath << ": " << e.what() << std::endl;
+        unlink(tmpPath.c_str());
+        return path;
+    }
+    if (rename(tmpPath.c_str(), cachePath.c_str()) != 0){
+        unlink(tmpPath.c_str());
+        return path;
+    }
+    reportTime("Model cache " + cachePath + " created in", start);
+    return cachePath;
+}
+
+}
+
+#endif // MODELLOADER_H
@@ -0,0 +1,218 @@
+#ifndef MOTIONGATE_H
+#define MOTIONGATE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "FrameCache.h"
+
+/*
+    Число пикселей, яркость которых отличается больше чем на threshold
+*/
+inline int countChanged8u(const uint8_t* a, const uint8_t* b, int n, uint8_t threshold)
+{
+    int count = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i t = _mm_set1_epi8((char)threshold), zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16){
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        // |a - b| через два вычитания с насыщением
+        __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        int same = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(d, t), zero));
+        count += __builtin_popcount(~same & 0xFFFF);
+    }
+#endif
+    for (; i < n; i++){
+        count += std::abs(int(a[i]) - int(b[i])) > threshold;
+    }
+    return count;
+}
+
+/*
+    Число пикселей карты глубины, изменившихся больше чем на threshold (мм).
+    Пиксели без глубины (0) не учитываются.
+*/
+inline int countChanged16u(const uint16_t* a, const uint16_t* b, int n, uint16_t threshold)
+{
+    int count = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i t = _mm_set1_epi16((short)threshold), zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8){
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+        __m128i same = _mm_cmpeq_epi16(_mm_subs_epu16(d, t), zero);
+        __m128i invalid = _mm_or_si128(_mm_cmpeq_epi16(va, zero), _mm_cmpeq_epi16(vb, zero));
+        int skip = _mm_movemask_epi8(_mm_or_si128(same, invalid));
+        // По 2 бита маски на пиксель
+        count += __builtin_popcount(~skip & 0xFFFF) / 2;
+    }
+#endif
+    for (; i < n; i++){
+        count += a[i] != 0 && b[i] != 0 && std::abs(int(a[i]) - int(b[i])) > threshold;
+    }
+    return count;
+}
+
+/*
+    Проверка изменений в кадре перед запуском детекторов.
+    Сильно уменьшенный кадр (и, если задана, карта глубины) сравнивается с кадром,
+    на котором детекторы запускались последний раз. Если изменений нет,
+    детекция пропускается и используются предыдущие результаты.
+    После последнего изменения детекция продолжается еще m_holdOff кадров
+    (лицо могло остановиться на краю кадра), а не реже чем раз в m_maxSkip
+    кадров выполняется принудительно.
+*/
+class MotionGate
+{
+private:
+    // Разрешение, на котором сравниваются кадры
+    cv::Size m_size = cv::Size(80, 60);
+    // Порог изменения яркости и минимальная доля изменившихся пикселей
+    uint8_t m_colorThreshold = 20;
+    float m_minColorFraction = 0.005;
+    // Порог изменения глубины (мм) и минимальная доля изменившихся пикселей
+    uint16_t m_depthThreshold = 50;
+    float m_minDepthFraction = 0.005;
+    int m_holdOff = 10;
+    int m_maxSkip = 150;
+
+    // Кадры, на которых детекция запускалась последний раз
+    cv::Mat m_refGray, m_refDepth, m_smallDepth;
+    int m_framesSinceMotion = 0;
+    int m_framesSinceRun = 0;
+
+    int m_frames = 0;
+    int m_skipped = 0;
+    float m_lastChange = 0;
+
+    bool changed(const cv::Mat& gray, const cv::Mat& depth)
+    {
+        if (m_refGray.size() != gray.size() || (!depth.empty() && m_refDepth.size() != depth.size())){
+            return true;
+        }
+        int n = int(gray.total());
+        float colorFraction = float(countChanged8u(gray.ptr<uint8_t>(), m_refGray.ptr<uint8_t>(), n, m_colorThreshold)) / n;
+        m_lastChange = colorFraction;
+        if (colorFraction >= m_minColorFraction){
+            return true;
+        }
+        if (!depth.empty()){
+            int nd = int(depth.total());
+            float depthFraction = float(countChanged16u(depth.ptr<uint16_t>(), m_refDepth.ptr<uint16_t>(), nd,
+                                                        m_depthThreshold)) / nd;
+            m_lastChange = std::max(m_lastChange, depthFraction);
+            if (depthFraction >= m_minDepthFraction){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool decide(const cv::Mat& gray, const cv::Mat& depth)
+    {
+        m_frames++;
+        if (changed(gray, depth)){
+            m_framesSinceMotion = 0;
+        }
+        else{
+            m_framesSinceMotion++;
+        }
+        m_framesSinceRun++;
+        bool run = m_framesSinceMotion <= m_holdOff || m_framesSinceRun >= m_maxSkip;
+        if (run){
+            m_framesSinceRun = 0;
+            gray.copyTo(m_refGray);
+            if (!depth.empty()){
+                depth.copyTo(m_refDepth);
+            }
+        }
+        else{
+            m_skipped++;
+        }
+        return run;
+    }
+
+public:
+    MotionGate(){};
+    ~MotionGate(){};
+
+    /*
+        Проверка цветного кадра. Возвращает true, если детекторы нужно запустить.
+    */
+    bool update(FrameCache& frame)
+    {
+        return decide(frame.gray(m_size), cv::Mat());
+    }
+
+    /*
+        Проверка цветного кадра и карты глубины
+        Аргументы:
+            - frame - кэш цветного кадра
+            - depth - карта глубины (CV_16UC1, мм)
+    */
+    bool update(FrameCache& frame, const cv::Mat& depth)
+    {
+        resize(depth, m_smallDepth, m_size, 0, 0, cv::INTER_NEAREST);
+        return decide(frame.gray(m_size), m_smallDepth);
+    }
+
+    /*
+        Пороги изменения
+        Аргументы:
+            - threshold - изменение яркости пикселя
+            - minFraction - доля изменившихся пикселей, при которой кадр считается изменившимся
+    */
+    void setColorThreshold(uint8_t threshold, float minFraction) { m_colorThreshold = threshold; m_minColorFraction = minFraction; }
+    void setDepthThreshold(uint16_t threshold, float minFraction) { m_depthThreshold = threshold; m_minDepthFraction = minFraction; }
+
+    /*
+        Пороги по подсказке камеры (AXONLINK_STREAM_PROPERTY_MOTIONTHRESHOLD)
+        Аргументы:
+            - threshold - изменение глубины пикселя (мм)
+            - count - число изменившихся пикселей в разрешении камеры
+            - sensorSize - разрешение карты глубины камеры
+    */
+    void setSensorHint(uint16_t threshold, uint32_t count, cv::Size sensorSize)
+    {
+        if (threshold > 0 && count > 0 && sensorSize.area() > 0){
+            setDepthThreshold(threshold, float(count) / sensorSize.area());
+        }
+    }
+
+    /*
+        Аргументы:
+            - holdOff - число кадров после последнего изменения, в течение которых детекция продолжается
+            - maxSkip - максимальное число кадров без детекции
+    */
+    void setHoldOff(int holdOff, int maxSkip) { m_holdOff = holdOff; m_maxSkip = std::max(1, maxSkip); }
+    void setSize(cv::Size size) { m_size = size; }
+
+    int frames() const { return m_frames; }
+    int skipped() const { return m_skipped; }
+    double savedFraction() const { return m_frames > 0 ? double(m_skipped) / m_frames : 0.0; }
+    // Доля изменившихся пикселей на последнем кадре
+    float lastChange() const { return m_lastChange; }
+
+    /*
+        Вывод числа пропущенных запусков детекторов
+    */
+    void report() const
+    {
+        std::cout << "Motion gate: skipped " << m_skipped << " of " << m_frames << " frames ("
+                  << 100.0 * savedFraction() << "% inference saved)" << std::endl;
+    }
+};
+
+#endif // MOTIONGATE_H
@@ -0,0 +1,551 @@
+#ifndef MULTIFACETRACKER_H
+#define MULTIFACETRACKER_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "FaceBatch.h"
+#include "FaceDetectors.h"
+#include "FrameCache.h"
+
+// Face Tracking
+namespace FaceTracking{
+
+/*
+    Решение задачи о назначениях венгерским алгоритмом (O(n^2 m)).
+    Буферы переиспользуются между вызовами.
+*/
+class HungarianSolver
+{
+private:
+    std::vector<double> m_u, m_v, m_minv;
+    std::vector<int> m_p, m_way, m_colAssignment;
+    std::vector<char> m_used;
+
+    /*
+        Назначение для rows <= cols: assignment[i] - столбец строки i
+    */
+    void solveWide(const float* cost, int stride, int rows, int cols, bool transposed, int* assignment)
+    {
+        const double inf = std::numeric_limits<double>::infinity();
+        m_u.assign(rows + 1, 0.0);
+        m_v.assign(cols + 1, 0.0);
+        m_p.assign(cols + 1, 0);
+        m_way.assign(cols + 1, 0);
+        for (int i = 1; i <= rows; i++){
+            m_p[0] = i;
+            int j0 = 0;
+            m_minv.assign(cols + 1, inf);
+            m_used.assign(cols + 1, 0);
+            do{
+                m_used[j0] = 1;
+                int i0 = m_p[j0], j1 = 0;
+                double delta = inf;
+                for (int j = 1; j <= cols; j++){
+                    if (m_used[j]){
+                        continue;
+                    }
+                    double c = transposed ? cost[(j - 1) * stride + (i0 - 1)] : cost[(i0 - 1) * stride + (j - 1)];
+                    double cur = c - m_u[i0] - m_v[j];
+                    if (cur < m_minv[j]){
+                        m_minv[j] = cur;
+                        m_way[j] = j0;
+                    }
+                    if (m_minv[j] < delta){
+                        delta = m_minv[j];
+                        j1 = j;
+                    }
+                }
+                for (int j = 0; j <= cols; j++){
+                    if (m_used[j]){
+                        m_u[m_p[j]] += delta;
+                        m_v[j] -= delta;
+                    }
+                    else{
+                        m_minv[j] -= delta;
+                    }
+                }
+                j0 = j1;
+            } while (m_p[j0] != 0);
+            do{
+                int j1 = m_way[j0];
+                m_p[j0] = m_p[j1];
+                j0 = j1;
+            } while (j0);
+        }
+        for (int j = 1; j <= cols; j++){
+            if (m_p[j] != 0){
+                assignment[m_p[j] - 1] = j - 1;
+            }
+        }
+    }
+
+public:
+    HungarianSolver(){};
+    ~HungarianSolver(){};
+
+    /*
+        Назначение минимальной суммарной стоимости
+        Аргументы:
+            - cost - матрица стоимостей rows x cols (строки по stride элементов)
+            - rowAssignment - столбец, назначенный строке (-1 - не назначен), rows элементов
+    */
+    void solve(const float* cost, int stride, int rows, int cols, int* rowAssignment)
+    {
+        std::fill(rowAssignment, rowAssignment + rows, -1);
+        if (rows == 0 || cols == 0){
+            return;
+        }
+        if (rows <= cols){
+            solveWide(cost, stride, rows, cols, false, rowAssignment);
+            return;
+        }
+        // Строк больше, чем столбцов: решается транспонированная задача
+        m_colAssignment.assign(cols, -1);
+        solveWide(cost, stride, cols, rows, true, m_colAssignment.data());
+        for (int j = 0; j < cols; j++){
+            if (m_colAssignment[j] >= 0){
+                rowAssignment[m_colAssignment[j]] = j;
+            }
+        }
+    }
+};
+
+/*
+    Сопровождение нескольких лиц с постоянными идентификаторами по детекциям YuNet.
+    Положение и размер лица (cx, cy, w, h) предсказываются фильтром Калмана с
+    постоянной скоростью (независимые фильтры по каждой координате). Детекции
+    сопоставляются с предсказаниями по матрице стоимостей из IoU и сходства
+    внешнего вида (нормированный уменьшенный фрагмент лица в градациях серого),
+    оптимальное назначение находится венгерским алгоритмом.
+    Гистерезис: новое лицо подтверждается после m_minHits детекций подряд,
+    подтвержденное лицо удаляется после m_maxMisses кадров без детекции
+    (в это время его box предсказывается). Состояние всех лиц хранится в
+    пулах фиксированной емкости (structure of arrays), при обработке кадра
+    память не выделяется.
+*/
+class MultiFaceTracker
+{
+public:
+    enum TrackState { TRACK_FREE = 0, TRACK_TENTATIVE, TRACK_CONFIRMED };
+    // Размер стороны фрагмента лица для сравнения внешнего вида
+    static const int patchSize = 16;
+    static const int appearanceSize = patchSize * patchSize;
+
+private:
+    FaceBBDetector::YuNetDetector m_detector;
+    int m_capacity;
+
+    // Пул сопровождаемых лиц, элемент k - слот k
+    std::vector<int> m_ids, m_state, m_hits, m_misses, m_age;
+    std::vector<float> m_scores;
+    // Фильтр Калмана: по 4 координаты (cx, cy, w, h) на слот - значение, скорость, ковариация
+    std::vector<float> m_pos, m_vel, m_p00, m_p01, m_p11;
+    // Ключевые точки YuNet (5 на слот) и внешний вид (appearanceSize на слот)
+    std::vector<float> m_lx, m_ly, m_appearance;
+    std::vector<int> m_freeSlots;
+    int m_nextId = 0;
+
+    // Параметры сопоставления
+    float m_iouWeight = 0.7f;
+    float m_minIoU = 0.1f;
+    float m_minSimilarity = 0.6f;
+    // Максимальное смещение центра (доля ширины) для сопоставления только по внешнему виду
+    float m_maxJump = 1.0f;
+    float m_maxCost = 0.8f;
+    // Гистерезис рождения и удаления
+    int m_minHits = 3;
+    int m_maxMisses = 5;
+    // Шум модели движения и измерения (доля размера лица)
+    float m_processNoise = 0.05f;
+    float m_measurementNoise = 0.05f;
+    // Скорость обновления внешнего вида
+    float m_appearanceRate = 0.2f;
+
+    // Буферы кадра (емкость m_capacity)
+    HungarianSolver m_solver;
+    std::vector<int> m_active, m_assignment, m_detectionUsed, m_output;
+    std::vector<float> m_cost, m_detAppearance;
+    cv::Mat m_patch;
+
+    static float iou(const cv::Rect2f& a, const cv::Rect2f& b)
+    {
+        float inter = (a & b).area();
+        float uni = a.area() + b.area() - inter;
+        return uni > 0 ? inter / uni : 0.f;
+    }
+
+    cv::Rect2f slotBox(int k) const
+    {
+        const float* s = &m_pos[4 * k];
+        return cv::Rect2f(s[0] - s[2] * 0.5f, s[1] - s[3] * 0.5f, s[2], s[3]);
+    }
+
+    /*
+        Нормированный фрагмент лица (нулевое среднее, единичная норма)
+    */
+    void extractAppearance(const cv::Mat& gray, const cv::Rect2f& box, float* out)
+    {
+        cv::Rect2i roi = cv::Rect2i(box) & cv::Rect2i(0, 0, gray.cols, gray.rows);
+        if (roi.area() <= 0){
+            std::fill(out, out + appearanceSize, 0.f);
+            return;
+        }
+        cv::resize(gray(roi), m_patch, cv::Size(patchSize, patchSize), 0, 0, cv::INTER_AREA);
+        float mean = 0.f;
+        for (int i = 0; i < appearanceSize; i++){
+            out[i] = m_patch.data[i];
+            mean += out[i];
+        }
+        mean /= appearanceSize;
+        float norm = 0.f;
+        for (int i = 0; i < appearanceSize; i++){
+            out[i] -= mean;
+            norm += out[i] * out[i];
+        }
+        float inv = norm > 0.f ? 1.f / std::sqrt(norm) : 0.f;
+        for (int i = 0; i < appearanceSize; i++){
+            out[i] *= inv;
+        }
+    }
+
+    static float dot(const float* a, const float* b, int n)
+    {
+        float sum = 0.f;
+        for (int i = 0; i < n; i++){
+            sum += a[i] * b[i];
+        }
+        return sum;
+    }
+
+    /*
+        Предсказание фильтра Калмана на один кадр для всех координат слота
+    */
+    void predictSlot(int k)
+    {
+        float q = m_processNoise * m_pos[4 * k + 2];
+        q *= q;
+        for (int a = 4 * k; a < 4 * k + 4; a++){
+            m_pos[a] += m_vel[a];
+            m_p00[a] += 2.f * m_p01[a] + m_p11[a] + 0.25f * q;
+            m_p01[a] += m_p11[a] + 0.5f * q;
+            m_p11[a] += q;
+        }
+        // Размер не может стать отрицательным
+        m_pos[4 * k + 2] = std::max(m_pos[4 * k + 2], 1.f);
+        m_pos[4 * k + 3] = std::max(m_pos[4 * k + 3], 1.f);
+    }
+
+    /*
+        Коррекция фильтра Калмана по измерению z (cx, cy, w, h)
+    */
+    void correctSlot(int k, const float* z)
+    {
+        float r = m_measurementNoise * z[2];
+        r *= r;
+        for (int i = 0; i < 4; i++){
+            int a = 4 * k + i;
+            float s = m_p00[a] + r;
+            float k0 = m_p00[a] / s, k1 = m_p01[a] / s;
+            float y = z[i] - m_pos[a];
+            m_pos[a] += k0 * y;
+            m_vel[a] += k1 * y;
+            m_p11[a] -= k1 * m_p01[a];
+            m_p01[a] *= 1.f - k0;
+            m_p00[a] *= 1.f - k0;
+        }
+    }
+
+    void initSlot(int k, const float* z)
+    {
+        float r = m_measurementNoise * z[2];
+        r *= r;
+        for (int i = 0; i < 4; i++){
+            int a = 4 * k + i;
+            m_pos[a] = z[i];
+            m_vel[a] = 0.f;
+            m_p00[a] = r;
+            m_p01[a] = 0.f;
+            // Скорость нового лица неизвестна
+            m_p11[a] = 100.f * r;
+        }
+    }
+
+    void setDetection(int k, const float* row, const float* appearance, bool blendAppearance)
+    {
+        m_scores[k] = row[14];
+        for (int j = 0; j < 5; j++){
+            m_lx[5 * k + j] = row[4 + 2 * j];
+            m_ly[5 * k + j] = row[5 + 2 * j];
+        }
+        float* a = &m_appearance[size_t(k) * appearanceSize];
+        if (!blendAppearance){
+            std::copy(appearance, appearance + appearanceSize, a);
+            return;
+        }
+        float norm = 0.f;
+        for (int i = 0; i < appearanceSize; i++){
+            a[i] += m_appearanceRate * (appearance[i] - a[i]);
+            norm += a[i] * a[i];
+        }
+        float inv = norm > 0.f ? 1.f / std::sqrt(norm) : 0.f;
+        for (int i = 0; i < appearanceSize; i++){
+            a[i] *= inv;
+        }
+    }
+
+    void releaseSlot(int k)
+    {
+        m_state[k] = TRACK_FREE;
+        m_freeSlots.push_back(k);
+    }
+
+public:
+    /*
+        Аргументы:
+            - capacity - максимальное число одновременно сопровождаемых лиц
+            - config - параметры запуска YuNet
+    */
+    MultiFaceTracker(int capacity = 32, const FaceBBDetector::YuNetConfig& config = FaceBBDetector::defaultYuNetConfig())
+        : m_detector(config), m_capacity(std::max(capacity, 1))
+    {
+        int c = m_capacity;
+        m_ids.assign(c, -1);
+        m_state.assign(c, TRACK_FREE);
+        m_hits.assign(c, 0);
+        m_misses.assign(c, 0);
+        m_age.assign(c, 0);
+        m_scores.assign(c, 0.f);
+        m_pos.assign(4 * c, 0.f);
+        m_vel.assign(4 * c, 0.f);
+        m_p00.assign(4 * c, 0.f);
+        m_p01.assign(4 * c, 0.f);
+        m_p11.assign(4 * c, 0.f);
+        m_lx.assign(5 * c, 0.f);
+        m_ly.assign(5 * c, 0.f);
+        m_appearance.assign(size_t(c) * appearanceSize, 0.f);
+        m_detAppearance.assign(size_t(c) * appearanceSize, 0.f);
+        m_cost.assign(size_t(c) * c, 0.f);
+        m_assignment.assign(c, -1);
+        m_detectionUsed.assign(c, 0);
+        m_active.reserve(c);
+        m_output.reserve(c);
+        m_freeSlots.reserve(c);
+        for (int k = c - 1; k >= 0; k--){
+            m_freeSlots.push_back(k);
+        }
+    };
+    ~MultiFaceTracker(){};
+
+    /*
+        Обновление по детекциям кадра
+        Аргументы:
+            - frame - кэш кадра
+            - faces - результат YuNetDetector::detect (строки x, y, w, h, 5 ключевых точек, уверенность)
+    */
+    void update(FrameCache& frame, const cv::Mat& faces)
+    {
+        const cv::Mat& gray = frame.gray();
+        int numDetections = std::min(faces.rows, m_capacity);
+
+        // Предсказание всех лиц
+        m_active.clear();
+        for (int k = 0; k < m_capacity; k++){
+            if (m_state[k] != TRACK_FREE){
+                predictSlot(k);
+                m_age[k]++;
+                m_active.push_back(k);
+            }
+        }
+        for (int d = 0; d < numDetections; d++){
+            const float* row = faces.ptr<float>(d);
+            extractAppearance(gray, cv::Rect2f(row[0], row[1], row[2], row[3]), &m_detAppearance[size_t(d) * appearanceSize]);
+        }
+
+        // Матрица стоимостей: лица x детекции, недопустимые пары имеют стоимость выше m_maxCost
+        int numActive = int(m_active.size());
+        for (int t = 0; t < numActive; t++){
+            int k = m_active[t];
+            cv::Rect2f predicted = slotBox(k);
+            cv::Point2f center(m_pos[4 * k], m_pos[4 * k + 1]);
+            for (int d = 0; d < numDetections; d++){
+                const float* row = faces.ptr<float>(d);
+                cv::Rect2f box(row[0], row[1], row[2], row[3]);
+                float overlap = iou(predicted, box);
+                float similarity = dot(&m_appearance[size_t(k) * appearanceSize],
+                                       &m_detAppearance[size_t(d) * appearanceSize], appearanceSize);
+                cv::Point2f shift = cv::Point2f(box.x + box.width * 0.5f, box.y + box.height * 0.5f) - center;
+                bool allowed = overlap >= m_minIoU ||
+                               (similarity >= m_minSimilarity &&
+                                shift.dot(shift) <= m_maxJump * m_maxJump * predicted.width * predicted.width);
+                float cost = m_iouWeight * (1.f - overlap) + (1.f - m_iouWeight) * 0.5f * (1.f - similarity);
+                m_cost[size_t(t) * numDetections + d] = allowed ? cost : 1.f + m_maxCost;
+            }
+        }
+        m_solver.solve(m_cost.data(), numDetections, numActive, numDetections, m_assignment.data());
+
+        // Обновление сопоставленных лиц, пропуски и удаление
+        std::fill(m_detectionUsed.begin(), m_detectionUsed.end(), 0);
+        for (int t = 0; t < numActive; t++){
+            int k = m_active[t];
+            int d = m_assignment[t];
+            if (d >= 0 && m_cost[size_t(t) * numDetections + d] > m_maxCost){
+                d = -1;
+            }
+            if (d >= 0){
+                const float* row = faces.ptr<float>(d);
+                float z[4] = {row[0] + row[2] * 0.5f, row[1] + row[3] * 0.5f, row[2], row[3]};
+                correctSlot(k, z);
+                setDetection(k, row, &m_detAppearance[size_t(d) * appearanceSize], true);
+                m_detectionUsed[d] = 1;
+                m_hits[k]++;
+                m_misses[k] = 0;
+                if (m_state[k] == TRACK_TENTATIVE && m_hits[k] >= m_minHits){
+                    m_state[k] = TRACK_CONFIRMED;
+                }
+            }
+            else{
+                m_misses[k]++;
+                // Ключевые точки смещаются вместе с предсказанным box
+                for (int j = 0; j < 5; j++){
+                    m_lx[5 * k + j] += m_vel[4 * k];
+                    m_ly[5 * k + j] += m_vel[4 * k + 1];
+                }
+                if (m_state[k] == TRACK_TENTATIVE || m_misses[k] > m_maxMisses){
+                    releaseSlot(k);
+                }
+            }
+        }
+
+        // Новые лица из несопоставленных детекций
+        for (int d = 0; d < numDetections && !m_freeSlots.empty(); d++){
+            if (m_detectionUsed[d]){
+                continue;
+            }
+            int k = m_freeSlots.back();
+            m_freeSlots.pop_back();
+            const float* row = faces.ptr<float>(d);
+            float z[4] = {row[0] + row[2] * 0.5f, row[1] + row[3] * 0.5f, row[2], row[3]};
+            initSlot(k, z);
+            setDetection(k, row, &m_detAppearance[size_t(d) * appearanceSize], false);
+            m_ids[k] = m_nextId++;
+            m_state[k] = m_minHits <= 1 ? TRACK_CONFIRMED : TRACK_TENTATIVE;
+            m_hits[k] = 1;
+            m_misses[k] = 0;
+            m_age[k] = 0;
+        }
+
+        // Выдаются подтвержденные лица в порядке идентификаторов
+        m_output.clear();
+        for (int k = 0; k < m_capacity; k++){
+            if (m_state[k] == TRACK_CONFIRMED){
+                m_output.push_back(k);
+            }
+        }
+        std::sort(m_output.begin(), m_output.end(), [this](int a, int b){ return m_ids[a] < m_ids[b]; });
+    }
+
+    /*
+        Детекция YuNet и обновление сопровождения.
+        Возвращает число подтвержденных лиц.
+    */
+    int update(FrameCache& frame)
+    {
+        update(frame, m_detector.detect(frame));
+        return size();
+    }
+
+    /*
+        Кадр без детекции: предсказание фильтров Калмана на один кадр
+        (лица не считаются пропущенными)
+    */
+    void coast()
+    {
+        for (int k = 0; k < m_capacity; k++){
+            if (m_state[k] != TRACK_FREE){
+                predictSlot(k);
+                m_age[k]++;
+                for (int j = 0; j < 5; j++){
+                    m_lx[5 * k + j] += m_vel[4 * k];
+                    m_ly[5 * k + j] += m_vel[4 * k + 1];
+                }
+            }
+        }
+    }
+
+    /*
+        Функция предсказания координат bounding boxes лица с записью в контейнер faces
+        (подтвержденные лица; для N = 5 записываются ключевые точки YuNet)
+    */
+    template<int N>
+    void predict(FrameCache& frame, FaceBatch<N>& faces)
+    {
+        update(frame);
+        cv::Rect2i frameRect(0, 0, frame.size().width, frame.size().height);
+        faces.resize(size());
+        for (int i = 0; i < size(); i++){
+            int k = m_output[i];
+            faces.box(i) = cv::Rect2i(slotBox(k)) & frameRect;
+            faces.score(i) = m_scores[k];
+            faces.id(i) = m_ids[k];
+            if (N == 5){
+                for (int j = 0; j < 5; j++){
+                    faces.setLandmark(i, j, m_lx[5 * k + j], m_ly[5 * k + j]);
+                }
+            }
+        }
+    }
+
+    bool isReady() const { return m_detector.isReady(); }
+    FaceBBDetector::YuNetDetector& detector() { return m_detector; }
+    void waitReady() { m_detector.waitReady(); }
+
+    // Подтвержденные лица последнего кадра (в порядке predict)
+    int size() const { return int(m_output.size()); }
+    int id(int i) const { return m_ids[m_output[i]]; }
+    cv::Rect2f box(int i) const { return slotBox(m_output[i]); }
+    cv::Point2f velocity(int i) const { return cv::Point2f(m_vel[4 * m_output[i]], m_vel[4 * m_output[i] + 1]); }
+    float score(int i) const { return m_scores[m_output[i]]; }
+    // Число кадров с момента появления и число кадров без детекции
+    int age(int i) const { return m_age[m_output[i]]; }
+    int misses(int i) const { return m_misses[m_output[i]]; }
+    int capacity() const { return m_capacity; }
+
+    /*
+        Аргументы:
+            - iouWeight - вес IoU в стоимости (остальное - внешний вид)
+            - minIoU, minSimilarity - пороги допустимости пары
+            - maxCost - максимальная стоимость назначения
+    */
+    void setMatching(float iouWeight, float minIoU, float minSimilarity, float maxCost)
+    {
+        m_iouWeight = iouWeight;
+        m_minIoU = minIoU;
+        m_minSimilarity = minSimilarity;
+        m_maxCost = maxCost;
+    }
+    /*
+        Аргументы:
+            - minHits - число детекций подряд для подтверждения лица
+            - maxMisses - число кадров без детекции до удаления лица
+    */
+    void setHysteresis(int minHits, int maxMisses)
+    {
+        m_minHits = std::max(minHits, 1);
+        m_maxMisses = std::max(maxMisses, 0);
+    }
+    void setNoise(float processNoise, float measurementNoise)
+    {
+        m_processNoise = processNoise;
+        m_measurementNoise = measurementNoise;
+    }
+};
+
+}
+
+#endif // MULTIFACETRACKER_H
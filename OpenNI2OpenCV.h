@@ -1,14 +1,58 @@
 #ifndef _OpenNI2OpenCV_H_
 #define _OpenNI2OpenCV_H_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <stdio.h>
+#include <vector>
 
 #include <OpenNI.h>
+#include <AXonLink.h>
 #include <opencv2/opencv.hpp>
 
+#include "TaskScheduler.h"
+
 namespace OpenNIOpenCV {
 
+/*
+    Внутренние параметры камеры (в пикселях)
+*/
+struct CameraIntrinsics
+{
+    float fx, fy, cx, cy;
+};
+
+/*
+    Геометрия сенсора глубины (он же снимает ИК кадр) относительно цветной камеры:
+    внутренние параметры сенсора и перевод точки в систему цветной камеры
+    X_color = R * X_depth + T (мм)
+*/
+struct DepthSensorGeometry
+{
+    CameraIntrinsics depthK;
+    cv::Matx33f R = cv::Matx33f::eye();
+    cv::Vec3f T = cv::Vec3f(0, 0, 0);
+
+    /*
+        Пиксель кадра глубины/ИК, в который проецируется точка p системы цветной камеры (мм).
+        Для точки позади сенсора возвращается (-1, -1).
+    */
+    cv::Point2f colorToDepthPixel(const cv::Point3f& p) const
+    {
+        cv::Vec3f d = R.t() * (cv::Vec3f(p.x, p.y, p.z) - T);
+        if (d[2] <= 0.f){
+            return cv::Point2f(-1.f, -1.f);
+        }
+        return cv::Point2f(depthK.fx * d[0] / d[2] + depthK.cx, depthK.fy * d[1] / d[2] + depthK.cy);
+    }
+};
+
 /*
 
     Функция для получения поддерживаемых форматов пикселей с строковом
@@ -56,7 +100,154 @@ const char* PixelFormatToStr(openni::PixelFormat pixelformat) {
             break;
     }
 }
-    
+
+/*
+    Сопоставление меток времени кадров (часы камеры, мкс) с часами компьютера.
+    Запоминается минимальная разность между временем получения кадра и его
+    меткой времени, то есть самая быстрая доставка кадра. Задержка кадра
+    отсчитывается от этого момента: постоянная задержка передачи по USB
+    в нее не входит, дрейф часов камеры не учитывается.
+*/
+class SensorClock
+{
+private:
+    std::atomic<int64_t> m_offset;
+
+    static int64_t hostMicros()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    SensorClock()
+    {
+        m_offset.store(std::numeric_limits<int64_t>::max());
+    };
+    ~SensorClock(){};
+
+    /*
+        Учет кадра с меткой времени timestamp, полученного в текущий момент
+    */
+    void observe(uint64_t timestamp)
+    {
+        int64_t offset = hostMicros() - int64_t(timestamp);
+        int64_t current = m_offset.load();
+        while (offset < current && !m_offset.compare_exchange_weak(current, offset)){
+        }
+    }
+
+    /*
+        Время от съемки кадра с меткой времени timestamp до текущего момента (мс)
+    */
+    double latencyMs(uint64_t timestamp) const
+    {
+        int64_t offset = m_offset.load();
+        if (offset == std::numeric_limits<int64_t>::max()){
+            return 0.0;
+        }
+        return double(hostMicros() - (int64_t(timestamp) + offset)) / 1000.0;
+    }
+};
+
+/*
+    Почтовый ящик кадров потока OpenNI. Обработчик новых кадров только отмечает
+    время прихода кадра в часах SensorClock и сохраняет ссылку на кадр; обработка
+    кадров выполняется потребителем. Емкость 1 - единственный слот: кадр, который
+    еще не был забран, заменяется новым, и потребитель всегда получает самый свежий
+    кадр. Большая емкость - очередь кадров по порядку (как очередь драйвера), при
+    переполнении заменяется самый старый кадр. Число замененных (пропущенных)
+    кадров подсчитывается.
+*/
+class FrameMailbox : public openni::VideoStream::NewFrameListener
+{
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_arrived;
+    // Кольцевой буфер кадров: m_count кадров начиная с m_head
+    std::vector<openni::VideoFrameRef> m_frames;
+    int m_head = 0;
+    int m_count = 0;
+    long long m_delivered = 0;
+    long long m_replaced = 0;
+    SensorClock& m_clock;
+
+public:
+    /*
+        Аргументы:
+            - clock - часы потока, по которым отмечается время прихода кадров
+            - capacity - число хранимых кадров
+    */
+    FrameMailbox(SensorClock& clock, int capacity = 1) : m_frames(std::max(capacity, 1)), m_clock(clock) {};
+    ~FrameMailbox(){};
+
+    void onNewFrame(openni::VideoStream& stream)
+    {
+        openni::VideoFrameRef frame;
+        if (stream.readFrame(&frame) != openni::STATUS_OK){
+            return;
+        }
+        m_clock.observe(frame.getTimestamp());
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            int capacity = int(m_frames.size());
+            if (m_count == capacity){
+                m_replaced++;
+                m_head = (m_head + 1) % capacity;
+                m_count--;
+            }
+            m_frames[(m_head + m_count) % capacity] = frame;
+            m_count++;
+        }
+        m_arrived.notify_one();
+    }
+
+    /*
+        Получение кадра (самого свежего при емкости 1, иначе самого старого);
+        если кадров нет, ожидание. Возвращает false, если кадр не пришел за timeoutMs.
+    */
+    bool take(openni::VideoFrameRef& frame, int timeoutMs = 1000)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_arrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]{ return m_count > 0; })){
+            return false;
+        }
+        frame = m_frames[m_head];
+        m_frames[m_head].release();
+        m_head = (m_head + 1) % int(m_frames.size());
+        m_count--;
+        m_delivered++;
+        return true;
+    }
+
+    /*
+        Изменение емкости, хранимые кадры отбрасываются
+    */
+    void setCapacity(int capacity)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < m_frames.size(); i++){
+            m_frames[i].release();
+        }
+        m_frames.resize(std::max(capacity, 1));
+        m_head = 0;
+        m_count = 0;
+    }
+
+    long long replaced()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_replaced;
+    }
+
+    void report()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::cout << "Frame mailbox: " << m_delivered << " frames delivered, " << m_replaced
+                  << " replaced by newer frames" << std::endl;
+    }
+};
+
 class OpenNI2OpenCV
 {
 private:
@@ -64,6 +255,15 @@ private:
     openni::VideoStream m_depthStream, m_colorStream, m_irStream;
     openni::Device m_device;
     int m_height, m_width;
+    // Цветные кадры принимает обработчик m_colorMailbox (время прихода кадров отмечается
+    // в момент прихода в обоих режимах); без почтового ящика он хранит очередь из
+    // m_colorQueueDepth кадров. Метка времени последнего цветного кадра.
+    SensorClock m_colorClock;
+    const int m_colorQueueDepth = 4;
+    FrameMailbox m_colorMailbox{m_colorClock, m_colorQueueDepth};
+    bool m_colorListener = false;
+    bool m_mailbox = false;
+    uint64_t m_colorTimestamp = 0;
 
 /*
     Функция для вычисления значения градиента писелей в зависимости от расстояния
@@ -93,6 +293,9 @@ public:
     OpenNI2OpenCV() {};
     ~OpenNI2OpenCV()
     {
+        if (m_colorListener){
+            m_colorStream.removeNewFrameListener(&m_colorMailbox);
+        }
         m_device.close();
         if (m_colorStream.isValid()){
             m_colorStream.stop();
@@ -110,8 +313,11 @@ public:
 /*
     Функция инициализации устройства с которого будут считываться информация,
     а также потоков для цветного изображения, карты глубины, и инфраксного канала.
+    Аргументы:
+        - registerDepthToColor - совмещение карты глубины с цветным изображением
+        (необходимо, чтобы использовать глубину в координатах цветного кадра)
 */
-    openni::Status init()
+    openni::Status init(bool registerDepthToColor = false)
     {
         openni::Status rc = openni::STATUS_OK;
 
@@ -150,8 +356,8 @@ public:
             1. Без синхронизации (IMAGE_REGISTRATION_OFF)
             2. С синхронизацией цветного канала и канала глубины (IMAGE_REGISTRATION_DEPTH_TO_COLOR)
         */
-//        openni::ImageRegistrationMode regMode = openni::IMAGE_REGISTRATION_DEPTH_TO_COLOR;
-        openni::ImageRegistrationMode regMode = openni::IMAGE_REGISTRATION_OFF;
+        openni::ImageRegistrationMode regMode = registerDepthToColor ?
+                    openni::IMAGE_REGISTRATION_DEPTH_TO_COLOR : openni::IMAGE_REGISTRATION_OFF;
         if (m_device.isImageRegistrationModeSupported(regMode)){
             if (m_device.getImageRegistrationMode() != regMode){
                 rc = m_device.setImageRegistrationMode(regMode);
@@ -182,6 +388,13 @@ public:
             m_colorStream.destroy();
             return openni::STATUS_ERROR;
         }
+        // Кадры принимаются обработчиком, чтобы часы калибровались по времени прихода кадра,
+        // а не по времени его чтения
+        m_colorListener = m_colorStream.addNewFrameListener(&m_colorMailbox) == openni::STATUS_OK;
+        if (!m_colorListener){
+            std::cout << "Can't add color frame listener, frame latency is measured from read time: "
+                      << openni::OpenNI::getExtendedError() << std::endl;
+        }
 
         rc = m_irStream.start();
         if (rc != openni::STATUS_OK)
@@ -251,12 +464,29 @@ public:
         }
         return openni::STATUS_OK;
     }
+    /*
+        Копирование 16-битного кадра канала в матрицу CV_16UC1 его размера
+        (строки кадра могут быть выровнены, шаг - getStrideInBytes)
+    */
+    static void copyRawFrame(const openni::VideoFrameRef& source, cv::Mat& frame)
+    {
+        int width = source.getWidth(), height = source.getHeight();
+        if (frame.cols != width || frame.rows != height || frame.type() != CV_16UC1){
+            frame.create(height, width, CV_16UC1);
+        }
+        const uint8_t* data = (const uint8_t*)source.getData();
+        for (int y = 0; y < height; y++){
+            memcpy(frame.ptr(y), data + y * source.getStrideInBytes(), width * sizeof(uint16_t));
+        }
+    }
     /*
         Функция для получения кадра цветоного канала
         Аргументы:
             - frame - Матрица для записи полученного с устройства кадра
+        Возвращает false, если кадр не получен (кадр не пришел за timeoutMs или
+        ошибка чтения); frame и colorTimestamp() при этом не изменяются.
     */
-    void getColorFrame(cv::Mat& frame)
+    bool getColorFrame(cv::Mat& frame, int timeoutMs = 1000)
     {
         if(frame.cols != m_width || frame.rows != m_height) {
             frame.create(m_height, m_width, CV_8UC3);
@@ -266,10 +496,22 @@ public:
 
         openni::VideoFrameRef colorFrame;
 
-        m_colorStream.readFrame(&colorFrame);
+        if (m_colorListener){
+            if (!m_colorMailbox.take(colorFrame, timeoutMs)){
+                return false;
+            }
+        }
+        else{
+            if (m_colorStream.readFrame(&colorFrame) != openni::STATUS_OK){
+                return false;
+            }
+            m_colorClock.observe(colorFrame.getTimestamp());
+        }
+        m_colorTimestamp = colorFrame.getTimestamp();
         openni::RGB888Pixel* dData = (openni::RGB888Pixel*)colorFrame.getData();
         memcpy(frame.data, dData, colorFrame.getStrideInBytes() * colorFrame.getHeight());
         cvtColor(frame, frame, cv::COLOR_RGB2BGR);
+        return true;
     }
     /*
         Функция для получения кадра канала глубины
@@ -291,38 +533,208 @@ public:
         openni::DepthPixel* dData = (openni::DepthPixel*)depthFrame.getData();
         memcpy(localFrame.data, dData, depthFrame.getStrideInBytes() * depthFrame.getHeight());
 
+        colorizeDepth(localFrame, frame);
+    }
+    /*
+        Функция раскраски карты глубины для отображения
+        Аргументы:
+            - depth - карта глубины (16 бит, мм)
+            - frame - Матрица для записи раскрашенного кадра (CV_8UC3)
+    */
+    void colorizeDepth(const cv::Mat& depth, cv::Mat& frame)
+    {
+        frame.create(depth.rows, depth.cols, CV_8UC3);
         float maxVal = floor(4000.0);
         cv::Vec3b color1 = cv::Vec3b(255, 0, 0);    // Цвет для наиболее удаленных объектов
         cv::Vec3b color2 = cv::Vec3b(0, 0, 255);    // Цвет для наиболее близких объектов
-        for( int y = 0; y < frame.rows; y++ ) {
-            for( int x = 0; x < frame.cols; x++ ) {
-                uint16_t dist = (uint16_t)localFrame.at<uint16_t>(y,x);
-                if (dist == 0){
-                    frame.at<cv::Vec3b>(y, x) = cv::Vec3b(0, 0, 0);
+        // Строки раскрашиваются параллельно блоками по 32 строки
+        defaultScheduler().parallelFor(cv::Range(0, frame.rows), [&](const cv::Range& range){
+            for( int y = range.start; y < range.end; y++ ) {
+                const uint16_t* d = depth.ptr<uint16_t>(y);
+                cv::Vec3b* out = frame.ptr<cv::Vec3b>(y);
+                for( int x = 0; x < frame.cols; x++ ) {
+                    uint16_t dist = d[x];
+                    if (dist == 0){
+                        out[x] = cv::Vec3b(0, 0, 0);
+                    }
+                    else{
+                        float progress = dist / maxVal;
+                        out[x] = interpolation(color1, color2, progress);
+                    }
                 }
-                else{
-                    float progress = dist / maxVal;
-                    frame.at<cv::Vec3b>(y, x) = interpolation(color1, color2, progress);
+            }
+        }, 32);
+    }
+    /*
+        Функция для получения карты глубины без раскраски
+        Аргументы:
+            - frame - Матрица для записи полученного с устройства кадра (CV_16UC1, мм),
+            размер - разрешение канала глубины
+        Возвращает false, если кадр не получен (ошибка чтения); frame при этом не изменяется.
+    */
+    bool getRawDepthFrame(cv::Mat& frame)
+    {
+        openni::VideoFrameRef depthFrame;
+        if (m_depthStream.readFrame(&depthFrame) != openni::STATUS_OK || !depthFrame.isValid()){
+            return false;
+        }
+        copyRawFrame(depthFrame, frame);
+        return true;
+    }
+    /*
+        Функция для получения внутренних параметров цветной камеры.
+        Параметры читаются из калибровки устройства, при ее отсутствии
+        вычисляются по углам обзора.
+    */
+    CameraIntrinsics getColorIntrinsics()
+    {
+        CameraIntrinsics K;
+        AXonLinkCamParam camParam;
+        int size = sizeof(camParam);
+        if (m_device.getProperty(AXONLINK_DEVICE_PROPERTY_GET_CAMERA_PARAMETERS, &camParam, &size) == openni::STATUS_OK){
+            for (int i = 0; i < AXON_LINK_SUPPORTED_PARAMETERS; i++){
+                const CamIntrinsicParam& p = camParam.astColorParam[i];
+                if (p.ResolutionX == m_width && p.ResolutionY == m_height){
+                    K.fx = p.fx;
+                    K.fy = p.fy;
+                    K.cx = p.cx;
+                    K.cy = p.cy;
+                    return K;
                 }
             }
         }
+        float hfov = m_colorStream.getHorizontalFieldOfView();
+        float vfov = m_colorStream.getVerticalFieldOfView();
+        K.fx = m_width / (2.f * tan(hfov / 2.f));
+        K.fy = m_height / (2.f * tan(vfov / 2.f));
+        K.cx = m_width / 2.f;
+        K.cy = m_height / 2.f;
+        return K;
     }
+    /*
+        Функция для получения геометрии сенсора глубины относительно цветной камеры
+        из калибровки устройства. Возвращает false, если калибровка недоступна
+        или в ней нет параметров для текущего разрешения.
+        Аргументы:
+            - geometry - структура для записи параметров
+    */
+    bool getDepthSensorGeometry(DepthSensorGeometry& geometry)
+    {
+        AXonLinkCamParam camParam;
+        int size = sizeof(camParam);
+        if (m_device.getProperty(AXONLINK_DEVICE_PROPERTY_GET_CAMERA_PARAMETERS, &camParam, &size) != openni::STATUS_OK){
+            return false;
+        }
+        for (int i = 0; i < AXON_LINK_SUPPORTED_PARAMETERS; i++){
+            const CamIntrinsicParam& p = camParam.astDepthParam[i];
+            if (p.ResolutionX == m_width && p.ResolutionY == m_height){
+                geometry.depthK.fx = p.fx;
+                geometry.depthK.fy = p.fy;
+                geometry.depthK.cx = p.cx;
+                geometry.depthK.cy = p.cy;
+                geometry.R = cv::Matx33f(camParam.stExtParam.R_Param);
+                geometry.T = cv::Vec3f(camParam.stExtParam.T_Param[0], camParam.stExtParam.T_Param[1],
+                                       camParam.stExtParam.T_Param[2]);
+                return true;
+            }
+        }
+        return false;
+    }
+    /*
+        Карта глубины совмещена с цветным кадром (IMAGE_REGISTRATION_DEPTH_TO_COLOR).
+        ИК кадр при этом остается в координатах сенсора глубины.
+    */
+    bool isDepthRegistered()
+    {
+        return m_device.getImageRegistrationMode() == openni::IMAGE_REGISTRATION_DEPTH_TO_COLOR;
+    }
+    /*
+        Функция для получения порога движения канала глубины
+        (AXONLINK_STREAM_PROPERTY_MOTIONTHRESHOLD)
+        Аргументы:
+            - threshold - структура для записи порога
+    */
+    bool getMotionThreshold(AXonMotionThreshold& threshold)
+    {
+        int size = sizeof(threshold);
+        return m_depthStream.getProperty(AXONLINK_STREAM_PROPERTY_MOTIONTHRESHOLD, &threshold, &size) == openni::STATUS_OK;
+    }
+    /*
+        Функция для установки порога движения канала глубины
+        Аргументы:
+            - thresHold - изменение глубины пикселя
+            - count - число изменившихся пикселей
+    */
+    bool setMotionThreshold(uint16_t thresHold, uint32_t count)
+    {
+        AXonMotionThreshold threshold;
+        threshold.thresHold = thresHold;
+        threshold.count = count;
+        threshold.remain = 0;
+        return m_depthStream.setProperty(AXONLINK_STREAM_PROPERTY_MOTIONTHRESHOLD, threshold) == openni::STATUS_OK;
+    }
+    cv::Size getFrameSize() const { return cv::Size(m_width, m_height); }
+
+    /*
+        Режим почтового ящика для цветного потока (вызывается после init):
+        getColorFrame возвращает самый свежий кадр, а не следующий кадр из очереди
+        драйвера; не забранные вовремя кадры заменяются более новыми.
+        Аргументы:
+            - enable - включение или отключение режима
+    */
+    openni::Status setColorMailbox(bool enable)
+    {
+        if (enable == m_mailbox){
+            return openni::STATUS_OK;
+        }
+        if (!m_colorListener){
+            std::cout << "Color frame listener is not available" << std::endl;
+            return openni::STATUS_ERROR;
+        }
+        m_colorMailbox.setCapacity(enable ? 1 : m_colorQueueDepth);
+        m_mailbox = enable;
+        return openni::STATUS_OK;
+    }
+    bool colorMailbox() const { return m_mailbox; }
+    FrameMailbox& colorFrameMailbox() { return m_colorMailbox; }
+
+    // Метка времени последнего кадра, полученного getColorFrame (мкс, часы камеры)
+    uint64_t colorTimestamp() const { return m_colorTimestamp; }
+
+    /*
+        Время от съемки цветного кадра с меткой времени timestamp до текущего момента (мс)
+    */
+    double colorLatencyMs(uint64_t timestamp) const { return m_colorClock.latencyMs(timestamp); }
     /*
         Функция для получения кадра инфракрасного канала
         Аргументы:
             - frame - Матрица для записи полученного с устройства кадра
+            (CV_8UC1, яркость растянута на весь диапазон для отображения)
     */
     void getIrFrame(cv::Mat& frame){
-        if(frame.cols != m_width || frame.rows != m_height) {
-            frame.create(m_height, m_width, CV_8UC1);
+        cv::Mat rawFrame;
+        if (!getRawIrFrame(rawFrame)){
+            frame.release();
+            return;
         }
-        openni::VideoMode vm = m_depthStream.getVideoMode();
-
+        // Кадр канала 16-битный: копирование в 8-битную матрицу без преобразования
+        // выходило за границы ее буфера
+        cv::normalize(rawFrame, frame, 0, 255, cv::NORM_MINMAX, CV_8UC1);
+    }
+    /*
+        Функция для получения кадра инфракрасного канала без преобразования
+        Аргументы:
+            - frame - Матрица для записи полученного с устройства кадра (CV_16UC1),
+            размер - разрешение ИК канала
+        Возвращает false, если кадр не получен (ошибка чтения); frame при этом не изменяется.
+    */
+    bool getRawIrFrame(cv::Mat& frame){
         openni::VideoFrameRef irFrame;
-
-        m_irStream.readFrame(&irFrame);
-        openni::Grayscale16Pixel* dData = (openni::Grayscale16Pixel*)irFrame.getData();
-        memcpy(frame.data, dData, irFrame.getStrideInBytes() * irFrame.getHeight());
+        if (m_irStream.readFrame(&irFrame) != openni::STATUS_OK || !irFrame.isValid()){
+            return false;
+        }
+        copyRawFrame(irFrame, frame);
+        return true;
     }
     /*
         Метод, для получения информации о цветном канале
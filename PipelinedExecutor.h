@@ -0,0 +1,387 @@
+#ifndef PIPELINEDEXECUTOR_H
+#define PIPELINEDEXECUTOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+    Ограниченная очередь без блокировок для одного производителя и одного потребителя.
+    Емкость округляется до степени двойки; индексы записи и чтения разделены
+    заполнением, чтобы потоки не делили строку кэша.
+*/
+template<class T>
+class SpscQueue
+{
+private:
+    std::vector<T> m_buffer;
+    size_t m_mask;
+    char m_pad0[64];
+    std::atomic<size_t> m_head;
+    char m_pad1[64];
+    std::atomic<size_t> m_tail;
+    char m_pad2[64];
+
+public:
+    SpscQueue(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < std::max<size_t>(capacity, 1)){
+            size <<= 1;
+        }
+        m_buffer.resize(size);
+        m_mask = size - 1;
+        m_head.store(0);
+        m_tail.store(0);
+    };
+    ~SpscQueue(){};
+
+    // Вызывается только производителем
+    bool push(const T& value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > m_mask){
+            return false;
+        }
+        m_buffer[tail & m_mask] = value;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Вызывается только потребителем
+    bool pop(T& value)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)){
+            return false;
+        }
+        value = m_buffer[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Приблизительное число элементов (точное только в потоке производителя или потребителя)
+    size_t size() const { return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire); }
+    size_t capacity() const { return m_mask + 1; }
+};
+
+/*
+    Поведение ребра конвейера при переполнении очереди
+*/
+enum DropPolicy
+{
+    // Производитель ждет освобождения места (кадры не теряются)
+    DROP_BLOCK = 0,
+    // Новый кадр отбрасывается
+    DROP_NEWEST,
+    // Вход этапа - ячейка на один кадр: новый кадр заменяет необработанный,
+    // этап всегда получает самый свежий кадр (глубина очереди не используется)
+    KEEP_LATEST
+};
+
+/*
+    Многоэтапный конвейер обработки кадров (например, захват -> детекция ->
+    ключевые точки -> отрисовка). Каждый этап работает в своем потоке и
+    обрабатывает кадры по порядку, поэтому этапы с состоянием (трекеры) корректны.
+    Соседние этапы соединены очередями SpscQueue с индексами слотов пула (этап
+    KEEP_LATEST - атомарной ячейкой на один слот): данные кадра (Slot) выделяются
+    один раз и переходят между этапами без копирования.
+    Пропускная способность определяется самым медленным этапом, а не суммой задержек.
+    Для каждого ребра задаются глубина очереди и поведение при переполнении,
+    заполненность очередей, потери кадров и задержки этапов выводятся в report().
+*/
+template<class Slot>
+class PipelinedExecutor
+{
+public:
+    // Этап: обработка слота. false, возвращенный источником, завершает конвейер
+    // после обработки кадров в очередях; false другого этапа останавливает его сразу
+    typedef std::function<bool(Slot&)> StageFunction;
+
+private:
+    struct Stage
+    {
+        std::string name;
+        StageFunction function;
+        // Входная очередь этапа (для источника отсутствует)
+        std::unique_ptr<SpscQueue<int>> input;
+        // Вход этапа KEEP_LATEST: слот последнего кадра или -1
+        std::atomic<int> mailbox;
+        DropPolicy policy;
+        std::thread thread;
+        // Статистика: кадры, время обработки, заполненность входной очереди, потери на входе
+        long long frames = 0;
+        double busyMs = 0;
+        double occupancySum = 0;
+        size_t occupancyMax = 0;
+        std::atomic<long long> dropped;
+        // Этап завершил работу (следующий этап дорабатывает свою очередь и тоже завершается)
+        std::atomic<bool> finished;
+    };
+
+    std::vector<Slot> m_slots;
+    std::unique_ptr<std::atomic<bool>[]> m_used;
+    std::vector<std::unique_ptr<Stage>> m_stages;
+    std::atomic<bool> m_running;
+    std::chrono::steady_clock::time_point m_start;
+    double m_elapsedMs = 0;
+
+    /*
+        Ожидание с нарастающей паузой: сначала уступка процессора, затем сон
+    */
+    static void backoff(int& spins)
+    {
+        if (++spins < 64){
+            std::this_thread::yield();
+        }
+        else{
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    int acquire()
+    {
+        int spins = 0;
+        while (m_running.load(std::memory_order_acquire)){
+            for (size_t i = 0; i < m_slots.size(); i++){
+                bool expected = false;
+                if (m_used[i].compare_exchange_strong(expected, true, std::memory_order_acq_rel)){
+                    return int(i);
+                }
+            }
+            backoff(spins);
+        }
+        return -1;
+    }
+
+    void release(int slot) { m_used[slot].store(false, std::memory_order_release); }
+
+    /*
+        Передача слота следующему этапу в соответствии с политикой ребра
+    */
+    void forward(Stage& next, int slot)
+    {
+        // Замена необработанного кадра: обмен атомарный, поэтому замененный слот
+        // принадлежит только производителю и освобождается им
+        if (next.policy == KEEP_LATEST){
+            int replaced = next.mailbox.exchange(slot, std::memory_order_acq_rel);
+            if (replaced >= 0){
+                next.dropped++;
+                release(replaced);
+            }
+            return;
+        }
+        if (next.input->push(slot)){
+            return;
+        }
+        if (next.policy == DROP_NEWEST){
+            next.dropped++;
+            release(slot);
+            return;
+        }
+        int spins = 0;
+        while (!next.input->push(slot)){
+            if (!m_running.load(std::memory_order_acquire)){
+                release(slot);
+                return;
+            }
+            backoff(spins);
+        }
+    }
+
+    /*
+        Получение слота из входной очереди этапа, -1 - конвейер остановлен
+        или предыдущий этап завершился и очередь пуста
+    */
+    int receive(Stage& stage, const Stage& previous)
+    {
+        if (stage.policy == KEEP_LATEST){
+            return receiveLatest(stage, previous);
+        }
+        int slot = -1, spins = 0;
+        while (!stage.input->pop(slot)){
+            if (!m_running.load(std::memory_order_acquire)){
+                return -1;
+            }
+            if (previous.finished.load(std::memory_order_acquire)){
+                // Элемент мог быть добавлен перед завершением предыдущего этапа
+                if (!stage.input->pop(slot)){
+                    return -1;
+                }
+                break;
+            }
+            backoff(spins);
+        }
+        size_t occupancy = stage.input->size() + 1;
+        stage.occupancySum += occupancy;
+        stage.occupancyMax = std::max(stage.occupancyMax, occupancy);
+        return slot;
+    }
+
+    /*
+        Получение кадра из ячейки этапа KEEP_LATEST
+    */
+    int receiveLatest(Stage& stage, const Stage& previous)
+    {
+        int spins = 0;
+        for (;;){
+            int slot = stage.mailbox.exchange(-1, std::memory_order_acq_rel);
+            if (slot >= 0){
+                stage.occupancySum += 1;
+                stage.occupancyMax = 1;
+                return slot;
+            }
+            if (!m_running.load(std::memory_order_acquire)){
+                return -1;
+            }
+            if (previous.finished.load(std::memory_order_acquire)){
+                // Кадр мог быть передан перед завершением предыдущего этапа
+                slot = stage.mailbox.exchange(-1, std::memory_order_acq_rel);
+                return slot;
+            }
+            backoff(spins);
+        }
+    }
+
+    void runStage(size_t index)
+    {
+        Stage& stage = *m_stages[index];
+        bool source = index == 0, sink = index + 1 == m_stages.size();
+        while (m_running.load(std::memory_order_acquire)){
+            int slot = source ? acquire() : receive(stage, *m_stages[index - 1]);
+            if (slot < 0){
+                break;
+            }
+            auto start = std::chrono::steady_clock::now();
+            bool ok = stage.function(m_slots[slot]);
+            std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+            stage.busyMs += ms.count();
+            stage.frames++;
+            if (!ok){
+                // Источник завершает конвейер после обработки очередей, другие этапы - сразу
+                release(slot);
+                if (!source){
+                    m_running.store(false, std::memory_order_release);
+                }
+                break;
+            }
+            if (sink){
+                release(slot);
+            }
+            else{
+                forward(*m_stages[index + 1], slot);
+            }
+        }
+        stage.finished.store(true, std::memory_order_release);
+    }
+
+public:
+    /*
+        Аргументы:
+            - poolSize - число слотов (кадров, одновременно находящихся в конвейере)
+    */
+    PipelinedExecutor(int poolSize) : m_slots(std::max(poolSize, 1)), m_used(new std::atomic<bool>[std::max(poolSize, 1)])
+    {
+        for (size_t i = 0; i < m_slots.size(); i++){
+            m_used[i].store(false);
+        }
+        m_running.store(false);
+    };
+    ~PipelinedExecutor()
+    {
+        stop();
+    };
+
+    /*
+        Добавление этапа (первый добавленный этап - источник кадров)
+        Аргументы:
+            - name - имя этапа
+            - function - обработка слота
+            - queueDepth - глубина входной очереди этапа (для KEEP_LATEST вход - один кадр)
+            - policy - поведение входной очереди при переполнении
+    */
+    void addStage(const std::string& name, const StageFunction& function, int queueDepth = 2, DropPolicy policy = DROP_BLOCK)
+    {
+        std::unique_ptr<Stage> stage(new Stage());
+        stage->name = name;
+        stage->function = function;
+        stage->input.reset(new SpscQueue<int>(std::max(queueDepth, 1)));
+        stage->policy = policy;
+        stage->mailbox.store(-1);
+        stage->dropped.store(0);
+        stage->finished.store(false);
+        m_stages.push_back(std::move(stage));
+    }
+
+    // Слоты пула (для начальной настройки до запуска)
+    std::vector<Slot>& slots() { return m_slots; }
+
+    /*
+        Запуск потоков всех этапов
+    */
+    void start()
+    {
+        m_running.store(true);
+        m_start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < m_stages.size(); i++){
+            m_stages[i]->thread = std::thread(&PipelinedExecutor::runStage, this, i);
+        }
+    }
+
+    /*
+        Ожидание остановки конвейера (источник вернул false или вызван stop)
+    */
+    void join()
+    {
+        for (size_t i = 0; i < m_stages.size(); i++){
+            if (m_stages[i]->thread.joinable()){
+                m_stages[i]->thread.join();
+            }
+        }
+        m_running.store(false, std::memory_order_release);
+        if (m_elapsedMs == 0){
+            std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - m_start;
+            m_elapsedMs = ms.count();
+        }
+    }
+
+    void stop()
+    {
+        m_running.store(false, std::memory_order_release);
+        join();
+    }
+
+    bool running() const { return m_running.load(std::memory_order_acquire); }
+
+    /*
+        Вывод задержек этапов, заполненности очередей и потерь кадров
+        (вызывается после остановки конвейера)
+    */
+    void report() const
+    {
+        const Stage& sink = *m_stages.back();
+        double elapsed = m_elapsedMs > 0 ? m_elapsedMs
+                         : std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count();
+        std::cout << "Pipelined executor: " << (elapsed > 0 ? 1000.0 * sink.frames / elapsed : 0.0) << " FPS output" << std::endl;
+        for (size_t i = 0; i < m_stages.size(); i++){
+            const Stage& stage = *m_stages[i];
+            std::cout << "  " << stage.name << ": " << stage.frames << " frames, mean "
+                      << (stage.frames > 0 ? stage.busyMs / stage.frames : 0.0) << " ms";
+            if (i > 0){
+                std::cout << ", queue " << (stage.frames > 0 ? stage.occupancySum / stage.frames : 0.0)
+                          << " mean / " << stage.occupancyMax << " max of "
+                          << (stage.policy == KEEP_LATEST ? size_t(1) : stage.input->capacity())
+                          << ", dropped " << stage.dropped.load();
+            }
+            std::cout << std::endl;
+        }
+    }
+};
+
+#endif // PIPELINEDEXECUTOR_H
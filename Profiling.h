@@ -0,0 +1,71 @@
+#ifndef PROFILING_H
+#define PROFILING_H
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+/*
+    Статистика задержки этапа обработки.
+    Первое измерение хранится отдельно, так как оно включает ленивую
+    инициализацию и "холодные" кэши и не характеризует установившийся режим.
+*/
+class LatencyStats
+{
+private:
+    std::string m_name;
+    int m_count = 0;
+    double m_first = 0;
+    // Сумма и максимум измерений, начиная со второго
+    double m_sum = 0;
+    double m_max = 0;
+    double m_last = 0;
+
+public:
+    LatencyStats(const std::string& name) : m_name(name) {};
+    ~LatencyStats(){};
+
+    /*
+        Добавление измерения (мс)
+    */
+    void add(double ms)
+    {
+        if (m_count == 0){
+            m_first = ms;
+        }
+        else{
+            m_sum += ms;
+            m_max = std::max(m_max, ms);
+        }
+        m_last = ms;
+        m_count++;
+    }
+
+    /*
+        Добавление измерения по моменту начала этапа
+    */
+    void addSince(std::chrono::steady_clock::time_point start)
+    {
+        std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        add(ms.count());
+    }
+
+    int count() const { return m_count; }
+    double first() const { return m_first; }
+    double last() const { return m_last; }
+    double steadyMean() const { return m_count > 1 ? m_sum / (m_count - 1) : 0.0; }
+    double steadyMax() const { return m_max; }
+    const std::string& name() const { return m_name; }
+
+    /*
+        Вывод задержки первого кадра и установившегося режима
+    */
+    void report() const
+    {
+        std::cout << m_name << ": first " << m_first << " ms, steady mean " << steadyMean()
+                  << " ms, steady max " << m_max << " ms (" << m_count << " frames)" << std::endl;
+    }
+};
+
+#endif // PROFILING_H
@@ -0,0 +1,299 @@
+#ifndef QUALITYCONTROLLER_H
+#define QUALITYCONTROLLER_H
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+    Этапы обработки кадра, задержка которых учитывается регулятором
+*/
+enum QualityStage
+{
+    // Ожидание кадра камеры: задается частотой сенсора, в бюджет не входит
+    STAGE_CAPTURE = 0,
+    // Детекция лиц и ключевых точек
+    STAGE_PROCESS,
+    // Чтение глубины, положение головы, проверка живого лица
+    STAGE_DEPTH,
+    // Отрисовка и вывод
+    STAGE_RENDER,
+    STAGE_COUNT
+};
+
+/*
+    Параметры качества обработки, которыми управляет регулятор
+*/
+struct QualitySettings
+{
+    // Масштаб разрешения детекции YuNet
+    float detectScale = 1.f;
+    // Множитель периода полной детекции
+    int detectEveryFactor = 1;
+    // 68 ключевых точек (dlib/LBF), иначе 5 точек YuNet
+    bool fullLandmarks = true;
+    // Обработка глубины (положение головы, проверка живого лица)
+    bool depthStages = true;
+    // Раскраска карты глубины для отображения
+    bool colorizeDepth = true;
+};
+
+/*
+    Параметры детекции, которые поддерживает детектор лиц конвейера
+*/
+struct QualityKnobs
+{
+    // Масштаб разрешения детекции (QualitySettings::detectScale)
+    bool detectScale = false;
+    // Период полной детекции (QualitySettings::detectEveryFactor)
+    bool detectCadence = false;
+};
+
+/*
+    Регулятор качества по времени обработки кадра.
+    Задержки этапов усредняются по окну из m_window кадров. С бюджетом сравнивается
+    время вычислений - сумма этапов без ожидания кадра (STAGE_CAPTURE): если камера
+    задает темп цикла, полное время кадра всегда равно периоду кадров, и по нему
+    нельзя понять, есть ли запас. Если среднее время вычислений превышает бюджет,
+    качество снижается на один шаг: выбирается этап с наибольшей задержкой, у которого
+    есть параметр для снижения, и его первый еще не сниженный параметр; этапы,
+    которые почти не занимают времени (меньше m_minStageMs), не выбираются.
+    Если время вычислений ниже m_restoreRatio бюджета в течение
+    m_restoreWindows окон подряд, восстанавливается последний сниженный параметр.
+    Если после восстановления качество снова приходится снижать, требуемое число
+    окон удваивается, чтобы регулятор не колебался около границы.
+    Каждое решение выводится с причиной.
+*/
+class QualityController
+{
+private:
+    struct Knob
+    {
+        std::string name;
+        QualityStage stage;
+        int level;
+        int maxLevel;
+    };
+
+    double m_budgetMs;
+    int m_window = 15;
+    double m_restoreRatio = 0.7;
+    int m_baseRestoreWindows = 4;
+    int m_restoreWindows = 4;
+    int m_maxRestoreWindows = 64;
+    // Этап быстрее этого (мс) не снижается: снижение ничего не даст
+    double m_minStageMs = 0.1;
+
+    std::vector<Knob> m_knobs;
+    // Порядок снижения параметров (для восстановления в обратном порядке)
+    std::vector<int> m_history;
+    QualitySettings m_settings;
+
+    // Суммы по текущему окну
+    double m_stageSum[STAGE_COUNT];
+    int m_frames = 0;
+    int m_headroomWindows = 0;
+    // Число окон после последнего восстановления
+    int m_sinceRestore = 1000;
+    long long m_totalFrames = 0;
+    int m_decisions = 0;
+
+    static const char* stageName(QualityStage stage)
+    {
+        static const char* names[STAGE_COUNT] = {"capture", "process", "depth", "render"};
+        return names[stage];
+    }
+
+    /*
+        Перевод уровней параметров в настройки
+    */
+    void applyLevels()
+    {
+        static const float scales[] = {1.f, 0.75f, 0.5f};
+        static const int factors[] = {1, 2, 4};
+        m_settings.detectScale = scales[m_knobs[0].level];
+        m_settings.detectEveryFactor = factors[m_knobs[1].level];
+        m_settings.fullLandmarks = m_knobs[2].level == 0;
+        m_settings.depthStages = m_knobs[3].level == 0;
+        m_settings.colorizeDepth = m_knobs[4].level == 0;
+    }
+
+    std::string knobValue(int k) const
+    {
+        switch (k){
+        case 0: return std::to_string(m_settings.detectScale).substr(0, 4);
+        case 1: return "x" + std::to_string(m_settings.detectEveryFactor);
+        case 2: return m_settings.fullLandmarks ? "68 points" : "5 points";
+        default: return m_knobs[k].level == 0 ? "on" : "off";
+        }
+    }
+
+    void log(const std::string& reason, int k)
+    {
+        m_decisions++;
+        std::cout << "Quality [frame " << m_totalFrames << "]: " << reason << " -> " << m_knobs[k].name
+                  << " " << knobValue(k) << std::endl;
+    }
+
+    bool degrade(double frameMs, const double* stageMs)
+    {
+        // Этап с наибольшей задержкой, у которого есть параметр для снижения
+        int bestKnob = -1;
+        double bestMs = -1.0;
+        for (int s = 0; s < STAGE_COUNT; s++){
+            for (size_t k = 0; k < m_knobs.size(); k++){
+                if (m_knobs[k].stage == s && m_knobs[k].level < m_knobs[k].maxLevel){
+                    if (stageMs[s] >= m_minStageMs && stageMs[s] > bestMs){
+                        bestMs = stageMs[s];
+                        bestKnob = int(k);
+                    }
+                    break;
+                }
+            }
+        }
+        if (bestKnob < 0){
+            return false;
+        }
+        m_knobs[bestKnob].level++;
+        m_history.push_back(bestKnob);
+        applyLevels();
+        log("compute " + std::to_string(int(frameMs)) + " ms > budget " + std::to_string(int(m_budgetMs)) + " ms, " +
+            stageName(m_knobs[bestKnob].stage) + " " + std::to_string(int(bestMs)) + " ms", bestKnob);
+        // Снижение сразу после восстановления: восстановление было преждевременным
+        if (m_sinceRestore <= 2){
+            m_restoreWindows = std::min(2 * m_restoreWindows, m_maxRestoreWindows);
+        }
+        return true;
+    }
+
+    bool restore(double frameMs)
+    {
+        if (m_history.empty()){
+            return false;
+        }
+        int k = m_history.back();
+        m_history.pop_back();
+        m_knobs[k].level--;
+        applyLevels();
+        log("compute " + std::to_string(int(frameMs)) + " ms < " + std::to_string(int(100 * m_restoreRatio)) +
+            "% of budget " + std::to_string(int(m_budgetMs)) + " ms for " + std::to_string(m_restoreWindows) + " windows", k);
+        m_sinceRestore = 0;
+        return true;
+    }
+
+public:
+    /*
+        Аргументы:
+            - budgetMs - бюджет времени на кадр (мс), например 1000 / целевой FPS
+    */
+    QualityController(double budgetMs) : m_budgetMs(budgetMs)
+    {
+        Knob knobs[] = {{"detect scale", STAGE_PROCESS, 0, 2},
+                        {"detect cadence", STAGE_PROCESS, 0, 2},
+                        {"landmarks", STAGE_PROCESS, 0, 1},
+                        {"depth stages", STAGE_DEPTH, 0, 1},
+                        {"depth colorization", STAGE_RENDER, 0, 1}};
+        m_knobs.assign(knobs, knobs + 5);
+        std::fill(m_stageSum, m_stageSum + STAGE_COUNT, 0.0);
+        applyLevels();
+    };
+    ~QualityController(){};
+
+    /*
+        Добавление задержки этапа текущего кадра (мс)
+    */
+    void addStage(QualityStage stage, double ms) { m_stageSum[stage] += ms; }
+
+    /*
+        Завершение кадра: время вычислений кадра - сумма добавленных задержек
+        этапов, кроме STAGE_CAPTURE.
+        Возвращает true, если настройки изменились.
+    */
+    bool endFrame()
+    {
+        m_totalFrames++;
+        if (++m_frames < m_window){
+            return false;
+        }
+        double frameMean = 0.0;
+        double stageMean[STAGE_COUNT];
+        for (int s = 0; s < STAGE_COUNT; s++){
+            stageMean[s] = m_stageSum[s] / m_frames;
+            m_stageSum[s] = 0.0;
+            if (s != STAGE_CAPTURE){
+                frameMean += stageMean[s];
+            }
+        }
+        m_frames = 0;
+        m_sinceRestore++;
+
+        bool changed = false;
+        if (frameMean > m_budgetMs){
+            m_headroomWindows = 0;
+            changed = degrade(frameMean, stageMean);
+        }
+        else if (frameMean < m_restoreRatio * m_budgetMs){
+            if (++m_headroomWindows >= m_restoreWindows){
+                m_headroomWindows = 0;
+                changed = restore(frameMean);
+            }
+        }
+        else{
+            m_headroomWindows = 0;
+        }
+        // Долгая устойчивая работа сбрасывает осторожность восстановления
+        if (m_sinceRestore > 8 * m_maxRestoreWindows){
+            m_restoreWindows = m_baseRestoreWindows;
+        }
+        return changed;
+    }
+
+    /*
+        Параметры, которые можно снижать в текущей конфигурации
+        Аргументы:
+            - landmarks - есть конвейер с 5 ключевыми точками для замены
+            - depthStages - глубина обрабатывается
+            - colorization - карта глубины отображается
+    */
+    void setAvailable(bool landmarks, bool depthStages, bool colorization)
+    {
+        m_knobs[2].maxLevel = landmarks ? 1 : 0;
+        m_knobs[3].maxLevel = depthStages ? 1 : 0;
+        m_knobs[4].maxLevel = colorization ? 1 : 0;
+    }
+
+    /*
+        Параметры детекции, которые можно снижать: параметр, не поддерживаемый
+        детектором лиц, не снижается, чтобы шаг регулятора не пропадал впустую
+    */
+    void setDetectKnobs(const QualityKnobs& knobs)
+    {
+        m_knobs[0].maxLevel = knobs.detectScale ? 2 : 0;
+        m_knobs[1].maxLevel = knobs.detectCadence ? 2 : 0;
+    }
+
+    const QualitySettings& settings() const { return m_settings; }
+    double budget() const { return m_budgetMs; }
+
+    /*
+        Аргументы:
+            - window - размер окна усреднения (кадров)
+            - restoreRatio - доля бюджета, ниже которой качество восстанавливается
+            - restoreWindows - число окон с запасом времени до восстановления
+    */
+    void setWindow(int window, double restoreRatio, int restoreWindows)
+    {
+        m_window = std::max(window, 1);
+        m_restoreRatio = restoreRatio;
+        m_baseRestoreWindows = m_restoreWindows = std::max(restoreWindows, 1);
+    }
+
+    void report() const
+    {
+        std::cout << "Quality: budget " << m_budgetMs << " ms, " << m_decisions << " decisions, "
+                  << m_history.size() << " knobs degraded" << std::endl;
+    }
+};
+
+#endif // QUALITYCONTROLLER_H
@@ -0,0 +1,492 @@
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <opencv2/core.hpp>
+
+// Бэкенд parallel_for_ можно заменить начиная с OpenCV 4.5.2
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 || (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 2)))
+#define TASKSCHEDULER_OPENCV_BACKEND 1
+#include <opencv2/core/parallel/parallel_backend.hpp>
+#endif
+
+/*
+    Планировщик задач с перехватом работы (work stealing), общий для всех
+    параллельных циклов программы: ключевые точки лиц, фрагменты кадра,
+    строки карты глубины и циклы OpenCV (routeOpenCV).
+    У каждого рабочего потока своя очередь задач. Поток берет задачи с конца
+    своей очереди, а свободные потоки забирают задачи с начала чужих очередей.
+    parallelFor делит диапазон пополам до размера grain: правая половина
+    помещается в очередь, где ее может забрать другой поток, левая выполняется сразу.
+    Поток, ожидающий завершения цикла, сам выполняет задачи, поэтому вложенные
+    циклы не блокируют рабочие потоки. Задачи потоков вне планировщика
+    (главный поток, этапы PipelinedExecutor) помещаются в общую очередь.
+    numThreads - общее число потоков, выполняющих циклы, включая вызывающий поток.
+*/
+class TaskScheduler
+{
+private:
+    // Завершение цикла parallelFor: число невыполненных частей и первое исключение
+    struct Join
+    {
+        std::atomic<int> pending;
+        std::atomic<bool> failed;
+        std::exception_ptr error;
+    };
+
+    struct Task
+    {
+        void (*invoke)(const void* body, int begin, int end);
+        const void* body;
+        int begin;
+        int end;
+        int grain;
+        Join* join;
+    };
+
+    /*
+        Кольцевой буфер задач. Память выделяется только при росте очереди сверх
+        прежнего максимума, поэтому в установившемся режиме parallelFor не выделяет
+        память (std::deque выделяет и освобождает блоки по мере движения очереди).
+    */
+    class TaskRing
+    {
+    private:
+        std::vector<Task> m_tasks;
+        size_t m_head = 0;
+        size_t m_size = 0;
+
+        void grow()
+        {
+            std::vector<Task> tasks(2 * m_tasks.size());
+            for (size_t i = 0; i < m_size; i++){
+                tasks[i] = m_tasks[(m_head + i) % m_tasks.size()];
+            }
+            m_tasks.swap(tasks);
+            m_head = 0;
+        }
+
+    public:
+        TaskRing() : m_tasks(64){};
+        ~TaskRing(){};
+
+        bool empty() const { return m_size == 0; }
+
+        void push_back(const Task& task)
+        {
+            if (m_size == m_tasks.size()){
+                grow();
+            }
+            m_tasks[(m_head + m_size) % m_tasks.size()] = task;
+            m_size++;
+        }
+
+        Task pop_back()
+        {
+            m_size--;
+            return m_tasks[(m_head + m_size) % m_tasks.size()];
+        }
+
+        Task pop_front()
+        {
+            Task task = m_tasks[m_head];
+            m_head = (m_head + 1) % m_tasks.size();
+            m_size--;
+            return task;
+        }
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        TaskRing tasks;
+        std::thread thread;
+    };
+
+    struct Context
+    {
+        TaskScheduler* scheduler;
+        int index;
+        unsigned seed;
+    };
+
+    int m_numThreads;
+    std::vector<int> m_cpus;
+    std::vector<std::unique_ptr<Queue>> m_workers;
+    // Очередь задач потоков вне планировщика
+    Queue m_shared;
+
+    std::atomic<bool> m_running;
+    std::atomic<int> m_queued;
+    std::atomic<int> m_sleeping;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wake;
+
+    // Статистика
+    std::atomic<long long> m_executed;
+    std::atomic<long long> m_stolen;
+
+    static Context& context()
+    {
+        static thread_local Context ctx = {nullptr, -1, 0};
+        return ctx;
+    }
+
+    template<class Body>
+    static void invokeRange(const void* body, int begin, int end)
+    {
+        (*static_cast<const Body*>(body))(cv::Range(begin, end));
+    }
+
+    static void pinThread(std::thread& thread, int cpu)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) != 0){
+            std::cout << "Task scheduler: cannot pin thread to CPU " << cpu << std::endl;
+        }
+#endif
+    }
+
+    void push(const Task& task)
+    {
+        Context& ctx = context();
+        Queue& queue = ctx.scheduler == this && ctx.index >= 0 ? *m_workers[ctx.index] : m_shared;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(task);
+        }
+        m_queued.fetch_add(1);
+        if (m_sleeping.load() > 0){
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_wake.notify_one();
+        }
+    }
+
+    bool popBack(Queue& queue, Task& task)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()){
+            return false;
+        }
+        task = queue.tasks.pop_back();
+        m_queued.fetch_sub(1);
+        return true;
+    }
+
+    bool popFront(Queue& queue, Task& task)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()){
+            return false;
+        }
+        task = queue.tasks.pop_front();
+        m_queued.fetch_sub(1);
+        return true;
+    }
+
+    /*
+        Поиск задачи: своя очередь, общая очередь, очереди других потоков
+        (начиная со случайной)
+    */
+    bool take(Task& task)
+    {
+        if (m_queued.load(std::memory_order_relaxed) <= 0){
+            return false;
+        }
+        Context& ctx = context();
+        bool own = ctx.scheduler == this && ctx.index >= 0;
+        if (own && popBack(*m_workers[ctx.index], task)){
+            return true;
+        }
+        if (popFront(m_shared, task)){
+            return true;
+        }
+        size_t n = m_workers.size();
+        if (n == 0){
+            return false;
+        }
+        ctx.seed = ctx.seed * 1103515245u + 12345u;
+        size_t first = (ctx.seed >> 16) % n;
+        for (size_t k = 0; k < n; k++){
+            size_t victim = (first + k) % n;
+            if (own && int(victim) == ctx.index){
+                continue;
+            }
+            if (popFront(*m_workers[victim], task)){
+                m_stolen++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+        Выполнение части цикла с делением на половины до размера grain
+    */
+    void execute(Task task)
+    {
+        while (task.end - task.begin > task.grain){
+            int mid = task.begin + (task.end - task.begin) / 2;
+            Task right = task;
+            right.begin = mid;
+            task.join->pending.fetch_add(1);
+            push(right);
+            task.end = mid;
+        }
+        if (!task.join->failed.load(std::memory_order_relaxed)){
+            try{
+                task.invoke(task.body, task.begin, task.end);
+            }
+            catch (...){
+                if (!task.join->failed.exchange(true)){
+                    task.join->error = std::current_exception();
+                }
+            }
+        }
+        m_executed++;
+        task.join->pending.fetch_sub(1, std::memory_order_release);
+    }
+
+    /*
+        Ожидание завершения цикла с выполнением доступных задач
+    */
+    void wait(Join& join)
+    {
+        int spins = 0;
+        while (join.pending.load(std::memory_order_acquire) > 0){
+            Task task;
+            if (take(task)){
+                execute(task);
+                spins = 0;
+            }
+            else if (++spins < 64){
+                std::this_thread::yield();
+            }
+            else{
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+    }
+
+    void runWorker(int index)
+    {
+        Context& ctx = context();
+        ctx.scheduler = this;
+        ctx.index = index;
+        ctx.seed = unsigned(index) * 2654435761u + 1u;
+        int spins = 0;
+        while (m_running.load(std::memory_order_acquire)){
+            Task task;
+            if (take(task)){
+                execute(task);
+                spins = 0;
+                continue;
+            }
+            if (++spins < 64){
+                std::this_thread::yield();
+                continue;
+            }
+            // Сон до появления задач
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_sleeping.fetch_add(1);
+            m_wake.wait(lock, [this]{ return m_queued.load() > 0 || !m_running.load(); });
+            m_sleeping.fetch_sub(1);
+            spins = 0;
+        }
+    }
+
+    void startWorkers()
+    {
+        m_running.store(true);
+        for (int i = 0; i + 1 < m_numThreads; i++){
+            m_workers.push_back(std::unique_ptr<Queue>(new Queue()));
+        }
+        for (size_t i = 0; i < m_workers.size(); i++){
+            m_workers[i]->thread = std::thread(&TaskScheduler::runWorker, this, int(i));
+            if (!m_cpus.empty()){
+                // Вызывающий поток не закрепляется, рабочие потоки занимают следующие ядра списка
+                pinThread(m_workers[i]->thread, m_cpus[(i + 1) % m_cpus.size()]);
+            }
+        }
+    }
+
+    void stopWorkers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_running.store(false);
+            m_wake.notify_all();
+        }
+        for (size_t i = 0; i < m_workers.size(); i++){
+            m_workers[i]->thread.join();
+        }
+        m_workers.clear();
+    }
+
+public:
+    /*
+        Аргументы:
+            - numThreads - число потоков, включая вызывающий (0 - по числу ядер)
+    */
+    TaskScheduler(int numThreads = 0)
+    {
+        m_queued.store(0);
+        m_sleeping.store(0);
+        m_executed.store(0);
+        m_stolen.store(0);
+        m_numThreads = numThreads > 0 ? numThreads : std::max(int(std::thread::hardware_concurrency()), 1);
+        startWorkers();
+    };
+    ~TaskScheduler()
+    {
+        stopWorkers();
+    };
+
+    /*
+        Параллельный цикл по диапазону range с ожиданием завершения.
+        body(const cv::Range&) вызывается для частей диапазона длиной не более grain
+        (совместимо с телом cv::parallel_for_). Исключение из body передается вызывающему.
+    */
+    template<class Body>
+    void parallelFor(const cv::Range& range, const Body& body, int grain = 1)
+    {
+        if (range.end <= range.start){
+            return;
+        }
+        grain = std::max(grain, 1);
+        if (m_workers.empty() || range.end - range.start <= grain){
+            body(range);
+            return;
+        }
+        Join join;
+        join.pending.store(1);
+        join.failed.store(false);
+        Task task = {&invokeRange<Body>, &body, range.start, range.end, grain, &join};
+        execute(task);
+        wait(join);
+        if (join.error){
+            std::rethrow_exception(join.error);
+        }
+    }
+
+    /*
+        Изменение числа потоков (вызывается, когда циклы не выполняются)
+    */
+    void setNumThreads(int numThreads)
+    {
+        stopWorkers();
+        m_numThreads = numThreads > 0 ? numThreads : std::max(int(std::thread::hardware_concurrency()), 1);
+        startWorkers();
+    }
+    int numThreads() const { return m_numThreads; }
+
+    /*
+        Закрепление рабочих потоков за ядрами (только Linux, вызывается, когда циклы не выполняются)
+        Аргументы:
+            - cpus - номера ядер; поток i закрепляется за cpus[i % cpus.size()],
+            первое ядро оставляется вызывающему потоку; пустой список снимает закрепление
+    */
+    void setAffinity(const std::vector<int>& cpus)
+    {
+        stopWorkers();
+        m_cpus = cpus;
+        startWorkers();
+    }
+
+    // Номер текущего потока: 0 - вызывающий поток, 1 .. numThreads - 1 - рабочие потоки
+    int threadIndex() const
+    {
+        const Context& ctx = context();
+        return ctx.scheduler == this ? ctx.index + 1 : 0;
+    }
+
+    void report() const
+    {
+        long long executed = m_executed.load();
+        std::cout << "Task scheduler: " << m_numThreads << " threads, " << executed << " tasks, "
+                  << (executed > 0 ? 100.0 * m_stolen.load() / executed : 0.0) << "% stolen" << std::endl;
+    }
+};
+
+/*
+    Планировщик, общий для всех модулей
+*/
+TaskScheduler& defaultScheduler()
+{
+    static TaskScheduler scheduler;
+    return scheduler;
+}
+
+#ifdef TASKSCHEDULER_OPENCV_BACKEND
+/*
+    Бэкенд cv::parallel_for_ на планировщике задач. OpenCV сам делит цикл на части;
+    cv::setNumThreads ограничивает число одновременно выполняемых частей,
+    не изменяя число потоков планировщика.
+*/
+class OpenCVSchedulerBackend : public cv::parallel::ParallelForAPI
+{
+private:
+    TaskScheduler& m_scheduler;
+    std::atomic<int> m_numThreads;
+
+public:
+    OpenCVSchedulerBackend(TaskScheduler& scheduler) : m_scheduler(scheduler)
+    {
+        m_numThreads.store(scheduler.numThreads());
+    };
+    ~OpenCVSchedulerBackend(){};
+
+    void parallel_for(int tasks, FN_parallel_for_body_cb_t body, void* data)
+    {
+        int numThreads = std::max(m_numThreads.load(), 1);
+        int grain = (tasks + numThreads - 1) / numThreads;
+        m_scheduler.parallelFor(cv::Range(0, tasks), [&](const cv::Range& range){
+            body(range.start, range.end, data);
+        }, grain);
+    }
+    int getThreadNum() const { return m_scheduler.threadIndex(); }
+    int getNumThreads() const { return m_numThreads.load(); }
+    int setNumThreads(int numThreads)
+    {
+        int previous = m_numThreads.load();
+        m_numThreads.store(numThreads > 0 ? std::min(numThreads, m_scheduler.numThreads()) : m_scheduler.numThreads());
+        return previous;
+    }
+    const char* getName() const { return "work-stealing"; }
+};
+#endif
+
+/*
+    Выполнение cv::parallel_for_ на планировщике scheduler, чтобы циклы OpenCV
+    и программы использовали одни и те же потоки.
+    Возвращает false, если версия OpenCV не позволяет заменить бэкенд.
+*/
+bool routeOpenCV(TaskScheduler& scheduler)
+{
+#ifdef TASKSCHEDULER_OPENCV_BACKEND
+    cv::parallel::setParallelForBackend(std::make_shared<OpenCVSchedulerBackend>(scheduler), false);
+    return true;
+#else
+    return false;
+#endif
+}
+
+#endif // TASKSCHEDULER_H
@@ -0,0 +1,351 @@
+#ifndef TILEDDETECTOR_H
+#define TILEDDETECTOR_H
+
+#include <algorithm>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/dnn.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "BoxMerging.h"
+#include "DepthGuidedDetector.h"
+#include "FaceBatch.h"
+#include "FaceDetectors.h"
+#include "FrameCache.h"
+#include "TaskScheduler.h"
+
+// Face Bounding Box Detector
+namespace FaceBBDetector{
+
+/*
+    Детекция мелких (удаленных) лиц YuNet по перекрывающимся фрагментам кадра.
+    Фрагменты обрабатываются в исходном (или увеличенном) разрешении параллельно,
+    у каждого потока свой экземпляр YuNetDetector. Крупные лица, не помещающиеся
+    во фрагмент, находятся дополнительным запуском на уменьшенном кадре.
+    Дубликаты из перекрывающихся фрагментов объединяются weighted box fusion.
+*/
+class TiledDetector
+{
+private:
+    /*
+        Задание для одного запуска сети: область кадра и масштаб, с которым она
+        подается на вход сети
+    */
+    struct Job
+    {
+        cv::Rect2i region;
+        float scale;
+        // Фрагмент сетки (детекции у внутренних границ отбрасываются)
+        bool tile;
+    };
+
+    // Размер фрагмента в пикселях кадра
+    cv::Size m_tileSize = cv::Size(320, 240);
+    // Перекрытие соседних фрагментов; лица меньше перекрытия целиком попадают хотя бы в один фрагмент
+    int m_overlap = 64;
+    // Масштаб фрагмента на входе сети (> 1 - увеличение для самых мелких лиц)
+    float m_tileScale = 1.f;
+    // Разрешение дополнительного запуска на всем кадре, пустой размер - без него
+    cv::Size m_coarseSize = cv::Size(320, 240);
+    float m_scoreThreshold = 0.9;
+    float m_nmsThreshold = 0.3;
+    // true - дубликаты усредняются (weighted box fusion), false - остается самый уверенный (NMS)
+    bool m_fuseBoxes = true;
+
+    // По детектору и буферу на поток
+    std::vector<cv::Ptr<YuNetDetector>> m_detectors;
+    std::vector<cv::Mat> m_buffers;
+
+    // Сетка фрагментов пересчитывается только при смене разрешения кадра
+    cv::Size m_frameSize;
+    std::vector<cv::Rect2i> m_tiles;
+    std::vector<Job> m_jobs;
+    // Результат каждого задания в формате YuNetDetector::detect
+    std::vector<cv::Mat> m_jobFaces;
+
+    // Буферы объединения
+    BoxMerging::BoxSet m_boxes;
+    BoxMerging::BoxMerger m_merger;
+    cv::Mat m_candidates, m_faces;
+    DepthProposals m_proposals;
+
+    /*
+        Начала фрагментов вдоль одной оси: фрагменты равномерно покрывают длину
+        с перекрытием не меньше m_overlap
+    */
+    std::vector<int> tileStarts(int length, int tile) const
+    {
+        std::vector<int> starts;
+        if (tile >= length){
+            starts.push_back(0);
+            return starts;
+        }
+        int n = (length - m_overlap + (tile - m_overlap) - 1) / (tile - m_overlap);
+        n = std::max(n, 2);
+        for (int i = 0; i < n; i++){
+            starts.push_back(int((long)(length - tile) * i / (n - 1)));
+        }
+        return starts;
+    }
+
+    void layoutTiles(cv::Size frameSize)
+    {
+        if (frameSize == m_frameSize){
+            return;
+        }
+        m_frameSize = frameSize;
+        m_tiles.clear();
+        cv::Size tile(std::min(m_tileSize.width, frameSize.width), std::min(m_tileSize.height, frameSize.height));
+        std::vector<int> xs = tileStarts(frameSize.width, tile.width);
+        std::vector<int> ys = tileStarts(frameSize.height, tile.height);
+        for (size_t i = 0; i < ys.size(); i++){
+            for (size_t j = 0; j < xs.size(); j++){
+                m_tiles.push_back(cv::Rect2i(xs[j], ys[i], tile.width, tile.height));
+            }
+        }
+    }
+
+    /*
+        Лицо обрезано внутренней границей фрагмента и будет найдено целиком в соседнем
+    */
+    bool cutByTileEdge(const float* face, const cv::Rect2i& tile) const
+    {
+        const float margin = 2.f;
+        if (face[2] > m_overlap || face[3] > m_overlap){
+            return false;
+        }
+        return (tile.x > 0 && face[0] < tile.x + margin) ||
+               (tile.y > 0 && face[1] < tile.y + margin) ||
+               (tile.x + tile.width < m_frameSize.width && face[0] + face[2] > tile.x + tile.width - margin) ||
+               (tile.y + tile.height < m_frameSize.height && face[1] + face[3] > tile.y + tile.height - margin);
+    }
+
+    /*
+        Запуск всех заданий: задание j выполняет детектор j % (число детекторов),
+        детекторы работают параллельно задачами общего планировщика
+    */
+    const cv::Mat& run(const cv::Mat& image)
+    {
+        int numWorkers = int(m_detectors.size());
+        m_jobFaces.resize(m_jobs.size());
+        defaultScheduler().parallelFor(cv::Range(0, numWorkers), [&](const cv::Range& range){
+            for (int w = range.start; w < range.end; w++){
+                for (size_t j = w; j < m_jobs.size(); j += numWorkers){
+                    const Job& job = m_jobs[j];
+                    cv::Size size(cvRound(job.region.width * job.scale), cvRound(job.region.height * job.scale));
+                    if (size == job.region.size()){
+                        image(job.region).copyTo(m_buffers[w]);
+                    }
+                    else{
+                        resize(image(job.region), m_buffers[w], size, 0, 0, cv::INTER_LINEAR);
+                    }
+                    m_detectors[w]->detect(m_buffers[w]).copyTo(m_jobFaces[j]);
+                }
+            }
+        });
+        return merge();
+    }
+
+    /*
+        Перевод результатов заданий в координаты кадра и объединение дубликатов
+    */
+    const cv::Mat& merge()
+    {
+        m_boxes.clear();
+        int total = 0;
+        for (size_t j = 0; j < m_jobFaces.size(); j++){
+            total += m_jobFaces[j].rows;
+        }
+        m_candidates.create(total, 15, CV_32F);
+        int n = 0;
+        for (size_t j = 0; j < m_jobs.size(); j++){
+            const Job& job = m_jobs[j];
+            float inv = 1.f / job.scale;
+            for (int i = 0; i < m_jobFaces[j].rows; i++){
+                const float* src = m_jobFaces[j].ptr<float>(i);
+                float* face = m_candidates.ptr<float>(n);
+                face[2] = src[2] * inv;
+                face[3] = src[3] * inv;
+                for (int k = 0; k < 14; k += 2){
+                    if (k == 2){
+                        continue;
+                    }
+                    face[k] = src[k] * inv + job.region.x;
+                    face[k + 1] = src[k + 1] * inv + job.region.y;
+                }
+                face[14] = src[14];
+                if (job.tile && cutByTileEdge(face, job.region)){
+                    continue;
+                }
+                m_boxes.add(face[0], face[1], face[2], face[3], face[14]);
+                n++;
+            }
+        }
+
+        const std::vector<int>& keep = m_merger.nms(m_boxes, m_nmsThreshold, m_scoreThreshold);
+        if (m_fuseBoxes){
+            m_merger.fuseRows(m_candidates.rowRange(0, n), 14, m_faces);
+            return m_faces;
+        }
+        m_faces.create(int(keep.size()), 15, CV_32F);
+        for (size_t i = 0; i < keep.size(); i++){
+            cv::Mat row = m_faces.row(int(i));
+            m_candidates.row(keep[i]).copyTo(row);
+        }
+        return m_faces;
+    }
+
+    void addCoarseJob(cv::Size frameSize)
+    {
+        if (m_coarseSize.empty()){
+            return;
+        }
+        Job job;
+        job.region = cv::Rect2i(0, 0, frameSize.width, frameSize.height);
+        job.scale = std::min(1.f, std::min(float(m_coarseSize.width) / frameSize.width,
+                                           float(m_coarseSize.height) / frameSize.height));
+        job.tile = false;
+        m_jobs.push_back(job);
+    }
+
+public:
+    /*
+        Аргументы:
+            - numWorkers - число потоков (экземпляров сети), 0 - по числу ядер
+            - config - параметры запуска сети (разрешение входа не используется:
+            фрагменты подаются на вход сети целиком)
+    */
+    TiledDetector(int numWorkers = 0, const YuNetConfig& config = defaultYuNetConfig())
+    {
+        if (numWorkers <= 0){
+            numWorkers = std::max(1, std::min(cv::getNumberOfCPUs(), 4));
+        }
+        // Фрагменты подаются на вход сети целиком, поэтому сеть работает на входе произвольного размера
+        YuNetConfig tileConfig = config;
+        tileConfig.inputSize = cv::Size();
+        for (int i = 0; i < numWorkers; i++){
+            m_detectors.push_back(cv::makePtr<YuNetDetector>(tileConfig));
+        }
+        m_buffers.resize(numWorkers);
+    };
+    ~TiledDetector(){};
+
+    bool isReady() const
+    {
+        for (size_t i = 0; i < m_detectors.size(); i++){
+            if (!m_detectors[i]->isReady()){
+                return false;
+            }
+        }
+        return true;
+    }
+    void waitReady()
+    {
+        for (size_t i = 0; i < m_detectors.size(); i++){
+            m_detectors[i]->waitReady();
+        }
+    }
+
+    /*
+        Функция детекции лиц по всему кадру.
+        Возвращает матрицу в формате YuNetDetector::detect.
+    */
+    const cv::Mat& detect(FrameCache& frame)
+    {
+        layoutTiles(frame.size());
+        m_jobs.clear();
+        for (size_t i = 0; i < m_tiles.size(); i++){
+            Job job = {m_tiles[i], m_tileScale, true};
+            m_jobs.push_back(job);
+        }
+        addCoarseJob(frame.size());
+        return run(frame.bgr());
+    }
+
+    /*
+        Функция детекции лиц только во фрагментах, пересекающихся с заданными областями
+        Аргументы:
+            - frame - кэш кадра
+            - regions - области поиска (например, объекты переднего плана)
+    */
+    const cv::Mat& detect(FrameCache& frame, const std::vector<cv::Rect2i>& regions)
+    {
+        layoutTiles(frame.size());
+        m_jobs.clear();
+        for (size_t i = 0; i < m_tiles.size(); i++){
+            for (size_t r = 0; r < regions.size(); r++){
+                if ((m_tiles[i] & regions[r]).area() > 0){
+                    Job job = {m_tiles[i], m_tileScale, true};
+                    m_jobs.push_back(job);
+                    break;
+                }
+            }
+        }
+        if (!regions.empty()){
+            addCoarseJob(frame.size());
+        }
+        return run(frame.bgr());
+    }
+
+    /*
+        Функция детекции лиц только во фрагментах с объектами переднего плана по карте глубины
+        Аргументы:
+            - frame - кэш цветного кадра
+            - depth - совмещенная с ним карта глубины (CV_16UC1, мм)
+            - K - внутренние параметры цветной камеры
+    */
+    const cv::Mat& detect(FrameCache& frame, const cv::Mat& depth, const OpenNIOpenCV::CameraIntrinsics& K)
+    {
+        const std::vector<FaceProposal>& proposals = m_proposals.propose(depth, K);
+        std::vector<cv::Rect2i> regions;
+        for (size_t i = 0; i < proposals.size(); i++){
+            regions.push_back(proposals[i].roi);
+        }
+        return detect(frame, regions);
+    }
+
+    std::vector<cv::Rect> predict(FrameCache& frame)
+    {
+        return YuNetDetector::boxesFromFaces(detect(frame));
+    }
+
+    template<int N>
+    void predict(FrameCache& frame, FaceBatch<N>& faces)
+    {
+        const cv::Mat& result = detect(frame);
+        faces.resize(result.rows);
+        for (int i = 0; i < result.rows; i++){
+            const float* row = result.ptr<float>(i);
+            faces.box(i) = cv::Rect2i(int(row[0]), int(row[1]), int(row[2]), int(row[3]));
+            faces.score(i) = row[14];
+            if (N == 5){
+                for (int j = 0; j < 5; j++){
+                    faces.setLandmark(i, j, row[4 + 2 * j], row[5 + 2 * j]);
+                }
+            }
+        }
+    }
+
+    /*
+        Аргументы:
+            - tileSize - размер фрагмента в пикселях кадра
+            - overlap - перекрытие соседних фрагментов (не меньше размера искомых лиц)
+            - tileScale - масштаб фрагмента на входе сети
+    */
+    void setTiling(cv::Size tileSize, int overlap, float tileScale = 1.f)
+    {
+        m_tileSize = tileSize;
+        m_overlap = std::min(overlap, std::min(tileSize.width, tileSize.height) / 2);
+        m_tileScale = tileScale;
+        m_frameSize = cv::Size();
+    }
+    void setCoarseSize(cv::Size coarseSize) { m_coarseSize = coarseSize; }
+    void setFuseBoxes(bool fuseBoxes) { m_fuseBoxes = fuseBoxes; }
+    const std::vector<cv::Rect2i>& tiles() const { return m_tiles; }
+    DepthProposals& proposals() { return m_proposals; }
+};
+
+}
+
+#endif // TILEDDETECTOR_H
@@ -1,17 +1,21 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <algorithm>
+
 #include <dlib/image_processing.h>
 #include <dlib/image_io.h>
 #include <opencv2/opencv.hpp>
 
+#include "FaceBatch.h"
+
 /*
     Функция для оттображения ограничивающих рамок
     Аргументы:
         - image - изображение
         - boxes - массив с координатами bounding boxes
 */
-void drawLandmarks(cv::Mat& image, std::vector< std::vector<cv::Point2i>> landmarks){
+void drawLandmarks(cv::Mat& image, const std::vector< std::vector<cv::Point2i>>& landmarks){
     for (int i = 0; i < landmarks.size(); i++){
         for (int j = 0; j < landmarks[i].size(); j++){
             // Отображение ключевых точек
@@ -26,13 +30,59 @@ void drawLandmarks(cv::Mat& image, std::vector< std::vector<cv::Point2i>> landma
         - image - изображение
         - boxes - массив с координатами bounding boxes
 */
-void drawBoundingBox(cv::Mat& image, std::vector<cv::Rect2i> boxes){
+void drawBoundingBox(cv::Mat& image, const std::vector<cv::Rect2i>& boxes){
     for (int i = 0; i < boxes.size(); i++){
         // Отображение bounding boxes
         cv::rectangle(image, boxes[i], cv::Scalar(0, 255, 0), 1);
     }
 }
 
+/*
+    Функция для оттображения ключевых точек лиц из контейнера FaceBatch.
+    На кадре BGR точки рисуются кругами радиуса 2 прямо в пикселях: cv::circle
+    с толщиной больше 1 строит многоугольник окружности в std::vector и выделяет
+    память на каждую точку. Кадры другого типа рисуются cv::circle.
+    Аргументы:
+        - image - изображение
+        - faces - контейнер с результатами детекции
+*/
+template<int N>
+void drawLandmarks(cv::Mat& image, const FaceBatch<N>& faces){
+    const cv::Vec3b color(0, 255, 0);
+    for (int i = 0; i < faces.size(); i++){
+        const float* x = faces.x(i);
+        const float* y = faces.y(i);
+        for (int j = 0; j < N; j++){
+            int cx = cvRound(x[j]), cy = cvRound(y[j]);
+            if (image.type() != CV_8UC3){
+                cv::circle(image, cv::Point(cx, cy), 1, cv::Scalar(0, 255, 0), 2);
+                continue;
+            }
+            for (int v = std::max(cy - 2, 0); v <= std::min(cy + 2, image.rows - 1); v++){
+                cv::Vec3b* row = image.ptr<cv::Vec3b>(v);
+                for (int u = std::max(cx - 2, 0); u <= std::min(cx + 2, image.cols - 1); u++){
+                    if ((u - cx) * (u - cx) + (v - cy) * (v - cy) <= 4){
+                        row[u] = color;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+    Функция для оттображения ограничивающих рамок лиц из контейнера FaceBatch
+    Аргументы:
+        - image - изображение
+        - faces - контейнер с результатами детекции
+*/
+template<int N>
+void drawBoundingBox(cv::Mat& image, const FaceBatch<N>& faces){
+    for (int i = 0; i < faces.size(); i++){
+        cv::rectangle(image, faces.box(i), cv::Scalar(0, 255, 0), 1);
+    }
+}
+
 cv::Rect dlibRectangleToOpenCV(dlib::rectangle r)
 {
   return cv::Rect(cv::Point2i(r.left(), r.top()), cv::Point2i(r.right() + 1, r.bottom() + 1));
@@ -0,0 +1,253 @@
+#ifndef YUNETTUNER_H
+#define YUNETTUNER_H
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <opencv2/core.hpp>
+#include <opencv2/dnn.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "FaceDetectors.h"
+
+// Face Bounding Box Detector
+namespace FaceBBDetector{
+
+/*
+    Автоматический выбор параметров запуска YuNet (бэкенд, устройство,
+    число потоков, разрешение) для текущего компьютера.
+    Лучшая конфигурация сохраняется в файл отдельно для каждого компьютера.
+*/
+class YuNetTuner
+{
+private:
+    // Файл с результатами настройки
+    std::string m_storagePath;
+    // Кадры, на которых сравниваются конфигурации
+    std::vector<cv::Mat> m_frames;
+    // Число замеров на конфигурацию
+    int m_runs = 30;
+
+    /*
+        Имя узла файла настройки для текущего компьютера
+    */
+    static std::string hostKey()
+    {
+        char name[256] = {0};
+        gethostname(name, sizeof(name) - 1);
+        std::string key = "host_";
+        for (const char* c = name; *c; c++){
+            key += isalnum((unsigned char)*c) ? *c : '_';
+        }
+        return key;
+    }
+
+    static void writeConfig(cv::FileStorage& fs, const std::string& key, const YuNetConfig& config, double ms)
+    {
+        fs << key << "{"
+           << "backend" << config.backendId
+           << "target" << config.targetId
+           << "threads" << config.numThreads
+           << "width" << config.inputSize.width
+           << "height" << config.inputSize.height
+           << "ms" << ms
+           << "}";
+    }
+
+    static YuNetConfig readConfig(const cv::FileNode& node)
+    {
+        YuNetConfig config;
+        config.backendId = int(node["backend"]);
+        config.targetId = int(node["target"]);
+        config.numThreads = int(node["threads"]);
+        config.inputSize = cv::Size(int(node["width"]), int(node["height"]));
+        return config;
+    }
+
+    /*
+        Медианное время детекции (мс) с заданной конфигурацией,
+        отрицательное значение - конфигурация не поддерживается
+    */
+    double benchmark(const YuNetConfig& config)
+    {
+        std::vector<double> times;
+        // Число потоков кандидата действует только на время замера
+        int numThreads = cv::getNumThreads();
+        applyThreads(config);
+        try{
+            YuNetDetector detector(config);
+            detector.waitReady();
+            for (int i = 0; i < m_runs; i++){
+                const cv::Mat& frame = m_frames[i % m_frames.size()];
+                auto start = std::chrono::steady_clock::now();
+                detector.detect(frame);
+                std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+                times.push_back(ms.count());
+            }
+        }
+        catch (const cv::Exception& e){
+            cv::setNumThreads(numThreads);
+            return -1.0;
+        }
+        cv::setNumThreads(numThreads);
+        std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+        return times[times.size() / 2];
+    }
+
+public:
+    YuNetTuner(const std::string& storagePath = "yunet_tuning.yml") : m_storagePath(storagePath) {};
+    ~YuNetTuner(){};
+
+    /*
+        Загрузка кадров записи, на которых будет выполняться настройка
+        Аргументы:
+            - clipPath - путь к видеофайлу
+            - maxFrames - максимальное число кадров
+    */
+    bool loadFrames(const std::string& clipPath, int maxFrames = 30)
+    {
+        cv::VideoCapture capture(clipPath);
+        if (!capture.isOpened()){
+            std::cout << "Can't open clip " << clipPath << std::endl;
+            return false;
+        }
+        m_frames.clear();
+        cv::Mat frame;
+        while (int(m_frames.size()) < maxFrames && capture.read(frame)){
+            m_frames.push_back(frame.clone());
+        }
+        return !m_frames.empty();
+    }
+
+    /*
+        Список конфигураций-кандидатов: все доступные пары бэкенд/устройство,
+        число потоков 1, 2, 4, ... до числа ядер и заданные разрешения
+        Аргументы:
+            - inputSizes - допустимые разрешения детекции
+    */
+    std::vector<YuNetConfig> candidates(const std::vector<cv::Size>& inputSizes) const
+    {
+        std::vector<int> threads(1, 0);
+        for (int n = 1; n <= cv::getNumberOfCPUs(); n *= 2){
+            threads.push_back(n);
+        }
+        std::vector<YuNetConfig> result;
+        std::vector< std::pair<cv::dnn::Backend, cv::dnn::Target> > backends = cv::dnn::getAvailableBackends();
+        for (size_t b = 0; b < backends.size(); b++){
+            for (size_t t = 0; t < threads.size(); t++){
+                for (size_t s = 0; s < inputSizes.size(); s++){
+                    YuNetConfig config;
+                    config.backendId = backends[b].first;
+                    config.targetId = backends[b].second;
+                    config.numThreads = threads[t];
+                    config.inputSize = inputSizes[s];
+                    result.push_back(config);
+                }
+            }
+        }
+        return result;
+    }
+
+    /*
+        Сравнение конфигураций и сохранение самой быстрой для текущего компьютера
+    */
+    YuNetConfig tune(const std::vector<YuNetConfig>& configs)
+    {
+        if (m_frames.empty()){
+            // Без записи используются синтетические кадры разрешения камеры
+            cv::Mat frame(480, 640, CV_8UC3);
+            cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(255));
+            m_frames.push_back(frame);
+        }
+        YuNetConfig best = defaultYuNetConfig();
+        double bestMs = -1.0;
+        for (size_t i = 0; i < configs.size(); i++){
+            double ms = benchmark(configs[i]);
+            std::cout << "YuNet backend " << configs[i].backendId << " target " << configs[i].targetId
+                      << " threads " << configs[i].numThreads << " input " << configs[i].inputSize.width
+                      << "x" << configs[i].inputSize.height << ": "
+                      << (ms < 0 ? std::string("not supported") : std::to_string(ms) + " ms") << std::endl;
+            if (ms >= 0 && (bestMs < 0 || ms < bestMs)){
+                bestMs = ms;
+                best = configs[i];
+            }
+        }
+        if (bestMs >= 0){
+            save(best, bestMs);
+        }
+        return best;
+    }
+
+    /*
+        Чтение сохраненной конфигурации текущего компьютера
+    */
+    bool load(YuNetConfig& config) const
+    {
+        cv::FileStorage fs(m_storagePath, cv::FileStorage::READ);
+        if (!fs.isOpened()){
+            return false;
+        }
+        cv::FileNode node = fs[hostKey()];
+        if (node.empty()){
+            return false;
+        }
+        config = readConfig(node);
+        return true;
+    }
+
+    /*
+        Сохранение конфигурации текущего компьютера (записи других компьютеров сохраняются)
+    */
+    void save(const YuNetConfig& config, double ms) const
+    {
+        std::map<std::string, std::pair<YuNetConfig, double> > hosts;
+        {
+            cv::FileStorage in(m_storagePath, cv::FileStorage::READ);
+            if (in.isOpened()){
+                cv::FileNode root = in.root();
+                for (cv::FileNodeIterator it = root.begin(); it != root.end(); ++it){
+                    hosts[(*it).name()] = std::make_pair(readConfig(*it), double((*it)["ms"]));
+                }
+            }
+        }
+        hosts[hostKey()] = std::make_pair(config, ms);
+
+        cv::FileStorage out(m_storagePath, cv::FileStorage::WRITE);
+        for (std::map<std::string, std::pair<YuNetConfig, double> >::const_iterator it = hosts.begin();
+             it != hosts.end(); ++it){
+            writeConfig(out, it->first, it->second.first, it->second.second);
+        }
+    }
+
+    /*
+        Получение конфигурации: найденной сравнением кандидатов при forceTune == true,
+        иначе сохраненной для текущего компьютера или, если ее нет, defaultYuNetConfig()
+        (настройка занимает десятки секунд и выполняется только по запросу)
+        Аргументы:
+            - forceTune - выполнить настройку заново
+            - inputSizes - допустимые разрешения детекции
+    */
+    YuNetConfig loadOrTune(bool forceTune = false,
+                           const std::vector<cv::Size>& inputSizes = std::vector<cv::Size>(1, cv::Size(320, 240)))
+    {
+        if (forceTune){
+            return tune(candidates(inputSizes));
+        }
+        YuNetConfig config;
+        if (load(config)){
+            return config;
+        }
+        std::cout << "No saved YuNet tuning for this computer, using defaults (run with --autotune to tune)" << std::endl;
+        return defaultYuNetConfig();
+    }
+};
+
+}
+
+#endif // YUNETTUNER_H
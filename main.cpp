@@ -1,4 +1,5 @@
 #include <iostream>
+#include <sstream>
 #include <stdio.h>
 #include <vector>
 #include <chrono>
@@ -8,13 +9,114 @@
 #include <opencv2/opencv.hpp>
 
 #include "OpenNI2OpenCV.h"
-#include "FaceKeyPointDetector.h"
-#include "FaceDetectors.h"
+#include "FaceEmbedding.h"
+#include "FacePipeline.h"
+#include "FrameCache.h"
+#include "HeadPose.h"
+#include "IdentityIndex.h"
+#include "Liveness.h"
+#include "MotionGate.h"
+#include "PipelinedExecutor.h"
+#include "Profiling.h"
+#include "QualityController.h"
+#include "TaskScheduler.h"
+#include "YuNetTuner.h"
 
 #include "Utils.h"
 
 
-int main() {
+/*
+    Данные кадра, проходящего через многопоточный конвейер
+*/
+struct PipelineFrame
+{
+    // Номер слота (номер контейнера лиц в AnyPipeline)
+    int slot = 0;
+    // Метка времени кадра (мкс, часы камеры)
+    uint64_t timestamp = 0;
+    cv::Mat color;
+    FrameCache cache;
+};
+
+/*
+    Многопоточный режим: захват, детекция лиц, ключевые точки и отрисовка
+    выполняются в отдельных потоках над разными кадрами. Если детектор лиц
+    использует ключевые точки предыдущего кадра, детекция и ключевые точки
+    выполняются одним этапом. Захват не ждет обработки: детекция получает
+    самый свежий кадр, остальные кадры отбрасываются.
+    Все вызовы highgui выполняются в потоке отрисовки.
+*/
+void runPipelined(OpenNIOpenCV::OpenNI2OpenCV& oni, FacePipeline::AnyPipeline& pipeline)
+{
+    const int queueDepth = 2;
+    bool split = pipeline.splittable();
+    int numStages = split ? 4 : 3;
+    // Кадры во всех очередях и по одному в каждом этапе
+    int poolSize = (numStages - 1) * queueDepth + numStages;
+    PipelinedExecutor<PipelineFrame> executor(poolSize);
+    for (int i = 0; i < poolSize; i++){
+        executor.slots()[i].slot = i;
+    }
+    pipeline.setSlots(poolSize);
+
+    // Если кадр не пришел вовремя, захват ждет следующего кадра, не передавая дальше
+    // прежнее содержимое слота
+    executor.addStage("capture", [&oni, &executor](PipelineFrame& frame){
+        while (!oni.getColorFrame(frame.color, 100)){
+            if (!executor.running()){
+                return false;
+            }
+        }
+        frame.timestamp = oni.colorTimestamp();
+        frame.cache.setFrame(frame.color);
+        return true;
+    });
+    if (split){
+        executor.addStage("detect", [&pipeline](PipelineFrame& frame){
+            pipeline.detect(frame.cache, frame.slot);
+            return true;
+        }, queueDepth, KEEP_LATEST);
+        executor.addStage("landmarks", [&pipeline](PipelineFrame& frame){
+            pipeline.landmarks(frame.cache, frame.slot);
+            return true;
+        }, queueDepth, DROP_BLOCK);
+    }
+    else{
+        executor.addStage("process", [&pipeline](PipelineFrame& frame){
+            pipeline.process(frame.cache, frame.slot);
+            return true;
+        }, queueDepth, KEEP_LATEST);
+    }
+
+    std::string textFPS;
+    int currFPS = 0;
+    auto t1 = std::chrono::steady_clock::now();
+    LatencyStats sensorLatency("Sensor to result");
+    executor.addStage("render", [&](PipelineFrame& frame){
+        pipeline.draw(frame.color, frame.slot);
+        std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - t1;
+        if (ms.count() > 1000.0){
+            textFPS = "FPS = " + std::to_string(currFPS);
+            currFPS = 0;
+            t1 = std::chrono::steady_clock::now();
+        }
+        else{
+            currFPS++;
+        }
+        cv::putText(frame.color, textFPS, cv::Point(10, 450), cv::FONT_HERSHEY_SIMPLEX, 1, cv::Scalar(0, 255, 0), 2, cv::LINE_AA);
+        cv::imshow("Color", frame.color);
+        sensorLatency.add(oni.colorLatencyMs(frame.timestamp));
+        return cv::waitKey(1) != 27;
+    }, queueDepth, DROP_BLOCK);
+
+    executor.start();
+    executor.join();
+    executor.report();
+    sensorLatency.report();
+}
+
+
+int main(int argc, char** argv) {
     using std::chrono::high_resolution_clock;
     using std::chrono::duration_cast;
     using std::chrono::duration;
@@ -22,29 +124,408 @@ int main() {
 
     OpenNIOpenCV::OpenNI2OpenCV oni;
 
-    FaceBBDetector::YuNetDetector BBdetector;
-    FaceKPDetector::DlibDetector KPdetector;
+    // Конвейер детекции выбирается аргументом командной строки.
+    // По умолчанию YuNet запускается раз в 5 кадров, между детекциями лица
+    // сопровождаются оптическим потоком, ключевые точки определяются dlib.
+    // Модели загружаются в фоновых потоках параллельно с инициализацией устройства.
+    // Ключ --autotune (или --autotune=clip) заново подбирает параметры YuNet для этого
+    // компьютера (на кадрах записи clip, если она указана); иначе используются сохраненные
+    // параметры, а если их нет - параметры по умолчанию.
+    // Ключ --no-gate отключает пропуск детекции на неизменившихся кадрах,
+    // --depth-gate добавляет к проверке изменений карту глубины.
+    // Ключ --pose включает оценку положения головы по ключевым точкам и
+    // совмещенной с цветным кадром карте глубины, --liveness - проверку живого лица
+    // по глубине и ИК кадру. С --liveness ключи --record-live=dir и --record-fake=dir
+    // сохраняют кадры с одним лицом (глубина, ИК, лицо, ожидаемый результат) в каталог dir
+    // для воспроизведения тестом test_liveness (tests/data/liveness).
+    // Ключ --gallery=path включает распознавание лиц по индексу дескрипторов из файла path.
+    // С ключом --enroll=id дескрипторы единственного лица в кадре добавляются в индекс
+    // с идентификатором id, и индекс сохраняется в path (файл создается, если его нет).
+    // Ключ --show-depth выводит раскрашенную карту глубины.
+    // Ключ --shadow включает теневой режим каскадного детектора ("cascade", "cascade+dlib"):
+    // YuNet дополнительно работает на каждом кадре, выводится полнота каскада
+    // (для записанного ролика - tests/bench_cascade_recall).
+    // Ключ --target-fps=N (или --budget=ms) включает регулятор качества: при нехватке
+    // времени на кадр снижаются разрешение и частота детекции, число ключевых точек,
+    // обработка и раскраска глубины; при появлении запаса качество восстанавливается.
+    // Ключ --pipelined выполняет захват, детекцию, ключевые точки и отрисовку
+    // в отдельных потоках (только отображение ключевых точек).
+    // Параллельные циклы (лица, фрагменты кадра, строки глубины, циклы OpenCV) выполняет
+    // общий планировщик задач: --threads=N задает число его потоков,
+    // --affinity=0,1,... закрепляет потоки за ядрами.
+    // Ключ --mailbox включает получение самого свежего цветного кадра вместо
+    // следующего кадра из очереди драйвера (меньше задержка, часть кадров пропускается).
+    std::string pipelineName = "track+dlib";
+    bool autotune = false;
+    bool useGate = true;
+    bool depthGate = false;
+    bool estimatePose = false;
+    bool checkLiveness = false;
+    std::string recordDir;
+    int recordLabel = -1;
+    std::string tuneClip;
+    std::string galleryPath;
+    int enrollId = -1;
+    bool showDepth = false;
+    bool shadow = false;
+    double budgetMs = 0;
+    bool pipelined = false;
+    bool mailbox = false;
+    int numThreads = 0;
+    std::vector<int> cpus;
+    for (int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if (arg == "--autotune"){
+            autotune = true;
+        }
+        else if (arg.compare(0, 11, "--autotune=") == 0){
+            autotune = true;
+            tuneClip = arg.substr(11);
+        }
+        else if (arg == "--no-gate"){
+            useGate = false;
+        }
+        else if (arg == "--depth-gate"){
+            depthGate = true;
+        }
+        else if (arg == "--pose"){
+            estimatePose = true;
+        }
+        else if (arg == "--liveness"){
+            checkLiveness = true;
+        }
+        else if (arg.compare(0, 14, "--record-live=") == 0 || arg.compare(0, 14, "--record-fake=") == 0){
+            recordDir = arg.substr(14);
+            recordLabel = arg.compare(0, 14, "--record-live=") == 0 ? 1 : 0;
+        }
+        else if (arg.compare(0, 10, "--gallery=") == 0){
+            galleryPath = arg.substr(10);
+        }
+        else if (arg.compare(0, 9, "--enroll=") == 0){
+            enrollId = std::max(0, atoi(arg.c_str() + 9));
+        }
+        else if (arg == "--show-depth"){
+            showDepth = true;
+        }
+        else if (arg == "--shadow"){
+            shadow = true;
+        }
+        else if (arg.compare(0, 13, "--target-fps=") == 0){
+            budgetMs = 1000.0 / std::max(1.0, atof(arg.c_str() + 13));
+        }
+        else if (arg.compare(0, 9, "--budget=") == 0){
+            budgetMs = atof(arg.c_str() + 9);
+        }
+        else if (arg == "--pipelined"){
+            pipelined = true;
+        }
+        else if (arg == "--mailbox"){
+            mailbox = true;
+        }
+        else if (arg.compare(0, 10, "--threads=") == 0){
+            numThreads = atoi(arg.c_str() + 10);
+        }
+        else if (arg.compare(0, 11, "--affinity=") == 0){
+            std::stringstream list(arg.substr(11));
+            std::string cpu;
+            while (std::getline(list, cpu, ',')){
+                cpus.push_back(atoi(cpu.c_str()));
+            }
+        }
+        else{
+            pipelineName = arg;
+        }
+    }
+    // Циклы OpenCV выполняются потоками планировщика, чтобы не занимать ядра отдельным пулом
+    if (numThreads > 0){
+        defaultScheduler().setNumThreads(numThreads);
+    }
+    if (!cpus.empty()){
+        defaultScheduler().setAffinity(cpus);
+    }
+    if (!routeOpenCV(defaultScheduler())){
+        std::cout << "OpenCV parallel_for_ uses its own thread pool (OpenCV < 4.5.2)" << std::endl;
+    }
+    FaceBBDetector::YuNetTuner tuner("yunet_tuning.yml");
+    if (!tuneClip.empty()){
+        tuner.loadFrames(tuneClip);
+    }
+    FaceBBDetector::defaultYuNetConfig() = tuner.loadOrTune(autotune);
+    FaceBBDetector::applyThreads(FaceBBDetector::defaultYuNetConfig());
 
-    std::vector<cv::Rect2i> boxes;
-    std::vector <std::vector <cv::Point2i>> landmarks;
+    cv::Ptr<FacePipeline::AnyPipeline> pipeline = FacePipeline::createPipeline(pipelineName);
+    if (!pipeline){
+        return 1;
+    }
+    // Конвейер с 5 ключевыми точками на случай нехватки времени (загружается заранее)
+    cv::Ptr<FacePipeline::AnyPipeline> lightPipeline;
+    if (budgetMs > 0 && pipeline->numLandmarks() != 5){
+        lightPipeline = FacePipeline::createPipeline(FacePipeline::lightPipelineName(pipelineName));
+    }
+    if (shadow){
+        pipeline->setShadowMode(true);
+        if (lightPipeline){
+            lightPipeline->setShadowMode(true);
+        }
+    }
 
-    if (oni.init() != openni::STATUS_OK){
+    if (oni.init(estimatePose || checkLiveness) != openni::STATUS_OK){
         printf("Initializatuion failed");
         return 1;
     }
+    if (mailbox){
+        oni.setColorMailbox(true);
+    }
+    // Ожидание загрузки и прогрева моделей, чтобы первый кадр обрабатывался
+    // с задержкой установившегося режима
+    auto tReady = std::chrono::steady_clock::now();
+    pipeline->waitReady();
+    std::chrono::duration<double, std::milli> waitMs = std::chrono::steady_clock::now() - tReady;
+    std::cout << "Pipeline " << pipeline->name() << " ready after waiting " << waitMs.count() << " ms" << std::endl;
+    LatencyStats processLatency("Pipeline " + pipeline->name());
+    // Задержка от съемки кадра камерой до вывода результата
+    LatencyStats sensorLatency("Sensor to result");
+    if (lightPipeline){
+        lightPipeline->waitReady();
+    }
+    if (pipelined){
+        runPipelined(oni, *pipeline);
+        defaultScheduler().report();
+        if (oni.colorMailbox()){
+            oni.colorFrameMailbox().report();
+        }
+        openni::OpenNI::shutdown();
+        return 0;
+    }
+
+    // Пороги изменения глубины берутся из настроек камеры, если она их сообщает
+    MotionGate motionGate;
+    FacePose::HeadPoseEstimator poseEstimator;
+    FaceLiveness::LivenessChecker livenessChecker;
+    // Сеть дескрипторов загружается, только если задан индекс
+    cv::Ptr<FaceRecognition::FaceEmbedder> embedder;
+    FaceRecognition::IdentityIndex gallery;
+    // Минимальное сходство с ближайшим дескриптором индекса для распознавания
+    const float minSimilarity = 0.36f;
+    // Запись лица: каждый 10-й кадр с одним лицом, после enrollSamples дескрипторов индекс
+    // сохраняется; индекс обучается, когда в нем достаточно дескрипторов для всех списков
+    const int enrollSamples = 20;
+    int enrollFrames = 0, enrolled = 0;
+    if (enrollId >= 0 && galleryPath.empty()){
+        std::cout << "--enroll requires --gallery=path" << std::endl;
+        return 1;
+    }
+    if (!galleryPath.empty()){
+        if (gallery.load(galleryPath)){
+            std::cout << "Gallery " << galleryPath << ": " << gallery.size() << " embeddings" << std::endl;
+        }
+        else if (enrollId >= 0){
+            std::cout << "Creating gallery " << galleryPath << std::endl;
+        }
+        else{
+            std::cout << "Cannot load gallery " << galleryPath << std::endl;
+            return 1;
+        }
+        embedder = cv::makePtr<FaceRecognition::FaceEmbedder>();
+    }
+    // Лица, для которых вычисляются дескрипторы (один запуск сети на кадр)
+    std::vector<int> embedFaces;
+    std::vector<const float*> embedX, embedY;
+    // Идентификаторы лиц кадра и результаты распознавания сопровождаемых лиц
+    std::vector<int> identities;
+    FaceRecognition::TrackIdentityCache identityCache;
+    OpenNIOpenCV::CameraIntrinsics colorK = oni.getColorIntrinsics();
+    // ИК кадр снимает сенсор глубины: при совмещении глубины с цветным кадром он остается
+    // в координатах сенсора, и область лица переводится через калибровку устройства.
+    // Без калибровки ИК признак не используется.
+    bool useIr = checkLiveness;
+    OpenNIOpenCV::DepthSensorGeometry irGeometry;
+    bool hasIrGeometry = false;
+    if (checkLiveness && oni.isDepthRegistered()){
+        hasIrGeometry = oni.getDepthSensorGeometry(irGeometry);
+        if (hasIrGeometry){
+            livenessChecker.setIrGeometry(irGeometry);
+        }
+        else{
+            useIr = false;
+            std::cout << "No depth sensor calibration, IR liveness cue disabled" << std::endl;
+        }
+    }
+    // Ключевые точки переводятся в 3D один раз на кадр (Landmarks3D), только если карта
+    // глубины совмещена с цветным кадром; иначе положение головы находится по
+    // выборке глубины в опорных точках
+    bool depthRegistered = estimatePose && oni.isDepthRegistered();
+    int recordFrames = 0, recordedSamples = 0;
+    AXonMotionThreshold motionThreshold;
+    if (depthGate && oni.getMotionThreshold(motionThreshold)){
+        motionGate.setSensorHint(motionThreshold.thresHold, motionThreshold.count, oni.getFrameSize());
+    }
+
+    QualityController quality(budgetMs > 0 ? budgetMs : 1e9);
+    quality.setAvailable(bool(lightPipeline), estimatePose || checkLiveness, showDepth);
+    // Параметры детекции снижаются раньше ключевых точек, то есть пока работает основной конвейер
+    quality.setDetectKnobs(pipeline->qualityKnobs());
+    QualitySettings settings = quality.settings();
+    FacePipeline::AnyPipeline* active = pipeline.get();
+
     std::string textFPS;
     int currFPS = 0;
-    cv::Mat colorFrame, depthFrame, irFrame;
+    cv::Mat colorFrame, depthFrame, irFrame, depthColor;
+    // Градации серого и уменьшенные копии кадра общие для всех детекторов
+    FrameCache frameCache;
     auto t1 = high_resolution_clock::now();
+    auto msSince = [](std::chrono::steady_clock::time_point start){
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
     for (;;) {
+        auto tFrame = std::chrono::steady_clock::now();
 //        oni.getDepthFrame(depthFrame);
 //        oni.getIrFrame(irFrame);
-        oni.getColorFrame(colorFrame);
-        boxes = BBdetector.predict(colorFrame);
-        landmarks = KPdetector.predict(colorFrame, boxes);
+        // Кадр не пришел вовремя: обработка пропускается, клавиши продолжают опрашиваться
+        if (!oni.getColorFrame(colorFrame, 100)){
+            if (cv::waitKey(1) == 27) break;
+            continue;
+        }
+        uint64_t frameTimestamp = oni.colorTimestamp();
+        frameCache.setFrame(colorFrame);
+        quality.addStage(STAGE_CAPTURE, msSince(tFrame));
+
+        // Если карта глубины не прочитана, этапы глубины на этом кадре пропускаются
+        auto tDepth = std::chrono::steady_clock::now();
+        bool depthStages = (estimatePose || checkLiveness) && settings.depthStages;
+        bool hasDepth = false;
+        if (depthGate || showDepth || depthStages){
+            hasDepth = oni.getRawDepthFrame(depthFrame);
+        }
+        depthStages = depthStages && hasDepth;
+        // Без ИК кадра проверка живого лица выполняется только по глубине
+        if (useIr && depthStages && !oni.getRawIrFrame(irFrame)){
+            irFrame.release();
+        }
+        quality.addStage(STAGE_DEPTH, msSince(tDepth));
+
+        // Если в кадре ничего не изменилось, используются результаты предыдущей детекции
+        auto tProcess = std::chrono::steady_clock::now();
+        bool changed = !useGate || (depthGate && hasDepth ? motionGate.update(frameCache, depthFrame)
+                                                          : motionGate.update(frameCache));
+        if (changed){
+            auto tPipeline = std::chrono::steady_clock::now();
+            active->process(frameCache);
+            processLatency.addSince(tPipeline);
+            if (processLatency.count() == 100){
+                processLatency.report();
+            }
+        }
+        if (useGate && motionGate.frames() % 300 == 0){
+            motionGate.report();
+        }
 
-        drawLandmarks(colorFrame, landmarks);
+        // Дескрипторы вычисляются до отрисовки, пока кадр не изменен
+        // Сопровождаемое лицо распознается один раз, нераспознанное - раз в 10 кадров
+        identities.clear();
+        if (embedder){
+            identityCache.beginFrame();
+            embedFaces.clear();
+            embedX.clear();
+            embedY.clear();
+            for (int i = 0; i < active->size(); i++){
+                int identity;
+                if (identityCache.needsRecognition(active->trackId(i), identity)){
+                    embedFaces.push_back(i);
+                    embedX.push_back(active->x(i));
+                    embedY.push_back(active->y(i));
+                }
+                identities.push_back(identity);
+            }
+            // Дескрипторы всех распознаваемых лиц одним запуском сети;
+            // строка невыровненного лица нулевая, и сходство с ней равно 0
+            if (!embedFaces.empty()){
+                const cv::Mat& embeddings = embedder->embed(colorFrame, embedX.data(), embedY.data(),
+                                                            active->numLandmarks(), int(embedFaces.size()));
+                for (size_t k = 0; k < embedFaces.size(); k++){
+                    std::vector<FaceRecognition::SearchResult> nearest = gallery.search(embeddings.row(int(k)), 1);
+                    int identity = !nearest.empty() && nearest[0].similarity >= minSimilarity
+                                   ? nearest[0].id : FaceRecognition::TrackIdentityCache::unknown;
+                    identities[embedFaces[k]] = identity;
+                    identityCache.store(active->trackId(embedFaces[k]), identity);
+                }
+            }
 
+            if (enrollId >= 0 && active->size() == 1 && enrollFrames++ % 10 == 0){
+                const float* x = active->x(0);
+                const float* y = active->y(0);
+                const cv::Mat& embedding = embedder->embed(colorFrame, &x, &y, active->numLandmarks(), 1);
+                if (cv::countNonZero(embedding) > 0){
+                    gallery.add(enrollId, embedding);
+                    enrolled++;
+                }
+                if (enrolled == enrollSamples){
+                    if (!gallery.isTrained() && gallery.size() >= 16 * gallery.numLists()){
+                        gallery.train(gallery.embeddings());
+                    }
+                    std::cout << (gallery.save(galleryPath) ? "Enrolled id " : "Cannot save gallery, id ") << enrollId
+                              << ": " << enrolled << " embeddings, gallery " << gallery.size() << std::endl;
+                    enrollId = -1;
+                    identityCache.clear();
+                }
+            }
+        }
+        quality.addStage(STAGE_PROCESS, msSince(tProcess));
+
+        auto tRender = std::chrono::steady_clock::now();
+        active->draw(colorFrame);
+        for (size_t i = 0; i < identities.size(); i++){
+            cv::Rect2i box = active->box(int(i));
+            std::string text = identities[i] >= 0 ? "id " + std::to_string(identities[i]) : "unknown";
+            cv::putText(colorFrame, text, cv::Point(box.x, box.y + box.height + 15), cv::FONT_HERSHEY_SIMPLEX, 0.5,
+                        cv::Scalar(255, 255, 0), 1, cv::LINE_AA);
+        }
+        double renderMs = msSince(tRender);
+
+        tDepth = std::chrono::steady_clock::now();
+        if (estimatePose && depthStages){
+            if (depthRegistered){
+                active->liftLandmarks(depthFrame, colorK);
+            }
+            poseEstimator.beginFrame();
+            for (int i = 0; i < active->size(); i++){
+                const FacePose::HeadPose& pose = depthRegistered
+                    ? poseEstimator.addFace(active->box(i), active->x(i), active->y(i), active->numLandmarks(), colorK,
+                                            active->X(i), active->Y(i), active->Z(i))
+                    : poseEstimator.addFace(active->box(i), active->x(i), active->y(i), active->numLandmarks(), colorK,
+                                            depthFrame);
+                FacePose::drawHeadPose(colorFrame, pose, colorK);
+            }
+        }
+        if (checkLiveness && depthStages){
+            for (int i = 0; i < active->size(); i++){
+                FaceLiveness::LivenessResult live = livenessChecker.checkFace(active->box(i), active->x(i), active->y(i),
+                                                                              active->numLandmarks(), depthFrame, colorK, irFrame);
+                std::string text = live.score < 0 ? "live: ?" : "live: " + std::to_string(int(100 * live.score)) + "%";
+                cv::putText(colorFrame, text, active->box(i).tl() - cv::Point(0, 5), cv::FONT_HERSHEY_SIMPLEX, 0.5,
+                            live.score >= 0.5f ? cv::Scalar(0, 255, 0) : cv::Scalar(0, 0, 255), 1, cv::LINE_AA);
+            }
+            // Запись каждого 15-го кадра с одним лицом, не более 100 кадров
+            if (!recordDir.empty() && active->size() == 1 && recordedSamples < 100 && recordFrames++ % 15 == 0){
+                FaceLiveness::LivenessSample sample;
+                sample.depth = depthFrame;
+                sample.ir = irFrame;
+                sample.box = active->box(0);
+                sample.x.assign(active->x(0), active->x(0) + active->numLandmarks());
+                sample.y.assign(active->y(0), active->y(0) + active->numLandmarks());
+                sample.K = colorK;
+                sample.hasIrGeometry = hasIrGeometry;
+                sample.irGeometry = irGeometry;
+                sample.live = recordLabel;
+                std::string path = recordDir + (recordLabel ? "/live_" : "/fake_") + std::to_string(recordedSamples) + ".yml.gz";
+                if (FaceLiveness::writeSample(path, sample)){
+                    recordedSamples++;
+                }
+            }
+        }
+        quality.addStage(STAGE_DEPTH, msSince(tDepth));
+
+        tRender = std::chrono::steady_clock::now();
         // Вычисление количество FPS
         auto t2 = high_resolution_clock::now();
         duration<double, std::milli> ms_double = (t2 - t1);
@@ -59,12 +540,40 @@ int main() {
         if(!colorFrame.empty() || !depthFrame.empty() || !irFrame.empty()){
             cv::putText(colorFrame, textFPS, cv::Point(10, 450), cv::FONT_HERSHEY_SIMPLEX, 1, cv::Scalar(0, 255, 0), 2, cv::LINE_AA);
 
-//           cv::imshow("Depth", depthFrame);
+            if (showDepth && settings.colorizeDepth && hasDepth){
+                oni.colorizeDepth(depthFrame, depthColor);
+                cv::imshow("Depth", depthColor);
+            }
 //           cv::imshow("IR", irFrame);
             cv::imshow("Color", colorFrame);
+            sensorLatency.add(oni.colorLatencyMs(frameTimestamp));
         }
+        // Ожидание клавиши не входит во время вычислений кадра
+        quality.addStage(STAGE_RENDER, renderMs + msSince(tRender));
         if (cv::waitKey(10) == 27) break;
 
+        // Регулятор качества: настройки применяются к обоим конвейерам,
+        // при отказе от 68 ключевых точек обработка переключается на легкий конвейер
+        if (budgetMs > 0 && quality.endFrame()){
+            settings = quality.settings();
+            pipeline->applyQuality(settings);
+            if (lightPipeline){
+                lightPipeline->applyQuality(settings);
+            }
+            FacePipeline::AnyPipeline* next = settings.fullLandmarks || !lightPipeline ? pipeline.get() : lightPipeline.get();
+            if (next != active){
+                active = next;
+                identityCache.clear();
+            }
+        }
+    }
+    if (budgetMs > 0){
+        quality.report();
+    }
+    defaultScheduler().report();
+    sensorLatency.report();
+    if (oni.colorMailbox()){
+        oni.colorFrameMailbox().report();
     }
 
     openni::OpenNI::shutdown();
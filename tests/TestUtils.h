@@ -0,0 +1,60 @@
+#ifndef TESTUTILS_H
+#define TESTUTILS_H
+
+#include <iostream>
+#include <string>
+
+/*
+    Число нарушенных проверок текущего теста
+*/
+int& testFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+/*
+    Проверка условия: при нарушении выводится место и текст условия,
+    тест продолжается, а testResult возвращает ненулевой код
+*/
+#define CHECK(condition) \
+    do{ \
+        if (!(condition)){ \
+            std::cout << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+            testFailures()++; \
+        } \
+    } while (0)
+
+/*
+    Код возврата пропущенного теста (SKIP_RETURN_CODE в tests/CMakeLists.txt)
+*/
+const int testSkipCode = 77;
+
+/*
+    Тест пропущен: нет данных для проверки; ctest показывает его как Skipped
+    Аргументы:
+        - name - имя теста
+        - reason - причина пропуска
+*/
+int testSkipped(const std::string& name, const std::string& reason)
+{
+    std::cout << name << ": skipped, " << reason << std::endl;
+    return testSkipCode;
+}
+
+/*
+    Итог теста (код возврата main)
+    Аргументы:
+        - name - имя теста
+*/
+int testResult(const std::string& name)
+{
+    if (testFailures() > 0){
+        std::cout << name << ": " << testFailures() << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << name << ": passed" << std::endl;
+    return 0;
+}
+
+#endif // TESTUTILS_H
@@ -0,0 +1,72 @@
+/*
+    Бенчмарк BoxMerger::nms и cv::dnn::NMSBoxes на одинаковых наборах
+    из 16-4096 случайных boxes, собранных в группы (как кандидаты фрагментов
+    TiledDetector). Время на один вызов, входные данные готовятся заранее.
+    Запуск: bench_box_merging [число повторов]
+*/
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/dnn.hpp>
+
+#include "BoxMerging.h"
+
+void randomBoxes(cv::RNG& rng, int n, BoxMerging::BoxSet& boxes, std::vector<cv::Rect2d>& rects)
+{
+    boxes.clear();
+    rects.clear();
+    int numCenters = std::max(1, n / 6);
+    std::vector<cv::Point2f> centers;
+    for (int c = 0; c < numCenters; c++){
+        centers.push_back(cv::Point2f(rng.uniform(0.f, 1280.f), rng.uniform(0.f, 720.f)));
+    }
+    for (int i = 0; i < n; i++){
+        const cv::Point2f& center = centers[rng.uniform(0, numCenters)];
+        float w = rng.uniform(20.f, 120.f);
+        boxes.add(center.x + rng.uniform(-20.f, 20.f) - w / 2, center.y + rng.uniform(-20.f, 20.f) - w / 2,
+                  w, w, rng.uniform(0.f, 1.f));
+        rects.push_back(cv::Rect2d(boxes.box(i)));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int runs = argc > 1 ? std::max(atoi(argv[1]), 1) : 200;
+    const float iouThreshold = 0.3f;
+    const float scoreThreshold = 0.5f;
+    cv::RNG rng(1);
+    BoxMerging::BoxMerger merger;
+    BoxMerging::BoxSet boxes;
+    std::vector<cv::Rect2d> rects;
+    std::vector<int> indices;
+
+    std::cout << "boxes | BoxMerger::nms us | cv::dnn::NMSBoxes us | speedup" << std::endl;
+    for (int n = 16; n <= 4096; n *= 4){
+        randomBoxes(rng, n, boxes, rects);
+        // Прогрев: буферы BoxMerger выделяются при первом вызове
+        merger.nms(boxes, iouThreshold, scoreThreshold);
+        cv::dnn::NMSBoxes(rects, boxes.score, scoreThreshold, iouThreshold, indices);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < runs; i++){
+            merger.nms(boxes, iouThreshold, scoreThreshold);
+        }
+        std::chrono::duration<double, std::micro> mergerUs = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < runs; i++){
+            cv::dnn::NMSBoxes(rects, boxes.score, scoreThreshold, iouThreshold, indices);
+        }
+        std::chrono::duration<double, std::micro> opencvUs = std::chrono::steady_clock::now() - start;
+
+        if (merger.keep() != indices){
+            std::cout << "results differ for " << n << " boxes" << std::endl;
+        }
+        std::cout << n << " | " << mergerUs.count() / runs << " | " << opencvUs.count() / runs
+                  << " | " << opencvUs.count() / mergerUs.count() << std::endl;
+    }
+    return 0;
+}
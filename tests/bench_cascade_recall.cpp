@@ -0,0 +1,70 @@
+/*
+    Полнота и доля пропущенных кадров каскадного детектора на записанном ролике:
+    CascadeDetector работает в теневом режиме (YuNet на каждом кадре - эталон),
+    для каждого предварительного фильтра выводятся статистика и среднее время кадра
+    без учета эталонной детекции.
+    Запуск из каталога с моделями YuNet и каскада Хаара:
+        bench_cascade_recall ролик [число кадров]
+*/
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "CascadeDetector.h"
+#include "FrameCache.h"
+
+int main(int argc, char** argv)
+{
+    if (argc < 2){
+        std::cout << "Usage: bench_cascade_recall clip [max frames]" << std::endl;
+        return 1;
+    }
+    int maxFrames = argc > 2 ? std::max(atoi(argv[2]), 1) : 1000;
+    std::vector<cv::Mat> frames;
+    cv::VideoCapture capture(argv[1]);
+    cv::Mat frame;
+    while (int(frames.size()) < maxFrames && capture.read(frame)){
+        frames.push_back(frame.clone());
+    }
+    if (frames.empty()){
+        std::cout << "Can't read clip " << argv[1] << std::endl;
+        return 1;
+    }
+
+    const FaceBBDetector::CascadeGate gates[] = {FaceBBDetector::GATE_HAAR, FaceBBDetector::GATE_MOTION,
+                                                 FaceBBDetector::GATE_HAAR_OR_MOTION};
+    const char* names[] = {"haar", "motion", "haar+motion"};
+    for (int g = 0; g < 3; g++){
+        FaceBBDetector::CascadeDetector detector(gates[g]);
+        detector.setReportEvery(0);
+        detector.waitReady();
+
+        // Время кадра измеряется без теневого режима, полнота - на втором проходе
+        FrameCache cache;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < frames.size(); i++){
+            cache.setFrame(frames[i]);
+            detector.detect(cache);
+        }
+        std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+
+        FaceBBDetector::CascadeDetector shadow(gates[g]);
+        shadow.setReportEvery(0);
+        shadow.setShadowMode(true);
+        shadow.waitReady();
+        for (size_t i = 0; i < frames.size(); i++){
+            cache.setFrame(frames[i]);
+            shadow.detect(cache);
+        }
+        const FaceBBDetector::CascadeStats& stats = shadow.stats();
+        std::cout << names[g] << ": " << ms.count() / frames.size() << " ms/frame, gated "
+                  << 100.0 * stats.gatedFraction() << "%, haar " << stats.haarFrames << "/" << stats.frames
+                  << " frames, recall " << 100.0 * stats.recall() << "% (" << stats.recalledFaces
+                  << "/" << stats.referenceFaces << ")" << std::endl;
+    }
+    return 0;
+}
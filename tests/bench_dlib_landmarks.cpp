@@ -0,0 +1,73 @@
+/*
+    Бенчмарк DlibDetector::predict для 1-32 лиц: время кадра при последовательной
+    обработке лиц (планировщик с одним потоком) и при параллельной обработке
+    всеми потоками планировщика.
+    Запуск из каталога с моделью shape_predictor_68_face_landmarks.dat:
+        bench_dlib_landmarks [изображение] [число повторов]
+*/
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "FaceBatch.h"
+#include "FaceKeyPointDetector.h"
+#include "FrameCache.h"
+#include "TaskScheduler.h"
+
+/*
+    Среднее время predict (мс) для numFaces лиц, расположенных сеткой 8 x 4
+*/
+double measure(FaceKPDetector::DlibDetector& detector, FrameCache& frame, int numFaces, int runs)
+{
+    DlibFaceBatch faces;
+    cv::Size size = frame.size();
+    int boxSize = std::min(size.width / 8, size.height / 4);
+    for (int i = 0; i < numFaces; i++){
+        faces.add(cv::Rect2i((i % 8) * size.width / 8, (i / 8) * size.height / 4, boxSize, boxSize), 1.f);
+    }
+    for (int i = 0; i < 3; i++){
+        detector.predict(frame, faces);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++){
+        detector.predict(frame, faces);
+    }
+    std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+    return ms.count() / runs;
+}
+
+int main(int argc, char** argv)
+{
+    cv::Mat image;
+    if (argc > 1){
+        image = cv::imread(argv[1]);
+    }
+    if (image.empty()){
+        // Шум со сглаживанием: деревья регрессии проходят те же ветви, что и на реальных кадрах
+        image.create(720, 1280, CV_8UC3);
+        cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+        cv::GaussianBlur(image, image, cv::Size(7, 7), 2.0);
+    }
+    int runs = argc > 2 ? std::max(atoi(argv[2]), 1) : 30;
+
+    FrameCache frame;
+    frame.setFrame(image);
+    FaceKPDetector::DlibDetector detector;
+    detector.waitReady();
+
+    int numThreads = defaultScheduler().numThreads();
+    const int counts[] = {1, 2, 4, 8, 16, 32};
+    std::cout << "faces | serial ms | parallel ms (" << numThreads << " threads) | speedup | parallel ms/face" << std::endl;
+    for (int k = 0; k < 6; k++){
+        defaultScheduler().setNumThreads(1);
+        double serial = measure(detector, frame, counts[k], runs);
+        defaultScheduler().setNumThreads(numThreads);
+        double parallel = measure(detector, frame, counts[k], runs);
+        std::cout << counts[k] << " | " << serial << " | " << parallel << " | " << serial / parallel
+                  << " | " << parallel / counts[k] << std::endl;
+    }
+    return 0;
+}
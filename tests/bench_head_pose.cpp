@@ -0,0 +1,90 @@
+/*
+    Бенчмарк HeadPoseEstimator: время оценки положения одного лица (мкс)
+    по глубине (с перебором наборов точек для отбрасывания выбросов) и по проекции
+    (solvePnP без начального приближения и с положением предыдущего кадра).
+    Цель - не более 50 мкс на лицо.
+    Запуск: bench_head_pose [число повторов]
+*/
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+
+#include "HeadPose.h"
+
+const OpenNIOpenCV::CameraIntrinsics K = {570.f, 570.f, 320.f, 240.f};
+
+/*
+    Ключевые точки синтетической головы и карта глубины (см. test_head_pose);
+    outlier - подбородок попадает на фон
+*/
+void renderHead(const cv::Vec3d& rvec, const cv::Vec3d& tvec, bool outlier,
+                std::vector<float>& x, std::vector<float>& y, cv::Mat& depth)
+{
+    const int index[] = {30, 8, 36, 45, 48, 54};
+    const cv::Point3f model[] = {cv::Point3f(0, 0, 0), cv::Point3f(0, 66, 13),
+                                 cv::Point3f(-45, -34, 27), cv::Point3f(45, -34, 27),
+                                 cv::Point3f(-30, 30, 25), cv::Point3f(30, 30, 25)};
+    cv::Matx33d R;
+    cv::Rodrigues(rvec, R);
+    x.assign(68, 0.f);
+    y.assign(68, 0.f);
+    depth = cv::Mat(480, 640, CV_16UC1, cv::Scalar(0));
+    for (int i = 0; i < 6; i++){
+        cv::Vec3d p = R * cv::Vec3d(model[i].x, model[i].y, model[i].z) + tvec;
+        float u = float(K.fx * p[0] / p[2] + K.cx), v = float(K.fy * p[1] / p[2] + K.cy);
+        x[index[i]] = u;
+        y[index[i]] = v;
+        cv::Rect2i patch(int(u) - 3, int(v) - 3, 7, 7);
+        depth(patch & cv::Rect2i(0, 0, depth.cols, depth.rows)).setTo(cv::Scalar(p[2] + (outlier && i == 1 ? 600 : 0)));
+    }
+}
+
+/*
+    Среднее время (мкс) оценки положения одного лица
+    Аргументы:
+        - tracked - положение ищется через addFace (начальное приближение - предыдущий кадр)
+*/
+double measure(const std::vector<float>& x, const std::vector<float>& y, const cv::Mat& depth, bool tracked, int runs)
+{
+    FacePose::HeadPoseEstimator estimator;
+    cv::Rect2i box(200, 150, 240, 240);
+    FacePose::HeadPose pose;
+    for (int i = 0; i < 10; i++){
+        estimator.beginFrame();
+        pose = estimator.addFace(box, x.data(), y.data(), 68, K, depth);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; i++){
+        if (tracked){
+            estimator.beginFrame();
+            pose = estimator.addFace(box, x.data(), y.data(), 68, K, depth);
+        }
+        else{
+            pose = estimator.estimateFace(box, x.data(), y.data(), 68, K, depth);
+        }
+    }
+    std::chrono::duration<double, std::micro> us = std::chrono::steady_clock::now() - start;
+    if (!pose.valid){
+        std::cout << "pose not found" << std::endl;
+    }
+    return us.count() / runs;
+}
+
+int main(int argc, char** argv)
+{
+    int runs = argc > 1 ? std::max(atoi(argv[1]), 1) : 10000;
+    std::vector<float> x, y;
+    cv::Mat depth, outlierDepth;
+    renderHead(cv::Vec3d(0.1, 0.35, 0.05), cv::Vec3d(30, -20, 700), false, x, y, depth);
+    renderHead(cv::Vec3d(0.1, 0.35, 0.05), cv::Vec3d(30, -20, 700), true, x, y, outlierDepth);
+
+    std::cout << "depth (6 points): " << measure(x, y, depth, false, runs) << " us/face" << std::endl;
+    std::cout << "depth (chin on background): " << measure(x, y, outlierDepth, false, runs) << " us/face" << std::endl;
+    std::cout << "projection, no initial guess: " << measure(x, y, cv::Mat(), false, runs) << " us/face" << std::endl;
+    std::cout << "projection, previous frame: " << measure(x, y, cv::Mat(), true, runs) << " us/face" << std::endl;
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+    Выделения памяти в установившемся режиме на пути детекция -> ключевые точки ->
+    отрисовка. Считаются все выделения процесса: функции malloc glibc заменяются
+    в тесте, поэтому учитываются и operator new, и cv::fastMalloc (буферы cv::Mat).
+    Без моделей: сопоставление детекций DetectThenTrack (строки в формате YuNet)
+    с заменой точек слежения ключевыми точками, кэш ключевых точек CachedLandmarks
+    с детектором без модели, распределяющим лица по задачам планировщика
+    (parallelFor), и drawLandmarks - выделений быть не должно.
+    С моделями face_detection_yunet_2023mar.onnx и shape_predictor_68_face_landmarks.dat
+    в каталоге теста: YuNet, DlibDetector и drawLandmarks на кадре с шумом. Сам
+    dlib::shape_predictor выделяет память на каждое лицо (результат возвращается
+    в новом dlib::full_object_detection), поэтому для него проверяется только, что
+    число выделений на кадр не растет; число выделений YuNet выводится.
+*/
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <opencv2/core.hpp>
+
+#include "FaceBatch.h"
+#include "FaceDetectors.h"
+#include "FaceKeyPointDetector.h"
+#include "FaceTracker.h"
+#include "FrameCache.h"
+#include "LandmarkCache.h"
+#include "TaskScheduler.h"
+#include "TestUtils.h"
+#include "Utils.h"
+
+std::atomic<bool> g_counting(false);
+std::atomic<long long> g_allocations(0);
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* p);
+
+static void countAllocation()
+{
+    if (g_counting.load(std::memory_order_relaxed)){
+        g_allocations++;
+    }
+}
+
+// Замена функций выделения памяти glibc: operator new и cv::fastMalloc вызывают их
+void* malloc(size_t size) { countAllocation(); return __libc_malloc(size); }
+void* calloc(size_t count, size_t size) { countAllocation(); return __libc_calloc(count, size); }
+void* realloc(void* p, size_t size) { countAllocation(); return __libc_realloc(p, size); }
+void* memalign(size_t alignment, size_t size) { countAllocation(); return __libc_memalign(alignment, size); }
+void* aligned_alloc(size_t alignment, size_t size) { countAllocation(); return __libc_memalign(alignment, size); }
+int posix_memalign(void** p, size_t alignment, size_t size)
+{
+    countAllocation();
+    *p = __libc_memalign(alignment, size);
+    return *p ? 0 : ENOMEM;
+}
+void free(void* p) { __libc_free(p); }
+}
+
+/*
+    Число выделений памяти при вызове f
+*/
+template<class F>
+long long countAllocations(F f)
+{
+    g_allocations.store(0);
+    g_counting.store(true);
+    f();
+    g_counting.store(false);
+    return g_allocations.load();
+}
+
+/*
+    Детектор ключевых точек без модели: точки на окружности, вписанной в box.
+    Лица обрабатываются задачами общего планировщика, как в DlibDetector.
+*/
+class CircleLandmarks
+{
+public:
+    static const int numLandmarks = 68;
+
+    void predict(FrameCache&, FaceBatch<numLandmarks>& faces, const std::vector<int>& indices)
+    {
+        defaultScheduler().parallelFor(cv::Range(0, int(indices.size())), [&](const cv::Range& range){
+            for (int k = range.start; k < range.end; k++){
+                int i = indices[k];
+                const cv::Rect2i& box = faces.box(i);
+                for (int j = 0; j < numLandmarks; j++){
+                    float angle = float(CV_2PI) * j / numLandmarks;
+                    faces.setLandmark(i, j, box.x + box.width * (0.5f + 0.4f * std::cos(angle)),
+                                      box.y + box.height * (0.5f + 0.4f * std::sin(angle)));
+                }
+            }
+        });
+    }
+    bool isReady() const { return true; }
+    void waitReady() {}
+};
+
+/*
+    Детекции кадра frame: число лиц меняется от 0 до 4, лица медленно движутся
+*/
+cv::Mat detections(int frame)
+{
+    static const int counts[] = {4, 2, 3, 0, 1, 4, 3};
+    int n = counts[(frame / 5) % 7];
+    cv::Mat faces(n, 15, CV_32F, cv::Scalar(0));
+    for (int i = 0; i < n; i++){
+        float* row = faces.ptr<float>(i);
+        row[0] = 20.f + 150.f * i + (frame % 5);
+        row[1] = 60.f + (frame % 3);
+        row[2] = 100.f;
+        row[3] = 100.f;
+        for (int j = 0; j < 5; j++){
+            row[4 + 2 * j] = row[0] + 20.f + 15.f * j;
+            row[5 + 2 * j] = row[1] + 50.f;
+        }
+        row[14] = 0.9f;
+    }
+    return faces;
+}
+
+/*
+    Путь без моделей: выделений в установившемся режиме нет
+*/
+void testModelFreePath()
+{
+    const int warmUpFrames = 70;
+    const int numFrames = 350;
+    // Детекции готовятся заранее, чтобы не учитывать выделения самого теста
+    std::vector<cv::Mat> frames;
+    for (int f = 0; f < numFrames; f++){
+        frames.push_back(detections(f));
+    }
+
+    FaceTracking::DetectThenTrack tracker;
+    FaceKPDetector::CachedLandmarks<CircleLandmarks> landmarks;
+    DlibFaceBatch faces;
+    FrameCache frameCache;
+    cv::Mat canvas(480, 640, CV_8UC3, cv::Scalar::all(0));
+    // Фоновая загрузка модели YuNet (в тесте сеть не используется) должна завершиться
+    // до начала подсчета: выделения ее потока также попадают в счетчик
+    try{
+        tracker.waitReady();
+    }
+    catch (...){
+    }
+
+    auto processFrame = [&](int f){
+        tracker.assignDetections(frames[f]);
+        const std::vector<FaceTracking::TrackedFace>& tracked = tracker.faces();
+        faces.resize(int(tracked.size()));
+        for (size_t i = 0; i < tracked.size(); i++){
+            faces.box(int(i)) = cv::Rect2i(tracked[i].box);
+            faces.score(int(i)) = tracked[i].score;
+            faces.id(int(i)) = tracked[i].id;
+        }
+        landmarks.predict(frameCache, faces);
+        tracker.seedLandmarks(faces);
+        drawLandmarks(canvas, faces);
+    };
+    for (int f = 0; f < warmUpFrames; f++){
+        processFrame(f);
+    }
+    long long steadyAllocations = countAllocations([&]{
+        for (int f = warmUpFrames; f < numFrames; f++){
+            processFrame(f);
+        }
+    });
+    std::cout << "Allocations in " << numFrames - warmUpFrames << " steady-state frames (no models): "
+              << steadyAllocations << std::endl;
+    CHECK(steadyAllocations == 0);
+}
+
+bool fileExists(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+/*
+    Путь с моделями YuNet и dlib (если модели есть в каталоге теста)
+*/
+void testModelPath()
+{
+    if (!fileExists("face_detection_yunet_2023mar.onnx") || !fileExists("shape_predictor_68_face_landmarks.dat")){
+        std::cout << "Model path skipped: face_detection_yunet_2023mar.onnx, shape_predictor_68_face_landmarks.dat not found" << std::endl;
+        return;
+    }
+    FaceBBDetector::YuNetDetector detector;
+    FaceKPDetector::DlibDetector landmarks;
+    detector.waitReady();
+    landmarks.waitReady();
+
+    cv::Mat image(480, 640, CV_8UC3);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+    FrameCache frameCache;
+    frameCache.setFrame(image);
+    cv::Mat canvas = image.clone();
+    DlibFaceBatch faces;
+    faces.resize(3);
+    for (int i = 0; i < faces.size(); i++){
+        faces.box(i) = cv::Rect2i(40 + 200 * i, 140, 160, 160);
+        faces.id(i) = i;
+    }
+
+    const int warmUpFrames = 10, numFrames = 40;
+    long long detectTotal = 0, minLandmarks = -1, maxLandmarks = -1, drawTotal = 0;
+    for (int f = 0; f < numFrames; f++){
+        long long detect = countAllocations([&]{ detector.detect(frameCache); });
+        long long predict = countAllocations([&]{ landmarks.predict(frameCache, faces); });
+        long long draw = countAllocations([&]{ drawLandmarks(canvas, faces); });
+        if (f < warmUpFrames){
+            continue;
+        }
+        detectTotal += detect;
+        drawTotal += draw;
+        minLandmarks = minLandmarks < 0 ? predict : std::min(minLandmarks, predict);
+        maxLandmarks = std::max(maxLandmarks, predict);
+    }
+    int frames = numFrames - warmUpFrames;
+    std::cout << "Allocations per frame with models: YuNet " << double(detectTotal) / frames
+              << ", dlib " << maxLandmarks << " (" << faces.size() << " faces), draw " << double(drawTotal) / frames << std::endl;
+    CHECK(drawTotal == 0);
+    CHECK(minLandmarks == maxLandmarks);
+}
+
+int main()
+{
+    testModelFreePath();
+    testModelPath();
+    return testResult("test_allocations");
+}
@@ -0,0 +1,154 @@
+/*
+    BoxMerger: NMS совпадает с полным перебором (IoU с делением) и с cv::dnn::NMSBoxes
+    на случайных наборах boxes разного размера (в том числе не кратного 4),
+    weighted box fusion усредняет кластер с весами-уверенностями.
+*/
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/dnn.hpp>
+
+#include "BoxMerging.h"
+#include "TestUtils.h"
+
+/*
+    Случайные boxes, собранные в группы вокруг нескольких центров, чтобы
+    перекрытия встречались часто и IoU принимал значения во всем диапазоне
+*/
+void randomBoxes(cv::RNG& rng, int n, BoxMerging::BoxSet& boxes)
+{
+    boxes.clear();
+    int numCenters = std::max(1, n / 6);
+    std::vector<cv::Point2f> centers;
+    for (int c = 0; c < numCenters; c++){
+        centers.push_back(cv::Point2f(rng.uniform(0.f, 600.f), rng.uniform(0.f, 400.f)));
+    }
+    for (int i = 0; i < n; i++){
+        const cv::Point2f& center = centers[rng.uniform(0, numCenters)];
+        float w = rng.uniform(20.f, 80.f);
+        float h = w * rng.uniform(0.8f, 1.25f);
+        boxes.add(center.x + rng.uniform(-20.f, 20.f) - w / 2, center.y + rng.uniform(-20.f, 20.f) - h / 2,
+                  w, h, rng.uniform(0.f, 1.f));
+    }
+}
+
+float iou(const BoxMerging::BoxSet& boxes, int a, int b)
+{
+    cv::Rect2f ra = boxes.box(a), rb = boxes.box(b);
+    float inter = (ra & rb).area();
+    return inter / (ra.area() + rb.area() - inter);
+}
+
+/*
+    NMS полным перебором: boxes по убыванию уверенности, box оставляется,
+    если его IoU со всеми оставленными не больше порога
+*/
+std::vector<int> bruteForceNms(const BoxMerging::BoxSet& boxes, float iouThreshold, float scoreThreshold)
+{
+    std::vector<int> order;
+    for (int i = 0; i < boxes.size(); i++){
+        if (boxes.score[i] >= scoreThreshold){
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&boxes](int a, int b){ return boxes.score[a] > boxes.score[b]; });
+    std::vector<int> keep;
+    for (size_t k = 0; k < order.size(); k++){
+        bool suppressed = false;
+        for (size_t j = 0; j < keep.size() && !suppressed; j++){
+            suppressed = iou(boxes, order[k], keep[j]) > iouThreshold;
+        }
+        if (!suppressed){
+            keep.push_back(order[k]);
+        }
+    }
+    return keep;
+}
+
+void testNmsMatchesReference()
+{
+    cv::RNG rng(2024);
+    BoxMerging::BoxMerger merger;
+    BoxMerging::BoxSet boxes;
+    const int sizes[] = {0, 1, 2, 3, 5, 7, 16, 33, 64, 257};
+    const float iouThresholds[] = {0.1f, 0.3f, 0.5f, 0.7f};
+    for (int s = 0; s < 10; s++){
+        for (int t = 0; t < 4; t++){
+            for (int trial = 0; trial < 20; trial++){
+                randomBoxes(rng, sizes[s], boxes);
+                float scoreThreshold = trial % 2 ? 0.3f : 0.f;
+                std::vector<int> expected = bruteForceNms(boxes, iouThresholds[t], scoreThreshold);
+                CHECK(merger.nms(boxes, iouThresholds[t], scoreThreshold) == expected);
+
+                // NMSBoxes оставляет boxes с уверенностью строго выше порога: случайные
+                // уверенности не совпадают с порогом, поэтому результаты должны совпасть
+                std::vector<cv::Rect2d> rects;
+                for (int i = 0; i < boxes.size(); i++){
+                    rects.push_back(cv::Rect2d(boxes.box(i)));
+                }
+                std::vector<int> opencv;
+                cv::dnn::NMSBoxes(rects, boxes.score, scoreThreshold, iouThresholds[t], opencv);
+                CHECK(merger.keep() == opencv);
+            }
+        }
+    }
+}
+
+void testTopK()
+{
+    cv::RNG rng(7);
+    BoxMerging::BoxMerger merger;
+    BoxMerging::BoxSet boxes;
+    randomBoxes(rng, 100, boxes);
+    std::vector<int> expected = bruteForceNms(boxes, 0.3f, 0.f);
+    expected.resize(std::min<size_t>(expected.size(), 3));
+    CHECK(merger.nms(boxes, 0.3f, 0.f, 3) == expected);
+}
+
+void testFuse()
+{
+    BoxMerging::BoxMerger merger;
+    BoxMerging::BoxSet boxes, fused;
+    // Кластер из двух boxes с уверенностями 0.9 и 0.3 и отдельный box
+    boxes.add(100.f, 100.f, 50.f, 50.f, 0.9f);
+    boxes.add(104.f, 102.f, 50.f, 50.f, 0.3f);
+    boxes.add(300.f, 100.f, 40.f, 40.f, 0.6f);
+    merger.fuse(boxes, fused, 0.5f);
+    CHECK(fused.size() == 2);
+    CHECK(std::abs(fused.x1[0] - (0.9f * 100.f + 0.3f * 104.f) / 1.2f) < 1e-3f);
+    CHECK(std::abs(fused.y1[0] - (0.9f * 100.f + 0.3f * 102.f) / 1.2f) < 1e-3f);
+    CHECK(std::abs(fused.x2[0] - (0.9f * 150.f + 0.3f * 154.f) / 1.2f) < 1e-3f);
+    CHECK(std::abs(fused.score[0] - 0.9f) < 1e-6f);
+    CHECK(std::abs(fused.x1[1] - 300.f) < 1e-3f && std::abs(fused.score[1] - 0.6f) < 1e-6f);
+
+    // Строки YuNet: координаты и ключевые точки усредняются, уверенность - максимальная
+    cv::Mat rows(3, 15, CV_32F, cv::Scalar(0));
+    for (int i = 0; i < 3; i++){
+        cv::Rect2f box = boxes.box(i);
+        float* row = rows.ptr<float>(i);
+        row[0] = box.x;
+        row[1] = box.y;
+        row[2] = box.width;
+        row[3] = box.height;
+        for (int j = 4; j < 14; j++){
+            row[j] = float(10 * i + j);
+        }
+        row[14] = boxes.score[i];
+    }
+    cv::Mat fusedRows;
+    merger.fuseRows(rows, 14, fusedRows);
+    CHECK(fusedRows.rows == 2);
+    CHECK(std::abs(fusedRows.at<float>(0, 4) - (0.9f * 4.f + 0.3f * 14.f) / 1.2f) < 1e-3f);
+    CHECK(std::abs(fusedRows.at<float>(0, 14) - 0.9f) < 1e-6f);
+    CHECK(std::abs(fusedRows.at<float>(1, 0) - 300.f) < 1e-3f);
+}
+
+int main()
+{
+    testNmsMatchesReference();
+    testTopK();
+    testFuse();
+    return testResult("test_box_merging");
+}
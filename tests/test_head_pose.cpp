@@ -0,0 +1,109 @@
+/*
+    HeadPoseEstimator по глубине: синтетическая голова с известным положением,
+    карта глубины содержит глубину опорных точек. Положение должно находиться
+    по глубине и совпадать с истинным, в том числе когда одна или две опорные
+    точки попадают на фон или имеют ошибочную глубину; по ключевым точкам,
+    заранее переведенным в 3D (Landmarks3D), находится то же положение.
+*/
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+
+#include "FaceBatch.h"
+#include "HeadPose.h"
+#include "TestUtils.h"
+
+const OpenNIOpenCV::CameraIntrinsics K = {570.f, 570.f, 320.f, 240.f};
+
+/*
+    Опорные точки модели для 68 ключевых точек (как в HeadPoseEstimator)
+*/
+const int modelIndex[] = {30, 8, 36, 45, 48, 54};
+const cv::Point3f modelPoints[] = {cv::Point3f(0, 0, 0), cv::Point3f(0, 66, 13),
+                                   cv::Point3f(-45, -34, 27), cv::Point3f(45, -34, 27),
+                                   cv::Point3f(-30, 30, 25), cv::Point3f(30, 30, 25)};
+
+/*
+    Проекции опорных точек головы с положением (rvec, tvec) и карта глубины,
+    в которой вокруг каждой проекции записана глубина точки (depthError[i] мм - ошибка)
+*/
+void renderHead(const cv::Vec3d& rvec, const cv::Vec3d& tvec, const float depthError[6],
+                std::vector<float>& x, std::vector<float>& y, cv::Mat& depth)
+{
+    cv::Matx33d R;
+    cv::Rodrigues(rvec, R);
+    x.assign(68, 0.f);
+    y.assign(68, 0.f);
+    depth = cv::Mat(480, 640, CV_16UC1, cv::Scalar(0));
+    for (int i = 0; i < 6; i++){
+        cv::Vec3d p = R * cv::Vec3d(modelPoints[i].x, modelPoints[i].y, modelPoints[i].z) + tvec;
+        float u = float(K.fx * p[0] / p[2] + K.cx), v = float(K.fy * p[1] / p[2] + K.cy);
+        x[modelIndex[i]] = u;
+        y[modelIndex[i]] = v;
+        cv::Rect2i patch(int(u) - 3, int(v) - 3, 7, 7);
+        depth(patch & cv::Rect2i(0, 0, depth.cols, depth.rows)).setTo(cv::Scalar(p[2] + depthError[i]));
+    }
+}
+
+/*
+    Угол (градусы) между поворотами rvec и истинным
+*/
+double rotationError(const cv::Vec3d& rvec, const cv::Vec3d& truth)
+{
+    cv::Matx33d R, T;
+    cv::Rodrigues(rvec, R);
+    cv::Rodrigues(truth, T);
+    cv::Vec3d diff;
+    cv::Rodrigues(R * T.t(), diff);
+    return cv::norm(diff) * 180.0 / CV_PI;
+}
+
+void checkPose(const float depthError[6])
+{
+    const cv::Vec3d rvecs[] = {cv::Vec3d(0, 0, 0), cv::Vec3d(0.1, 0.35, 0.05), cv::Vec3d(-0.2, -0.5, 0.1)};
+    const cv::Vec3d tvec(30, -20, 700);
+    for (int k = 0; k < 3; k++){
+        std::vector<float> x, y;
+        cv::Mat depth;
+        renderHead(rvecs[k], tvec, depthError, x, y, depth);
+        FacePose::HeadPoseEstimator estimator;
+        FacePose::HeadPose pose = estimator.estimateFace(cv::Rect2i(200, 150, 240, 240), x.data(), y.data(), 68, K, depth);
+        CHECK(pose.valid);
+        CHECK(pose.fromDepth);
+        CHECK(rotationError(pose.rvec, rvecs[k]) < 2.0);
+        CHECK(cv::norm(pose.tvec - tvec) < 5.0);
+
+        // Те же ключевые точки, заранее переведенные в 3D (Landmarks3D): то же положение
+        FaceBatch<68> faces;
+        faces.add(cv::Rect2i(200, 150, 240, 240), 1.f);
+        std::copy(x.begin(), x.end(), faces.x(0));
+        std::copy(y.begin(), y.end(), faces.y(0));
+        FacePose::Landmarks3D<68> points;
+        points.lift(faces, depth, K);
+        FacePose::HeadPoseEstimator liftedEstimator;
+        const FacePose::HeadPose& lifted = liftedEstimator.estimate(faces, points, K)[0];
+        CHECK(lifted.valid);
+        CHECK(lifted.fromDepth);
+        CHECK(rotationError(lifted.rvec, pose.rvec) < 0.01);
+        CHECK(cv::norm(lifted.tvec - pose.tvec) < 0.01);
+    }
+}
+
+int main()
+{
+    const float clean[6] = {0, 0, 0, 0, 0, 0};
+    // Подбородок на фоне (на 600 мм дальше)
+    const float background[6] = {0, 600, 0, 0, 0, 0};
+    // Угол глаза в тени волос: ошибка глубины в пределах перепада глубины лица
+    const float shadowed[6] = {0, 0, 70, 0, 0, 0};
+    // Фон и ошибочная глубина одновременно
+    const float both[6] = {0, 600, 0, 0, 0, -70};
+    checkPose(clean);
+    checkPose(background);
+    checkPose(shadowed);
+    checkPose(both);
+    return testResult("test_head_pose");
+}
@@ -0,0 +1,156 @@
+/*
+    IdentityIndex: сохранение и загрузка индекса (до и после обучения) сохраняют
+    результаты поиска; файлы с испорченным заголовком или размерами списков
+    не загружаются, и индекс остается пустым.
+    TrackIdentityCache: распознанное лицо не распознается повторно, нераспознанное -
+    раз в retryEvery кадров, записи пропавших лиц занимают новые лица.
+*/
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "IdentityIndex.h"
+#include "TestUtils.h"
+
+const std::string indexPath = "test_identity_index.bin";
+
+std::vector<char> readFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::vector<char>& data)
+{
+    std::ofstream file(path, std::ios::binary);
+    file.write(data.data(), data.size());
+}
+
+/*
+    Копия файла индекса, в которой по смещению offset записано value
+*/
+std::vector<char> patched(const std::vector<char>& data, size_t offset, int32_t value)
+{
+    std::vector<char> result = data;
+    memcpy(result.data() + offset, &value, sizeof(value));
+    return result;
+}
+
+/*
+    Каждый дескриптор находится поиском самого себя
+*/
+void checkSearch(const FaceRecognition::IdentityIndex& index, const cv::Mat& embeddings)
+{
+    CHECK(index.size() == embeddings.rows);
+    for (int i = 0; i < embeddings.rows; i++){
+        std::vector<FaceRecognition::SearchResult> nearest = index.search(embeddings.row(i), 1);
+        CHECK(nearest.size() == 1 && nearest[0].id == i && nearest[0].similarity > 0.95f);
+    }
+}
+
+/*
+    Файл не загружается, индекс после попытки загрузки пустой
+*/
+void checkRejected(const std::vector<char>& data)
+{
+    writeFile(indexPath, data);
+    FaceRecognition::IdentityIndex index;
+    CHECK(!index.load(indexPath));
+    CHECK(index.size() == 0 && !index.isTrained());
+    cv::Mat query(1, 128, CV_32F, cv::Scalar(1.f / std::sqrt(128.f)));
+    CHECK(index.search(query, 1).empty());
+}
+
+void testTrackCache()
+{
+    FaceRecognition::TrackIdentityCache cache(2, 3);
+    const int unknown = FaceRecognition::TrackIdentityCache::unknown;
+    int identity;
+    // Новые лица распознаются сразу, лицо без сопровождения - на каждом кадре
+    cache.beginFrame();
+    CHECK(cache.needsRecognition(10, identity) && identity == unknown);
+    CHECK(cache.needsRecognition(11, identity));
+    CHECK(cache.needsRecognition(-1, identity));
+    cache.store(10, 7);
+    cache.store(11, unknown);
+    // Лицо 10 распознано, лицо 11 повторяется через 3 кадра
+    int retries = 0;
+    for (int frame = 0; frame < 6; frame++){
+        cache.beginFrame();
+        CHECK(!cache.needsRecognition(10, identity) && identity == 7);
+        if (cache.needsRecognition(11, identity)){
+            retries++;
+            cache.store(11, unknown);
+        }
+    }
+    CHECK(retries == 2);
+    // Лицо 12 занимает запись пропавшего лица 11, третье лицо не помещается
+    cache.beginFrame();
+    CHECK(!cache.needsRecognition(10, identity) && identity == 7);
+    CHECK(cache.needsRecognition(12, identity));
+    cache.store(12, 3);
+    CHECK(cache.needsRecognition(13, identity) && identity == unknown);
+    cache.beginFrame();
+    CHECK(!cache.needsRecognition(12, identity) && identity == 3);
+    CHECK(cache.needsRecognition(11, identity) && identity == unknown);
+    cache.clear();
+    cache.beginFrame();
+    CHECK(cache.needsRecognition(10, identity) && identity == unknown);
+}
+
+int main()
+{
+    cv::RNG rng(3);
+    cv::Mat embeddings(64, 128, CV_32F);
+    rng.fill(embeddings, cv::RNG::NORMAL, 0.f, 1.f);
+    for (int i = 0; i < embeddings.rows; i++){
+        cv::Mat row = embeddings.row(i);
+        cv::normalize(embeddings.row(i), row);
+    }
+
+    // Необученный индекс: один список
+    FaceRecognition::IdentityIndex index(128, 4);
+    for (int i = 0; i < embeddings.rows; i++){
+        index.add(i, embeddings.row(i));
+    }
+    CHECK(index.save(indexPath));
+    std::vector<char> untrained = readFile(indexPath);
+    FaceRecognition::IdentityIndex loaded;
+    CHECK(loaded.load(indexPath));
+    checkSearch(loaded, embeddings);
+
+    // Обученный индекс: все списки просматриваются (4 списка, 8 проб)
+    index.train(index.embeddings());
+    CHECK(index.isTrained());
+    CHECK(index.save(indexPath));
+    std::vector<char> trained = readFile(indexPath);
+    FaceRecognition::IdentityIndex loadedTrained;
+    CHECK(loadedTrained.load(indexPath));
+    CHECK(loadedTrained.isTrained() && loadedTrained.numLists() == 4);
+    checkSearch(loadedTrained, embeddings);
+
+    // Заголовок: "FACEIVF1", dim, numLists, обучен, число списков; затем размер первого списка
+    const size_t dimOffset = 8, listsOffset = 12, storedOffset = 20, firstListOffset = 24;
+    checkRejected(std::vector<char>(untrained.begin(), untrained.begin() + untrained.size() / 2));
+    checkRejected(std::vector<char>(untrained.begin(), untrained.begin() + 20));
+    checkRejected(patched(untrained, dimOffset, 0));
+    checkRejected(patched(untrained, dimOffset, -128));
+    checkRejected(patched(untrained, listsOffset, 0));
+    checkRejected(patched(untrained, storedOffset, 0));
+    checkRejected(patched(untrained, storedOffset, 0x7fffffff));
+    checkRejected(patched(trained, storedOffset, 3));
+    checkRejected(patched(trained, listsOffset, 0x40000000));
+    checkRejected(patched(untrained, firstListOffset, -1));
+    checkRejected(patched(untrained, firstListOffset, 0x7fffffff));
+    checkRejected(patched(untrained, firstListOffset, 65));
+
+    std::remove(indexPath.c_str());
+    testTrackCache();
+    return testResult("test_identity_index");
+}
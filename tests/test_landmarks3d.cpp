@@ -0,0 +1,137 @@
+/*
+    Landmarks3D: ключевые точки на синтетических картах глубины (наклонная
+    плоскость и сфера) переводятся в 3D и сравниваются с истинными координатами;
+    точки в дырах глубины отбрасываются, одиночные дыры и выбросы глубины
+    рядом с точкой не искажают результат.
+*/
+#include <cmath>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "FaceBatch.h"
+#include "Landmarks3D.h"
+#include "TestUtils.h"
+
+const OpenNIOpenCV::CameraIntrinsics K = {500.f, 500.f, 320.f, 240.f};
+
+/*
+    Наклонная плоскость: глубина (мм) пикселя (u, v)
+*/
+float planeDepth(float u, float v)
+{
+    return 800.f + 0.5f * (u - K.cx) + 0.25f * (v - K.cy);
+}
+
+/*
+    Сфера с центром center и радиусом radius (мм): глубина ближайшего пересечения
+    луча пикселя (u, v) со сферой, 0 - луч не пересекает сферу
+*/
+float sphereDepth(float u, float v, const cv::Point3f& center, float radius)
+{
+    cv::Point3f ray((u - K.cx) / K.fx, (v - K.cy) / K.fy, 1.f);
+    float a = ray.dot(ray), b = ray.dot(center), c = center.dot(center) - radius * radius;
+    float disc = b * b - a * c;
+    return disc < 0.f ? 0.f : (b - std::sqrt(disc)) / a;
+}
+
+/*
+    Точка обратной проекции совпадает с истинной точкой поверхности
+*/
+void checkPoint(const FacePose::Landmarks3D<5>& points, int i, int j, float x, float y, float z, float tolerance)
+{
+    CHECK(points.valid(i)[j]);
+    CHECK(std::abs(points.Z(i)[j] - z) < tolerance);
+    CHECK(std::abs(points.X(i)[j] - (x - K.cx) * z / K.fx) < tolerance);
+    CHECK(std::abs(points.Y(i)[j] - (y - K.cy) * z / K.fy) < tolerance);
+}
+
+void checkHole(const FacePose::Landmarks3D<5>& points, int i, int j)
+{
+    CHECK(!points.valid(i)[j]);
+    CHECK(points.Z(i)[j] == 0.f);
+    CHECK(points.X(i)[j] == 0.f && points.Y(i)[j] == 0.f);
+}
+
+/*
+    Два лица на наклонной плоскости (точки в дробных координатах).
+    Лицо 1: точка 0 в большой дыре глубины, точка 1 за пределами кадра,
+    точка 2 в дыре из одного пикселя, точка 3 рядом с выбросом глубины
+*/
+void testPlane()
+{
+    cv::Mat depth(480, 640, CV_16UC1);
+    for (int v = 0; v < depth.rows; v++){
+        for (int u = 0; u < depth.cols; u++){
+            depth.at<uint16_t>(v, u) = uint16_t(std::lround(planeDepth(float(u), float(v))));
+        }
+    }
+    depth(cv::Rect(400, 300, 20, 20)).setTo(cv::Scalar(0));
+    depth.at<uint16_t>(100, 451) = 0;
+    depth.at<uint16_t>(200, 501) = 3000;
+
+    FaceBatch<5> faces;
+    faces.resize(2);
+    const float x0[5] = {150.3f, 210.7f, 180.5f, 160.2f, 200.9f};
+    const float y0[5] = {120.6f, 118.1f, 150.5f, 185.4f, 182.8f};
+    const float x1[5] = {410.f, 650.f, 450.5f, 500.4f, 520.25f};
+    const float y1[5] = {310.f, 100.f, 99.5f, 200.3f, 260.75f};
+    for (int j = 0; j < 5; j++){
+        faces.setLandmark(0, j, x0[j], y0[j]);
+        faces.setLandmark(1, j, x1[j], y1[j]);
+    }
+    FacePose::Landmarks3D<5> points;
+    points.lift(faces, depth, K);
+    CHECK(points.size() == 2);
+    // Глубина плоскости округлена до миллиметра
+    for (int j = 0; j < 5; j++){
+        checkPoint(points, 0, j, x0[j], y0[j], planeDepth(x0[j], y0[j]), 1.f);
+    }
+    checkHole(points, 1, 0);
+    checkHole(points, 1, 1);
+    for (int j = 2; j < 5; j++){
+        checkPoint(points, 1, j, x1[j], y1[j], planeDepth(x1[j], y1[j]), 1.f);
+    }
+    CHECK(points.point(1, 4) == cv::Point3f(points.X(1)[4], points.Y(1)[4], points.Z(1)[4]));
+}
+
+/*
+    Точки на сфере (голова радиусом 100 мм на расстоянии 700 мм) лежат на
+    ее поверхности; точка на фоне за сферой получает глубину фона
+*/
+void testSphere()
+{
+    const cv::Point3f center(20.f, -10.f, 700.f);
+    const float radius = 100.f, background = 2000.f;
+    cv::Mat depth(480, 640, CV_16UC1);
+    for (int v = 0; v < depth.rows; v++){
+        for (int u = 0; u < depth.cols; u++){
+            float z = sphereDepth(float(u), float(v), center, radius);
+            depth.at<uint16_t>(v, u) = uint16_t(std::lround(z > 0.f ? z : background));
+        }
+    }
+    // Проекция центра сферы: (334.3, 232.9), радиус изображения около 71 пикселя
+    const float x[5] = {310.4f, 360.6f, 334.3f, 315.8f, 520.5f};
+    const float y[5] = {205.2f, 210.7f, 232.9f, 265.1f, 60.5f};
+    FaceBatch<5> faces;
+    faces.resize(1);
+    for (int j = 0; j < 5; j++){
+        faces.setLandmark(0, j, x[j], y[j]);
+    }
+    FacePose::Landmarks3D<5> points;
+    points.lift(faces, depth, K);
+    for (int j = 0; j < 4; j++){
+        CHECK(points.valid(0)[j]);
+        CHECK(std::abs(points.Z(0)[j] - sphereDepth(x[j], y[j], center, radius)) < 1.f);
+        float distance = float(cv::norm(points.point(0, j) - center));
+        CHECK(std::abs(distance - radius) < 1.5f);
+    }
+    checkPoint(points, 0, 4, x[4], y[4], background, 0.01f);
+}
+
+int main()
+{
+    testPlane();
+    testSphere();
+    return testResult("test_landmarks3d");
+}
@@ -0,0 +1,306 @@
+/*
+    MultiFaceTracker: венгерский алгоритм сравнивается с полным перебором
+    назначений; сопровождение проверяется на синтетических кадрах с
+    текстурированными лицами и детекциями в формате YuNet (сеть не запускается):
+    сохранение идентификаторов при пересечении лиц и коротких пропусках,
+    гистерезис подтверждения и удаления лица.
+*/
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "FrameCache.h"
+#include "MultiFaceTracker.h"
+#include "TestUtils.h"
+
+/*
+    Минимальная стоимость назначения полным перебором: назначается
+    min(rows, cols) пар, каждая строка и каждый столбец - не более одного раза
+*/
+float bruteForceCost(const std::vector<float>& cost, int rows, int cols, int row, int assigned,
+                     std::vector<char>& usedCols)
+{
+    int needed = std::min(rows, cols);
+    if (row == rows){
+        return assigned == needed ? 0.f : std::numeric_limits<float>::infinity();
+    }
+    // Строка без назначения допустима, только если оставшихся строк хватает
+    float best = std::numeric_limits<float>::infinity();
+    if (rows - row - 1 >= needed - assigned){
+        best = bruteForceCost(cost, rows, cols, row + 1, assigned, usedCols);
+    }
+    for (int j = 0; j < cols; j++){
+        if (usedCols[j]){
+            continue;
+        }
+        usedCols[j] = 1;
+        best = std::min(best, cost[row * cols + j] + bruteForceCost(cost, rows, cols, row + 1, assigned + 1, usedCols));
+        usedCols[j] = 0;
+    }
+    return best;
+}
+
+/*
+    Случайные матрицы до 5 x 5, в том числе строк больше, чем столбцов:
+    назначение корректно (столбцы не повторяются, назначено min(rows, cols) строк),
+    его стоимость совпадает с минимумом перебора
+*/
+void testHungarian()
+{
+    FaceTracking::HungarianSolver solver;
+    cv::RNG rng(2024);
+    for (int trial = 0; trial < 300; trial++){
+        int rows = rng.uniform(1, 6), cols = rng.uniform(1, 6);
+        std::vector<float> cost(rows * cols);
+        for (size_t i = 0; i < cost.size(); i++){
+            // Целые стоимости дают одинаковые назначения, дробные - общий случай
+            cost[i] = trial % 2 ? float(rng.uniform(0, 4)) : rng.uniform(0.f, 1.f);
+        }
+        std::vector<int> assignment(rows, -2);
+        solver.solve(cost.data(), cols, rows, cols, assignment.data());
+
+        std::vector<char> usedCols(cols, 0);
+        int assigned = 0;
+        float total = 0.f;
+        for (int i = 0; i < rows; i++){
+            int j = assignment[i];
+            CHECK(j >= -1 && j < cols);
+            if (j < 0 || j >= cols){
+                continue;
+            }
+            CHECK(!usedCols[j]);
+            usedCols[j] = 1;
+            assigned++;
+            total += cost[i * cols + j];
+        }
+        CHECK(assigned == std::min(rows, cols));
+        std::fill(usedCols.begin(), usedCols.end(), 0);
+        float best = bruteForceCost(cost, rows, cols, 0, 0, usedCols);
+        CHECK(std::abs(total - best) < 1e-4f);
+    }
+
+    // Строк больше, чем столбцов: лучшие строки выбираются для каждого столбца
+    const float tall[] = {5.f, 9.f,
+                          1.f, 8.f,
+                          7.f, 2.f};
+    int assignment[3];
+    solver.solve(tall, 2, 3, 2, assignment);
+    CHECK(assignment[0] == -1 && assignment[1] == 0 && assignment[2] == 1);
+}
+
+/*
+    Текстура: размытый шум, растянутый на весь диапазон яркости
+*/
+cv::Mat texture(cv::Size size, uint64_t seed)
+{
+    cv::Mat noise(size, CV_8UC1);
+    cv::RNG rng(seed);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+    cv::GaussianBlur(noise, noise, cv::Size(0, 0), 2.0);
+    cv::normalize(noise, noise, 0, 255, cv::NORM_MINMAX);
+    return noise;
+}
+
+/*
+    Детекция лица с box (x, y, size, size) и ключевыми точками внутри box
+*/
+void addDetection(cv::Mat& faces, float x, float y, float size)
+{
+    cv::Mat row(1, 15, CV_32F);
+    float* r = row.ptr<float>();
+    r[0] = x;
+    r[1] = y;
+    r[2] = size;
+    r[3] = size;
+    for (int j = 0; j < 5; j++){
+        r[4 + 2 * j] = x + size * (0.2f + 0.15f * j);
+        r[5 + 2 * j] = y + size * 0.5f;
+    }
+    r[14] = 0.95f;
+    faces.push_back(row);
+}
+
+/*
+    Кадр: фон и лица (текстуры) в точках positions, лица рисуются по порядку
+*/
+void renderFrame(FrameCache& frameCache, const cv::Mat& background, const std::vector<cv::Mat>& faces,
+                 const std::vector<cv::Point>& positions, cv::Mat& bgr)
+{
+    cv::Mat gray = background.clone();
+    for (size_t i = 0; i < faces.size(); i++){
+        cv::Mat faceRoi = gray(cv::Rect(positions[i], faces[i].size()));
+        faces[i].copyTo(faceRoi);
+    }
+    cv::cvtColor(gray, bgr, cv::COLOR_GRAY2BGR);
+    frameCache.setFrame(bgr);
+}
+
+int indexOfId(const FaceTracking::MultiFaceTracker& tracker, int id)
+{
+    for (int i = 0; i < tracker.size(); i++){
+        if (tracker.id(i) == id){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+    Два лица движутся навстречу друг другу и пересекаются (лицо B частично
+    закрывает лицо A), затем лицо A не детектируется 3 кадра (меньше maxMisses):
+    оба лица сохраняют идентификаторы, новых идентификаторов не появляется,
+    во время пропусков box лица A продолжает движение
+*/
+void testCrossingFaces()
+{
+    const int faceSize = 80, frames = 60;
+    const int missFrom = 40, missTo = 43;
+    cv::Mat background = texture(cv::Size(640, 480), 3);
+    std::vector<cv::Mat> textures = {texture(cv::Size(faceSize, faceSize), 5),
+                                     texture(cv::Size(faceSize, faceSize), 9)};
+    FaceTracking::MultiFaceTracker tracker(8);
+    tracker.setHysteresis(3, 5);
+    FrameCache frameCache;
+    cv::Mat bgr;
+    int idA = -1, idB = -1;
+    for (int frame = 0; frame < frames; frame++){
+        cv::Point a(60 + 6 * frame, 150), b(500 - 6 * frame, 180);
+        renderFrame(frameCache, background, textures, {a, b}, bgr);
+        bool missA = frame >= missFrom && frame < missTo;
+        cv::Mat detections(0, 15, CV_32F);
+        // Порядок строк детекций меняется от кадра к кадру
+        if (frame % 2){
+            addDetection(detections, float(b.x), float(b.y), float(faceSize));
+        }
+        if (!missA){
+            addDetection(detections, float(a.x), float(a.y), float(faceSize));
+        }
+        if (frame % 2 == 0){
+            addDetection(detections, float(b.x), float(b.y), float(faceSize));
+        }
+        tracker.update(frameCache, detections);
+        if (frame < 2){
+            CHECK(tracker.size() == 0);
+            continue;
+        }
+        CHECK(tracker.size() == 2);
+        if (tracker.size() != 2){
+            continue;
+        }
+        if (idA < 0){
+            // Лица выдаются в порядке идентификаторов, A детектируется первым на кадре 0
+            idA = tracker.id(0);
+            idB = tracker.id(1);
+        }
+        int ia = indexOfId(tracker, idA), ib = indexOfId(tracker, idB);
+        CHECK(ia >= 0 && ib >= 0);
+        if (ia < 0 || ib < 0){
+            continue;
+        }
+        cv::Rect2f boxA = tracker.box(ia), boxB = tracker.box(ib);
+        CHECK(std::abs(boxB.x - b.x) < 3.f && std::abs(boxB.y - b.y) < 3.f);
+        // Во время пропуска box A предсказывается фильтром Калмана
+        float tolerance = missA ? 6.f : 3.f;
+        CHECK(std::abs(boxA.x - a.x) < tolerance && std::abs(boxA.y - a.y) < tolerance);
+        CHECK(tracker.misses(ia) == (missA ? frame - missFrom + 1 : 0));
+    }
+    CHECK(idA >= 0 && idB >= 0 && idA != idB);
+}
+
+/*
+    Новое лицо выдается только после minHits детекций подряд: лицо, которое
+    детектируется через кадр или пропадает раньше подтверждения, не выдается
+*/
+void testTentativeTracks()
+{
+    const int faceSize = 80;
+    cv::Mat background = texture(cv::Size(640, 480), 13);
+    std::vector<cv::Mat> textures = {texture(cv::Size(faceSize, faceSize), 17),
+                                     texture(cv::Size(faceSize, faceSize), 19),
+                                     texture(cv::Size(faceSize, faceSize), 23)};
+    FaceTracking::MultiFaceTracker tracker(8);
+    tracker.setHysteresis(3, 5);
+    FrameCache frameCache;
+    cv::Mat bgr;
+    int steadyId = -1;
+    for (int frame = 0; frame < 20; frame++){
+        cv::Point steady(100, 100), flicker(300, 100), brief(450, 250);
+        renderFrame(frameCache, background, textures, {steady, flicker, brief}, bgr);
+        cv::Mat detections(0, 15, CV_32F);
+        addDetection(detections, float(steady.x), float(steady.y), float(faceSize));
+        if (frame % 2 == 0){
+            addDetection(detections, float(flicker.x), float(flicker.y), float(faceSize));
+        }
+        if (frame >= 5 && frame < 7){
+            addDetection(detections, float(brief.x), float(brief.y), float(faceSize));
+        }
+        tracker.update(frameCache, detections);
+        // Выдается только постоянное лицо, начиная с третьего кадра
+        CHECK(tracker.size() == (frame < 2 ? 0 : 1));
+        if (tracker.size() != 1){
+            continue;
+        }
+        if (steadyId < 0){
+            steadyId = tracker.id(0);
+        }
+        CHECK(tracker.id(0) == steadyId);
+        CHECK(std::abs(tracker.box(0).x - steady.x) < 3.f);
+    }
+}
+
+/*
+    Подтвержденное лицо без детекций выдается maxMisses кадров и удаляется
+    на следующем кадре; появившееся снова лицо получает новый идентификатор
+    и снова проходит подтверждение
+*/
+void testReleaseAfterMaxMisses()
+{
+    const int faceSize = 80, maxMisses = 5;
+    cv::Mat background = texture(cv::Size(640, 480), 29);
+    std::vector<cv::Mat> textures = {texture(cv::Size(faceSize, faceSize), 31)};
+    std::vector<cv::Point> positions = {cv::Point(200, 150)};
+    FaceTracking::MultiFaceTracker tracker(4);
+    tracker.setHysteresis(3, maxMisses);
+    FrameCache frameCache;
+    cv::Mat bgr;
+    renderFrame(frameCache, background, textures, positions, bgr);
+    cv::Mat detections(0, 15, CV_32F);
+    addDetection(detections, float(positions[0].x), float(positions[0].y), float(faceSize));
+    cv::Mat none(0, 15, CV_32F);
+
+    for (int frame = 0; frame < 3; frame++){
+        tracker.update(frameCache, detections);
+    }
+    CHECK(tracker.size() == 1);
+    int firstId = tracker.size() == 1 ? tracker.id(0) : -1;
+
+    for (int miss = 1; miss <= maxMisses; miss++){
+        tracker.update(frameCache, none);
+        CHECK(tracker.size() == 1);
+        if (tracker.size() == 1){
+            CHECK(tracker.id(0) == firstId);
+            CHECK(tracker.misses(0) == miss);
+        }
+    }
+    tracker.update(frameCache, none);
+    CHECK(tracker.size() == 0);
+
+    for (int frame = 0; frame < 3; frame++){
+        tracker.update(frameCache, detections);
+        CHECK(tracker.size() == (frame < 2 ? 0 : 1));
+    }
+    CHECK(tracker.size() == 1 && tracker.id(0) != firstId);
+}
+
+int main()
+{
+    testHungarian();
+    testCrossingFaces();
+    testTentativeTracks();
+    testReleaseAfterMaxMisses();
+    return testResult("test_multi_face_tracker");
+}
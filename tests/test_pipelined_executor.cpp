@@ -0,0 +1,63 @@
+/*
+    PipelinedExecutor: этап KEEP_LATEST, который медленнее источника, получает кадры
+    по возрастанию номеров, пропуская устаревшие, и обязательно обрабатывает последний
+    кадр источника; этап DROP_BLOCK получает все кадры предыдущего этапа по порядку.
+    Все слоты возвращаются в пул (источник не блокируется навсегда).
+*/
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "PipelinedExecutor.h"
+#include "TestUtils.h"
+
+struct NumberedFrame
+{
+    int number = -1;
+};
+
+int main()
+{
+    const int numFrames = 200;
+    PipelinedExecutor<NumberedFrame> executor(16);
+    std::atomic<int> produced(0);
+    std::vector<int> latest, sink;
+    // Число кадров, созданных источником после полученного этапом кадра
+    double staleness = 0;
+    executor.addStage("source", [&](NumberedFrame& frame){
+        if (produced == numFrames){
+            return false;
+        }
+        frame.number = produced.load();
+        produced++;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        return true;
+    });
+    executor.addStage("slow", [&](NumberedFrame& frame){
+        latest.push_back(frame.number);
+        staleness += produced.load() - 1 - frame.number;
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        return true;
+    }, 2, KEEP_LATEST);
+    executor.addStage("sink", [&](NumberedFrame& frame){
+        sink.push_back(frame.number);
+        return true;
+    }, 2, DROP_BLOCK);
+    executor.start();
+    executor.join();
+    executor.report();
+
+    CHECK(produced == numFrames);
+    CHECK(!latest.empty() && int(latest.size()) < numFrames);
+    for (size_t i = 1; i < latest.size(); i++){
+        CHECK(latest[i] > latest[i - 1]);
+    }
+    // Последний кадр заменяет необработанный, а не отбрасывается
+    CHECK(!latest.empty() && latest.back() == numFrames - 1);
+    CHECK(sink == latest);
+    // Источник создает около 10 кадров за время обработки одного кадра этапа,
+    // этап получает самый свежий из них
+    CHECK(!latest.empty() && staleness / latest.size() < 2.0);
+    return testResult("test_pipelined_executor");
+}
@@ -0,0 +1,204 @@
+/*
+    Стабильность идентификаторов DetectThenTrack: синтетические детекции
+    (строки в формате YuNet) воспроизводятся через сопоставление по IoU
+    без запуска сети; слежение оптическим потоком между детекциями проверяется
+    на кадрах со смещающимся текстурированным лицом.
+*/
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "FaceTracker.h"
+#include "FrameCache.h"
+#include "TestUtils.h"
+
+/*
+    Детекция лица с box (x, y, size, size) и ключевыми точками внутри box
+*/
+void addDetection(cv::Mat& faces, float x, float y, float size)
+{
+    cv::Mat row(1, 15, CV_32F);
+    float* r = row.ptr<float>();
+    r[0] = x;
+    r[1] = y;
+    r[2] = size;
+    r[3] = size;
+    for (int j = 0; j < 5; j++){
+        r[4 + 2 * j] = x + size * (0.2f + 0.15f * j);
+        r[5 + 2 * j] = y + size * 0.5f;
+    }
+    r[14] = 0.95f;
+    faces.push_back(row);
+}
+
+int idOfBoxAt(const std::vector<FaceTracking::TrackedFace>& faces, float x, float y)
+{
+    for (size_t i = 0; i < faces.size(); i++){
+        if (std::abs(faces[i].box.x - x) < 1e-3f && std::abs(faces[i].box.y - y) < 1e-3f){
+            return faces[i].id;
+        }
+    }
+    return -1;
+}
+
+/*
+    Три лица медленно движутся с шумом детектора, порядок строк детекций
+    меняется от кадра к кадру: идентификаторы должны сохраняться
+*/
+void testMovingFaces()
+{
+    FaceTracking::DetectThenTrack tracker;
+    cv::RNG rng(12345);
+    const float startX[3] = {40.f, 240.f, 440.f};
+    const float startY[3] = {100.f, 120.f, 90.f};
+    const float speed[3] = {2.f, -1.5f, 1.f};
+    int ids[3] = {-1, -1, -1};
+    for (int frame = 0; frame < 120; frame++){
+        float x[3], y[3];
+        cv::Mat faces(0, 15, CV_32F);
+        int order[3] = {0, 1, 2};
+        std::rotate(order, order + frame % 3, order + 3);
+        for (int k = 0; k < 3; k++){
+            int i = order[k];
+            x[i] = startX[i] + speed[i] * frame + rng.uniform(-2.f, 2.f);
+            y[i] = startY[i] + rng.uniform(-2.f, 2.f);
+            addDetection(faces, x[i], y[i], 80.f);
+        }
+        tracker.assignDetections(faces);
+        CHECK(tracker.faces().size() == 3);
+        for (int i = 0; i < 3; i++){
+            int id = idOfBoxAt(tracker.faces(), x[i], y[i]);
+            CHECK(id >= 0);
+            if (frame == 0){
+                ids[i] = id;
+            }
+            CHECK(id == ids[i]);
+        }
+    }
+    CHECK(ids[0] != ids[1] && ids[1] != ids[2] && ids[0] != ids[2]);
+}
+
+/*
+    Лицо пропадает и появляется новое: оставшиеся лица сохраняют идентификаторы,
+    новое лицо получает идентификатор, которого еще не было
+*/
+void testLeaveAndEnter()
+{
+    FaceTracking::DetectThenTrack tracker;
+    cv::Mat faces(0, 15, CV_32F);
+    addDetection(faces, 50.f, 50.f, 80.f);
+    addDetection(faces, 300.f, 50.f, 80.f);
+    tracker.assignDetections(faces);
+    int first = idOfBoxAt(tracker.faces(), 50.f, 50.f);
+    int second = idOfBoxAt(tracker.faces(), 300.f, 50.f);
+
+    faces = cv::Mat(0, 15, CV_32F);
+    addDetection(faces, 302.f, 51.f, 80.f);
+    tracker.assignDetections(faces);
+    CHECK(tracker.faces().size() == 1);
+    CHECK(idOfBoxAt(tracker.faces(), 302.f, 51.f) == second);
+
+    faces = cv::Mat(0, 15, CV_32F);
+    addDetection(faces, 304.f, 52.f, 80.f);
+    addDetection(faces, 500.f, 200.f, 80.f);
+    tracker.assignDetections(faces);
+    CHECK(idOfBoxAt(tracker.faces(), 304.f, 52.f) == second);
+    int third = idOfBoxAt(tracker.faces(), 500.f, 200.f);
+    CHECK(third >= 0 && third != first && third != second);
+}
+
+/*
+    Два лица рядом: каждое лицо сохраняет идентификатор, хотя детекция соседа
+    тоже перекрывается с ним (одно сопровождаемое лицо - не более одной детекции)
+*/
+void testAdjacentFaces()
+{
+    FaceTracking::DetectThenTrack tracker;
+    cv::Mat faces(0, 15, CV_32F);
+    addDetection(faces, 100.f, 100.f, 80.f);
+    addDetection(faces, 150.f, 100.f, 80.f);
+    tracker.assignDetections(faces);
+    int left = idOfBoxAt(tracker.faces(), 100.f, 100.f);
+    int right = idOfBoxAt(tracker.faces(), 150.f, 100.f);
+    for (int frame = 1; frame < 20; frame++){
+        faces = cv::Mat(0, 15, CV_32F);
+        addDetection(faces, 150.f + frame * 0.5f, 100.f, 80.f);
+        addDetection(faces, 100.f - frame * 0.5f, 100.f, 80.f);
+        tracker.assignDetections(faces);
+        CHECK(idOfBoxAt(tracker.faces(), 100.f - frame * 0.5f, 100.f) == left);
+        CHECK(idOfBoxAt(tracker.faces(), 150.f + frame * 0.5f, 100.f) == right);
+    }
+}
+
+/*
+    Текстура: размытый шум, растянутый на весь диапазон яркости
+*/
+cv::Mat texture(cv::Size size, uint64_t seed)
+{
+    cv::Mat noise(size, CV_8UC1);
+    cv::RNG rng(seed);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+    cv::GaussianBlur(noise, noise, cv::Size(0, 0), 2.0);
+    cv::normalize(noise, noise, 0, 255, cv::NORM_MINMAX);
+    return noise;
+}
+
+/*
+    Текстурированное лицо смещается на (3, 2) пикселя за кадр по неподвижному фону.
+    Детекция выполняется раз в 5 кадров; на промежуточных кадрах переданные детекции
+    смещены на 100 пикселей и не должны использоваться: box переносится оптическим
+    потоком вслед за лицом, идентификатор сохраняется между детекциями.
+*/
+void testOpticalFlowTracking()
+{
+    const int faceSize = 120, detectEvery = 5;
+    cv::Mat background = texture(cv::Size(640, 480), 7);
+    cv::Mat face = texture(cv::Size(faceSize, faceSize), 11);
+    FaceTracking::DetectThenTrack tracker(detectEvery);
+    FrameCache frameCache;
+    int id = -1, tracked = 0;
+    for (int frame = 0; frame < 30; frame++){
+        float x = 100.f + 3.f * frame, y = 150.f + 2.f * frame;
+        cv::Mat gray = background.clone();
+        cv::Mat faceRoi = gray(cv::Rect(int(x), int(y), faceSize, faceSize));
+        face.copyTo(faceRoi);
+        cv::Mat bgr;
+        cv::cvtColor(gray, bgr, cv::COLOR_GRAY2BGR);
+        frameCache.setFrame(bgr);
+
+        bool detectFrame = frame % detectEvery == 0;
+        cv::Mat detections(0, 15, CV_32F);
+        addDetection(detections, detectFrame ? x : x + 100.f, y, float(faceSize));
+        const std::vector<FaceTracking::TrackedFace>& faces = tracker.update(frameCache, detections);
+        CHECK(faces.size() == 1);
+        if (faces.size() != 1){
+            continue;
+        }
+        const FaceTracking::TrackedFace& result = faces[0];
+        if (frame == 0){
+            id = result.id;
+        }
+        CHECK(result.id == id);
+        float cx = result.box.x + result.box.width * 0.5f, cy = result.box.y + result.box.height * 0.5f;
+        CHECK(std::abs(cx - (x + faceSize * 0.5f)) < 1.5f);
+        CHECK(std::abs(cy - (y + faceSize * 0.5f)) < 1.5f);
+        CHECK(std::abs(result.box.width - faceSize) < 0.05f * faceSize);
+        if (!detectFrame){
+            CHECK(result.trackQuality >= 0.5f);
+            tracked++;
+        }
+    }
+    CHECK(tracked == 24);
+}
+
+int main()
+{
+    testMovingFaces();
+    testLeaveAndEnter();
+    testAdjacentFaces();
+    testOpticalFlowTracking();
+    return testResult("test_tracker_ids");
+}